@@ -0,0 +1,615 @@
+#include "buffer.h"
+
+CDTP_TEST_EXPORT CDTPRecvBuffer *_cdtp_recv_buffer(size_t max_message_size)
+{
+    CDTPRecvBuffer *buffer = (CDTPRecvBuffer *) malloc(sizeof(CDTPRecvBuffer));
+
+    buffer->capacity = CDTP_RECV_BUFFER_SIZE;
+    buffer->data = (unsigned char *) malloc(buffer->capacity * sizeof(unsigned char));
+    buffer->start = 0;
+    buffer->end = 0;
+    buffer->max_message_size = max_message_size;
+
+    return buffer;
+}
+
+CDTP_TEST_EXPORT void *_cdtp_recv_buffer_space(CDTPRecvBuffer *buffer, size_t *space)
+{
+    size_t pending = buffer->end - buffer->start;
+    size_t needed = pending + CDTP_RECV_BUFFER_SIZE;
+
+    // Make sure a partially received message can be completed, unless it is larger than allowed
+    if (pending >= CDTP_LENSIZE) {
+        size_t msg_size = _cdtp_decode_message_size(buffer->data + buffer->start);
+
+        if (msg_size > buffer->max_message_size) {
+#ifdef _WIN32
+            WSASetLastError(WSAEMSGSIZE);
+#else
+            errno = EMSGSIZE;
+#endif
+            return NULL;
+        }
+
+        if (CDTP_LENSIZE + msg_size > needed) {
+            needed = CDTP_LENSIZE + msg_size;
+        }
+    }
+
+    // Move unparsed bytes to the front of the buffer
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer->data + buffer->start, pending);
+        buffer->start = 0;
+        buffer->end = pending;
+    }
+
+    if (buffer->capacity < needed) {
+        unsigned char *data = (unsigned char *) realloc(buffer->data, needed * sizeof(unsigned char));
+
+        if (data == NULL) {
+#ifdef _WIN32
+            WSASetLastError(WSAENOBUFS);
+#else
+            errno = ENOBUFS;
+#endif
+            return NULL;
+        }
+
+        buffer->data = data;
+        buffer->capacity = needed;
+    }
+    else if (buffer->capacity > CDTP_RECV_BUFFER_SIZE && buffer->capacity / 2 >= needed) {
+        // Give back the memory used by a large message once it has been handled
+        unsigned char *data = (unsigned char *) realloc(buffer->data, needed * sizeof(unsigned char));
+
+        if (data != NULL) {
+            buffer->data = data;
+            buffer->capacity = needed;
+        }
+    }
+
+    *space = buffer->capacity - buffer->end;
+
+    return (void *) (buffer->data + buffer->end);
+}
+
+CDTP_TEST_EXPORT bool _cdtp_recv_buffer_commit(CDTPRecvBuffer *buffer, size_t size)
+{
+    buffer->end += size;
+
+    // Check the size of every message received so far, so that none larger than allowed is ever handled
+    size_t offset = buffer->start;
+
+    while (buffer->end - offset >= CDTP_LENSIZE) {
+        size_t msg_size = _cdtp_decode_message_size(buffer->data + offset);
+
+        if (msg_size > buffer->max_message_size) {
+#ifdef _WIN32
+            WSASetLastError(WSAEMSGSIZE);
+#else
+            errno = EMSGSIZE;
+#endif
+            return false;
+        }
+
+        if (buffer->end - offset - CDTP_LENSIZE < msg_size) {
+            break;
+        }
+
+        offset += CDTP_LENSIZE + msg_size;
+    }
+
+    return true;
+}
+
+/**
+ * Check if the other party has closed a connection, without reading from it.
+ *
+ * @param sock The nonblocking socket.
+ * @return 1 if the connection was closed, 0 if it is open, or -1 if an error occurred, in which case the reason is left
+ * in `errno` (or `WSAGetLastError` on Windows).
+ */
+int _cdtp_recv_buffer_closed(CDTPSocket *sock)
+{
+    char byte;
+
+#ifdef _WIN32
+    int recv_code = recv(sock->sock, &byte, 1, MSG_PEEK);
+
+    if (recv_code == SOCKET_ERROR) {
+        return WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+    }
+#else
+    ssize_t recv_code = recv(sock->sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    if (recv_code == -1) {
+        return CDTP_EAGAIN_OR_WOULDBLOCK(errno) ? 0 : -1;
+    }
+#endif
+
+    return recv_code == 0 ? 1 : 0;
+}
+
+/**
+ * Read as much data as is available from a socket's shared memory ring into the buffer.
+ *
+ * @param buffer The receive buffer.
+ * @param sock The socket, which uses shared memory.
+ * @return The number of bytes read, or -1 if the other party corrupted the ring, in which case the reason is left in
+ * `errno` as `EPROTO`.
+ */
+int _cdtp_recv_buffer_read_ring(CDTPRecvBuffer *buffer, CDTPSocket *sock)
+{
+    size_t space;
+    void *dest = _cdtp_recv_buffer_space(buffer, &space);
+    size_t received;
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    if (!_cdtp_shm_read(sock->shm, dest, space < INT_MAX ? space : INT_MAX, &received)) {
+#ifndef _WIN32
+        errno = EPROTO;
+#endif
+        return -1;
+    }
+
+    if (!_cdtp_recv_buffer_commit(buffer, received)) {
+        return -1;
+    }
+
+    return (int) received;
+}
+
+/**
+ * Read from a socket using shared memory, after its doorbell rang or its connection was closed.
+ *
+ * @param buffer The receive buffer.
+ * @param sock The socket, which uses shared memory.
+ * @return The number of bytes read, 0 if the connection was closed and everything written before then has been read,
+ * or -1 if nothing could be read or an error occurred. A corrupted ring is reported as an `EPROTO` error.
+ */
+int _cdtp_recv_buffer_read_shm(CDTPRecvBuffer *buffer, CDTPSocket *sock)
+{
+    _cdtp_shm_clear_doorbell(sock->shm);
+
+    // The doorbell also rings when the other party has made room for queued bytes
+    _cdtp_send_buffer_flush(sock->send_buffer, sock);
+
+    int received = _cdtp_recv_buffer_read_ring(buffer, sock);
+
+    if (received != 0) {
+        return received;
+    }
+
+    // Only check the socket once the ring is empty, then read whatever was written before the connection was closed
+    int closed = _cdtp_recv_buffer_closed(sock);
+
+    if (closed == 1) {
+        return _cdtp_recv_buffer_read_ring(buffer, sock);
+    }
+    else if (closed == 0) {
+#ifdef _WIN32
+        WSASetLastError(WSAEWOULDBLOCK);
+#else
+        errno = EAGAIN;
+#endif
+    }
+
+    return -1;
+}
+
+int _cdtp_recv_buffer_read(CDTPRecvBuffer *buffer, CDTPSocket *sock)
+{
+    if (sock->shm != NULL) {
+        return _cdtp_recv_buffer_read_shm(buffer, sock);
+    }
+
+    size_t space;
+    void *dest = _cdtp_recv_buffer_space(buffer, &space);
+
+    if (dest == NULL) {
+        return -1;
+    }
+
+    if (space > INT_MAX) {
+        space = INT_MAX;
+    }
+
+#ifdef _WIN32
+    int recv_code = recv(sock->sock, (char *) dest, (int) space, 0);
+
+    if (recv_code == SOCKET_ERROR) {
+        return -1;
+    }
+#else
+    int recv_code = (int) read(sock->sock, dest, space);
+#endif
+
+    if (recv_code > 0 && !_cdtp_recv_buffer_commit(buffer, (size_t) recv_code)) {
+        return -1;
+    }
+
+    return recv_code;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_recv_buffer_next(CDTPRecvBuffer *buffer, void **data, size_t *data_size)
+{
+    size_t pending = buffer->end - buffer->start;
+
+    if (pending < CDTP_LENSIZE) {
+        return false;
+    }
+
+    size_t msg_size = _cdtp_decode_message_size(buffer->data + buffer->start);
+
+    if (pending - CDTP_LENSIZE < msg_size) {
+        return false;
+    }
+
+    *data = (void *) (buffer->data + buffer->start + CDTP_LENSIZE);
+    *data_size = msg_size;
+    buffer->start += CDTP_LENSIZE + msg_size;
+
+    return true;
+}
+
+CDTP_TEST_EXPORT void _cdtp_recv_buffer_free(CDTPRecvBuffer *buffer)
+{
+    free(buffer->data);
+    free(buffer);
+}
+
+CDTP_TEST_EXPORT CDTPSendBuffer *_cdtp_send_buffer(size_t low_watermark, size_t high_watermark)
+{
+    CDTPSendBuffer *buffer = (CDTPSendBuffer *) malloc(sizeof(CDTPSendBuffer));
+
+    _cdtp_mutex_init(&(buffer->lock));
+    buffer->head = NULL;
+    buffer->tail = NULL;
+    buffer->offset = 0;
+    buffer->pending = 0;
+    buffer->low_watermark = low_watermark;
+    buffer->high_watermark = high_watermark;
+    buffer->blocked = false;
+    buffer->unblocked = false;
+    buffer->writing = false;
+    buffer->reactor = NULL;
+    buffer->token = 0;
+
+    return buffer;
+}
+
+/**
+ * Update whether new messages are refused, and what the socket is watched for, to match the number of queued bytes.
+ * The buffer must be locked.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket the buffer belongs to.
+ */
+void _cdtp_send_buffer_update(CDTPSendBuffer *buffer, CDTPSocket *sock)
+{
+    bool writing = buffer->pending > 0;
+
+    if (buffer->pending > buffer->high_watermark) {
+        buffer->blocked = true;
+    }
+    else if (buffer->blocked && buffer->pending <= buffer->low_watermark) {
+        buffer->blocked = false;
+        buffer->unblocked = true;
+    }
+
+    if (writing != buffer->writing) {
+        buffer->writing = writing;
+
+        // The socket is always read from, so that a peer that is itself waiting to send is never stuck
+        if (buffer->reactor != NULL) {
+            _cdtp_reactor_modify(buffer->reactor, sock, buffer->token, true, writing);
+        }
+    }
+}
+
+/**
+ * Point an I/O vector at a region of memory.
+ *
+ * @param vec The I/O vector.
+ * @param base The start of the region.
+ * @param size The size of the region, in bytes.
+ */
+void _cdtp_io_vec_set(CDTPIOVec *vec, unsigned char *base, size_t size)
+{
+#ifdef _WIN32
+    vec->buf = (char *) base;
+    vec->len = (ULONG) size;
+#else
+    vec->iov_base = (void *) base;
+    vec->iov_len = size;
+#endif
+}
+
+/**
+ * Write regions of memory to a nonblocking socket, in order, with a single system call, or to its ring if it uses shared
+ * memory.
+ *
+ * @param sock The socket to send on.
+ * @param vecs The regions to send.
+ * @param num_vecs The number of regions.
+ * @param sent A pointer that will be set to the number of bytes sent, which is 0 if the socket cannot take any more
+ * right now.
+ * @return If no error occurred.
+ */
+bool _cdtp_send_buffer_write(CDTPSocket *sock, CDTPIOVec *vecs, size_t num_vecs, size_t *sent)
+{
+    // The ring only fails if the other party corrupted it, and shutting the socket down lets the next read report that
+    // the connection is closed
+    if (sock->shm != NULL) {
+        if (!_cdtp_shm_write(sock->shm, vecs, num_vecs, sent)) {
+#ifndef _WIN32
+            shutdown(sock->sock, SHUT_RDWR);
+#endif
+            return false;
+        }
+
+        return true;
+    }
+
+#ifdef _WIN32
+    DWORD bytes_sent = 0;
+
+    if (WSASend(sock->sock, vecs, (DWORD) num_vecs, &bytes_sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        *sent = 0;
+        return WSAGetLastError() == WSAEWOULDBLOCK;
+    }
+
+    *sent = (size_t) bytes_sent;
+#else
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vecs;
+    msg.msg_iovlen = num_vecs;
+
+#  ifdef MSG_NOSIGNAL
+    ssize_t send_code = sendmsg(sock->sock, &msg, MSG_NOSIGNAL);
+#  else
+    ssize_t send_code = sendmsg(sock->sock, &msg, 0);
+#  endif
+
+    if (send_code == -1) {
+        *sent = 0;
+        return CDTP_EAGAIN_OR_WOULDBLOCK(errno) || errno == EINTR;
+    }
+
+    *sent = (size_t) send_code;
+#endif
+
+    return true;
+}
+
+/**
+ * Drop sent bytes from the front of the queue. The buffer must be locked.
+ *
+ * @param buffer The send buffer.
+ * @param sent The number of bytes sent.
+ */
+void _cdtp_send_buffer_consume(CDTPSendBuffer *buffer, size_t sent)
+{
+    buffer->pending -= sent;
+
+    while (sent > 0) {
+        CDTPSendFrame *frame = buffer->head;
+        size_t remaining = frame->data_size - buffer->offset;
+
+        if (sent < remaining) {
+            buffer->offset += sent;
+            return;
+        }
+
+        sent -= remaining;
+        buffer->head = frame->next;
+        buffer->offset = 0;
+        free(frame->data);
+        free(frame);
+    }
+
+    if (buffer->head == NULL) {
+        buffer->tail = NULL;
+    }
+}
+
+/**
+ * Send queued messages until the queue is empty or the socket cannot take any more, writing up to
+ * `CDTP_SEND_BATCH_SIZE` messages per system call. The buffer must be locked.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket to send on.
+ * @return If no error occurred.
+ */
+bool _cdtp_send_buffer_write_pending(CDTPSendBuffer *buffer, CDTPSocket *sock)
+{
+    CDTPIOVec vecs[CDTP_SEND_BATCH_SIZE];
+
+    while (buffer->head != NULL) {
+        size_t num_vecs = 0;
+        size_t offset = buffer->offset;
+
+        for (CDTPSendFrame *frame = buffer->head;
+             frame != NULL && num_vecs < CDTP_SEND_BATCH_SIZE;
+             frame = frame->next) {
+            _cdtp_io_vec_set(&(vecs[num_vecs++]), frame->data + offset, frame->data_size - offset);
+            offset = 0;
+        }
+
+        size_t sent;
+
+        if (!_cdtp_send_buffer_write(sock, vecs, num_vecs, &sent)) {
+            return false;
+        }
+
+        if (sent == 0) {
+            break;
+        }
+
+        _cdtp_send_buffer_consume(buffer, sent);
+    }
+
+    return true;
+}
+
+void _cdtp_send_buffer_watch(CDTPSendBuffer *buffer, CDTPSocket *sock, CDTPReactor *reactor, size_t token)
+{
+    _cdtp_mutex_lock(&(buffer->lock));
+
+    buffer->reactor = reactor;
+    buffer->token = token;
+
+    // Messages may have been queued before the socket was watched
+    if (buffer->writing) {
+        _cdtp_reactor_modify(reactor, sock, token, true, true);
+    }
+
+    _cdtp_mutex_unlock(&(buffer->lock));
+}
+
+CDTP_TEST_EXPORT int _cdtp_send_buffer_send(CDTPSendBuffer *buffer, CDTPSocket *sock, void *data, size_t data_size)
+{
+    size_t message_size;
+    size_t sent = 0;
+    bool ok = true;
+
+    _cdtp_mutex_lock(&(buffer->lock));
+
+    // Refuse the message before it is encrypted, so the key's nonces stay in step with what the other party receives
+    if (buffer->blocked) {
+        _cdtp_mutex_unlock(&(buffer->lock));
+        return 0;
+    }
+
+    // Encrypting under the lock keeps the socket's cipher contexts to one thread at a time
+    void *message;
+
+    if (sock->key != NULL) {
+        message = _cdtp_crypto_aes_encrypt_message(sock->key, data, data_size, &message_size);
+    }
+    else {
+        message = _cdtp_construct_message(data, data_size);
+        message_size = CDTP_LENSIZE + data_size;
+    }
+
+    if (message == NULL) {
+        _cdtp_mutex_unlock(&(buffer->lock));
+        return -1;
+    }
+
+    // A message can only skip the queue if nothing is waiting ahead of it
+    if (buffer->head == NULL) {
+        CDTPIOVec vec;
+        _cdtp_io_vec_set(&vec, (unsigned char *) message, message_size);
+        ok = _cdtp_send_buffer_write(sock, &vec, 1, &sent);
+    }
+
+    if (!ok || sent == message_size) {
+        free(message);
+    }
+    else {
+        // Queue the rest of the message, taking it over
+        CDTPSendFrame *queued = (CDTPSendFrame *) malloc(sizeof(CDTPSendFrame));
+        queued->data = (unsigned char *) message;
+        queued->data_size = message_size;
+        queued->next = NULL;
+
+        if (buffer->tail == NULL) {
+            buffer->head = queued;
+            buffer->offset = sent;
+        }
+        else {
+            buffer->tail->next = queued;
+        }
+
+        buffer->tail = queued;
+        buffer->pending += message_size - sent;
+        _cdtp_send_buffer_update(buffer, sock);
+    }
+
+    _cdtp_mutex_unlock(&(buffer->lock));
+
+    return ok ? 1 : -1;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_flush(CDTPSendBuffer *buffer, CDTPSocket *sock)
+{
+    _cdtp_mutex_lock(&(buffer->lock));
+
+    bool flushed = _cdtp_send_buffer_write_pending(buffer, sock);
+
+    if (flushed) {
+        _cdtp_send_buffer_update(buffer, sock);
+    }
+
+    _cdtp_mutex_unlock(&(buffer->lock));
+
+    return flushed;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_drain(CDTPSendBuffer *buffer, CDTPSocket *sock, double timeout)
+{
+    for (double waited = 0; ; waited += CDTP_SLEEP_TIME) {
+        _cdtp_mutex_lock(&(buffer->lock));
+
+        bool flushed = _cdtp_send_buffer_write_pending(buffer, sock);
+        bool drained = flushed && buffer->head == NULL;
+
+        _cdtp_mutex_unlock(&(buffer->lock));
+
+        if (drained || !flushed) {
+            return drained;
+        }
+
+        if (waited >= timeout) {
+            return false;
+        }
+
+        cdtp_sleep(CDTP_SLEEP_TIME);
+    }
+}
+
+CDTP_TEST_EXPORT size_t _cdtp_send_buffer_pending(CDTPSendBuffer *buffer)
+{
+    _cdtp_mutex_lock(&(buffer->lock));
+    size_t pending = buffer->pending;
+    _cdtp_mutex_unlock(&(buffer->lock));
+
+    return pending;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_blocked(CDTPSendBuffer *buffer)
+{
+    _cdtp_mutex_lock(&(buffer->lock));
+    bool blocked = buffer->blocked;
+    _cdtp_mutex_unlock(&(buffer->lock));
+
+    return blocked;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_take_unblocked(CDTPSendBuffer *buffer)
+{
+    _cdtp_mutex_lock(&(buffer->lock));
+    bool unblocked = buffer->unblocked;
+    buffer->unblocked = false;
+    _cdtp_mutex_unlock(&(buffer->lock));
+
+    return unblocked;
+}
+
+CDTP_TEST_EXPORT void _cdtp_send_buffer_free(CDTPSendBuffer *buffer)
+{
+    while (buffer->head != NULL) {
+        CDTPSendFrame *frame = buffer->head;
+        buffer->head = frame->next;
+        free(frame->data);
+        free(frame);
+    }
+
+    _cdtp_mutex_destroy(&(buffer->lock));
+    free(buffer);
+}
@@ -0,0 +1,177 @@
+/**
+ * CDTP socket receive and send buffers.
+ */
+
+#pragma once
+#ifndef CDTP_BUFFER_H
+#define CDTP_BUFFER_H
+
+#include "defs.h"
+#include "util.h"
+#include "threading.h"
+#include "reactor.h"
+#include "shm.h"
+#include <stdbool.h>
+
+// Maximum number of queued messages written to a socket with a single system call.
+#define CDTP_SEND_BATCH_SIZE 64
+
+/**
+ * Create a new receive buffer.
+ *
+ * @param max_message_size The size of the largest message that may be received, in bytes.
+ * @return The new receive buffer.
+ */
+CDTP_TEST_EXPORT CDTPRecvBuffer *_cdtp_recv_buffer(size_t max_message_size);
+
+/**
+ * Get a region of the buffer that received bytes can be written to.
+ *
+ * @param buffer The receive buffer.
+ * @param space The size of the region, in bytes.
+ * @return A pointer to the start of the region, or NULL if a partially received message is larger than allowed or the
+ * buffer could not grow to fit it, in which case the reason is left in `errno` (or `WSAGetLastError` on Windows) as
+ * `EMSGSIZE` or `ENOBUFS`.
+ *
+ * The region is always large enough to complete a partially received message, and is at least `CDTP_RECV_BUFFER_SIZE`
+ * bytes. Once a large message has been taken out, the buffer shrinks back towards `CDTP_RECV_BUFFER_SIZE` bytes. Use
+ * `_cdtp_recv_buffer_commit` to mark bytes in the region as received.
+ */
+CDTP_TEST_EXPORT void *_cdtp_recv_buffer_space(CDTPRecvBuffer *buffer, size_t *space);
+
+/**
+ * Mark bytes written to the region returned by `_cdtp_recv_buffer_space` as received.
+ *
+ * @param buffer The receive buffer.
+ * @param size The number of bytes written.
+ * @return If every message received so far is within the maximum message size. If not, the reason is left in `errno`
+ * (or `WSAGetLastError` on Windows) as `EMSGSIZE`, and the connection should be closed.
+ */
+CDTP_TEST_EXPORT bool _cdtp_recv_buffer_commit(CDTPRecvBuffer *buffer, size_t size);
+
+/**
+ * Read as much data as is available from a socket into the buffer, with a single call to `recv`.
+ *
+ * @param buffer The receive buffer.
+ * @param sock The socket to read from.
+ * @return The number of bytes read, 0 if the connection was closed, or -1 if an error occurred.
+ *
+ * On error, the reason is left in `errno` (or `WSAGetLastError` on Windows). Sockets using shared memory are read from
+ * through their ring instead, and also send whatever is queued, since their doorbell rings both when bytes arrive and
+ * when room is made for queued bytes. If nothing could be read from the ring, -1 is returned with the reason set to
+ * `EAGAIN` (or `WSAEWOULDBLOCK`), and if the other party corrupted the ring, the reason is set to `EPROTO`. A message
+ * larger than the buffer allows is reported as `EMSGSIZE`, and a buffer that cannot grow to fit a message as `ENOBUFS`.
+ */
+int _cdtp_recv_buffer_read(CDTPRecvBuffer *buffer, CDTPSocket *sock);
+
+/**
+ * Take the next complete message out of the buffer.
+ *
+ * @param buffer The receive buffer.
+ * @param data A pointer that will be set to the message data.
+ * @param data_size A pointer that will be set to the size of the message, in bytes.
+ * @return If a complete message was available.
+ *
+ * The message data points into the buffer itself, and remains valid until the buffer is next written to.
+ */
+CDTP_TEST_EXPORT bool _cdtp_recv_buffer_next(CDTPRecvBuffer *buffer, void **data, size_t *data_size);
+
+/**
+ * Free the memory used by a receive buffer.
+ *
+ * @param buffer The receive buffer.
+ */
+CDTP_TEST_EXPORT void _cdtp_recv_buffer_free(CDTPRecvBuffer *buffer);
+
+/**
+ * Create a new send buffer.
+ *
+ * @param low_watermark The number of queued bytes at or below which messages are taken again after being refused.
+ * @param high_watermark The number of queued bytes above which new messages are refused.
+ * @return The new send buffer.
+ */
+CDTP_TEST_EXPORT CDTPSendBuffer *_cdtp_send_buffer(size_t low_watermark, size_t high_watermark);
+
+/**
+ * Let the buffer change what a socket is watched for as bytes are queued and sent.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket the buffer belongs to, which must already be watched by the reactor.
+ * @param reactor The event reactor watching the socket.
+ * @param token The value the reactor reports when the socket is ready.
+ *
+ * Until this is called, bytes are still queued, but nothing waits for the socket to become writable.
+ */
+void _cdtp_send_buffer_watch(CDTPSendBuffer *buffer, CDTPSocket *sock, CDTPReactor *reactor, size_t token);
+
+/**
+ * Encrypt data with a socket's key and send it as a message, queueing whatever the socket cannot take right away.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket to send on, which must be nonblocking.
+ * @param data The data to send.
+ * @param data_size The size of the data, in bytes.
+ * @return 1 if the message was sent or queued, 0 if it was refused because too many bytes are queued, or -1 if the
+ * connection is broken and nothing more can be sent.
+ *
+ * The data is encrypted straight into the message, which is never copied afterwards. Queued messages are sent by
+ * `_cdtp_send_buffer_flush` once the socket becomes writable, several at a time with a single system call. Sockets
+ * using shared memory write messages to their ring instead, without a system call unless the other party is asleep.
+ * Once more than the high watermark is queued, messages are refused until no more than the low watermark is left, so
+ * a peer that does not read cannot make the queue grow without limit.
+ */
+CDTP_TEST_EXPORT int _cdtp_send_buffer_send(CDTPSendBuffer *buffer, CDTPSocket *sock, void *data, size_t data_size);
+
+/**
+ * Send as many queued bytes as the socket will take. This is called when the socket becomes writable.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket to send on.
+ * @return If no error occurred.
+ */
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_flush(CDTPSendBuffer *buffer, CDTPSocket *sock);
+
+/**
+ * Wait for every queued byte to be sent. This is called before a socket is closed.
+ *
+ * @param buffer The send buffer.
+ * @param sock The socket to send on.
+ * @param timeout The maximum amount of time to wait, in seconds.
+ * @return If every queued byte was sent.
+ */
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_drain(CDTPSendBuffer *buffer, CDTPSocket *sock, double timeout);
+
+/**
+ * Get the number of bytes waiting to be sent.
+ *
+ * @param buffer The send buffer.
+ * @return The number of queued bytes.
+ */
+CDTP_TEST_EXPORT size_t _cdtp_send_buffer_pending(CDTPSendBuffer *buffer);
+
+/**
+ * Check if new messages are being refused because too many bytes are queued.
+ *
+ * @param buffer The send buffer.
+ * @return If new messages are refused.
+ */
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_blocked(CDTPSendBuffer *buffer);
+
+/**
+ * Check if new messages are taken again after being refused, since this was last called. Sending enough queued bytes to
+ * get back down to the low watermark is what makes a buffer take messages again, which may happen whenever the buffer
+ * is flushed.
+ *
+ * @param buffer The send buffer.
+ * @return If new messages were being refused, and are now taken again.
+ */
+CDTP_TEST_EXPORT bool _cdtp_send_buffer_take_unblocked(CDTPSendBuffer *buffer);
+
+/**
+ * Free the memory used by a send buffer. Queued bytes are discarded.
+ *
+ * @param buffer The send buffer.
+ */
+CDTP_TEST_EXPORT void _cdtp_send_buffer_free(CDTPSendBuffer *buffer);
+
+#endif // CDTP_BUFFER_H
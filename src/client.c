@@ -4,24 +4,42 @@
  * Call the `on_recv` event function.
  *
  * @param client The socket client.
- * @param data The received data.
+ * @param data The received data, which is decrypted in place unless the connection is plaintext. This is not freed.
  * @param data_size The size of the received data, in bytes.
  */
 void _cdtp_client_call_on_recv(CDTPClient *client, void *data, size_t data_size)
 {
     if (client->on_recv != NULL) {
-        CDTPCryptoData *data_decrypted = _cdtp_crypto_aes_decrypt(client->sock->key, data, data_size);
-        size_t decrypted_data_size = data_decrypted->data_size;
-        void *decrypted_data = _cdtp_crypto_data_unwrap(data_decrypted);
+        void *decrypted_data;
+        size_t decrypted_data_size;
 
-        _cdtp_start_thread_on_recv_client(client->on_recv,
+        // Plaintext connections pass the data along as it was received
+        if (client->sock->key == NULL) {
+            decrypted_data = data;
+            decrypted_data_size = data_size;
+        }
+        else if (!_cdtp_crypto_aes_decrypt_in_place(client->sock->key, data, data_size, &decrypted_data, &decrypted_data_size)) {
+            return;
+        }
+
+        if (client->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            // The data is only lent to the event function, straight from the receive buffer
+            (*client->on_recv)(client, decrypted_data, decrypted_data_size, client->on_recv_arg);
+        }
+        else {
+            // The event function runs later, so it gets its own copy of the data
+            void *data_copy = malloc(decrypted_data_size);
+            memcpy(data_copy, decrypted_data, decrypted_data_size);
+            decrypted_data = data_copy;
+
+            _cdtp_dispatch_on_recv_client(client->on_recv,
                                           client,
+                                          client->sock->strand,
                                           decrypted_data,
                                           decrypted_data_size,
                                           client->on_recv_arg);
+        }
     }
-
-    free(data);
 }
 
 /**
@@ -32,181 +50,529 @@ void _cdtp_client_call_on_recv(CDTPClient *client, void *data, size_t data_size)
 void _cdtp_client_call_on_disconnected(CDTPClient *client)
 {
     if (client->on_disconnected != NULL) {
-        _cdtp_start_thread_on_disconnected(client->on_disconnected,
+        if (client->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            (*client->on_disconnected)(client, client->on_disconnected_arg);
+        }
+        else {
+            _cdtp_dispatch_on_disconnected(client->on_disconnected,
                                            client,
+                                           client->sock->strand,
                                            client->on_disconnected_arg);
+        }
     }
 }
 
 /**
- * Exchange crypto keys with the server.
+ * Call the `on_writable` event function.
  *
  * @param client The socket client.
- * @return If the exchange succeeded.
  */
-bool _cdtp_client_exchange_keys(CDTPClient *client)
+void _cdtp_client_call_on_writable(CDTPClient *client)
+{
+    if (client->on_writable != NULL) {
+        if (client->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            (*client->on_writable)(client, client->on_writable_arg);
+        }
+        else {
+            _cdtp_dispatch_on_writable_client(client->on_writable,
+                                              client,
+                                              client->sock->strand,
+                                              client->on_writable_arg);
+        }
+    }
+}
+
+/**
+ * Read an exact number of bytes while exchanging keys with the server, continuing after short reads.
+ *
+ * @param client The socket client.
+ * @param dest The buffer to read into.
+ * @param size The number of bytes to read.
+ * @return If all of the bytes were read.
+ */
+bool _cdtp_client_recv_handshake_exact(CDTPClient *client, char *dest, size_t size)
+{
+    size_t received = 0;
+
+    while (received < size) {
+#ifdef _WIN32
+        int recv_code = recv(client->sock->sock, dest + received, (int) (size - received), 0);
+
+        if (recv_code == SOCKET_ERROR || recv_code == 0) {
+            return false;
+        }
+#else
+        ssize_t recv_code = read(client->sock->sock, dest + received, size - received);
+
+        if (recv_code == 0 || recv_code == -1) {
+            return false;
+        }
+#endif
+
+        received += (size_t) recv_code;
+    }
+
+    return true;
+}
+
+/**
+ * Receive a message while exchanging keys with the server.
+ *
+ * @param client The socket client.
+ * @param msg_size A pointer that will be set to the size of the message, in bytes.
+ * @return The message, or NULL if it could not be received.
+ *
+ * Note that the returned value is allocated on the heap, and `free` will need to be called on it.
+ */
+char *_cdtp_client_recv_handshake(CDTPClient *client, size_t *msg_size)
 {
     char size_buffer[CDTP_LENSIZE];
-    size_t msg_size;
-    char *buffer;
-    int recv_code;
 
+    if (!_cdtp_client_recv_handshake_exact(client, size_buffer, CDTP_LENSIZE)) {
+        return NULL;
+    }
+
+    // The size comes from a peer that has not been authenticated yet, so nothing larger than a handshake is allocated
+    *msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
+
+    if (*msg_size > CDTP_HANDSHAKE_MAX_SIZE) {
+        return NULL;
+    }
+
+    char *buffer = (char *) malloc(*msg_size * sizeof(char));
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    if (!_cdtp_client_recv_handshake_exact(client, buffer, *msg_size)) {
+        free(buffer);
+        return NULL;
+    }
+
+    return buffer;
+}
+
+/**
+ * Send a message while exchanging keys with the server.
+ *
+ * @param client The socket client.
+ * @param data The message.
+ * @param data_size The size of the message, in bytes.
+ * @return If the message was sent.
+ */
+bool _cdtp_client_send_handshake(CDTPClient *client, void *data, size_t data_size)
+{
+    char *message = _cdtp_construct_message(data, data_size);
+    bool sent = send(client->sock->sock, message, CDTP_LENSIZE + data_size, 0) >= 0;
+
+    free(message);
+
+    if (!sent) {
+        _cdtp_set_err(CDTP_CLIENT_SEND_FAILED);
+    }
+
+    return sent;
+}
+
+/**
+ * Check if the client asks the server to send and receive messages through shared memory.
+ *
+ * @param client The socket client.
+ * @return If the client asks for shared memory.
+ *
+ * Shared memory is only asked for over Unix domain sockets, and never on Windows.
+ */
+bool _cdtp_client_wants_shared_memory(CDTPClient *client)
+{
 #ifdef _WIN32
-    recv_code = recv(client->sock->sock, size_buffer, CDTP_LENSIZE, 0);
+    return false;
+#else
+    return client->shared_memory && client->sock->address.ss_family == AF_UNIX;
+#endif
+}
 
-    if (recv_code == SOCKET_ERROR || recv_code == 0) {
-        _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
+/**
+ * Get the flags byte the client sends the server during the handshake.
+ *
+ * @param client The socket client.
+ * @return The flags byte.
+ */
+char _cdtp_client_handshake_flags(CDTPClient *client)
+{
+    return (char) ((client->resumption ? CDTP_HANDSHAKE_WANTS_TICKET : 0) |
+                   (_cdtp_client_wants_shared_memory(client) ? CDTP_HANDSHAKE_WANTS_SHARED_MEMORY : 0));
+}
+
+/**
+ * Exchange crypto keys with the server using X25519.
+ *
+ * @param client The socket client.
+ * @param server_public_key The server's X25519 public key.
+ * @param ciphers The ciphers the server offers, in order of preference.
+ * @param num_ciphers The number of ciphers the server offers.
+ * @return If the exchange succeeded.
+ *
+ * The cipher is chosen with `_cdtp_crypto_choose_cipher`. Servers that offer no ciphers only support CBC mode, and are
+ * not sent a choice, nor asked for a resumption ticket or shared memory.
+ */
+bool _cdtp_client_exchange_keys_ecdh(CDTPClient *client, char *server_public_key, char *ciphers, size_t num_ciphers)
+{
+    int cipher = _cdtp_crypto_choose_cipher(ciphers, num_ciphers, _cdtp_crypto_aes_accelerated());
+
+    if (cipher == 0) {
         return false;
     }
-    else {
-        msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
-        buffer = (char *) malloc(msg_size * sizeof(char));
 
-        recv_code = recv(client->sock->sock, buffer, msg_size, 0);
+    CDTPECDHKeyPair *ecdh_keys = _cdtp_crypto_ecdh_key_pair();
 
-        if (recv_code == SOCKET_ERROR || recv_code == 0 || (size_t) recv_code != msg_size) {
-            _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
-            return false;
-        }
+    if (ecdh_keys == NULL) {
+        return false;
     }
-#else
-    recv_code = read(client->sock->sock, size_buffer, CDTP_LENSIZE);
 
-    if (recv_code == 0 || recv_code == -1) {
-        _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
+    char reply[3 + CDTP_ECDH_PUBLIC_KEY_SIZE];
+    char flags = _cdtp_client_handshake_flags(client);
+    size_t reply_size = num_ciphers == 0 ? 1 + CDTP_ECDH_PUBLIC_KEY_SIZE :
+                        flags != 0 ? 3 + CDTP_ECDH_PUBLIC_KEY_SIZE :
+                        2 + CDTP_ECDH_PUBLIC_KEY_SIZE;
+    reply[0] = (char) CDTP_HANDSHAKE_ECDH;
+    memcpy(reply + 1, ecdh_keys->public_key, CDTP_ECDH_PUBLIC_KEY_SIZE);
+    reply[1 + CDTP_ECDH_PUBLIC_KEY_SIZE] = (char) cipher;
+    reply[2 + CDTP_ECDH_PUBLIC_KEY_SIZE] = flags;
+
+    if (!_cdtp_client_send_handshake(client, reply, reply_size)) {
+        _cdtp_crypto_ecdh_key_pair_free(ecdh_keys);
         return false;
     }
-    else {
-        msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
-        buffer = (char *) malloc(msg_size * sizeof(char));
 
-        recv_code = read(client->sock->sock, buffer, msg_size);
+    client->sock->key = _cdtp_crypto_ecdh_aes_key(ecdh_keys, server_public_key, false, (CDTPCipher) cipher);
 
-        if (recv_code == 0 || recv_code == -1 || (size_t) recv_code != msg_size) {
-            _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
-            return false;
-        }
+    _cdtp_crypto_ecdh_key_pair_free(ecdh_keys);
+
+    return client->sock->key != NULL;
+}
+
+/**
+ * Exchange crypto keys with the server using RSA.
+ *
+ * @param client The socket client.
+ * @param public_key_bytes The server's RSA public key in PEM format.
+ * @param public_key_size The size of the public key, in bytes.
+ * @return If the exchange succeeded.
+ */
+bool _cdtp_client_exchange_keys_rsa(CDTPClient *client, char *public_key_bytes, size_t public_key_size)
+{
+    CDTPRSAPublicKey *public_key = _cdtp_crypto_rsa_public_key_from_bytes(public_key_bytes, public_key_size);
+
+    if (public_key == NULL) {
+        return false;
     }
-#endif
 
-    CDTPRSAPublicKey *public_key = _cdtp_crypto_rsa_public_key_from_bytes(buffer, msg_size);
     CDTPAESKey *key = _cdtp_crypto_aes_key();
-    CDTPCryptoData *key_encrypted = _cdtp_crypto_rsa_encrypt(public_key, key->key, key->key_size);
-    char *key_encoded = _cdtp_construct_message(key_encrypted->data, key_encrypted->data_size);
+    CDTPCryptoData *key_encrypted = key != NULL ? _cdtp_crypto_rsa_encrypt(public_key, key->key, key->key_size) : NULL;
+
+    _cdtp_crypto_rsa_public_key_free(public_key);
+
+    if (key_encrypted == NULL) {
+        if (key != NULL) {
+            _cdtp_crypto_aes_key_free(key);
+        }
 
-    if (send(client->sock->sock, key_encoded, CDTP_LENSIZE + key_encrypted->data_size, 0) < 0) {
-        _cdtp_set_err(CDTP_CLIENT_SEND_FAILED);
         return false;
     }
 
-    client->sock->key = key;
+    bool sent = _cdtp_client_send_handshake(client, key_encrypted->data, key_encrypted->data_size);
 
-    free(buffer);
-    _cdtp_crypto_rsa_public_key_free(public_key);
     _cdtp_crypto_data_free(key_encrypted);
-    free(key_encoded);
+
+    if (!sent) {
+        _cdtp_crypto_aes_key_free(key);
+        return false;
+    }
+
+    client->sock->key = key;
 
     return true;
 }
 
 /**
- * Handle messages from the server.
+ * Try to resume an earlier session with the server, using the client's resumption ticket.
  *
  * @param client The socket client.
+ * @param server_public_key The X25519 public key from the server's hello message, which the resumed session's key is
+ * bound to.
+ * @param resumed A pointer that will be set to whether the server accepted the ticket.
+ * @return If the server could be asked to resume the session.
+ *
+ * The client sends the ticket the server sealed, along with fresh random data, and both parties derive the new session
+ * key from those and the secret the ticket holds. If the server rejects the ticket, it is discarded, and keys must be
+ * exchanged as usual.
  */
-void _cdtp_client_handle(CDTPClient *client)
+bool _cdtp_client_resume(CDTPClient *client, char *server_public_key, bool *resumed)
 {
-#ifdef _WIN32
-    // Set non-blocking
-    unsigned long mode = 1;
+    // The client's ticket is the cipher and secret of the session it came from, followed by the server's sealed ticket
+    char *secret = client->ticket + 1;
+    char *sealed_ticket = client->ticket + 1 + CDTP_RESUMPTION_SECRET_SIZE;
+    char request[2 + CDTP_RESUMPTION_RANDOM_SIZE + CDTP_TICKET_SIZE];
+    request[0] = (char) CDTP_HANDSHAKE_RESUME;
+    request[1] = _cdtp_client_handshake_flags(client);
+    memcpy(request + 2 + CDTP_RESUMPTION_RANDOM_SIZE, sealed_ticket, CDTP_TICKET_SIZE);
+
+    if (RAND_bytes((unsigned char *) (request + 2), CDTP_RESUMPTION_RANDOM_SIZE) == 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return false;
+    }
 
-    if (ioctlsocket(client->sock->sock, FIONBIO, &mode) != 0) {
-        _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
-        return;
+    if (!_cdtp_client_send_handshake(client, request, sizeof(request))) {
+        return false;
     }
 
-    unsigned char size_buffer[CDTP_LENSIZE];
-    int recv_code;
+    size_t msg_size;
+    char *status = _cdtp_client_recv_handshake(client, &msg_size);
 
-    while (client->connected) {
-        recv_code = recv(client->sock->sock, (char *) size_buffer, CDTP_LENSIZE, 0);
+    if (status == NULL || msg_size != 1) {
+        free(status);
+        return false;
+    }
 
-        // Check if the client has disconnected
-        if (!client->connected) {
-            return;
+    *resumed = status[0] == (char) 1;
+    free(status);
+
+    if (*resumed) {
+        client->sock->key = _cdtp_crypto_resumed_aes_key(secret,
+                                                         request + 2,
+                                                         server_public_key,
+                                                         false,
+                                                         (CDTPCipher) (client->ticket[0]));
+        client->resumed = true;
+
+        return client->sock->key != NULL;
+    }
+
+    free(client->ticket);
+    client->ticket = NULL;
+
+    return true;
+}
+
+/**
+ * Receive a resumption ticket from the server, replacing the client's current ticket.
+ *
+ * @param client The socket client.
+ * @return If the ticket was received.
+ *
+ * The ticket is encrypted with the new session key. Servers that do not resume sessions send an empty ticket.
+ */
+bool _cdtp_client_recv_ticket(CDTPClient *client)
+{
+    size_t msg_size;
+    char *buffer = _cdtp_client_recv_handshake(client, &msg_size);
+    void *sealed_ticket;
+    size_t sealed_ticket_size;
+
+    if (buffer == NULL ||
+        !_cdtp_crypto_aes_decrypt_in_place(client->sock->key, buffer, msg_size, &sealed_ticket, &sealed_ticket_size) ||
+        (sealed_ticket_size != 0 && sealed_ticket_size != CDTP_TICKET_SIZE)) {
+        free(buffer);
+        return false;
+    }
+
+    free(client->ticket);
+    client->ticket = NULL;
+
+    if (sealed_ticket_size == CDTP_TICKET_SIZE) {
+        client->ticket = (char *) malloc(CDTP_RESUMPTION_TICKET_SIZE * sizeof(char));
+        client->ticket[0] = (char) (client->sock->key->mode);
+        memcpy(client->ticket + 1 + CDTP_RESUMPTION_SECRET_SIZE, sealed_ticket, CDTP_TICKET_SIZE);
+
+        if (!_cdtp_crypto_resumption_secret(client->sock->key, client->ticket + 1)) {
+            free(client->ticket);
+            client->ticket = NULL;
+            free(buffer);
+            return false;
         }
+    }
 
-        if (recv_code == SOCKET_ERROR) {
-            int err_code = WSAGetLastError();
+    free(buffer);
 
-            if (err_code == WSAECONNRESET) {
-                cdtp_client_disconnect(client);
-                _cdtp_client_call_on_disconnected(client);
-                return;
-            }
-            else if (err_code == WSAEWOULDBLOCK) {
-                // Nothing happened on the socket, do nothing
-            }
-            else {
-                _cdtp_set_error(CDTP_CLIENT_RECV_FAILED, err_code);
-                return;
+    return true;
+}
+
+/**
+ * Receive the server's answer to the client asking for shared memory, and tell the server whether it was mapped.
+ *
+ * @param client The socket client.
+ * @return If the answer was received.
+ *
+ * Servers that do not use shared memory decline, in which case messages are sent through the socket as usual.
+ */
+bool _cdtp_client_accept_shared_memory(CDTPClient *client)
+{
+    bool offered;
+    CDTPSharedMemory *shm;
+
+    if (!_cdtp_shm_recv_offer(client->sock, &offered, &shm)) {
+        return false;
+    }
+
+    if (offered) {
+        char reply = (char) (shm != NULL ? 1 : 0);
+
+        if (!_cdtp_client_send_handshake(client, &reply, 1)) {
+            if (shm != NULL) {
+                _cdtp_shm_free(shm);
             }
+
+            return false;
         }
-        else if (recv_code == 0) {
-            cdtp_client_disconnect(client);
-            _cdtp_client_call_on_disconnected(client);
-            return;
+    }
+
+    client->sock->shm = shm;
+
+    return true;
+}
+
+/**
+ * Exchange crypto keys with the server.
+ *
+ * @param client The socket client.
+ * @return If the exchange succeeded.
+ *
+ * Servers that do not offer an X25519 key exchange send only their RSA public key, which is used instead. Clients with
+ * a resumption ticket try to resume their earlier session before exchanging keys with X25519. Plaintext connections
+ * are only established if both the client and the server use the plaintext mode, in which case no keys are exchanged.
+ * Clients that ask for shared memory are answered once keys have been exchanged.
+ */
+bool _cdtp_client_exchange_keys(CDTPClient *client)
+{
+    size_t msg_size;
+    char *buffer = _cdtp_client_recv_handshake(client, &msg_size);
+
+    if (buffer == NULL) {
+        _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
+        return false;
+    }
+
+    // Look for the version byte, X25519 public key, and offered ciphers following the optional PEM text
+    char *ecdh_offer = (char *) memchr(buffer, 0, msg_size);
+    size_t pem_size = ecdh_offer != NULL ? (size_t) (ecdh_offer - buffer) : msg_size;
+    bool plaintext_offer = ecdh_offer != NULL && msg_size - pem_size == 2 && ecdh_offer[1] == (char) CDTP_HANDSHAKE_PLAINTEXT;
+    bool wants_shared_memory = _cdtp_client_wants_shared_memory(client);
+    bool exchanged;
+
+    if (client->plaintext || plaintext_offer) {
+        // Only go without encryption if both parties agreed to
+        char reply[2] = { (char) CDTP_HANDSHAKE_PLAINTEXT, (char) CDTP_HANDSHAKE_WANTS_SHARED_MEMORY };
+        exchanged = client->plaintext && plaintext_offer &&
+                    _cdtp_client_send_handshake(client, reply, wants_shared_memory ? 2 : 1);
+    }
+    else if (ecdh_offer != NULL && !client->legacy_handshake &&
+        msg_size - pem_size >= 2 + CDTP_ECDH_PUBLIC_KEY_SIZE && ecdh_offer[1] == (char) CDTP_HANDSHAKE_ECDH) {
+        // Only servers that offer ciphers understand resumption tickets
+        size_t num_ciphers = msg_size - pem_size - 2 - CDTP_ECDH_PUBLIC_KEY_SIZE;
+        bool resumed = false;
+        exchanged = num_ciphers == 0 || client->ticket == NULL || _cdtp_client_resume(client, ecdh_offer + 2, &resumed);
+
+        if (exchanged && !resumed) {
+            exchanged = _cdtp_client_exchange_keys_ecdh(client,
+                                                        ecdh_offer + 2,
+                                                        ecdh_offer + 2 + CDTP_ECDH_PUBLIC_KEY_SIZE,
+                                                        num_ciphers);
+        }
+
+        if (exchanged && num_ciphers > 0 && client->resumption) {
+            exchanged = _cdtp_client_recv_ticket(client);
         }
-        else {
-            size_t msg_size = _cdtp_decode_message_size(size_buffer);
-            unsigned char *buffer = (unsigned char *) malloc(msg_size * sizeof(unsigned char));
 
-            // Wait in case the message is sent in multiple chunks
-            cdtp_sleep(CDTP_SLEEP_TIME);
+        wants_shared_memory = wants_shared_memory && num_ciphers > 0;
+    }
+    else if (pem_size > 0) {
+        exchanged = _cdtp_client_exchange_keys_rsa(client, buffer, pem_size);
+        wants_shared_memory = false;
+    }
+    else {
+        exchanged = false;
+    }
 
-            recv_code = recv(client->sock->sock, (char *) buffer, msg_size, 0);
+    free(buffer);
 
-            if (recv_code == SOCKET_ERROR) {
-                int err_code = WSAGetLastError();
+    if (exchanged && wants_shared_memory) {
+        exchanged = _cdtp_client_accept_shared_memory(client);
+    }
 
-                if (err_code == WSAECONNRESET) {
-                    cdtp_client_disconnect(client);
-                    _cdtp_client_call_on_disconnected(client);
-                    return;
-                }
-                else {
-                    _cdtp_set_error(CDTP_CLIENT_RECV_FAILED, err_code);
-                    return;
-                }
-            }
-            else if (recv_code == 0) {
-                cdtp_client_disconnect(client);
-                _cdtp_client_call_on_disconnected(client);
-                return;
-            }
-            else if (((size_t) recv_code) != msg_size) {
-                _cdtp_set_err(CDTP_CLIENT_RECV_FAILED);
-                return;
-            }
-            else {
-                _cdtp_client_call_on_recv(client, (void *) buffer, msg_size);
+    if (!exchanged) {
+        _cdtp_set_err(CDTP_CLIENT_KEY_EXCHANGE_FAILED);
+    }
+
+    return exchanged;
+}
+
+/**
+ * Finish handling events, then stop the client's event threads.
+ *
+ * @param client The socket client.
+ * @return If the event threads were stopped.
+ */
+bool _cdtp_client_free_event_threads(CDTPClient *client)
+{
+    if (client->sock->strand != NULL) {
+        _cdtp_strand_free(client->sock->strand);
+        client->sock->strand = NULL;
+    }
+
+    if (client->event_pool != NULL && !_cdtp_thread_pool_free(client->event_pool)) {
+        return false;
+    }
+
+    client->event_pool = NULL;
+
+    return true;
+}
+
+/**
+ * Handle messages from the server.
+ *
+ * @param client The socket client.
+ */
+void _cdtp_client_handle(CDTPClient *client)
+{
+    CDTPReactorEvent events[1];
+
+    while (client->connected) {
+        int num_events = _cdtp_reactor_wait(client->reactor, events, 1);
+
+        // Check if the client has disconnected
+        if (!client->connected) {
+            return;
+        }
+
+        if (num_events == -1) {
+            _cdtp_set_err(CDTP_REACTOR_WAIT_FAILED);
+            return;
+        }
+        else if (num_events == 0) {
+            continue;
+        }
+
+        // Send queued data once the socket has room for it
+        if (events[0].writable) {
+            _cdtp_send_buffer_flush(client->sock->send_buffer, client->sock);
+
+            if (_cdtp_send_buffer_take_unblocked(client->sock->send_buffer)) {
+                _cdtp_client_call_on_writable(client);
             }
         }
 
-        cdtp_sleep(CDTP_SLEEP_TIME);
-    }
-#else
-    // Set non-blocking
-    if (fcntl(client->sock->sock, F_SETFL, fcntl(client->sock->sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
-        return;
-    }
+        if (!events[0].readable) {
+            continue;
+        }
 
-    unsigned char size_buffer[CDTP_LENSIZE];
-    int recv_code;
+        int recv_code = _cdtp_recv_buffer_read(client->sock->recv_buffer, client->sock);
 
-    while (client->connected) {
-        recv_code = read(client->sock->sock, (char *) size_buffer, CDTP_LENSIZE);
+        // Reading from shared memory also sends queued data, since the doorbell rings when the server makes room for it
+        if (client->sock->shm != NULL && _cdtp_send_buffer_take_unblocked(client->sock->send_buffer)) {
+            _cdtp_client_call_on_writable(client);
+        }
 
         // Check if the client has disconnected
         if (!client->connected) {
@@ -218,47 +584,56 @@ void _cdtp_client_handle(CDTPClient *client)
             _cdtp_client_call_on_disconnected(client);
             return;
         }
-        else if (recv_code == -1) {
-            int err_code = errno;
+        else if (recv_code < 0) {
+#ifdef _WIN32
+            int err_code = WSAGetLastError();
 
-            if (CDTP_EAGAIN_OR_WOULDBLOCK(err_code)) {
+            // A server that sent too large a message is disconnected from
+            if (err_code == WSAECONNRESET || err_code == WSAEMSGSIZE || err_code == WSAENOBUFS) {
+                cdtp_client_disconnect(client);
+                _cdtp_client_call_on_disconnected(client);
+                return;
+            }
+            else if (err_code == WSAEWOULDBLOCK) {
                 // Nothing happened on the socket, do nothing
             }
             else {
                 _cdtp_set_error(CDTP_CLIENT_RECV_FAILED, err_code);
                 return;
             }
-        }
-        else {
-            size_t msg_size = _cdtp_decode_message_size(size_buffer);
-            unsigned char *buffer = (unsigned char *) malloc(msg_size * sizeof(unsigned char));
-
-            // Wait in case the message is sent in multiple chunks
-            cdtp_sleep(CDTP_SLEEP_TIME);
-
-            recv_code = read(client->sock->sock, (char *) buffer, msg_size);
+#else
+            int err_code = errno;
 
-            if (recv_code == -1) {
-                _cdtp_set_err(CDTP_CLIENT_RECV_FAILED);
-                return;
-            }
-            else if (recv_code == 0) {
+            // A server that corrupted its shared memory or sent too large a message is treated as having gone away
+            if (err_code == ECONNRESET || err_code == EPROTO || err_code == EMSGSIZE || err_code == ENOBUFS) {
                 cdtp_client_disconnect(client);
                 _cdtp_client_call_on_disconnected(client);
                 return;
             }
-            else if (((size_t) recv_code) != msg_size) {
-                _cdtp_set_err(CDTP_CLIENT_RECV_FAILED);
-                return;
+            else if (CDTP_EAGAIN_OR_WOULDBLOCK(err_code)) {
+                // Nothing happened on the socket, do nothing
             }
             else {
-                _cdtp_client_call_on_recv(client, (void *) buffer, msg_size);
+                _cdtp_set_error(CDTP_CLIENT_RECV_FAILED, err_code);
+                return;
             }
+#endif
         }
+        else {
+            // Handle every complete message received so far, leaving any partial message for the next read
+            void *data;
+            size_t data_size;
 
-        cdtp_sleep(CDTP_SLEEP_TIME);
+            while (_cdtp_recv_buffer_next(client->sock->recv_buffer, &data, &data_size)) {
+                _cdtp_client_call_on_recv(client, data, data_size);
+
+                // An inline event function may have disconnected the client
+                if (!client->connected) {
+                    return;
+                }
+            }
+        }
     }
-#endif
 }
 
 /**
@@ -271,6 +646,118 @@ void _cdtp_client_call_handle(CDTPClient *client)
     client->handle_thread = _cdtp_start_handle_thread(_cdtp_client_handle, client);
 }
 
+/**
+ * Check that the client can connect to a server.
+ *
+ * @param client The socket client.
+ * @return If the client has never connected.
+ */
+bool _cdtp_client_can_connect(CDTPClient *client)
+{
+    // Make sure the client has not connected before
+    if (client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_RECONNECT, 0);
+        return false;
+    }
+
+    // Make sure the client is not already connected
+    if (client->connected) {
+        _cdtp_set_error(CDTP_CLIENT_ALREADY_CONNECTED, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Set whether the client's socket blocks.
+ *
+ * @param client The socket client.
+ * @param blocking If operations should block.
+ * @return If the socket was set to block or not block.
+ */
+bool _cdtp_client_set_blocking(CDTPClient *client, bool blocking)
+{
+#ifdef _WIN32
+    unsigned long mode = blocking ? 0 : 1;
+
+    if (ioctlsocket(client->sock->sock, FIONBIO, &mode) != 0) {
+        _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
+        return false;
+    }
+#else
+    int flags = fcntl(client->sock->sock, F_GETFL, 0);
+
+    if (flags == -1 ||
+        fcntl(client->sock->sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) == -1) {
+        _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/**
+ * Give up on a connection that could not be established, leaving the client done so that it can be freed.
+ *
+ * @param client The socket client, whose socket is connected to the server.
+ */
+void _cdtp_client_abort_connect(CDTPClient *client)
+{
+    _cdtp_client_free_event_threads(client);
+
+#ifdef _WIN32
+    closesocket(client->sock->sock);
+#else
+    close(client->sock->sock);
+#endif
+
+    client->done = true;
+}
+
+/**
+ * Connect to the server, exchange keys, and start handling messages.
+ *
+ * @param client The socket client, whose socket's address has been set.
+ *
+ * The client is only marked as connected once everything has been set up. If anything fails after the socket has
+ * connected, the socket is closed and the client is done, since a socket cannot connect twice.
+ */
+void _cdtp_client_connect(CDTPClient *client)
+{
+    if (connect(client->sock->sock, (struct sockaddr *) (&(client->sock->address)), client->sock->address_size) < 0) {
+        _cdtp_set_err(CDTP_CLIENT_CONNECT_FAILED);
+        return;
+    }
+
+    // Exchange keys over a blocking socket, then watch for messages without blocking
+    bool connected = _cdtp_client_set_blocking(client, true) &&
+                     _cdtp_client_exchange_keys(client) &&
+                     _cdtp_client_set_blocking(client, false);
+
+    // Start the event threads, unless event functions are called directly on the handle thread
+    if (connected && client->dispatch_mode != CDTP_DISPATCH_INLINE) {
+        client->event_pool = _cdtp_thread_pool(client->num_event_threads, client->max_queued_events);
+        connected = client->event_pool != NULL;
+    }
+
+    if (connected && client->dispatch_mode == CDTP_DISPATCH_ORDERED) {
+        client->sock->strand = _cdtp_strand(client->event_pool);
+    }
+
+    if (!connected || !_cdtp_reactor_add(client->reactor, client->sock, 0)) {
+        _cdtp_client_abort_connect(client);
+        return;
+    }
+
+    _cdtp_send_buffer_watch(client->sock->send_buffer, client->sock, client->reactor, 0);
+
+    // Handle received data
+    client->connected = true;
+    _cdtp_client_call_handle(client);
+}
+
 CDTP_EXPORT CDTPClient *cdtp_client(
     ClientOnRecvCallback on_recv,
     ClientOnDisconnectedCallback on_disconnected,
@@ -283,10 +770,27 @@ CDTP_EXPORT CDTPClient *cdtp_client(
     // Initialize the client object
     client->on_recv = on_recv;
     client->on_disconnected = on_disconnected;
+    client->on_writable = NULL;
     client->on_recv_arg = on_recv_arg;
     client->on_disconnected_arg = on_disconnected_arg;
+    client->on_writable_arg = NULL;
     client->connected = false;
     client->done = false;
+    client->legacy_handshake = false;
+    client->resumption = false;
+    client->resumed = false;
+    client->ticket = NULL;
+    client->plaintext = false;
+    client->shared_memory = false;
+    client->num_event_threads = CDTP_CLIENT_EVENT_THREADS > 0 ? CDTP_CLIENT_EVENT_THREADS : _cdtp_cpu_count();
+    client->max_queued_events = CDTP_EVENT_QUEUE_SIZE;
+    client->event_pool = NULL;
+    client->dispatch_mode = CDTP_DISPATCH_ORDERED;
+
+    // Initialize the event reactor
+    if ((client->reactor = _cdtp_reactor()) == NULL) {
+        return NULL;
+    }
 
     // Initialize the library
     if (!CDTP_INIT) {
@@ -316,23 +820,126 @@ CDTP_EXPORT CDTPClient *cdtp_client(
     }
 #endif
 
+    client->sock->key = NULL;
+    client->sock->shm = NULL;
+    client->sock->recv_buffer = _cdtp_recv_buffer(CDTP_MAX_MESSAGE_SIZE);
+    client->sock->send_buffer = _cdtp_send_buffer(CDTP_SEND_LOW_WATERMARK, CDTP_SEND_HIGH_WATERMARK);
+    client->sock->reactor_index = 0;
+    client->sock->strand = NULL;
+
     return client;
 }
 
-CDTP_EXPORT void cdtp_client_connect(CDTPClient *client, char *host, unsigned short port)
+CDTP_EXPORT void cdtp_client_set_event_threads(CDTPClient *client, size_t num_threads, size_t max_queued_events)
 {
-    // Make sure the client has not connected before
-    if (client->done) {
-        _cdtp_set_error(CDTP_CLIENT_CANNOT_RECONNECT, 0);
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
         return;
     }
 
-    // Make sure the client is not already connected
-    if (client->connected) {
-        _cdtp_set_error(CDTP_CLIENT_ALREADY_CONNECTED, 0);
+    client->num_event_threads = num_threads > 0 ? num_threads : _cdtp_cpu_count();
+    client->max_queued_events = max_queued_events;
+}
+
+CDTP_EXPORT void cdtp_client_set_dispatch_mode(CDTPClient *client, CDTPDispatchMode dispatch_mode)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->dispatch_mode = dispatch_mode;
+}
+
+CDTP_EXPORT void cdtp_client_set_legacy_handshake(CDTPClient *client, bool legacy_handshake)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->legacy_handshake = legacy_handshake;
+}
+
+CDTP_EXPORT void cdtp_client_set_resumption(CDTPClient *client, bool resumption)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->resumption = resumption;
+}
+
+CDTP_EXPORT void cdtp_client_set_plaintext(CDTPClient *client, bool plaintext)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->plaintext = plaintext;
+}
+
+CDTP_EXPORT void cdtp_client_set_shared_memory(CDTPClient *client, bool shared_memory)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->shared_memory = shared_memory;
+}
+
+CDTP_EXPORT void cdtp_client_set_send_watermarks(CDTPClient *client, size_t low_watermark, size_t high_watermark)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->sock->send_buffer->low_watermark = low_watermark < high_watermark ? low_watermark : high_watermark;
+    client->sock->send_buffer->high_watermark = high_watermark;
+}
+
+CDTP_EXPORT void cdtp_client_set_on_writable(CDTPClient *client, ClientOnWritableCallback on_writable, void *on_writable_arg)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->on_writable = on_writable;
+    client->on_writable_arg = on_writable_arg;
+}
+
+CDTP_EXPORT void cdtp_client_set_max_message_size(CDTPClient *client, size_t max_message_size)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(CDTP_CLIENT_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    client->sock->recv_buffer->max_message_size = max_message_size;
+}
+
+CDTP_EXPORT void cdtp_client_connect(CDTPClient *client, char *host, unsigned short port)
+{
+    if (!_cdtp_client_can_connect(client)) {
         return;
     }
 
+    struct sockaddr_in *address = (struct sockaddr_in *) (&(client->sock->address));
+
     // Change 'localhost' to '127.0.0.1'
     if (strcmp(host, "localhost") == 0) {
         host = "127.0.0.1";
@@ -351,44 +958,72 @@ CDTP_EXPORT void cdtp_client_connect(CDTPClient *client, char *host, unsigned sh
 
     free(host_wc);
 #else
-    if (inet_pton(CDTP_ADDRESS_FAMILY, host, &(client->sock->address)) != 1) {
+    if (inet_pton(CDTP_ADDRESS_FAMILY, host, &(address->sin_addr)) != 1) {
         _cdtp_set_err(CDTP_CLIENT_ADDRESS_FAILED);
         return;
     }
 #endif
 
-    client->sock->address.sin_family = CDTP_ADDRESS_FAMILY;
-    client->sock->address.sin_port = htons(port);
+    address->sin_family = CDTP_ADDRESS_FAMILY;
+    address->sin_port = htons(port);
+    client->sock->address_size = (socklen_t) sizeof(struct sockaddr_in);
 
-    if (connect(client->sock->sock, (struct sockaddr *) (&(client->sock->address)), sizeof(client->sock->address)) < 0) {
-        _cdtp_set_err(CDTP_CLIENT_CONNECT_FAILED);
+    _cdtp_client_connect(client);
+}
+
+CDTP_EXPORT void cdtp_client_connect_unix(CDTPClient *client, char *path)
+{
+    if (!_cdtp_client_can_connect(client)) {
         return;
     }
 
-    // Handle received data
-    client->connected = true;
+    if (!_cdtp_unix_address(&(client->sock->address), &(client->sock->address_size), path)) {
+        _cdtp_set_err(CDTP_CLIENT_ADDRESS_FAILED);
+        return;
+    }
 
-    // Set blocking for key exchange
+    // Replace the client's TCP socket with a Unix domain socket
 #ifdef _WIN32
-    unsigned long mode = 0;
+    closesocket(client->sock->sock);
 
-    if (ioctlsocket(client->sock->sock, FIONBIO, &mode) != 0) {
+    if ((client->sock->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
         _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
         return;
     }
 #else
-    if (fcntl(client->sock->sock, F_SETFL, fcntl(client->sock->sock, F_GETFL, 0) & ~O_NONBLOCK) == -1) {
+    close(client->sock->sock);
+
+    if ((client->sock->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
         _cdtp_set_err(CDTP_CLIENT_SOCK_INIT_FAILED);
         return;
     }
 #endif
 
-    // Exchange keys
-    if (!_cdtp_client_exchange_keys(client)) {
+    _cdtp_client_connect(client);
+}
+
+CDTP_EXPORT void cdtp_client_connect_resume(CDTPClient *client,
+                                            char *host,
+                                            unsigned short port,
+                                            void *ticket,
+                                            size_t ticket_size)
+{
+    // Make sure the client has not connected
+    if (client->connected || client->done) {
+        _cdtp_set_error(client->done ? CDTP_CLIENT_CANNOT_RECONNECT : CDTP_CLIENT_ALREADY_CONNECTED, 0);
         return;
     }
 
-    _cdtp_client_call_handle(client);
+    free(client->ticket);
+    client->ticket = NULL;
+
+    // Anything that is not a ticket is ignored, and keys are exchanged as usual
+    if (ticket != NULL && ticket_size == CDTP_RESUMPTION_TICKET_SIZE) {
+        client->ticket = (char *) malloc(CDTP_RESUMPTION_TICKET_SIZE * sizeof(char));
+        memcpy(client->ticket, ticket, CDTP_RESUMPTION_TICKET_SIZE);
+    }
+
+    cdtp_client_connect(client, host, port);
 }
 
 CDTP_EXPORT void cdtp_client_disconnect(CDTPClient *client)
@@ -402,13 +1037,19 @@ CDTP_EXPORT void cdtp_client_disconnect(CDTPClient *client)
     client->connected = false;
     client->done = true;
 
-#ifdef _WIN32
-    // Close the socket
-    if (closesocket(client->sock->sock) != 0) {
-        _cdtp_set_err(CDTP_CLIENT_DISCONNECT_FAILED);
-        return;
+    // An event function may be disconnecting the client, so the handle thread must not wait for it to make room
+    if (client->event_pool != NULL) {
+        _cdtp_thread_pool_close(client->event_pool);
+    }
+
+    if (client->sock->strand != NULL) {
+        _cdtp_strand_close(client->sock->strand);
     }
 
+    // Wake the handle thread so it notices the client has disconnected
+    _cdtp_reactor_wake(client->reactor);
+
+#ifdef _WIN32
     // Wait for threads to exit
     if (GetThreadId(client->handle_thread) != GetCurrentThreadId()) {
         if (WaitForSingleObject(client->handle_thread, INFINITE) == WAIT_FAILED) {
@@ -421,13 +1062,21 @@ CDTP_EXPORT void cdtp_client_disconnect(CDTPClient *client)
             return;
         }
     }
-#else
-    // Close the socket
-    if (close(client->sock->sock) != 0) {
+
+    // Send any queued data, then close the socket
+    _cdtp_reactor_remove(client->reactor, client->sock);
+    _cdtp_send_buffer_drain(client->sock->send_buffer, client->sock, CDTP_SEND_DRAIN_TIMEOUT);
+
+    if (closesocket(client->sock->sock) != 0) {
         _cdtp_set_err(CDTP_CLIENT_DISCONNECT_FAILED);
         return;
     }
 
+    // Finish handling events, unless the handle thread still has to report the disconnect
+    if (GetThreadId(client->handle_thread) != GetCurrentThreadId()) {
+        _cdtp_client_free_event_threads(client);
+    }
+#else
     // Wait for threads to exit
     if (pthread_equal(client->handle_thread, pthread_self()) == 0) {
         int err_code = pthread_join(client->handle_thread, NULL);
@@ -444,6 +1093,20 @@ CDTP_EXPORT void cdtp_client_disconnect(CDTPClient *client)
             return;
         }
     }
+
+    // Send any queued data, then close the socket
+    _cdtp_reactor_remove(client->reactor, client->sock);
+    _cdtp_send_buffer_drain(client->sock->send_buffer, client->sock, CDTP_SEND_DRAIN_TIMEOUT);
+
+    if (close(client->sock->sock) != 0) {
+        _cdtp_set_err(CDTP_CLIENT_DISCONNECT_FAILED);
+        return;
+    }
+
+    // Finish handling events, unless the handle thread still has to report the disconnect
+    if (pthread_equal(client->handle_thread, pthread_self()) == 0) {
+        _cdtp_client_free_event_threads(client);
+    }
 #endif
 }
 
@@ -452,6 +1115,30 @@ CDTP_EXPORT bool cdtp_client_is_connected(CDTPClient *client)
     return client->connected;
 }
 
+CDTP_EXPORT bool cdtp_client_is_resumed(CDTPClient *client)
+{
+    return client->resumed;
+}
+
+CDTP_EXPORT bool cdtp_client_uses_shared_memory(CDTPClient *client)
+{
+    return client->sock->shm != NULL;
+}
+
+CDTP_EXPORT void *cdtp_client_get_resumption_ticket(CDTPClient *client, size_t *ticket_size)
+{
+    if (client->ticket == NULL) {
+        *ticket_size = 0;
+        return NULL;
+    }
+
+    void *ticket = malloc(CDTP_RESUMPTION_TICKET_SIZE * sizeof(char));
+    memcpy(ticket, client->ticket, CDTP_RESUMPTION_TICKET_SIZE);
+    *ticket_size = CDTP_RESUMPTION_TICKET_SIZE;
+
+    return ticket;
+}
+
 CDTP_EXPORT char *cdtp_client_get_host(CDTPClient *client)
 {
     // Make sure the client is connected
@@ -468,6 +1155,11 @@ CDTP_EXPORT char *cdtp_client_get_host(CDTPClient *client)
         return NULL;
     }
 
+    // Unix domain sockets are identified by their path
+    if (addr.ss_family == AF_UNIX) {
+        return _cdtp_unix_address_path(&addr, len);
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
 
 #ifdef _WIN32
@@ -517,6 +1209,11 @@ CDTP_EXPORT unsigned short cdtp_client_get_port(CDTPClient *client)
         return 0;
     }
 
+    // Unix domain sockets have no port
+    if (addr.ss_family == AF_UNIX) {
+        return 0;
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
     unsigned short port = ntohs(s->sin_port);
 
@@ -539,6 +1236,11 @@ CDTP_EXPORT char *cdtp_client_get_server_host(CDTPClient *client)
         return NULL;
     }
 
+    // Unix domain sockets are identified by their path
+    if (addr.ss_family == AF_UNIX) {
+        return _cdtp_unix_address_path(&addr, len);
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
 
 #ifdef _WIN32
@@ -588,6 +1290,11 @@ CDTP_EXPORT unsigned short cdtp_client_get_server_port(CDTPClient *client)
         return 0;
     }
 
+    // Unix domain sockets have no port
+    if (addr.ss_family == AF_UNIX) {
+        return 0;
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
     unsigned short port = ntohs(s->sin_port);
 
@@ -602,16 +1309,14 @@ CDTP_EXPORT void cdtp_client_send(CDTPClient *client, void *data, size_t data_si
         return;
     }
 
-    CDTPCryptoData *data_encrypted = _cdtp_crypto_aes_encrypt(client->sock->key, data, data_size);
-    char *message = _cdtp_construct_message(data_encrypted->data, data_encrypted->data_size);
+    int sent = _cdtp_send_buffer_send(client->sock->send_buffer, client->sock, data, data_size);
 
-    if (send(client->sock->sock, message, CDTP_LENSIZE + data_encrypted->data_size, 0) < 0) {
+    if (sent < 0) {
         _cdtp_set_err(CDTP_CLIENT_SEND_FAILED);
-        return;
     }
-
-    _cdtp_crypto_data_free(data_encrypted);
-    free(message);
+    else if (sent == 0) {
+        _cdtp_set_error(CDTP_CLIENT_SEND_WOULD_BLOCK, 0);
+    }
 }
 
 CDTP_EXPORT void cdtp_client_free(CDTPClient *client)
@@ -622,7 +1327,23 @@ CDTP_EXPORT void cdtp_client_free(CDTPClient *client)
         return;
     }
 
-    _cdtp_crypto_aes_key_free(client->sock->key);
+    // Finish handling events, if the client was disconnected by the server
+    if (client->event_pool != NULL && !_cdtp_client_free_event_threads(client)) {
+        return;
+    }
+
+    if (client->sock->key != NULL) {
+        _cdtp_crypto_aes_key_free(client->sock->key);
+    }
+
+    if (client->sock->shm != NULL) {
+        _cdtp_shm_free(client->sock->shm);
+    }
+
+    free(client->ticket);
+    _cdtp_recv_buffer_free(client->sock->recv_buffer);
+    _cdtp_send_buffer_free(client->sock->send_buffer);
     free(client->sock);
+    _cdtp_reactor_free(client->reactor);
     free(client);
 }
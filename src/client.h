@@ -11,6 +11,9 @@
 #include "crypto.h"
 #include "threading.h"
 #include "server.h"
+#include "reactor.h"
+#include "buffer.h"
+#include "shm.h"
 
 /**
  * Instantiate a socket client.
@@ -27,12 +30,14 @@
  *   - a `size_t` representing the size of the received data, in bytes
  *   - a `void *` containing the `on_recv_arg`
  * Note that the data (the first parameter) is allocated on the heap by CDTP. Users are responsible for calling `free`
- * on the data at some point, whether that be at the end of the `on_recv` function or at a later time.
+ * on the data at some point, whether that be at the end of the `on_recv` function or at a later time, unless the
+ * client dispatches events inline.
  *
  * The `on_disconnected` functions should take one parameter:
  *   - a `void *` containing the `on_disconnected_arg`
  *
- * All event functions are executed in their own threads to prevent halting the client's event loop.
+ * By default, all event functions are executed on a pool of event threads to prevent halting the client's event loop.
+ * See `cdtp_client_set_event_threads` and `cdtp_client_set_dispatch_mode`.
  */
 CDTP_EXPORT CDTPClient *cdtp_client(
   ClientOnRecvCallback on_recv,
@@ -41,6 +46,121 @@ CDTP_EXPORT CDTPClient *cdtp_client(
   void *on_disconnected_arg
 );
 
+/**
+ * Set the number of threads the client uses to call event functions.
+ *
+ * @param client The socket client.
+ * @param num_threads The number of event threads, or 0 to use one per processor.
+ * @param max_queued_events The number of events that may wait for an event thread before the client stops reading
+ * from the server until an event function returns, or 0 to never stop reading.
+ *
+ * Events still waiting when the client disconnects are handled before `cdtp_client_disconnect` returns, or before
+ * `cdtp_client_free` returns if the server ended the connection. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_event_threads(CDTPClient *client, size_t num_threads, size_t max_queued_events);
+
+/**
+ * Set how the client schedules event functions on its event threads.
+ *
+ * @param client The socket client.
+ * @param dispatch_mode The dispatch mode.
+ *
+ * In the `CDTP_DISPATCH_ORDERED` mode (the default), event functions run one at a time, in the order the events
+ * occurred, so `on_disconnected` is always called last. In the `CDTP_DISPATCH_PARALLEL` mode, event functions may run
+ * concurrently when the client has more than one event thread. In the `CDTP_DISPATCH_INLINE` mode, event functions
+ * are called directly from the thread handling messages from the server, and no event threads are started. This has
+ * the lowest latency, but no further messages are read until each event function returns, so inline event functions
+ * must not block. The data passed to an inline `on_recv` function points into the client's receive buffer, so it is only
+ * valid until the function returns, may not be suitably aligned for any particular type, and must not be freed by the
+ * user. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_dispatch_mode(CDTPClient *client, CDTPDispatchMode dispatch_mode);
+
+/**
+ * Set whether the client always uses the RSA key exchange, even when the server offers an X25519 key exchange.
+ *
+ * @param client The socket client.
+ * @param legacy_handshake If the RSA key exchange should always be used.
+ *
+ * The X25519 key exchange is much faster, so this is mostly useful for testing servers that still support older
+ * clients. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_legacy_handshake(CDTPClient *client, bool legacy_handshake);
+
+/**
+ * Set whether the client asks the server for a resumption ticket when it connects.
+ *
+ * @param client The socket client.
+ * @param resumption If a resumption ticket should be requested.
+ *
+ * Once connected, the ticket can be retrieved with `cdtp_client_get_resumption_ticket`, and passed to
+ * `cdtp_client_connect_resume` by a later client to skip the key agreement. Servers that do not resume sessions send
+ * no ticket. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_resumption(CDTPClient *client, bool resumption);
+
+/**
+ * Set whether the client sends and receives messages without encrypting them.
+ *
+ * @param client The socket client.
+ * @param plaintext If messages should be sent unencrypted.
+ *
+ * The client can then only connect to servers that also use the plaintext mode, and connecting to any other server
+ * fails, as does connecting to a plaintext server without it. See `cdtp_server_set_plaintext`. This must be called
+ * before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_plaintext(CDTPClient *client, bool plaintext);
+
+/**
+ * Set whether the client asks the server to send and receive messages through shared memory.
+ *
+ * @param client The socket client.
+ * @param shared_memory If shared memory should be asked for.
+ *
+ * Shared memory is only asked for when connecting to a Unix domain socket (see `cdtp_client_connect_unix`), and is
+ * only used if the server offers it. See `cdtp_server_set_shared_memory`. Otherwise, and on Windows, messages are sent
+ * through the socket as usual. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_shared_memory(CDTPClient *client, bool shared_memory);
+
+/**
+ * Set how much sent data the client may queue before it refuses to send more.
+ *
+ * @param client The socket client.
+ * @param low_watermark The number of queued bytes at or below which data is sent again.
+ * @param high_watermark The number of queued bytes above which sending fails with `CDTP_CLIENT_SEND_WOULD_BLOCK`.
+ *
+ * Data that cannot be sent right away is queued, and sent on the client's handle thread once the server can take it.
+ * Once more than `high_watermark` bytes are queued, sending is refused until no more than `low_watermark` bytes are
+ * left. See `cdtp_client_set_on_writable` to be told when that happens. The server is always read from, whatever is
+ * queued. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_send_watermarks(CDTPClient *client, size_t low_watermark, size_t high_watermark);
+
+/**
+ * Set the event function called when the client can send again after sending was refused.
+ *
+ * @param client The socket client.
+ * @param on_writable The function to call with the client and `on_writable_arg`, or NULL.
+ * @param on_writable_arg A value that will be passed to `on_writable`.
+ *
+ * Once sending has failed with `CDTP_CLIENT_SEND_WOULD_BLOCK`, the function is called as soon as no more than the low
+ * watermark is queued (see `cdtp_client_set_send_watermarks`), after which sending succeeds again. It is called in the
+ * same way as the other event functions. This must be called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_on_writable(CDTPClient *client, ClientOnWritableCallback on_writable, void *on_writable_arg);
+
+/**
+ * Set the size of the largest message the client will receive from the server.
+ *
+ * @param client The socket client.
+ * @param max_message_size The size of the largest message, in bytes.
+ *
+ * If the server sends a larger message, the client disconnects before any memory is set aside for it. This must be
+ * called before the client connects.
+ */
+CDTP_EXPORT void cdtp_client_set_max_message_size(CDTPClient *client, size_t max_message_size);
+
 /**
  * Connect to a server.
  *
@@ -50,6 +170,34 @@ CDTP_EXPORT CDTPClient *cdtp_client(
  */
 CDTP_EXPORT void cdtp_client_connect(CDTPClient *client, char *host, unsigned short port);
 
+/**
+ * Connect to a server on a Unix domain socket.
+ *
+ * @param client The socket client.
+ * @param path The path the server is bound to.
+ *
+ * See `cdtp_server_start_unix`.
+ */
+CDTP_EXPORT void cdtp_client_connect_unix(CDTPClient *client, char *path);
+
+/**
+ * Connect to a server, resuming an earlier session if the server accepts the given ticket.
+ *
+ * @param client The socket client.
+ * @param host The server host.
+ * @param port The server port.
+ * @param ticket A ticket from `cdtp_client_get_resumption_ticket`, or NULL.
+ * @param ticket_size The size of the ticket, in bytes.
+ *
+ * If the server rejects the ticket, because it has expired or the server has restarted, keys are exchanged as they are
+ * by `cdtp_client_connect`. See `cdtp_client_is_resumed`.
+ */
+CDTP_EXPORT void cdtp_client_connect_resume(CDTPClient *client,
+                                            char *host,
+                                            unsigned short port,
+                                            void *ticket,
+                                            size_t ticket_size);
+
 /**
  * Disconnect from the server.
  *
@@ -65,6 +213,36 @@ CDTP_EXPORT void cdtp_client_disconnect(CDTPClient *client);
  */
 CDTP_EXPORT bool cdtp_client_is_connected(CDTPClient *client);
 
+/**
+ * Check if the client's session was resumed with a resumption ticket.
+ *
+ * @param client The socket client.
+ * @return If the session was resumed.
+ */
+CDTP_EXPORT bool cdtp_client_is_resumed(CDTPClient *client);
+
+/**
+ * Check if the client sends and receives messages through shared memory.
+ *
+ * @param client The socket client.
+ * @return If the client uses shared memory.
+ */
+CDTP_EXPORT bool cdtp_client_uses_shared_memory(CDTPClient *client);
+
+/**
+ * Get the client's resumption ticket.
+ *
+ * @param client The socket client.
+ * @param ticket_size A pointer that will be set to the size of the ticket, in bytes.
+ * @return The ticket, or NULL if the client has none.
+ *
+ * This is the latest ticket the server sent the client, or otherwise the ticket the client resumed its session with,
+ * which remains valid until it expires.
+ * The ticket holds the secret that the keys of resumed sessions are derived from, so it must be kept as private as
+ * those sessions' data. Note that the returned value is allocated on the heap, and `free` will need to be called on it.
+ */
+CDTP_EXPORT void *cdtp_client_get_resumption_ticket(CDTPClient *client, size_t *ticket_size);
+
 /**
  * Get the host of the client.
  *
@@ -107,6 +285,10 @@ CDTP_EXPORT unsigned short cdtp_client_get_server_port(CDTPClient *client);
  * @param client The socket client.
  * @param data The data to send.
  * @param data_size The size of the data, in bytes.
+ *
+ * This never waits for the server to read the data. Whatever cannot be sent right away is queued, and any data still
+ * queued when the client disconnects is sent before the connection is closed. If too much data is already queued,
+ * nothing is sent and the error `CDTP_CLIENT_SEND_WOULD_BLOCK` is reported, and the data should be sent again later.
  */
 CDTP_EXPORT void cdtp_client_send(CDTPClient *client, void *data, size_t data_size);
 
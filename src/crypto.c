@@ -38,12 +38,12 @@ void _cdtp_crypto_pad_data(CDTPCryptoData *crypto_data)
         padded_data = malloc(crypto_data->data_size + 2);
         padded_data[0] = (char) 1;
         padded_data[1] = (char) 255;
-        memcpy(padded_data + 2, crypto_data->data, crypto_data->data_size + 2);
+        memcpy(padded_data + 2, crypto_data->data, crypto_data->data_size);
         crypto_data->data_size += 2;
     } else {
         padded_data = malloc(crypto_data->data_size + 1);
         padded_data[0] = (char) 0;
-        memcpy(padded_data + 1, crypto_data->data, crypto_data->data_size + 1);
+        memcpy(padded_data + 1, crypto_data->data, crypto_data->data_size);
         crypto_data->data_size += 1;
     }
 
@@ -75,19 +75,17 @@ void _cdtp_crypto_unpad_data(CDTPCryptoData *crypto_data)
 }
 
 /**
- * Get an OpenSSL representation of a public key.
+ * Parse a public key in PEM format.
  *
- * @param public_key The public key.
- * @return The OpenSSL representation of the public key.
+ * @param public_key_bytes The public key bytes.
+ * @param public_key_size The size of the public key, in bytes.
+ * @return The OpenSSL representation of the public key, or NULL if it could not be parsed.
  */
-EVP_PKEY *_cdtp_crypto_openssl_rsa_public_key(CDTPRSAPublicKey *public_key)
+EVP_PKEY *_cdtp_crypto_openssl_rsa_public_key(char *public_key_bytes, size_t public_key_size)
 {
-    const char *pub_key = public_key->key;
-    int pub_len = public_key->key_size;
-
     BIO *pbkeybio = NULL;
 
-    if ((pbkeybio = BIO_new_mem_buf((const void *) pub_key, pub_len)) == NULL) {
+    if ((pbkeybio = BIO_new_mem_buf((const void *) public_key_bytes, (int) public_key_size)) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
         return NULL;
     }
@@ -96,7 +94,6 @@ EVP_PKEY *_cdtp_crypto_openssl_rsa_public_key(CDTPRSAPublicKey *public_key)
 
     if ((pb_rsa = PEM_read_bio_PUBKEY(pbkeybio, &pb_rsa, NULL, NULL)) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
     }
 
     BIO_free(pbkeybio);
@@ -105,19 +102,17 @@ EVP_PKEY *_cdtp_crypto_openssl_rsa_public_key(CDTPRSAPublicKey *public_key)
 }
 
 /**
- * Get an OpenSSL representation of a private key.
+ * Parse a private key in PEM format.
  *
- * @param private_key The private key.
- * @return The OpenSSL representation of the private key.
+ * @param private_key_bytes The private key bytes.
+ * @param private_key_size The size of the private key, in bytes.
+ * @return The OpenSSL representation of the private key, or NULL if it could not be parsed.
  */
-EVP_PKEY *_cdtp_crypto_openssl_rsa_private_key(CDTPRSAPrivateKey *private_key)
+EVP_PKEY *_cdtp_crypto_openssl_rsa_private_key(char *private_key_bytes, size_t private_key_size)
 {
-    const char *pri_key = private_key->key;
-    int pri_len = private_key->key_size;
-
     BIO *prkeybio = NULL;
 
-    if ((prkeybio = BIO_new_mem_buf((const void *) pri_key, pri_len)) == NULL) {
+    if ((prkeybio = BIO_new_mem_buf((const void *) private_key_bytes, (int) private_key_size)) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
         return NULL;
     }
@@ -126,7 +121,6 @@ EVP_PKEY *_cdtp_crypto_openssl_rsa_private_key(CDTPRSAPrivateKey *private_key)
 
     if ((p_rsa = PEM_read_bio_PrivateKey(prkeybio, &p_rsa, NULL, NULL)) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
     }
 
     BIO_free(prkeybio);
@@ -135,23 +129,44 @@ EVP_PKEY *_cdtp_crypto_openssl_rsa_private_key(CDTPRSAPrivateKey *private_key)
 }
 
 /**
- * Free the memory used by the OpenSSL public key.
+ * Write a key in PEM format.
  *
- * @param public_key The OpenSSL public key.
+ * @param key The OpenSSL key.
+ * @param private If the private key should be written, rather than the public key.
+ * @return The PEM text, or NULL if it could not be written.
  */
-void _cdtp_crypto_openssl_rsa_public_key_free(EVP_PKEY *public_key)
+CDTPCryptoData *_cdtp_crypto_openssl_rsa_pem(EVP_PKEY *key, bool private)
 {
-    EVP_PKEY_free(public_key);
-}
+    BIO *bp;
 
-/**
- * Free the memory used by the OpenSSL private key.
- *
- * @param private_key The OpenSSL private key.
- */
-void _cdtp_crypto_openssl_rsa_private_key_free(EVP_PKEY *private_key)
-{
-    EVP_PKEY_free(private_key);
+    if ((bp = BIO_new(BIO_s_mem())) == NULL) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return NULL;
+    }
+
+    int written = private ? PEM_write_bio_PrivateKey(bp, key, NULL, NULL, 0, NULL, NULL) : PEM_write_bio_PUBKEY(bp, key);
+    int pem_len = BIO_pending(bp);
+
+    if (written == 0 || pem_len < 1) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        BIO_free_all(bp);
+        return NULL;
+    }
+
+    CDTPCryptoData *pem = (CDTPCryptoData *) malloc(sizeof(CDTPCryptoData));
+    pem->data = malloc((size_t) pem_len * sizeof(char));
+    pem->data_size = (size_t) pem_len;
+
+    if (BIO_read(bp, pem->data, pem_len) != pem_len) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        BIO_free_all(bp);
+        _cdtp_crypto_data_free(pem);
+        return NULL;
+    }
+
+    BIO_free_all(bp);
+
+    return pem;
 }
 
 CDTPCryptoData *_cdtp_crypto_rsa_public_key_to_bytes(CDTPRSAPublicKey *public_key)
@@ -161,13 +176,20 @@ CDTPCryptoData *_cdtp_crypto_rsa_public_key_to_bytes(CDTPRSAPublicKey *public_ke
 
 CDTPCryptoData *_cdtp_crypto_rsa_private_key_to_bytes(CDTPRSAPrivateKey *private_key)
 {
-    return _cdtp_crypto_data(private_key->key, private_key->key_size);
+    return _cdtp_crypto_openssl_rsa_pem(private_key->evp_key, true);
 }
 
 CDTPRSAPublicKey *_cdtp_crypto_rsa_public_key_from_bytes(char *public_key_bytes, size_t public_key_size)
 {
+    EVP_PKEY *evp_key = _cdtp_crypto_openssl_rsa_public_key(public_key_bytes, public_key_size);
+
+    if (evp_key == NULL) {
+        return NULL;
+    }
+
     CDTPRSAPublicKey *public_key = (CDTPRSAPublicKey *) malloc(sizeof(CDTPRSAPublicKey));
 
+    public_key->evp_key = evp_key;
     public_key->key = (char *) malloc(public_key_size * sizeof(char));
     memcpy(public_key->key, public_key_bytes, public_key_size);
     public_key->key_size = public_key_size;
@@ -177,24 +199,29 @@ CDTPRSAPublicKey *_cdtp_crypto_rsa_public_key_from_bytes(char *public_key_bytes,
 
 CDTPRSAPrivateKey *_cdtp_crypto_rsa_private_key_from_bytes(char *private_key_bytes, size_t private_key_size)
 {
+    EVP_PKEY *evp_key = _cdtp_crypto_openssl_rsa_private_key(private_key_bytes, private_key_size);
+
+    if (evp_key == NULL) {
+        return NULL;
+    }
+
     CDTPRSAPrivateKey *private_key = (CDTPRSAPrivateKey *) malloc(sizeof(CDTPRSAPrivateKey));
 
-    private_key->key = (char *) malloc(private_key_size * sizeof(char));
-    memcpy(private_key->key, private_key_bytes, private_key_size);
-    private_key->key_size = private_key_size;
+    private_key->evp_key = evp_key;
 
     return private_key;
 }
 
 void _cdtp_crypto_rsa_public_key_free(CDTPRSAPublicKey *public_key)
 {
+    EVP_PKEY_free(public_key->evp_key);
     free(public_key->key);
     free(public_key);
 }
 
 void _cdtp_crypto_rsa_private_key_free(CDTPRSAPrivateKey *private_key)
 {
-    free(private_key->key);
+    EVP_PKEY_free(private_key->evp_key);
     free(private_key);
 }
 
@@ -207,55 +234,30 @@ CDTP_TEST_EXPORT CDTPRSAKeyPair *_cdtp_crypto_rsa_key_pair(void)
         return NULL;
     }
 
-    BIO *bp_public;
-    BIO *bp_private;
+    // Only the public key is ever sent, so it is the only one written out
+    CDTPCryptoData *public_pem = _cdtp_crypto_openssl_rsa_pem(r, false);
 
-    if ((bp_public = BIO_new(BIO_s_mem())) == NULL) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
-    }
+    if (public_pem == NULL || EVP_PKEY_up_ref(r) == 0) {
+        if (public_pem != NULL) {
+            _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+            _cdtp_crypto_data_free(public_pem);
+        }
 
-    if (PEM_write_bio_PUBKEY(bp_public, r) == 0) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        EVP_PKEY_free(r);
         return NULL;
     }
 
-    if ((bp_private = BIO_new(BIO_s_mem())) == NULL) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
-    }
-
-    if (PEM_write_bio_PrivateKey(bp_private, r, NULL, NULL, 0, NULL, NULL) == 0) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
-    }
-
-    size_t pub_len = BIO_pending(bp_public);
-    size_t pri_len = BIO_pending(bp_private);
-    char *public_key_bytes = (char *) malloc(pub_len * sizeof(char));
-    char *private_key_bytes = (char *) malloc(pri_len * sizeof(char));
-
-    if (BIO_read(bp_public, public_key_bytes, pub_len) < 1) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
-    }
-
-    if (BIO_read(bp_private, private_key_bytes, pri_len) < 1) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
-    }
-
-    BIO_free_all(bp_public);
-    BIO_free_all(bp_private);
-    EVP_PKEY_free(r);
-
+    // Both halves share the generated key, each holding a reference to it
     CDTPRSAKeyPair *key_pair = (CDTPRSAKeyPair *) malloc(sizeof(CDTPRSAKeyPair));
+    key_pair->public_key = (CDTPRSAPublicKey *) malloc(sizeof(CDTPRSAPublicKey));
+    key_pair->private_key = (CDTPRSAPrivateKey *) malloc(sizeof(CDTPRSAPrivateKey));
 
-    key_pair->public_key = _cdtp_crypto_rsa_public_key_from_bytes(public_key_bytes, pub_len);
-    key_pair->private_key = _cdtp_crypto_rsa_private_key_from_bytes(private_key_bytes, pri_len);
+    key_pair->public_key->evp_key = r;
+    key_pair->public_key->key = (char *) (public_pem->data);
+    key_pair->public_key->key_size = public_pem->data_size;
+    key_pair->private_key->evp_key = r;
 
-    free(public_key_bytes);
-    free(private_key_bytes);
+    free(public_pem);
 
     return key_pair;
 }
@@ -274,7 +276,7 @@ CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_rsa_encrypt(CDTPRSAPublicKey *publ
     unsigned char *plaintext_data = (unsigned char *) plaintext_padded->data;
     int plaintext_len = (int) plaintext_padded->data_size;
 
-    EVP_PKEY *evp_public_key = _cdtp_crypto_openssl_rsa_public_key(public_key);
+    EVP_PKEY *evp_public_key = public_key->evp_key;
 
     int encrypted_key_len;
 
@@ -330,7 +332,6 @@ CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_rsa_encrypt(CDTPRSAPublicKey *publ
     memcpy(all_unsigned + CDTP_LENSIZE + encrypted_key_len + nonce_len, ciphertext_unsigned, ciphertext_len);
 
     EVP_CIPHER_CTX_free(ctx);
-    _cdtp_crypto_openssl_rsa_public_key_free(evp_public_key);
 
     CDTPCryptoData *ciphertext = _cdtp_crypto_data((void *) all_unsigned, CDTP_LENSIZE + encrypted_key_len + nonce_len + ciphertext_len);
 
@@ -346,68 +347,63 @@ CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_rsa_encrypt(CDTPRSAPublicKey *publ
 
 CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_rsa_decrypt(CDTPRSAPrivateKey *private_key, void *ciphertext, size_t ciphertext_size)
 {
-    EVP_PKEY *evp_private_key = _cdtp_crypto_openssl_rsa_private_key(private_key);
-    int nonce_len = EVP_CIPHER_iv_length(EVP_aes_256_cbc());
-
+    EVP_PKEY *evp_private_key = private_key->evp_key;
+    size_t nonce_len = (size_t) EVP_CIPHER_iv_length(EVP_aes_256_cbc());
     unsigned char *all_unsigned = (unsigned char *) ciphertext;
 
-    char *encoded_encrypted_key_len = (char *) malloc(CDTP_LENSIZE * sizeof(char));
-    memcpy(encoded_encrypted_key_len, all_unsigned, CDTP_LENSIZE);
-
-    int encrypted_key_len = (int) _cdtp_decode_message_size((unsigned char *) encoded_encrypted_key_len);
-
-    unsigned char *encrypted_key = (unsigned char *) malloc(encrypted_key_len * sizeof(unsigned char));
-    memcpy(encrypted_key, all_unsigned + CDTP_LENSIZE, encrypted_key_len);
-
-    unsigned char *nonce = (unsigned char *) malloc(nonce_len * sizeof(unsigned char *));
-    memcpy(nonce, all_unsigned + CDTP_LENSIZE + encrypted_key_len, nonce_len);
-
-    int ciphertext_len = ciphertext_size - (CDTP_LENSIZE + encrypted_key_len + nonce_len);
-
-    unsigned char *ciphertext_unsigned = (unsigned char *) malloc(ciphertext_len * sizeof(unsigned char));
-    memcpy(ciphertext_unsigned, all_unsigned + CDTP_LENSIZE + encrypted_key_len + nonce_len, ciphertext_len);
-
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int plaintext_len;
+    // The encrypted key's size comes from the peer, so it is checked against the key and the data actually received
+    size_t encrypted_key_len = ciphertext_size >= CDTP_LENSIZE ? _cdtp_decode_message_size(all_unsigned) : 0;
 
-    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+    if (ciphertext_size < CDTP_LENSIZE ||
+        encrypted_key_len != (size_t) EVP_PKEY_size(evp_private_key) ||
+        ciphertext_size - CDTP_LENSIZE < encrypted_key_len + nonce_len) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, 0);
         return NULL;
     }
 
-    if (EVP_OpenInit(ctx, EVP_aes_256_cbc(), encrypted_key, encrypted_key_len, nonce, evp_private_key) == 0) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+    unsigned char *encrypted_key = all_unsigned + CDTP_LENSIZE;
+    unsigned char *nonce = encrypted_key + encrypted_key_len;
+    unsigned char *ciphertext_unsigned = nonce + nonce_len;
+    size_t ciphertext_len = ciphertext_size - (CDTP_LENSIZE + encrypted_key_len + nonce_len);
+
+    // Anything but whole blocks cannot have been produced by `_cdtp_crypto_rsa_encrypt`
+    if (ciphertext_len == 0 || ciphertext_len % 16 != 0 || ciphertext_len > INT_MAX / 2) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, 0);
         return NULL;
     }
 
-    unsigned char *plaintext_unsigned = (unsigned char *) malloc(ciphertext_len * sizeof(unsigned char));
-
-    if (EVP_OpenUpdate(ctx, plaintext_unsigned, &len, ciphertext_unsigned, ciphertext_len) == 0) {
-        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    unsigned char *plaintext_unsigned = (unsigned char *) malloc((ciphertext_len + 16) * sizeof(unsigned char));
+    int len = 0;
+    int plaintext_len = 0;
+    bool decrypted = ctx != NULL && plaintext_unsigned != NULL &&
+                     EVP_OpenInit(ctx,
+                                  EVP_aes_256_cbc(),
+                                  encrypted_key,
+                                  (int) encrypted_key_len,
+                                  nonce,
+                                  evp_private_key) != 0 &&
+                     EVP_OpenUpdate(ctx, plaintext_unsigned, &len, ciphertext_unsigned, (int) ciphertext_len) != 0;
+
+    if (decrypted) {
+        plaintext_len = len;
+        decrypted = EVP_OpenFinal(ctx, plaintext_unsigned + plaintext_len, &len) != 0;
+        plaintext_len += len;
     }
 
-    plaintext_len = len;
+    // Data padded by `_cdtp_crypto_pad_data` always starts with its whole padding prefix
+    decrypted = decrypted && plaintext_len >= (plaintext_len > 0 && plaintext_unsigned[0] == 1 ? 2 : 1);
+
+    CDTPCryptoData *plaintext = NULL;
 
-    if (EVP_OpenFinal(ctx, plaintext_unsigned + len, &len) == 0) {
+    if (decrypted) {
+        plaintext = _cdtp_crypto_data(plaintext_unsigned, (size_t) plaintext_len);
+        _cdtp_crypto_unpad_data(plaintext);
+    } else {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
     }
 
-    plaintext_len += len;
-    plaintext_unsigned = realloc(plaintext_unsigned, plaintext_len);
-
-    CDTPCryptoData *plaintext = _cdtp_crypto_data(plaintext_unsigned, plaintext_len);
-    _cdtp_crypto_unpad_data(plaintext);
-
     EVP_CIPHER_CTX_free(ctx);
-    _cdtp_crypto_openssl_rsa_private_key_free(evp_private_key);
-
-    free(encoded_encrypted_key_len);
-    free(encrypted_key);
-    free(nonce);
-    free(ciphertext_unsigned);
     free(plaintext_unsigned);
 
     return plaintext;
@@ -422,140 +418,679 @@ CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key(void)
         return NULL;
     }
 
-    CDTPAESKey *key = (CDTPAESKey *) malloc(sizeof(CDTPAESKey));
-
-    key->key = (char *) malloc(CDTP_AES_KEY_SIZE * sizeof(char));
-    memcpy(key->key, key_unsigned, CDTP_AES_KEY_SIZE);
-    key->key_size = CDTP_AES_KEY_SIZE;
-
-    return key;
+    return _cdtp_crypto_aes_key_from((char *) key_unsigned, CDTP_AES_KEY_SIZE);
 }
 
 CDTP_TEST_EXPORT void _cdtp_crypto_aes_key_free(CDTPAESKey *key)
 {
+    EVP_CIPHER_CTX_free(key->encrypt_ctx);
+    EVP_CIPHER_CTX_free(key->decrypt_ctx);
+    EVP_CIPHER_free(key->cipher);
     free(key->key);
     free(key);
 }
 
 CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key_from(char *bytes, size_t size)
+{
+    return _cdtp_crypto_aes_key_with_cipher(bytes, size, CDTP_CIPHER_AES_256_CBC, false);
+}
+
+/**
+ * Get the name OpenSSL knows a cipher by.
+ *
+ * @param mode The cipher.
+ * @return The cipher's name.
+ */
+const char *_cdtp_crypto_cipher_name(CDTPCipher mode)
+{
+    switch (mode) {
+        case CDTP_CIPHER_AES_256_GCM:
+            return CDTP_AES_GCM_CIPHER_NAME;
+        case CDTP_CIPHER_CHACHA20_POLY1305:
+            return CDTP_CHACHA20_CIPHER_NAME;
+        case CDTP_CIPHER_AES_256_CBC:
+        default:
+            return CDTP_AES_CBC_CIPHER_NAME;
+    }
+}
+
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key_with_cipher(char *bytes, size_t size, CDTPCipher mode, bool server)
 {
     CDTPAESKey *key = (CDTPAESKey *) malloc(sizeof(CDTPAESKey));
 
     key->key = (char *) malloc(size);
     memcpy(key->key, bytes, size);
     key->key_size = size;
+    key->mode = mode;
+    key->server = server;
+    key->send_counter = 0;
+    key->recv_counter = 0;
+    key->cipher = EVP_CIPHER_fetch(NULL, _cdtp_crypto_cipher_name(mode), NULL);
+    key->encrypt_ctx = EVP_CIPHER_CTX_new();
+    key->decrypt_ctx = EVP_CIPHER_CTX_new();
+
+    // Expand the key once, leaving the nonce to be set for each message. Decryption handles the block cipher's padding
+    // itself, see `_cdtp_crypto_aes_decrypt_in_place`.
+    if (key->cipher == NULL ||
+        key->encrypt_ctx == NULL ||
+        key->decrypt_ctx == NULL ||
+        EVP_EncryptInit_ex(key->encrypt_ctx, key->cipher, NULL, (unsigned char *) key->key, NULL) == 0 ||
+        EVP_DecryptInit_ex(key->decrypt_ctx, key->cipher, NULL, (unsigned char *) key->key, NULL) == 0 ||
+        EVP_CIPHER_CTX_set_padding(key->decrypt_ctx, 0) == 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        _cdtp_crypto_aes_key_free(key);
+        return NULL;
+    }
 
     return key;
 }
 
-CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_encrypt(CDTPAESKey *key, void *plaintext, size_t plaintext_size)
+CDTP_TEST_EXPORT bool _cdtp_crypto_cipher_supported(int cipher)
+{
+    return cipher == CDTP_CIPHER_AES_256_CBC ||
+           cipher == CDTP_CIPHER_AES_256_GCM ||
+           cipher == CDTP_CIPHER_CHACHA20_POLY1305;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_crypto_aes_accelerated(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(_M_X64) || defined(_M_IX86)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 25)) != 0 && (info[2] & (1 << 1)) != 0;
+#elif defined(__aarch64__) && defined(__APPLE__)
+    return true;
+#elif defined(__aarch64__) && defined(__linux__) && defined(HWCAP_AES) && defined(HWCAP_PMULL)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_AES) != 0 && (hwcap & HWCAP_PMULL) != 0;
+#else
+    // Without a way to tell, assume the worst, since AES in software is both slow and open to cache-timing attacks
+    return false;
+#endif
+}
+
+CDTP_TEST_EXPORT size_t _cdtp_crypto_offer_ciphers(char *ciphers, bool aes_accelerated)
+{
+    ciphers[0] = (char) (aes_accelerated ? CDTP_CIPHER_AES_256_GCM : CDTP_CIPHER_CHACHA20_POLY1305);
+    ciphers[1] = (char) (aes_accelerated ? CDTP_CIPHER_CHACHA20_POLY1305 : CDTP_CIPHER_AES_256_GCM);
+    ciphers[2] = (char) CDTP_CIPHER_AES_256_CBC;
+
+    return CDTP_NUM_CIPHERS;
+}
+
+CDTP_TEST_EXPORT int _cdtp_crypto_choose_cipher(char *ciphers, size_t num_ciphers, bool aes_accelerated)
+{
+    if (num_ciphers == 0) {
+        return CDTP_CIPHER_AES_256_CBC;
+    }
+
+    int chosen = 0;
+
+    for (size_t i = 0; i < num_ciphers; i++) {
+        int cipher = (int) ((unsigned char) ciphers[i]);
+
+        if (!aes_accelerated && cipher == CDTP_CIPHER_CHACHA20_POLY1305) {
+            return cipher;
+        }
+
+        if (chosen == 0 && _cdtp_crypto_cipher_supported(cipher)) {
+            chosen = cipher;
+        }
+    }
+
+    return chosen;
+}
+
+CDTP_TEST_EXPORT size_t _cdtp_crypto_aes_ciphertext_size(CDTPAESKey *key, size_t plaintext_size)
+{
+    if (key->mode != CDTP_CIPHER_AES_256_CBC) {
+        return plaintext_size + CDTP_AEAD_TAG_SIZE;
+    }
+
+    // The padding prefix, followed by the block cipher's own padding, which always adds at least one byte
+    size_t padded_size = plaintext_size + ((plaintext_size + 1) % 16 == 0 ? 2 : 1);
+
+    return CDTP_AES_NONCE_SIZE + (padded_size / 16 + 1) * 16;
+}
+
+/**
+ * Build the nonce of a message encrypted with an authenticated cipher.
+ *
+ * @param nonce Where to write the `CDTP_AEAD_NONCE_SIZE` bytes of the nonce.
+ * @param server If the message was sent by the server.
+ * @param counter The number of messages the sender sent before this one.
+ *
+ * Both parties encrypt with the same key, so the first four bytes keep the two directions' nonces apart, and the
+ * counter keeps every nonce in one direction unique.
+ */
+void _cdtp_crypto_aead_nonce(unsigned char *nonce, bool server, uint64_t counter)
+{
+    memset(nonce, 0, CDTP_AEAD_NONCE_SIZE - 8);
+    nonce[3] = (unsigned char) (server ? 1 : 0);
+
+    for (int i = 0; i < 8; i++) {
+        nonce[CDTP_AEAD_NONCE_SIZE - 1 - i] = (unsigned char) ((counter >> (8 * i)) & 0xff);
+    }
+}
+
+/**
+ * Encrypt data with an authenticated cipher, writing the ciphertext and tag directly to their destination.
+ *
+ * @param key The AES key.
+ * @param plaintext The data to encrypt.
+ * @param plaintext_size The size of the data, in bytes.
+ * @param dest Where to write the `_cdtp_crypto_aes_ciphertext_size(key, plaintext_size)` bytes of encrypted data.
+ * @return If the data was encrypted.
+ */
+bool _cdtp_crypto_aead_encrypt_into(CDTPAESKey *key, void *plaintext, size_t plaintext_size, unsigned char *dest)
 {
-    unsigned char *key_unsigned = (unsigned char *) key->key;
-    unsigned char nonce_unsigned[CDTP_AES_KEY_SIZE];
+    unsigned char nonce[CDTP_AEAD_NONCE_SIZE];
+    _cdtp_crypto_aead_nonce(nonce, key->server, key->send_counter++);
+
+    EVP_CIPHER_CTX *ctx = key->encrypt_ctx;
+    unsigned char *out = dest;
+    unsigned char *in = (unsigned char *) plaintext;
+    size_t remaining = plaintext_size;
+    int len = 0;
+    bool encrypted = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 0;
+
+    // Encrypt straight from the caller's buffer, in pieces small enough for OpenSSL's lengths
+    while (encrypted && remaining > 0) {
+        int in_len = remaining > INT_MAX / 2 ? INT_MAX / 2 : (int) remaining;
+        encrypted = EVP_EncryptUpdate(ctx, out, &len, in, in_len) != 0;
+        out += len;
+        in += in_len;
+        remaining -= (size_t) in_len;
+    }
 
-    if (RAND_bytes(nonce_unsigned, CDTP_AES_KEY_SIZE) == 0) {
+    // Neither authenticated cipher holds data back, so finishing only computes the tag
+    encrypted = encrypted &&
+                EVP_EncryptFinal_ex(ctx, out, &len) != 0 &&
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CDTP_AEAD_TAG_SIZE, dest + plaintext_size) != 0;
+
+    if (!encrypted) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
     }
 
-    CDTPCryptoData *plaintext_padded = _cdtp_crypto_data(plaintext, plaintext_size);
-    _cdtp_crypto_pad_data(plaintext_padded);
-    unsigned char *plaintext_data = (unsigned char *) plaintext_padded->data;
-    int plaintext_len = (int) plaintext_padded->data_size;
+    return encrypted;
+}
 
-    EVP_CIPHER_CTX *ctx;
+/**
+ * Decrypt data with an authenticated cipher, overwriting the encrypted data.
+ *
+ * @param key The AES key.
+ * @param ciphertext The ciphertext and tag, which are decrypted in place.
+ * @param ciphertext_size The size of the ciphertext and tag, in bytes.
+ * @param plaintext A pointer that will be set to the start of the decrypted data.
+ * @param plaintext_size A pointer that will be set to the size of the decrypted data, in bytes.
+ * @return If the data was decrypted and was not tampered with.
+ */
+bool _cdtp_crypto_aead_decrypt_in_place(CDTPAESKey *key,
+                                       void *ciphertext,
+                                       size_t ciphertext_size,
+                                       void **plaintext,
+                                       size_t *plaintext_size)
+{
+    // The counter advances even for rejected messages, since the connection cannot be trusted after one anyway
+    unsigned char nonce[CDTP_AEAD_NONCE_SIZE];
+    _cdtp_crypto_aead_nonce(nonce, !key->server, key->recv_counter++);
+
+    if (ciphertext_size < CDTP_AEAD_TAG_SIZE) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, 0);
+        return false;
+    }
+
+    EVP_CIPHER_CTX *ctx = key->decrypt_ctx;
+    unsigned char *data = (unsigned char *) ciphertext;
+    size_t data_size = ciphertext_size - CDTP_AEAD_TAG_SIZE;
+    bool decrypted = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) != 0;
+    size_t done = 0;
     int len;
-    int ciphertext_len;
 
-    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
+    while (decrypted && done < data_size) {
+        int in_len = data_size - done > INT_MAX / 2 ? INT_MAX / 2 : (int) (data_size - done);
+        decrypted = EVP_DecryptUpdate(ctx, data + done, &len, data + done, in_len) != 0 && len == in_len;
+        done += (size_t) in_len;
+    }
+
+    // Finishing fails if the tag does not match
+    unsigned char final_block[16];
+    decrypted = decrypted &&
+                EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CDTP_AEAD_TAG_SIZE, data + data_size) != 0 &&
+                EVP_DecryptFinal_ex(ctx, final_block, &len) > 0;
+
+    if (!decrypted) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
-        return NULL;
+        return false;
+    }
+
+    *plaintext = (void *) data;
+    *plaintext_size = data_size;
+
+    return true;
+}
+
+/**
+ * Encrypt data with AES, writing the nonce and ciphertext directly to their destination.
+ *
+ * @param key The AES key.
+ * @param plaintext The data to encrypt.
+ * @param plaintext_size The size of the data, in bytes.
+ * @param dest Where to write the `_cdtp_crypto_aes_ciphertext_size(key, plaintext_size)` bytes of encrypted data.
+ * @return If the data was encrypted.
+ *
+ * In CBC mode, the plaintext is padded in the same way as `_cdtp_crypto_pad_data`, without ever being copied.
+ */
+bool _cdtp_crypto_aes_encrypt_into(CDTPAESKey *key, void *plaintext, size_t plaintext_size, unsigned char *dest)
+{
+    if (key->mode != CDTP_CIPHER_AES_256_CBC) {
+        return _cdtp_crypto_aead_encrypt_into(key, plaintext, plaintext_size, dest);
+    }
+
+    if (RAND_bytes(dest, CDTP_AES_NONCE_SIZE) == 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return false;
+    }
+
+    unsigned char padding[2];
+    int padding_len;
+
+    if ((plaintext_size + 1) % 16 == 0) {
+        padding[0] = (unsigned char) 1;
+        padding[1] = (unsigned char) 255;
+        padding_len = 2;
+    } else {
+        padding[0] = (unsigned char) 0;
+        padding_len = 1;
+    }
+
+    // Only the nonce changes between messages
+    EVP_CIPHER_CTX *ctx = key->encrypt_ctx;
+    unsigned char *out = dest + CDTP_AES_NONCE_SIZE;
+    unsigned char *in = (unsigned char *) plaintext;
+    size_t remaining = plaintext_size;
+    int len;
+    bool encrypted = EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, dest) != 0 &&
+                     EVP_EncryptUpdate(ctx, out, &len, padding, padding_len) != 0;
+
+    // Encrypt straight from the caller's buffer, in pieces small enough for OpenSSL's lengths
+    while (encrypted && remaining > 0) {
+        out += len;
+
+        int in_len = remaining > INT_MAX / 2 ? INT_MAX / 2 : (int) remaining;
+        encrypted = EVP_EncryptUpdate(ctx, out, &len, in, in_len) != 0;
+        in += in_len;
+        remaining -= (size_t) in_len;
     }
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key_unsigned, nonce_unsigned) == 0) {
+    if (encrypted) {
+        out += len;
+        encrypted = EVP_EncryptFinal_ex(ctx, out, &len) != 0;
+    }
+
+    if (!encrypted) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+    }
+
+    return encrypted;
+}
+
+CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_encrypt(CDTPAESKey *key, void *plaintext, size_t plaintext_size)
+{
+    size_t ciphertext_size = _cdtp_crypto_aes_ciphertext_size(key, plaintext_size);
+    unsigned char *ciphertext = (unsigned char *) malloc(ciphertext_size * sizeof(unsigned char));
+
+    if (!_cdtp_crypto_aes_encrypt_into(key, plaintext, plaintext_size, ciphertext)) {
+        free(ciphertext);
         return NULL;
     }
 
-    int block_size = EVP_CIPHER_CTX_block_size(ctx);
-    unsigned char *ciphertext_unsigned = (unsigned char *) malloc((plaintext_len + block_size - 1) * sizeof(unsigned char));
+    CDTPCryptoData *ciphertext_data = (CDTPCryptoData *) malloc(sizeof(CDTPCryptoData));
+    ciphertext_data->data = (void *) ciphertext;
+    ciphertext_data->data_size = ciphertext_size;
 
-    len = plaintext_len + block_size - 1;
+    return ciphertext_data;
+}
+
+CDTP_TEST_EXPORT void *_cdtp_crypto_aes_encrypt_message(CDTPAESKey *key,
+                                                        void *plaintext,
+                                                        size_t plaintext_size,
+                                                        size_t *message_size)
+{
+    size_t ciphertext_size = _cdtp_crypto_aes_ciphertext_size(key, plaintext_size);
+    unsigned char *message = (unsigned char *) malloc((CDTP_LENSIZE + ciphertext_size) * sizeof(unsigned char));
+
+    if (!_cdtp_crypto_aes_encrypt_into(key, plaintext, plaintext_size, message + CDTP_LENSIZE)) {
+        free(message);
+        return NULL;
+    }
+
+    _cdtp_write_message_size(message, ciphertext_size);
+    *message_size = CDTP_LENSIZE + ciphertext_size;
+
+    return (void *) message;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_crypto_aes_decrypt_in_place(CDTPAESKey *key,
+                                                        void *ciphertext,
+                                                        size_t ciphertext_size,
+                                                        void **plaintext,
+                                                        size_t *plaintext_size)
+{
+    if (key->mode != CDTP_CIPHER_AES_256_CBC) {
+        return _cdtp_crypto_aead_decrypt_in_place(key, ciphertext, ciphertext_size, plaintext, plaintext_size);
+    }
+
+    unsigned char *nonce_unsigned = (unsigned char *) ciphertext;
+    unsigned char *data = nonce_unsigned + CDTP_AES_NONCE_SIZE;
+
+    // Anything else cannot have been produced by `_cdtp_crypto_aes_encrypt`
+    if (ciphertext_size < CDTP_AES_NONCE_SIZE + 16 || (ciphertext_size - CDTP_AES_NONCE_SIZE) % 16 != 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, 0);
+        return false;
+    }
+
+    size_t data_size = ciphertext_size - CDTP_AES_NONCE_SIZE;
 
-    if (EVP_EncryptUpdate(ctx, ciphertext_unsigned, &len, plaintext_data, plaintext_len) == 0) {
+    // Only the nonce changes between messages. With the block cipher's padding handled here instead, OpenSSL never
+    // holds a block back, so each block is decrypted exactly where it was received.
+    EVP_CIPHER_CTX *ctx = key->decrypt_ctx;
+    bool decrypted = EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce_unsigned) != 0;
+    size_t done = 0;
+
+    while (decrypted && done < data_size) {
+        int len;
+        int in_len = data_size - done > INT_MAX / 2 ? (INT_MAX / 2) & ~15 : (int) (data_size - done);
+        decrypted = EVP_DecryptUpdate(ctx, data + done, &len, data + done, in_len) != 0 && len == in_len;
+        done += (size_t) in_len;
+    }
+
+    if (!decrypted) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return false;
+    }
+
+    // Check and remove the block cipher's padding, then the padding prefix
+    size_t block_padding = data[data_size - 1];
+    bool valid = block_padding >= 1 && block_padding <= 16;
+
+    for (size_t i = 1; valid && i <= block_padding; i++) {
+        valid = data[data_size - i] == block_padding;
+    }
+
+    size_t prefix_size = data[0] == 1 ? 2 : 1;
+
+    if (!valid || data_size - block_padding < prefix_size) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, 0);
+        return false;
+    }
+
+    *plaintext = (void *) (data + prefix_size);
+    *plaintext_size = data_size - block_padding - prefix_size;
+
+    return true;
+}
+
+CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_decrypt(CDTPAESKey *key, void *ciphertext, size_t ciphertext_size)
+{
+    CDTPCryptoData *plaintext = (CDTPCryptoData *) malloc(sizeof(CDTPCryptoData));
+    plaintext->data = malloc(ciphertext_size);
+    memcpy(plaintext->data, ciphertext, ciphertext_size);
+
+    void *plaintext_data;
+
+    if (!_cdtp_crypto_aes_decrypt_in_place(key, plaintext->data, ciphertext_size, &plaintext_data, &(plaintext->data_size))) {
+        _cdtp_crypto_data_free(plaintext);
         return NULL;
     }
 
-    ciphertext_len = len;
+    memmove(plaintext->data, plaintext_data, plaintext->data_size);
 
-    if (EVP_EncryptFinal_ex(ctx, ciphertext_unsigned + len, &len) == 0) {
+    return plaintext;
+}
+
+CDTP_TEST_EXPORT CDTPECDHKeyPair *_cdtp_crypto_ecdh_key_pair(void)
+{
+    EVP_PKEY *key;
+
+    if ((key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519")) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
         return NULL;
     }
 
-    ciphertext_len += len;
-    ciphertext_unsigned = realloc(ciphertext_unsigned, ciphertext_len);
-    unsigned char *ciphertext_with_nonce_unsigned = (unsigned char *) malloc((CDTP_AES_NONCE_SIZE + ciphertext_len) * sizeof(unsigned char));
-    memcpy(ciphertext_with_nonce_unsigned, nonce_unsigned, CDTP_AES_NONCE_SIZE);
-    memcpy(ciphertext_with_nonce_unsigned + CDTP_AES_NONCE_SIZE, ciphertext_unsigned, ciphertext_len);
-    CDTPCryptoData *ciphertext_with_nonce = _cdtp_crypto_data((void *) ciphertext_with_nonce_unsigned, CDTP_AES_NONCE_SIZE + ciphertext_len);
+    CDTPECDHKeyPair *key_pair = (CDTPECDHKeyPair *) malloc(sizeof(CDTPECDHKeyPair));
+    size_t public_key_size = CDTP_ECDH_PUBLIC_KEY_SIZE;
 
-    EVP_CIPHER_CTX_free(ctx);
+    if (EVP_PKEY_get_raw_public_key(key, (unsigned char *) (key_pair->public_key), &public_key_size) == 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        EVP_PKEY_free(key);
+        free(key_pair);
+        return NULL;
+    }
 
-    _cdtp_crypto_data_free(plaintext_padded);
-    free(ciphertext_unsigned);
-    free(ciphertext_with_nonce_unsigned);
+    key_pair->key = key;
 
-    return ciphertext_with_nonce;
+    return key_pair;
 }
 
-CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_decrypt(CDTPAESKey *key, void *ciphertext, size_t ciphertext_size)
+CDTP_TEST_EXPORT void _cdtp_crypto_ecdh_key_pair_free(CDTPECDHKeyPair *key_pair)
 {
-    unsigned char *key_unsigned = (unsigned char *) key->key;
-    unsigned char nonce_unsigned[CDTP_AES_NONCE_SIZE];
-    memcpy(nonce_unsigned, ciphertext, CDTP_AES_NONCE_SIZE);
-    unsigned char *ciphertext_data = (unsigned char *) malloc((ciphertext_size - CDTP_AES_NONCE_SIZE) * sizeof(unsigned char));
-    memcpy(ciphertext_data, ((char *) ciphertext) + CDTP_AES_NONCE_SIZE, ciphertext_size - CDTP_AES_NONCE_SIZE);
-    int ciphertext_len = (int) (ciphertext_size - CDTP_AES_NONCE_SIZE);
+    EVP_PKEY_free(key_pair->key);
+    free(key_pair);
+}
 
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int plaintext_len;
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_ecdh_aes_key(CDTPECDHKeyPair *key_pair,
+                                                       char *peer_public_key,
+                                                       bool server,
+                                                       CDTPCipher mode)
+{
+    EVP_PKEY *peer_key;
 
-    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
+    if ((peer_key = EVP_PKEY_new_raw_public_key(NID_X25519, NULL, (unsigned char *) peer_public_key, CDTP_ECDH_PUBLIC_KEY_SIZE)) == NULL) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return NULL;
+    }
+
+    // Compute the shared secret
+    unsigned char shared_secret[CDTP_ECDH_PUBLIC_KEY_SIZE];
+    size_t shared_secret_size = CDTP_ECDH_PUBLIC_KEY_SIZE;
+    EVP_PKEY_CTX *ctx;
+
+    if ((ctx = EVP_PKEY_CTX_new(key_pair->key, NULL)) == NULL) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        EVP_PKEY_free(peer_key);
         return NULL;
     }
 
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key_unsigned, nonce_unsigned) == 0) {
+    // OpenSSL rejects peer keys that produce an all-zero shared secret
+    if (EVP_PKEY_derive_init(ctx) <= 0 ||
+        EVP_PKEY_derive_set_peer(ctx, peer_key) <= 0 ||
+        EVP_PKEY_derive(ctx, shared_secret, &shared_secret_size) <= 0) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(peer_key);
         return NULL;
     }
 
-    unsigned char *plaintext_unsigned = (unsigned char *) malloc(ciphertext_len * sizeof(unsigned char));
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer_key);
+
+    // Bind the key to both public keys, always in server-then-client order
+    size_t info_prefix_size = sizeof(CDTP_ECDH_KDF_INFO) - 1;
+    unsigned char info[sizeof(CDTP_ECDH_KDF_INFO) - 1 + 2 * CDTP_ECDH_PUBLIC_KEY_SIZE];
+    char *server_public_key = server ? key_pair->public_key : peer_public_key;
+    char *client_public_key = server ? peer_public_key : key_pair->public_key;
+    memcpy(info, CDTP_ECDH_KDF_INFO, info_prefix_size);
+    memcpy(info + info_prefix_size, server_public_key, CDTP_ECDH_PUBLIC_KEY_SIZE);
+    memcpy(info + info_prefix_size + CDTP_ECDH_PUBLIC_KEY_SIZE, client_public_key, CDTP_ECDH_PUBLIC_KEY_SIZE);
+
+    // Expand the shared secret into an AES key
+    unsigned char key_unsigned[CDTP_AES_KEY_SIZE];
+    size_t key_size = CDTP_AES_KEY_SIZE;
+
+    if (!_cdtp_crypto_hkdf(shared_secret, shared_secret_size, info, sizeof(info), key_unsigned, key_size)) {
+        return NULL;
+    }
+
+    return _cdtp_crypto_aes_key_with_cipher((char *) key_unsigned, key_size, mode, server);
+}
+
+bool _cdtp_crypto_hkdf(unsigned char *secret,
+                       size_t secret_size,
+                       unsigned char *info,
+                       size_t info_size,
+                       unsigned char *out,
+                       size_t out_size)
+{
+    EVP_PKEY_CTX *ctx;
+
+    if ((ctx = EVP_PKEY_CTX_new_id(NID_hkdf, NULL)) == NULL) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        return false;
+    }
 
-    if (EVP_DecryptUpdate(ctx, plaintext_unsigned, &len, ciphertext_data, ciphertext_len) == 0) {
+    if (EVP_PKEY_derive_init(ctx) <= 0 ||
+        EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) <= 0 ||
+        EVP_PKEY_CTX_set1_hkdf_key(ctx, secret, (int) secret_size) <= 0 ||
+        EVP_PKEY_CTX_add1_hkdf_info(ctx, info, (int) info_size) <= 0 ||
+        EVP_PKEY_derive(ctx, out, &out_size) <= 0) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        EVP_PKEY_CTX_free(ctx);
+        return false;
+    }
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return true;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_crypto_resumption_secret(CDTPAESKey *key, char *secret)
+{
+    return _cdtp_crypto_hkdf((unsigned char *) (key->key),
+                             key->key_size,
+                             (unsigned char *) CDTP_RESUMPTION_SECRET_INFO,
+                             sizeof(CDTP_RESUMPTION_SECRET_INFO) - 1,
+                             (unsigned char *) secret,
+                             CDTP_RESUMPTION_SECRET_SIZE);
+}
+
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_resumed_aes_key(char *secret,
+                                                          char *client_random,
+                                                          char *server_public_key,
+                                                          bool server,
+                                                          CDTPCipher mode)
+{
+    size_t info_prefix_size = sizeof(CDTP_RESUMPTION_KDF_INFO) - 1;
+    unsigned char info[sizeof(CDTP_RESUMPTION_KDF_INFO) - 1 + CDTP_RESUMPTION_RANDOM_SIZE + CDTP_ECDH_PUBLIC_KEY_SIZE];
+    memcpy(info, CDTP_RESUMPTION_KDF_INFO, info_prefix_size);
+    memcpy(info + info_prefix_size, client_random, CDTP_RESUMPTION_RANDOM_SIZE);
+    memcpy(info + info_prefix_size + CDTP_RESUMPTION_RANDOM_SIZE, server_public_key, CDTP_ECDH_PUBLIC_KEY_SIZE);
+
+    unsigned char key_unsigned[CDTP_AES_KEY_SIZE];
+
+    if (!_cdtp_crypto_hkdf((unsigned char *) secret,
+                           CDTP_RESUMPTION_SECRET_SIZE,
+                           info,
+                           sizeof(info),
+                           key_unsigned,
+                           CDTP_AES_KEY_SIZE)) {
         return NULL;
     }
 
-    plaintext_len = len;
+    return _cdtp_crypto_aes_key_with_cipher((char *) key_unsigned, CDTP_AES_KEY_SIZE, mode, server);
+}
+
+CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_ticket_seal(char *ticket_key,
+                                                          CDTPCipher mode,
+                                                          char *secret,
+                                                          double lifetime)
+{
+    // Tickets are sealed on any handshake thread, so each one gets its own context and a random nonce
+    unsigned char plaintext[1 + 8 + CDTP_RESUMPTION_SECRET_SIZE];
+    uint64_t expiry = (uint64_t) time(NULL) + (uint64_t) lifetime;
+    plaintext[0] = (unsigned char) mode;
 
-    if (EVP_DecryptFinal_ex(ctx, plaintext_unsigned + len, &len) == 0) {
+    for (int i = 0; i < 8; i++) {
+        plaintext[8 - i] = (unsigned char) ((expiry >> (8 * i)) & 0xff);
+    }
+
+    memcpy(plaintext + 1 + 8, secret, CDTP_RESUMPTION_SECRET_SIZE);
+
+    unsigned char *ticket = (unsigned char *) malloc(CDTP_TICKET_SIZE * sizeof(unsigned char));
+    unsigned char *ciphertext = ticket + CDTP_AEAD_NONCE_SIZE;
+    EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, CDTP_AES_GCM_CIPHER_NAME, NULL);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+    bool sealed = cipher != NULL && ctx != NULL &&
+                  RAND_bytes(ticket, CDTP_AEAD_NONCE_SIZE) != 0 &&
+                  EVP_EncryptInit_ex(ctx, cipher, NULL, (unsigned char *) ticket_key, ticket) != 0 &&
+                  EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, (int) sizeof(plaintext)) != 0 &&
+                  EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 0 &&
+                  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, CDTP_AEAD_TAG_SIZE, ciphertext + sizeof(plaintext)) != 0;
+
+    if (!sealed) {
         _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_free(cipher);
+    memset(plaintext, 0, sizeof(plaintext));
+
+    if (!sealed) {
+        free(ticket);
         return NULL;
     }
 
-    plaintext_len += len;
-    plaintext_unsigned = realloc(plaintext_unsigned, plaintext_len);
-    CDTPCryptoData *plaintext = _cdtp_crypto_data((void *) plaintext_unsigned, plaintext_len);
-    _cdtp_crypto_unpad_data(plaintext);
+    CDTPCryptoData *ticket_data = (CDTPCryptoData *) malloc(sizeof(CDTPCryptoData));
+    ticket_data->data = (char *) ticket;
+    ticket_data->data_size = CDTP_TICKET_SIZE;
+
+    return ticket_data;
+}
+
+CDTP_TEST_EXPORT bool _cdtp_crypto_ticket_open(char *ticket_key,
+                                               void *ticket,
+                                               size_t ticket_size,
+                                               CDTPCipher *mode,
+                                               char *secret)
+{
+    if (ticket_size != CDTP_TICKET_SIZE) {
+        return false;
+    }
+
+    unsigned char *nonce = (unsigned char *) ticket;
+    unsigned char *ciphertext = nonce + CDTP_AEAD_NONCE_SIZE;
+    unsigned char plaintext[1 + 8 + CDTP_RESUMPTION_SECRET_SIZE];
+    unsigned char final_block[16];
+    EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, CDTP_AES_GCM_CIPHER_NAME, NULL);
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len;
+    bool opened = cipher != NULL && ctx != NULL &&
+                  EVP_DecryptInit_ex(ctx, cipher, NULL, (unsigned char *) ticket_key, nonce) != 0 &&
+                  EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, (int) sizeof(plaintext)) != 0 &&
+                  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, CDTP_AEAD_TAG_SIZE, ciphertext + sizeof(plaintext)) != 0 &&
+                  EVP_DecryptFinal_ex(ctx, final_block, &len) > 0;
 
     EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_free(cipher);
 
-    free(ciphertext_data);
-    free(plaintext_unsigned);
+    uint64_t expiry = 0;
 
-    return plaintext;
+    for (int i = 1; opened && i <= 8; i++) {
+        expiry = (expiry << 8) | plaintext[i];
+    }
+
+    opened = opened && _cdtp_crypto_cipher_supported(plaintext[0]) && (uint64_t) time(NULL) < expiry;
+
+    if (opened) {
+        *mode = (CDTPCipher) (plaintext[0]);
+        memcpy(secret, plaintext + 1 + 8, CDTP_RESUMPTION_SECRET_SIZE);
+    }
+
+    memset(plaintext, 0, sizeof(plaintext));
+
+    return opened;
 }
@@ -9,6 +9,14 @@
 #include "util.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#  include <intrin.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#  include <sys/auxv.h>
+#endif
 
 #define BIO void
 #define BIO_METHOD void
@@ -18,8 +26,14 @@
 #define EVP_CIPHER_CTX void
 #define EVP_CIPHER void
 #define ENGINE void
+#define EVP_PKEY_CTX void
+#define EVP_MD void
 
 #define BIO_CTRL_PENDING 10
+#define NID_X25519 1034
+#define NID_hkdf 1036
+#define EVP_CTRL_AEAD_GET_TAG 0x10
+#define EVP_CTRL_AEAD_SET_TAG 0x11
 
 extern BIO *BIO_new(const BIO_METHOD *type);
 extern BIO *BIO_new_mem_buf(const void *buf, int len);
@@ -40,10 +54,16 @@ extern EVP_PKEY *EVP_PKEY_Q_keygen(OSSL_LIB_CTX *libctx, const char *propq,
     const char *type, ...);
 extern int EVP_PKEY_get_size(const EVP_PKEY *pkey);
 extern void EVP_PKEY_free(EVP_PKEY *key);
+extern int EVP_PKEY_up_ref(EVP_PKEY *key);
 extern EVP_CIPHER_CTX *EVP_CIPHER_CTX_new(void);
 extern int EVP_CIPHER_CTX_get_block_size(const EVP_CIPHER_CTX *ctx);
 extern void EVP_CIPHER_CTX_free(EVP_CIPHER_CTX *ctx);
+extern int EVP_CIPHER_CTX_set_padding(EVP_CIPHER_CTX *c, int pad);
+extern int EVP_CIPHER_CTX_ctrl(EVP_CIPHER_CTX *ctx, int type, int arg, void *ptr);
 extern EVP_CIPHER *EVP_aes_256_cbc(void);
+extern EVP_CIPHER *EVP_CIPHER_fetch(OSSL_LIB_CTX *ctx, const char *algorithm,
+    const char *properties);
+extern void EVP_CIPHER_free(EVP_CIPHER *cipher);
 extern int EVP_CIPHER_get_iv_length(const EVP_CIPHER *e);
 extern int EVP_SealInit(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *type,
     unsigned char **ek, int *ekl, unsigned char *iv,
@@ -67,6 +87,22 @@ extern int EVP_DecryptUpdate(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl,
     const unsigned char *in, int inl);
 extern int EVP_DecryptFinal_ex(EVP_CIPHER_CTX *ctx, unsigned char *outm,
     int *outl);
+extern EVP_PKEY *EVP_PKEY_new_raw_public_key(int type, ENGINE *e,
+    const unsigned char *pub, size_t len);
+extern int EVP_PKEY_get_raw_public_key(const EVP_PKEY *pkey, unsigned char *pub,
+    size_t *len);
+extern EVP_PKEY_CTX *EVP_PKEY_CTX_new(EVP_PKEY *pkey, ENGINE *e);
+extern EVP_PKEY_CTX *EVP_PKEY_CTX_new_id(int id, ENGINE *e);
+extern void EVP_PKEY_CTX_free(EVP_PKEY_CTX *ctx);
+extern int EVP_PKEY_derive_init(EVP_PKEY_CTX *ctx);
+extern int EVP_PKEY_derive_set_peer(EVP_PKEY_CTX *ctx, EVP_PKEY *peer);
+extern int EVP_PKEY_derive(EVP_PKEY_CTX *ctx, unsigned char *key, size_t *keylen);
+extern int EVP_PKEY_CTX_set_hkdf_md(EVP_PKEY_CTX *ctx, const EVP_MD *md);
+extern int EVP_PKEY_CTX_set1_hkdf_key(EVP_PKEY_CTX *ctx, const unsigned char *key,
+    int keylen);
+extern int EVP_PKEY_CTX_add1_hkdf_info(EVP_PKEY_CTX *ctx,
+    const unsigned char *info, int infolen);
+extern const EVP_MD *EVP_sha256(void);
 extern int RAND_bytes(unsigned char *buf, int num);
 extern unsigned long ERR_get_error(void);
 
@@ -85,9 +121,51 @@ extern unsigned long ERR_get_error(void);
 // The AES key size.
 #define CDTP_AES_KEY_SIZE 32
 
-// The AES nonce size.
+// The name of the cipher fetched for AES keys in CBC mode.
+#define CDTP_AES_CBC_CIPHER_NAME "AES-256-CBC"
+
+// The name of the cipher fetched for AES keys in GCM mode.
+#define CDTP_AES_GCM_CIPHER_NAME "AES-256-GCM"
+
+// The AES nonce size in CBC mode.
 #define CDTP_AES_NONCE_SIZE 16
 
+// The name of the cipher fetched for keys used with ChaCha20-Poly1305.
+#define CDTP_CHACHA20_CIPHER_NAME "ChaCha20-Poly1305"
+
+// The nonce size of the authenticated ciphers, AES-256-GCM and ChaCha20-Poly1305.
+#define CDTP_AEAD_NONCE_SIZE 12
+
+// The size of the authentication tag following each message encrypted with an authenticated cipher.
+#define CDTP_AEAD_TAG_SIZE 16
+
+// The number of ciphers that can be negotiated during a key exchange.
+#define CDTP_NUM_CIPHERS 3
+
+// The X25519 public key size.
+#define CDTP_ECDH_PUBLIC_KEY_SIZE 32
+
+// The context mixed into keys derived from an X25519 shared secret.
+#define CDTP_ECDH_KDF_INFO "cdtp x25519 aes-256"
+
+// The size of the secret a resumption ticket holds.
+#define CDTP_RESUMPTION_SECRET_SIZE 32
+
+// The size of the random data a client sends when resuming a session.
+#define CDTP_RESUMPTION_RANDOM_SIZE 32
+
+// The size of a ticket sealed by the server: a nonce, then the encrypted cipher, expiry time, and secret, then a tag.
+#define CDTP_TICKET_SIZE (CDTP_AEAD_NONCE_SIZE + 1 + 8 + CDTP_RESUMPTION_SECRET_SIZE + CDTP_AEAD_TAG_SIZE)
+
+// The size of a resumption ticket held by a client: the cipher and secret, then the ticket sealed by the server.
+#define CDTP_RESUMPTION_TICKET_SIZE (1 + CDTP_RESUMPTION_SECRET_SIZE + CDTP_TICKET_SIZE)
+
+// The context mixed into resumption secrets derived from a session key.
+#define CDTP_RESUMPTION_SECRET_INFO "cdtp resumption secret"
+
+// The context mixed into keys derived from a resumption secret.
+#define CDTP_RESUMPTION_KDF_INFO "cdtp resumption"
+
 /**
  * Generic data to be encrypted/decrypted.
  */
@@ -97,19 +175,19 @@ typedef struct _CDTPCryptoData {
 } CDTPCryptoData;
 
 /**
- * An RSA public key.
+ * An RSA public key. The key is kept parsed, along with the PEM text it is sent as.
  */
 typedef struct _CDTPRSAPublicKey {
+    EVP_PKEY *evp_key;
     char *key;
     size_t key_size;
 } CDTPRSAPublicKey;
 
 /**
- * An RSA private key.
+ * An RSA private key. The key is kept parsed, and is only written out as PEM text when asked for.
  */
 typedef struct _CDTPRSAPrivateKey {
-    char *key;
-    size_t key_size;
+    EVP_PKEY *evp_key;
 } CDTPRSAPrivateKey;
 
 /**
@@ -121,13 +199,44 @@ typedef struct _CDTPRSAKeyPair {
 } CDTPRSAKeyPair;
 
 /**
- * An AES key.
+ * Cipher type, identifying how messages are encrypted with a session key. The values are sent during key exchanges.
+ */
+typedef enum _CDTPCipher {
+    CDTP_CIPHER_AES_256_CBC = 1,
+    CDTP_CIPHER_AES_256_GCM = 2,
+    CDTP_CIPHER_CHACHA20_POLY1305 = 3
+} CDTPCipher;
+
+/**
+ * An AES key. The cipher is fetched, and the key is set up in both cipher contexts, once, when the key is created, so
+ * each message only needs a new nonce. Encryptions with the same key must not happen concurrently, and neither must
+ * decryptions.
+ *
+ * In CBC mode, each message's nonce is random, and is sent along with it. With the authenticated ciphers, AES-256-GCM
+ * and ChaCha20-Poly1305, nonces are never sent, but are built from the sending party and the number of messages it has
+ * already sent, so both parties must encrypt and decrypt messages in the order they are sent. Despite the name, keys
+ * used with ChaCha20-Poly1305 are also represented by this type.
  */
 typedef struct _CDTPAESKey {
     char *key;
     size_t key_size;
+    CDTPCipher mode;
+    bool server;
+    uint64_t send_counter;
+    uint64_t recv_counter;
+    EVP_CIPHER *cipher;
+    EVP_CIPHER_CTX *encrypt_ctx;
+    EVP_CIPHER_CTX *decrypt_ctx;
 } CDTPAESKey;
 
+/**
+ * An ephemeral X25519 key pair.
+ */
+typedef struct _CDTPECDHKeyPair {
+    EVP_PKEY *key;
+    char public_key[CDTP_ECDH_PUBLIC_KEY_SIZE];
+} CDTPECDHKeyPair;
+
 /**
  * Create a generic piece of crypto data.
  *
@@ -168,7 +277,7 @@ CDTPCryptoData *_cdtp_crypto_rsa_public_key_to_bytes(CDTPRSAPublicKey *public_ke
  * Get a byte representation of an RSA private key.
  *
  * @param private_key The RSA private key.
- * @return The byte representation of the private key.
+ * @return The byte representation of the private key, in PEM format, or NULL if it could not be written.
  */
 CDTPCryptoData *_cdtp_crypto_rsa_private_key_to_bytes(CDTPRSAPrivateKey *private_key);
 
@@ -177,7 +286,7 @@ CDTPCryptoData *_cdtp_crypto_rsa_private_key_to_bytes(CDTPRSAPrivateKey *private
  *
  * @param public_key_bytes The public key bytes.
  * @param public_key_size The size of the public key, in bytes.
- * @return The public key representation.
+ * @return The public key representation, or NULL if the bytes are not a public key in PEM format.
  *
  * Note that this makes its own copy of `public_key_bytes` and is not responsible for freeing it itself.
  */
@@ -188,9 +297,9 @@ CDTPRSAPublicKey *_cdtp_crypto_rsa_public_key_from_bytes(char *public_key_bytes,
  *
  * @param private_key_bytes The private key bytes.
  * @param private_key_size The size of the private key, in bytes.
- * @return The private key representation.
+ * @return The private key representation, or NULL if the bytes are not a private key in PEM format.
  *
- * Note that this makes its own copy of `private_key_bytes` and is not responsible for freeing it itself.
+ * Note that this does not keep `private_key_bytes`, and is not responsible for freeing it itself.
  */
 CDTPRSAPrivateKey *_cdtp_crypto_rsa_private_key_from_bytes(char *private_key_bytes, size_t private_key_size);
 
@@ -211,7 +320,7 @@ void _cdtp_crypto_rsa_private_key_free(CDTPRSAPrivateKey *private_key);
 /**
  * Generate an RSA key pair.
  *
- * @return The generated key pair.
+ * @return The generated key pair, or NULL if it could not be generated.
  */
 CDTP_TEST_EXPORT CDTPRSAKeyPair *_cdtp_crypto_rsa_key_pair(void);
 
@@ -257,14 +366,73 @@ CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key(void);
 CDTP_TEST_EXPORT void _cdtp_crypto_aes_key_free(CDTPAESKey *key);
 
 /**
- * Create an AES key from bytes.
+ * Create an AES key from bytes, for use in CBC mode.
  *
  * @param bytes The key data.
  * @param size The size of the key data, in bytes.
- * @return The AES key.
+ * @return The AES key, or NULL if its cipher contexts could not be set up.
  */
 CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key_from(char *bytes, size_t size);
 
+/**
+ * Create an AES key from bytes, for use with a particular cipher.
+ *
+ * @param bytes The key data.
+ * @param size The size of the key data, in bytes.
+ * @param mode The cipher the key is used with.
+ * @param server If the key belongs to the server, which decides the nonces it sends with the authenticated ciphers.
+ * @return The AES key, or NULL if its cipher contexts could not be set up.
+ */
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key_with_cipher(char *bytes, size_t size, CDTPCipher mode, bool server);
+
+/**
+ * Check if a cipher offered during a key exchange is supported.
+ *
+ * @param cipher The cipher's identifying value.
+ * @return If the cipher is supported.
+ */
+CDTP_TEST_EXPORT bool _cdtp_crypto_cipher_supported(int cipher);
+
+/**
+ * Check if the processor has instructions that accelerate AES, and the multiplications used by GCM mode.
+ *
+ * @return If AES is accelerated.
+ */
+CDTP_TEST_EXPORT bool _cdtp_crypto_aes_accelerated(void);
+
+/**
+ * Write the ciphers a server offers during a key exchange, in order of preference.
+ *
+ * @param ciphers Where to write the `CDTP_NUM_CIPHERS` offered ciphers, one byte each.
+ * @param aes_accelerated If the server's processor accelerates AES.
+ * @return The number of ciphers written.
+ *
+ * AES-256-GCM is preferred when AES is accelerated, and ChaCha20-Poly1305 otherwise.
+ */
+CDTP_TEST_EXPORT size_t _cdtp_crypto_offer_ciphers(char *ciphers, bool aes_accelerated);
+
+/**
+ * Choose one of the ciphers a server offered during a key exchange.
+ *
+ * @param ciphers The offered ciphers, in the server's order of preference.
+ * @param num_ciphers The number of offered ciphers.
+ * @param aes_accelerated If the client's processor accelerates AES.
+ * @return The chosen cipher, or 0 if none of the offered ciphers are supported.
+ *
+ * The server's preference is followed, unless the client does not accelerate AES and ChaCha20-Poly1305 was offered.
+ * Servers that offer no ciphers only support CBC mode.
+ */
+CDTP_TEST_EXPORT int _cdtp_crypto_choose_cipher(char *ciphers, size_t num_ciphers, bool aes_accelerated);
+
+/**
+ * Get the size of data once it has been encrypted with AES.
+ *
+ * @param key The AES key.
+ * @param plaintext_size The size of the data, in bytes.
+ * @return The size of the nonce and ciphertext in CBC mode, or of the ciphertext and tag otherwise, in bytes.
+ */
+CDTP_TEST_EXPORT size_t _cdtp_crypto_aes_ciphertext_size(CDTPAESKey *key, size_t plaintext_size);
+
 /**
  * Encrypt data with AES.
  *
@@ -275,6 +443,24 @@ CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_aes_key_from(char *bytes, size_t size)
  */
 CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_encrypt(CDTPAESKey *key, void *plaintext, size_t plaintext_size);
 
+/**
+ * Encrypt data with AES into a complete message, ready to be sent.
+ *
+ * @param key The AES key.
+ * @param plaintext The data to encrypt.
+ * @param plaintext_size The size of the data, in bytes.
+ * @param message_size A pointer that will be set to the size of the message, in bytes.
+ * @return The message, or NULL if the data could not be encrypted.
+ *
+ * The message's size portion, and in CBC mode its nonce, are reserved up front, and the plaintext is encrypted straight
+ * into the rest of the message, so it is read exactly once. Note that the returned value is allocated on the heap, and `free` will need
+ * to be called on it.
+ */
+CDTP_TEST_EXPORT void *_cdtp_crypto_aes_encrypt_message(CDTPAESKey *key,
+                                                        void *plaintext,
+                                                        size_t plaintext_size,
+                                                        size_t *message_size);
+
 /**
  * Decrypt data with AES.
  *
@@ -285,4 +471,132 @@ CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_encrypt(CDTPAESKey *key, void
  */
 CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_aes_decrypt(CDTPAESKey *key, void *ciphertext, size_t ciphertext_size);
 
+/**
+ * Decrypt data with AES, overwriting the encrypted data.
+ *
+ * @param key The AES key.
+ * @param ciphertext The data to decrypt, which is decrypted in place.
+ * @param ciphertext_size The size of the data, in bytes.
+ * @param plaintext A pointer that will be set to the start of the decrypted data, somewhere within `ciphertext`.
+ * @param plaintext_size A pointer that will be set to the size of the decrypted data, in bytes.
+ * @return If the data was decrypted, and with the authenticated ciphers, was not tampered with.
+ *
+ * Nothing is allocated or copied, so the decrypted data is only valid for as long as `ciphertext` is, and may not be
+ * suitably aligned for any particular type.
+ */
+CDTP_TEST_EXPORT bool _cdtp_crypto_aes_decrypt_in_place(CDTPAESKey *key,
+                                                        void *ciphertext,
+                                                        size_t ciphertext_size,
+                                                        void **plaintext,
+                                                        size_t *plaintext_size);
+
+/**
+ * Generate a new ephemeral X25519 key pair.
+ *
+ * @return The new key pair, or NULL if it could not be generated.
+ */
+CDTP_TEST_EXPORT CDTPECDHKeyPair *_cdtp_crypto_ecdh_key_pair(void);
+
+/**
+ * Free the memory used by an X25519 key pair.
+ *
+ * @param key_pair The key pair.
+ */
+CDTP_TEST_EXPORT void _cdtp_crypto_ecdh_key_pair_free(CDTPECDHKeyPair *key_pair);
+
+/**
+ * Derive an AES key from an X25519 key agreement.
+ *
+ * @param key_pair The local key pair.
+ * @param peer_public_key The peer's public key, `CDTP_ECDH_PUBLIC_KEY_SIZE` bytes long.
+ * @param server If the local key pair belongs to the server.
+ * @param mode The cipher the key is used with.
+ * @return The derived AES key, or NULL if the key agreement failed.
+ *
+ * Both parties derive the same key, which is bound to both public keys by mixing them into the HKDF-SHA256 info.
+ */
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_ecdh_aes_key(CDTPECDHKeyPair *key_pair,
+                                                       char *peer_public_key,
+                                                       bool server,
+                                                       CDTPCipher mode);
+
+/**
+ * Expand a secret into key material with HKDF-SHA256.
+ *
+ * @param secret The secret.
+ * @param secret_size The size of the secret, in bytes.
+ * @param info The context mixed into the key material.
+ * @param info_size The size of the context, in bytes.
+ * @param out Where to write the key material.
+ * @param out_size The number of bytes of key material to write.
+ * @return If the key material was derived.
+ */
+bool _cdtp_crypto_hkdf(unsigned char *secret,
+                       size_t secret_size,
+                       unsigned char *info,
+                       size_t info_size,
+                       unsigned char *out,
+                       size_t out_size);
+
+/**
+ * Derive the secret that lets a session be resumed from the session's key.
+ *
+ * @param key The AES key.
+ * @param secret Where to write the `CDTP_RESUMPTION_SECRET_SIZE` bytes of the secret.
+ * @return If the secret was derived.
+ */
+CDTP_TEST_EXPORT bool _cdtp_crypto_resumption_secret(CDTPAESKey *key, char *secret);
+
+/**
+ * Derive the AES key of a resumed session.
+ *
+ * @param secret The resumption secret, `CDTP_RESUMPTION_SECRET_SIZE` bytes long.
+ * @param client_random The random data sent by the client, `CDTP_RESUMPTION_RANDOM_SIZE` bytes long.
+ * @param server_public_key The X25519 public key the server sent in this key exchange.
+ * @param server If the key belongs to the server.
+ * @param mode The cipher the key is used with.
+ * @return The derived AES key, or NULL if it could not be derived.
+ *
+ * Mixing in the client's random data and the server's fresh public key gives every resumed session its own key, even
+ * when the same ticket is used more than once.
+ */
+CDTP_TEST_EXPORT CDTPAESKey *_cdtp_crypto_resumed_aes_key(char *secret,
+                                                          char *client_random,
+                                                          char *server_public_key,
+                                                          bool server,
+                                                          CDTPCipher mode);
+
+/**
+ * Seal a resumption secret into a ticket that only the server can open.
+ *
+ * @param ticket_key The server's ticket key, `CDTP_AES_KEY_SIZE` bytes long.
+ * @param mode The cipher of the session the secret came from.
+ * @param secret The resumption secret, `CDTP_RESUMPTION_SECRET_SIZE` bytes long.
+ * @param lifetime The number of seconds the ticket is valid for.
+ * @return The `CDTP_TICKET_SIZE` bytes of the ticket, or NULL if it could not be sealed.
+ */
+CDTP_TEST_EXPORT CDTPCryptoData *_cdtp_crypto_ticket_seal(char *ticket_key,
+                                                          CDTPCipher mode,
+                                                          char *secret,
+                                                          double lifetime);
+
+/**
+ * Open a ticket sealed by `_cdtp_crypto_ticket_seal`.
+ *
+ * @param ticket_key The server's ticket key, `CDTP_AES_KEY_SIZE` bytes long.
+ * @param ticket The ticket.
+ * @param ticket_size The size of the ticket, in bytes.
+ * @param mode A pointer that will be set to the cipher of the session the secret came from.
+ * @param secret Where to write the `CDTP_RESUMPTION_SECRET_SIZE` bytes of the secret.
+ * @return If the ticket was sealed with the ticket key and has not expired.
+ *
+ * Invalid tickets are expected, since clients may hold tickets from before the server restarted, so they are not
+ * reported as errors.
+ */
+CDTP_TEST_EXPORT bool _cdtp_crypto_ticket_open(char *ticket_key,
+                                               void *ticket,
+                                               size_t ticket_size,
+                                               CDTPCipher *mode,
+                                               char *secret);
+
 #endif // CDTP_CRYPTO_H
@@ -35,6 +35,11 @@ typedef void (*ServerOnConnectCallback)(CDTPServer *, size_t, void *);
  */
 typedef void (*ServerOnDisconnectCallback)(CDTPServer *, size_t, void *);
 
+/**
+ * Server writable event callback function.
+ */
+typedef void (*ServerOnWritableCallback)(CDTPServer *, size_t, void *);
+
 /**
  * Client receive event callback function.
  */
@@ -46,7 +51,182 @@ typedef void (*ClientOnRecvCallback)(CDTPClient *, void *, size_t, void *);
 typedef void (*ClientOnDisconnectedCallback)(CDTPClient *, void *);
 
 /**
- * Generic socket type.
+ * Client writable event callback function.
+ */
+typedef void (*ClientOnWritableCallback)(CDTPClient *, void *);
+
+/**
+ * Mutex type.
+ */
+#ifdef _WIN32
+typedef CRITICAL_SECTION CDTPMutex;
+#else
+typedef pthread_mutex_t CDTPMutex;
+#endif
+
+/**
+ * Condition variable type.
+ */
+#ifdef _WIN32
+typedef CONDITION_VARIABLE CDTPCond;
+#else
+typedef pthread_cond_t CDTPCond;
+#endif
+
+/**
+ * Reader-writer lock type.
+ */
+#ifdef _WIN32
+typedef SRWLOCK CDTPRWLock;
+#else
+typedef pthread_rwlock_t CDTPRWLock;
+#endif
+
+/**
+ * Thread pool task type.
+ */
+typedef struct _CDTPThreadPoolTask {
+    void (*func)(void *);
+    void *arg;
+    struct _CDTPThreadPoolTask *next;
+} CDTPThreadPoolTask;
+
+/**
+ * Thread pool type. If `max_tasks` is nonzero, submitting blocks while that many tasks are queued, until the pool is
+ * closed.
+ */
+typedef struct _CDTPThreadPool {
+    CDTPMutex lock;
+    CDTPCond cond;
+    CDTPCond not_full;
+    CDTPThreadPoolTask *head;
+    CDTPThreadPoolTask *tail;
+    size_t num_tasks;
+    size_t max_tasks;
+    bool closing;
+    bool stopping;
+    bool free_on_exit;
+    size_t num_threads;
+#ifdef _WIN32
+    HANDLE *threads;
+#else
+    pthread_t *threads;
+#endif
+} CDTPThreadPool;
+
+/**
+ * Strand type. A strand runs its tasks on a thread pool one at a time, in the order they were submitted.
+ */
+typedef struct _CDTPStrand {
+    CDTPThreadPool *pool;
+    CDTPMutex lock;
+    CDTPCond not_full;
+    CDTPThreadPoolTask *head;
+    CDTPThreadPoolTask *tail;
+    size_t num_tasks;
+    bool closing;
+    bool running;
+    bool released;
+} CDTPStrand;
+
+/**
+ * Event dispatch mode type, determining how event functions are scheduled on the event threads.
+ */
+typedef enum _CDTPDispatchMode {
+    CDTP_DISPATCH_PARALLEL,
+    CDTP_DISPATCH_ORDERED,
+    CDTP_DISPATCH_INLINE
+} CDTPDispatchMode;
+
+/**
+ * Receive buffer type. Bytes between `start` and `end` have been read from the socket but not yet parsed into messages.
+ * Messages larger than `max_message_size` bytes are rejected rather than making room for them.
+ */
+typedef struct _CDTPRecvBuffer {
+    unsigned char *data;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    size_t max_message_size;
+} CDTPRecvBuffer;
+
+/**
+ * I/O vector type, describing one of several regions of memory written with a single system call.
+ */
+#ifdef _WIN32
+typedef WSABUF CDTPIOVec;
+#else
+typedef struct iovec CDTPIOVec;
+#endif
+
+/**
+ * Queued message type, holding a complete message including its size portion.
+ */
+typedef struct _CDTPSendFrame {
+    unsigned char *data;
+    size_t data_size;
+    struct _CDTPSendFrame *next;
+} CDTPSendFrame;
+
+/**
+ * Send buffer type. Queued messages are waiting for the socket to become writable, and the first `offset` bytes of the
+ * first message have already been sent. Once more than `high_watermark` bytes are waiting, new messages are refused,
+ * until no more than `low_watermark` bytes are left.
+ */
+typedef struct _CDTPSendBuffer {
+    CDTPMutex lock;
+    CDTPSendFrame *head;
+    CDTPSendFrame *tail;
+    size_t offset;
+    size_t pending;
+    size_t low_watermark;
+    size_t high_watermark;
+    bool blocked;
+    bool unblocked;
+    bool writing;
+    struct _CDTPReactor *reactor;
+    size_t token;
+} CDTPSendBuffer;
+
+/**
+ * Shared memory ring type, living in memory shared by both parties to a connection. One party writes bytes to the ring
+ * and the other reads them. `head` and `tail` count every byte ever written and read, and each is on its own cache line
+ * so the parties do not contend for it. A party that finds nothing to read, or no room to write, sets its waiting flag
+ * before it sleeps, and the other party rings its doorbell when it finds the flag set.
+ */
+typedef struct _CDTPShmRing {
+    size_t head;
+    unsigned char head_padding[CDTP_CACHE_LINE_SIZE - sizeof(size_t)];
+    size_t tail;
+    unsigned char tail_padding[CDTP_CACHE_LINE_SIZE - sizeof(size_t)];
+    int reader_waiting;
+    int writer_waiting;
+    unsigned char waiting_padding[CDTP_CACHE_LINE_SIZE - 2 * sizeof(int)];
+} CDTPShmRing;
+
+/**
+ * Shared memory transport type. Messages are sent by writing them to one ring and received by reading them from the
+ * other, and the socket is only watched for the connection closing. Each party sleeps on its own doorbell, and the
+ * region's file descriptor is only kept until the region has been offered to the other party.
+ */
+typedef struct _CDTPSharedMemory {
+    void *region;
+    size_t region_size;
+    int region_fd;
+    size_t ring_size;
+    CDTPShmRing *send_ring;
+    unsigned char *send_data;
+    CDTPShmRing *recv_ring;
+    unsigned char *recv_data;
+    int doorbell;
+    int peer_doorbell;
+} CDTPSharedMemory;
+
+/**
+ * Generic socket type. The address is either an IPv4 address or a Unix domain socket address, and `address_size` is
+ * the size of whichever it is. Sockets using the plaintext mode have no key once their handshake has completed, and
+ * sockets not using shared memory have no `shm`. A server's client sockets count the references held to them, and are
+ * only closed and freed once the last one is released.
  */
 typedef struct _CDTPSocket {
 #ifdef _WIN32
@@ -54,43 +234,116 @@ typedef struct _CDTPSocket {
 #else
     int sock;
 #endif
-    struct sockaddr_in address;
+    struct sockaddr_storage address;
+    socklen_t address_size;
     CDTPAESKey *key;
+    CDTPSharedMemory *shm;
+    CDTPRecvBuffer *recv_buffer;
+    CDTPSendBuffer *send_buffer;
+    size_t reactor_index;
+    CDTPStrand *strand;
+    size_t refs;
 } CDTPSocket;
 
 /**
- * Client map node type.
+ * Client map node type. A node is empty if its socket is NULL, in which case it is on the map's free list.
  */
 typedef struct _CDTPClientMapNode {
-    bool allocated;
-    size_t client_id;
+    size_t generation;
     CDTPSocket *sock;
+    size_t next_free;
 } CDTPClientMapNode;
 
 /**
- * Client map type.
+ * Client map shard type. Each shard is a dense array of nodes with its own lock and free list.
  */
-typedef struct _CDTPClientMap {
+typedef struct _CDTPClientMapShard {
+    CDTPRWLock lock;
     size_t size;
     size_t capacity;
-    CDTPClientMapNode **nodes;
+    size_t free_head;
+    size_t free_tail;
+    CDTPClientMapNode *nodes;
+} CDTPClientMapShard;
+
+/**
+ * Client map type. Each client ID encodes the index of the client's node and the node's generation, which changes
+ * every time the node is emptied, so that IDs of removed clients never refer to the node's later occupants. Nodes are
+ * spread across shards so that threads looking up different clients rarely contend for the same lock.
+ */
+typedef struct _CDTPClientMap {
+    CDTPClientMapShard shards[CDTP_CLIENT_MAP_SHARDS];
+    CDTPMutex add_lock;
+    size_t next_shard;
 } CDTPClientMap;
 
 /**
- * Client map iterator node type.
+ * Reactor event type.
  */
-typedef struct _CDTPClientMapIterNode {
-    size_t client_id;
-    CDTPSocket *sock;
-} CDTPClientMapIterNode;
+typedef struct _CDTPReactorEvent {
+    size_t token;
+    bool readable;
+    bool writable;
+} CDTPReactorEvent;
+
+/**
+ * Event reactor type.
+ */
+typedef struct _CDTPReactor {
+#ifdef _WIN32
+    size_t size;
+    size_t capacity;
+    WSAPOLLFD *fds;
+    size_t *tokens;
+    WSAPOLLFD *poll_fds;
+    size_t *poll_tokens;
+    CDTPMutex lock;
+#else
+    int epoll_fd;
+    int wake_fd;
+#endif
+} CDTPReactor;
+
+/**
+ * Server RSA key mode type, determining where the key pair used for each key exchange comes from.
+ */
+typedef enum _CDTPKeyMode {
+    CDTP_KEY_MODE_PER_CONNECTION,
+    CDTP_KEY_MODE_POOL,
+    CDTP_KEY_MODE_PERSISTENT
+} CDTPKeyMode;
 
 /**
- * Client map iterator type.
+ * RSA key pool type. A background thread keeps the pool filled with freshly generated key pairs.
  */
-typedef struct _CDTPClientMapIter {
+typedef struct _CDTPKeyPool {
+    CDTPMutex lock;
+    CDTPCond cond;
+    CDTPRSAKeyPair **key_pairs;
     size_t size;
-    CDTPClientMapIterNode **clients;
-} CDTPClientMapIter;
+    size_t capacity;
+    bool stopping;
+#ifdef _WIN32
+    HANDLE refill_thread;
+#else
+    pthread_t refill_thread;
+#endif
+} CDTPKeyPool;
+
+/**
+ * Server I/O thread type. Each I/O thread owns a listening socket, an event reactor, and the clients it accepted.
+ */
+typedef struct _CDTPServerReactor {
+    CDTPServer *server;
+    size_t index;
+    CDTPSocket *sock;
+    CDTPReactor *reactor;
+#ifdef _WIN32
+    HANDLE serve_thread;
+#else
+    pthread_t serve_thread;
+#endif
+} CDTPServerReactor;
 
 /**
  * Socket server type struct.
@@ -99,19 +352,36 @@ struct _CDTPServer {
     ServerOnRecvCallback on_recv;
     ServerOnConnectCallback on_connect;
     ServerOnDisconnectCallback on_disconnect;
+    ServerOnWritableCallback on_writable;
     void *on_recv_arg;
     void *on_connect_arg;
     void *on_disconnect_arg;
+    void *on_writable_arg;
     bool serving;
     bool done;
     CDTPSocket *sock;
     CDTPClientMap *clients;
-    size_t next_client_id;
-#ifdef _WIN32
-    HANDLE serve_thread;
-#else
-    pthread_t serve_thread;
-#endif
+    size_t num_io_threads;
+    size_t num_reactors;
+    CDTPServerReactor *reactors;
+    size_t num_handshake_threads;
+    CDTPThreadPool *handshake_pool;
+    size_t num_event_threads;
+    size_t max_queued_events;
+    CDTPThreadPool *event_pool;
+    CDTPDispatchMode dispatch_mode;
+    bool legacy_handshake;
+    CDTPKeyMode key_mode;
+    size_t key_pool_size;
+    CDTPKeyPool *key_pool;
+    CDTPRSAKeyPair *key_pair;
+    size_t send_low_watermark;
+    size_t send_high_watermark;
+    size_t max_message_size;
+    double ticket_lifetime;
+    char ticket_key[CDTP_AES_KEY_SIZE];
+    bool plaintext;
+    size_t shm_ring_size;
 };
 
 /**
@@ -120,11 +390,24 @@ struct _CDTPServer {
 struct _CDTPClient {
     ClientOnRecvCallback on_recv;
     ClientOnDisconnectedCallback on_disconnected;
+    ClientOnWritableCallback on_writable;
     void *on_recv_arg;
     void *on_disconnected_arg;
+    void *on_writable_arg;
     bool connected;
     bool done;
+    bool legacy_handshake;
+    bool resumption;
+    bool resumed;
+    char *ticket;
+    bool plaintext;
+    bool shared_memory;
     CDTPSocket *sock;
+    CDTPReactor *reactor;
+    size_t num_event_threads;
+    size_t max_queued_events;
+    CDTPThreadPool *event_pool;
+    CDTPDispatchMode dispatch_mode;
 #ifdef _WIN32
     HANDLE handle_thread;
 #else
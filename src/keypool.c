@@ -0,0 +1,130 @@
+#include "keypool.h"
+
+/**
+ * Keep a key pool filled until it is stopped.
+ *
+ * @param pool_ptr The key pool.
+ * @return This always returns 0 or NULL, depending on the thread API being used.
+ */
+#ifdef _WIN32
+DWORD WINAPI _cdtp_key_pool_refill(LPVOID pool_ptr)
+#else
+void *_cdtp_key_pool_refill(void *pool_ptr)
+#endif
+{
+    CDTPKeyPool *pool = (CDTPKeyPool *) pool_ptr;
+
+    _cdtp_mutex_lock(&(pool->lock));
+
+    while (!pool->stopping) {
+        if (pool->size == pool->capacity) {
+            _cdtp_cond_wait(&(pool->cond), &(pool->lock));
+            continue;
+        }
+
+        // Generate without holding the lock, so key pairs can be taken in the meantime
+        _cdtp_mutex_unlock(&(pool->lock));
+        CDTPRSAKeyPair *key_pair = _cdtp_crypto_rsa_key_pair();
+        _cdtp_mutex_lock(&(pool->lock));
+
+        if (key_pair == NULL) {
+            break;
+        }
+
+        if (pool->stopping || pool->size == pool->capacity) {
+            _cdtp_crypto_rsa_key_pair_free(key_pair);
+        }
+        else {
+            pool->key_pairs[pool->size++] = key_pair;
+        }
+    }
+
+    _cdtp_mutex_unlock(&(pool->lock));
+
+#ifdef _WIN32
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+CDTP_TEST_EXPORT CDTPKeyPool *_cdtp_key_pool(size_t capacity)
+{
+    CDTPKeyPool *pool = (CDTPKeyPool *) malloc(sizeof(CDTPKeyPool));
+
+    _cdtp_mutex_init(&(pool->lock));
+    _cdtp_cond_init(&(pool->cond));
+    pool->key_pairs = (CDTPRSAKeyPair **) malloc(capacity * sizeof(CDTPRSAKeyPair *));
+    pool->size = 0;
+    pool->capacity = capacity;
+    pool->stopping = false;
+
+#ifdef _WIN32
+    if ((pool->refill_thread = CreateThread(NULL, 0, _cdtp_key_pool_refill, pool, 0, NULL)) == NULL) {
+        _cdtp_set_error(CDTP_KEY_POOL_START_FAILED, GetLastError());
+        _cdtp_cond_destroy(&(pool->cond));
+        _cdtp_mutex_destroy(&(pool->lock));
+        free(pool->key_pairs);
+        free(pool);
+        return NULL;
+    }
+#else
+    int return_code = pthread_create(&(pool->refill_thread), NULL, _cdtp_key_pool_refill, pool);
+
+    if (return_code != 0) {
+        _cdtp_set_error(CDTP_KEY_POOL_START_FAILED, return_code);
+        _cdtp_cond_destroy(&(pool->cond));
+        _cdtp_mutex_destroy(&(pool->lock));
+        free(pool->key_pairs);
+        free(pool);
+        return NULL;
+    }
+#endif
+
+    return pool;
+}
+
+CDTP_TEST_EXPORT CDTPRSAKeyPair *_cdtp_key_pool_take(CDTPKeyPool *pool)
+{
+    CDTPRSAKeyPair *key_pair = NULL;
+
+    _cdtp_mutex_lock(&(pool->lock));
+
+    if (pool->size > 0) {
+        key_pair = pool->key_pairs[--pool->size];
+        _cdtp_cond_signal(&(pool->cond));
+    }
+
+    _cdtp_mutex_unlock(&(pool->lock));
+
+    // Don't make the caller wait on the background thread
+    if (key_pair == NULL) {
+        key_pair = _cdtp_crypto_rsa_key_pair();
+    }
+
+    return key_pair;
+}
+
+CDTP_TEST_EXPORT void _cdtp_key_pool_free(CDTPKeyPool *pool)
+{
+    _cdtp_mutex_lock(&(pool->lock));
+    pool->stopping = true;
+    _cdtp_cond_signal(&(pool->cond));
+    _cdtp_mutex_unlock(&(pool->lock));
+
+#ifdef _WIN32
+    WaitForSingleObject(pool->refill_thread, INFINITE);
+    CloseHandle(pool->refill_thread);
+#else
+    pthread_join(pool->refill_thread, NULL);
+#endif
+
+    for (size_t i = 0; i < pool->size; i++) {
+        _cdtp_crypto_rsa_key_pair_free(pool->key_pairs[i]);
+    }
+
+    _cdtp_cond_destroy(&(pool->cond));
+    _cdtp_mutex_destroy(&(pool->lock));
+    free(pool->key_pairs);
+    free(pool);
+}
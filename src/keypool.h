@@ -0,0 +1,40 @@
+/**
+ * CDTP pools of pre-generated RSA key pairs.
+ */
+
+#pragma once
+#ifndef CDTP_KEYPOOL_H
+#define CDTP_KEYPOOL_H
+
+#include "defs.h"
+#include "util.h"
+#include "crypto.h"
+#include "threading.h"
+
+/**
+ * Create a new key pool and start filling it in the background.
+ *
+ * @param capacity The number of key pairs to keep ready.
+ * @return The new key pool, or NULL if the background thread could not be started.
+ */
+CDTP_TEST_EXPORT CDTPKeyPool *_cdtp_key_pool(size_t capacity);
+
+/**
+ * Take a key pair from the pool.
+ *
+ * @param pool The key pool.
+ * @return A key pair that has not been used before, or NULL if one could not be generated.
+ *
+ * If the pool is empty, a key pair is generated in the current thread rather than waiting for the pool to refill.
+ * The caller owns the returned key pair, and is responsible for freeing it.
+ */
+CDTP_TEST_EXPORT CDTPRSAKeyPair *_cdtp_key_pool_take(CDTPKeyPool *pool);
+
+/**
+ * Stop filling the pool, and free the memory used by it and the key pairs it holds.
+ *
+ * @param pool The key pool.
+ */
+CDTP_TEST_EXPORT void _cdtp_key_pool_free(CDTPKeyPool *pool);
+
+#endif // CDTP_KEYPOOL_H
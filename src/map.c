@@ -1,257 +1,325 @@
 #include "map.h"
 
-// Minimum capacity of a client map.
-#define CDTP_MAP_MIN_CAPACITY 16
+// Starting capacity of each client map shard.
+#define CDTP_MAP_START_CAPACITY 4
 
-// Starting capacity of a client map.
-#define CDTP_MAP_START_CAPACITY CDTP_MAP_MIN_CAPACITY
+// Number of low bits of a client ID holding its node index. The remaining bits hold the node's generation.
+#define CDTP_MAP_INDEX_BITS (sizeof(size_t) * CHAR_BIT / 2)
+
+// Mask selecting the node index from a client ID.
+#define CDTP_MAP_INDEX_MASK ((((size_t) 1) << CDTP_MAP_INDEX_BITS) - 1)
+
+// Maximum capacity of each client map shard, keeping client IDs clear of the event reactor's reserved tokens.
+#define CDTP_MAP_MAX_CAPACITY ((CDTP_MAP_INDEX_MASK - 1) / CDTP_CLIENT_MAP_SHARDS)
 
 /**
- * Allocate a new empty node for the client map.
+ * Get the shard holding a client ID's node.
  *
- * @return The new node.
+ * @param map The client map.
+ * @param client_id The client ID.
+ * @return The shard.
  */
-CDTPClientMapNode *_cdtp_client_map_node(void)
+CDTPClientMapShard *_cdtp_client_map_shard(CDTPClientMap *map, size_t client_id)
 {
-    CDTPClientMapNode *node = (CDTPClientMapNode *) malloc(sizeof(CDTPClientMapNode));
-
-    node->allocated = false;
-    node->client_id = SIZE_MAX;
-    node->sock = NULL;
-
-    return node;
+    return &(map->shards[(client_id & CDTP_MAP_INDEX_MASK) % CDTP_CLIENT_MAP_SHARDS]);
 }
 
 /**
- * Free the memory used by a client map node.
+ * Initialize empty nodes and append them to a shard's free list, in order.
  *
- * @param node The node.
+ * @param shard The client map shard.
+ * @param start The index of the first node within the shard.
+ * @param end The index after the last node within the shard.
  */
-void _cdtp_client_map_node_free(CDTPClientMapNode *node)
+void _cdtp_client_map_init_nodes(CDTPClientMapShard *shard, size_t start, size_t end)
 {
-    free(node);
+    for (size_t i = start; i < end; i++) {
+        shard->nodes[i].generation = 0;
+        shard->nodes[i].sock = NULL;
+        shard->nodes[i].next_free = SIZE_MAX;
+
+        if (shard->free_tail == SIZE_MAX) {
+            shard->free_head = i;
+        }
+        else {
+            shard->nodes[shard->free_tail].next_free = i;
+        }
+
+        shard->free_tail = i;
+    }
 }
 
-CDTP_TEST_EXPORT CDTPClientMap *_cdtp_client_map(void)
+/**
+ * Return a node to the end of its shard's free list, invalidating any IDs that refer to it. The caller must hold the
+ * shard's lock for writing.
+ *
+ * @param shard The client map shard.
+ * @param index The index of the node within the shard.
+ */
+void _cdtp_client_map_release_node(CDTPClientMapShard *shard, size_t index)
 {
-    CDTPClientMap *map = (CDTPClientMap *) malloc(sizeof(CDTPClientMap));
+    CDTPClientMapNode *node = &(shard->nodes[index]);
 
-    map->size = 0;
-    map->capacity = CDTP_MAP_START_CAPACITY;
-    map->nodes = (CDTPClientMapNode **) malloc((map->capacity) * sizeof(CDTPClientMapNode *));
+    node->generation = (node->generation + 1) & (SIZE_MAX >> CDTP_MAP_INDEX_BITS);
+    node->sock = NULL;
+    node->next_free = SIZE_MAX;
 
-    for (size_t i = 0; i < map->capacity; i++) {
-        map->nodes[i] = _cdtp_client_map_node();
+    if (shard->free_tail == SIZE_MAX) {
+        shard->free_head = index;
+    }
+    else {
+        shard->nodes[shard->free_tail].next_free = index;
     }
 
-    return map;
+    shard->free_tail = index;
+
+    shard->size--;
 }
 
 /**
- * Get the hash for a given key.
+ * Get the ID referring to a node's current occupant.
  *
- * @param map The client map.
- * @param key The key.
- * @return The key's hash.
+ * @param shard_index The index of the node's shard.
+ * @param index The index of the node within the shard.
+ * @param generation The generation of the node.
+ * @return The client ID.
  */
-size_t _cdtp_client_map_hash(CDTPClientMap *map, size_t key)
+size_t _cdtp_client_map_id(size_t shard_index, size_t index, size_t generation)
 {
-    return key % (map->capacity);
+    return (generation << CDTP_MAP_INDEX_BITS) | (index * CDTP_CLIENT_MAP_SHARDS + shard_index);
 }
 
 /**
- * Resize a map and rehash its contents.
+ * Find the node referred to by a client ID. The caller must hold the shard's lock.
  *
- * @param map The client map.
- * @param new_capacity The new capacity of the map.
+ * @param shard The client map shard holding the ID's node.
+ * @param client_id The client ID.
+ * @return The node, or NULL if the ID does not refer to a client in the map.
  */
-void _cdtp_client_map_resize(CDTPClientMap *map, size_t new_capacity)
+CDTPClientMapNode *_cdtp_client_map_node(CDTPClientMapShard *shard, size_t client_id)
 {
-    size_t old_capacity = map->capacity;
-    CDTPClientMapNode **old_nodes = (CDTPClientMapNode **) realloc(map->nodes, old_capacity * sizeof(CDTPClientMapNode *));
-    map->capacity = new_capacity;
-    map->nodes = (CDTPClientMapNode **) malloc((map->capacity) * sizeof(CDTPClientMapNode *));
+    size_t index = (client_id & CDTP_MAP_INDEX_MASK) / CDTP_CLIENT_MAP_SHARDS;
 
-    for (size_t i = 0; i < map->capacity; i++) {
-        map->nodes[i] = _cdtp_client_map_node();
+    if (index >= shard->capacity) {
+        return NULL;
     }
 
-    for (size_t i = 0; i < old_capacity; i++) {
-        if (old_nodes[i]->allocated) {
-            size_t hash = _cdtp_client_map_hash(map, old_nodes[i]->client_id);
+    CDTPClientMapNode *node = &(shard->nodes[index]);
 
-            while (map->nodes[hash]->allocated) {
-                hash = (hash + 1) % (map->capacity);
-            }
-
-            map->nodes[hash]->allocated = true;
-            map->nodes[hash]->client_id = old_nodes[i]->client_id;
-            map->nodes[hash]->sock = old_nodes[i]->sock;
-        }
+    if (node->sock == NULL || node->generation != client_id >> CDTP_MAP_INDEX_BITS) {
+        return NULL;
     }
 
-    free(old_nodes);
+    return node;
 }
 
-/**
- * Increase the capacity of a client map.
- *
- * @param map The client map.
- */
-void _cdtp_client_map_resize_up(CDTPClientMap *map)
+CDTP_TEST_EXPORT CDTPClientMap *_cdtp_client_map(void)
 {
-    _cdtp_client_map_resize(map, map->capacity * 2);
+    CDTPClientMap *map = (CDTPClientMap *) malloc(sizeof(CDTPClientMap));
+
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        CDTPClientMapShard *shard = &(map->shards[i]);
+
+        _cdtp_rwlock_init(&(shard->lock));
+        shard->size = 0;
+        shard->capacity = CDTP_MAP_START_CAPACITY;
+        shard->free_head = SIZE_MAX;
+        shard->free_tail = SIZE_MAX;
+        shard->nodes = (CDTPClientMapNode *) malloc((shard->capacity) * sizeof(CDTPClientMapNode));
+        _cdtp_client_map_init_nodes(shard, 0, shard->capacity);
+    }
+
+    _cdtp_mutex_init(&(map->add_lock));
+    map->next_shard = 0;
+
+    return map;
 }
 
 /**
- * Decrease the capacity of a client map.
+ * Increase the capacity of a shard. Existing nodes keep their indices, so existing client IDs remain valid. The caller
+ * must hold the shard's lock for writing.
  *
- * @param map The client map.
+ * @param shard The client map shard.
+ * @return If the capacity increased.
  */
-void _cdtp_client_map_resize_down(CDTPClientMap *map)
+bool _cdtp_client_map_resize_up(CDTPClientMapShard *shard)
 {
-    _cdtp_client_map_resize(map, map->capacity / 2);
+    size_t old_capacity = shard->capacity;
+    size_t new_capacity = old_capacity <= CDTP_MAP_MAX_CAPACITY / 2 ? old_capacity * 2 : CDTP_MAP_MAX_CAPACITY;
+
+    if (new_capacity == old_capacity) {
+        return false;
+    }
+
+    shard->capacity = new_capacity;
+    shard->nodes = (CDTPClientMapNode *) realloc(shard->nodes, (shard->capacity) * sizeof(CDTPClientMapNode));
+    _cdtp_client_map_init_nodes(shard, old_capacity, new_capacity);
+
+    return true;
 }
 
-/**
- * Attempt to increase or decrease the capacity of the map, depending on its current size and capacity.
- *
- * @param map The client map.
- * @return -1 if the capacity decreased, 1 if the capacity increased, or 0 if nothing changed.
- */
-int _cdtp_client_map_try_resize(CDTPClientMap *map)
+CDTP_TEST_EXPORT size_t _cdtp_client_map_size(CDTPClientMap *map)
 {
-    if (map->size >= map->capacity) {
-        _cdtp_client_map_resize_up(map);
-        return 1;
-    } else if (map->capacity > CDTP_MAP_MIN_CAPACITY && map->size * 4 <= map->capacity) {
-        _cdtp_client_map_resize_down(map);
-        return -1;
-    } else {
-        return 0;
+    size_t size = 0;
+
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        _cdtp_rwlock_read_lock(&(map->shards[i].lock));
+        size += map->shards[i].size;
+        _cdtp_rwlock_read_unlock(&(map->shards[i].lock));
     }
+
+    return size;
 }
 
 CDTP_TEST_EXPORT bool _cdtp_client_map_contains(CDTPClientMap *map, size_t client_id)
 {
-    size_t hash = _cdtp_client_map_hash(map, client_id);
-    size_t original_hash = hash;
+    return _cdtp_client_map_get(map, client_id) != NULL;
+}
 
-    do {
-        if (map->nodes[hash]->allocated && map->nodes[hash]->client_id == client_id) {
-            return true;
-        }
+CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_get(CDTPClientMap *map, size_t client_id)
+{
+    CDTPClientMapShard *shard = _cdtp_client_map_shard(map, client_id);
 
-        hash = (hash + 1) % (map->capacity);
-    } while (hash != original_hash);
+    _cdtp_rwlock_read_lock(&(shard->lock));
+    CDTPClientMapNode *node = _cdtp_client_map_node(shard, client_id);
+    CDTPSocket *sock = node != NULL ? node->sock : NULL;
+    _cdtp_rwlock_read_unlock(&(shard->lock));
 
-    return false;
+    return sock;
 }
 
-CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_get(CDTPClientMap *map, size_t client_id)
+CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_acquire(CDTPClientMap *map, size_t client_id)
 {
-    size_t hash = _cdtp_client_map_hash(map, client_id);
-    size_t original_hash = hash;
+    CDTPClientMapShard *shard = _cdtp_client_map_shard(map, client_id);
 
-    do {
-        if (map->nodes[hash]->allocated && map->nodes[hash]->client_id == client_id) {
-            return map->nodes[hash]->sock;
-        }
+    _cdtp_rwlock_read_lock(&(shard->lock));
+    CDTPClientMapNode *node = _cdtp_client_map_node(shard, client_id);
 
-        hash = (hash + 1) % (map->capacity);
-    } while (hash != original_hash);
+    if (node == NULL) {
+        _cdtp_rwlock_read_unlock(&(shard->lock));
+        return NULL;
+    }
 
-    return NULL;
+    return node->sock;
 }
 
-CDTP_TEST_EXPORT bool _cdtp_client_map_set(CDTPClientMap *map, size_t client_id, CDTPSocket *sock)
+CDTP_TEST_EXPORT void _cdtp_client_map_release(CDTPClientMap *map, size_t client_id)
 {
-    if (_cdtp_client_map_contains(map, client_id)) {
-        return false;
-    }
+    _cdtp_rwlock_read_unlock(&(_cdtp_client_map_shard(map, client_id)->lock));
+}
 
-    _cdtp_client_map_try_resize(map);
+CDTP_TEST_EXPORT size_t _cdtp_client_map_add(CDTPClientMap *map, CDTPSocket *sock)
+{
+    // Spread clients evenly across the shards, handing out IDs in order
+    _cdtp_mutex_lock(&(map->add_lock));
 
-    size_t hash = _cdtp_client_map_hash(map, client_id);
+    size_t client_id = CDTP_CLIENT_MAP_INVALID_ID;
 
-    while (map->nodes[hash]->allocated) {
-        hash = (hash + 1) % (map->capacity);
-    }
+    // Move on to the following shards if a shard is full, and only give up once every shard is
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS && client_id == CDTP_CLIENT_MAP_INVALID_ID; i++) {
+        size_t shard_index = (map->next_shard + i) % CDTP_CLIENT_MAP_SHARDS;
+        CDTPClientMapShard *shard = &(map->shards[shard_index]);
 
-    map->nodes[hash]->allocated = true;
-    map->nodes[hash]->client_id = client_id;
-    map->nodes[hash]->sock = sock;
+        _cdtp_rwlock_write_lock(&(shard->lock));
 
-    map->size++;
+        if (shard->free_head != SIZE_MAX || _cdtp_client_map_resize_up(shard)) {
+            size_t index = shard->free_head;
+            CDTPClientMapNode *node = &(shard->nodes[index]);
 
-    return true;
+            shard->free_head = node->next_free;
+
+            if (shard->free_head == SIZE_MAX) {
+                shard->free_tail = SIZE_MAX;
+            }
+
+            node->sock = sock;
+            node->next_free = SIZE_MAX;
+
+            shard->size++;
+
+            client_id = _cdtp_client_map_id(shard_index, index, node->generation);
+            map->next_shard = (shard_index + 1) % CDTP_CLIENT_MAP_SHARDS;
+        }
+
+        _cdtp_rwlock_write_unlock(&(shard->lock));
+    }
+
+    _cdtp_mutex_unlock(&(map->add_lock));
+
+    return client_id;
 }
 
 CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_pop(CDTPClientMap *map, size_t client_id)
 {
-    _cdtp_client_map_try_resize(map);
+    CDTPClientMapShard *shard = _cdtp_client_map_shard(map, client_id);
 
-    size_t hash = _cdtp_client_map_hash(map, client_id);
-    size_t original_hash = hash;
+    _cdtp_rwlock_write_lock(&(shard->lock));
+    CDTPClientMapNode *node = _cdtp_client_map_node(shard, client_id);
+    CDTPSocket *sock = NULL;
 
-    do {
-        if (map->nodes[hash]->allocated && map->nodes[hash]->client_id == client_id) {
-            CDTPSocket *sock = map->nodes[hash]->sock;
+    if (node != NULL) {
+        sock = node->sock;
+        _cdtp_client_map_release_node(shard, (client_id & CDTP_MAP_INDEX_MASK) / CDTP_CLIENT_MAP_SHARDS);
+    }
 
-            map->nodes[hash]->allocated = false;
-            map->nodes[hash]->client_id = SIZE_MAX;
-            map->nodes[hash]->sock = NULL;
+    _cdtp_rwlock_write_unlock(&(shard->lock));
 
-            map->size--;
+    return sock;
+}
 
-            return sock;
-        }
+CDTP_TEST_EXPORT void _cdtp_client_map_for_each(CDTPClientMap *map, void (*func)(size_t, CDTPSocket *, void *), void *arg)
+{
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        CDTPClientMapShard *shard = &(map->shards[i]);
+
+        _cdtp_rwlock_read_lock(&(shard->lock));
 
-        hash = (hash + 1) % (map->capacity);
-    } while (hash != original_hash);
+        for (size_t j = 0; j < shard->capacity; j++) {
+            if (shard->nodes[j].sock != NULL) {
+                (*func)(_cdtp_client_map_id(i, j, shard->nodes[j].generation), shard->nodes[j].sock, arg);
+            }
+        }
 
-    return NULL;
+        _cdtp_rwlock_read_unlock(&(shard->lock));
+    }
 }
 
-CDTP_TEST_EXPORT CDTPClientMapIter *_cdtp_client_map_iter(CDTPClientMap *map)
+CDTP_TEST_EXPORT void _cdtp_client_map_pop_all(CDTPClientMap *map, void (*func)(size_t, CDTPSocket *, void *), void *arg)
 {
-    CDTPClientMapIter *iter = (CDTPClientMapIter *) malloc(sizeof(CDTPClientMapIter));
-
-    iter->size = map->size;
-    iter->clients = (CDTPClientMapIterNode **) malloc((iter->size) * sizeof(CDTPClientMapIterNode *));
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        CDTPClientMapShard *shard = &(map->shards[i]);
 
-    size_t iter_index = 0;
+        _cdtp_rwlock_write_lock(&(shard->lock));
 
-    for (size_t i = 0; i < map->capacity; i++) {
-        if (map->nodes[i]->allocated) {
-            CDTPClientMapIterNode *iter_node = (CDTPClientMapIterNode *) malloc(sizeof(CDTPClientMapIterNode));
+        for (size_t j = 0; j < shard->capacity; j++) {
+            CDTPSocket *sock = shard->nodes[j].sock;
 
-            iter_node->client_id = map->nodes[i]->client_id;
-            iter_node->sock = map->nodes[i]->sock;
+            if (sock != NULL) {
+                size_t client_id = _cdtp_client_map_id(i, j, shard->nodes[j].generation);
+                _cdtp_client_map_release_node(shard, j);
 
-            iter->clients[iter_index++] = iter_node;
+                if (func != NULL) {
+                    (*func)(client_id, sock, arg);
+                }
+            }
         }
-    }
 
-    return iter;
+        _cdtp_rwlock_write_unlock(&(shard->lock));
+    }
 }
 
-CDTP_TEST_EXPORT void _cdtp_client_map_iter_free(CDTPClientMapIter *iter)
+CDTP_TEST_EXPORT void _cdtp_client_map_clear(CDTPClientMap *map)
 {
-    for (size_t i = 0; i < iter->size; i++) {
-        free(iter->clients[i]);
-    }
-
-    free(iter->clients);
-    free(iter);
+    _cdtp_client_map_pop_all(map, NULL, NULL);
 }
 
 CDTP_TEST_EXPORT void _cdtp_client_map_free(CDTPClientMap *map)
 {
-    for (size_t i = 0; i < map->capacity; i++) {
-        _cdtp_client_map_node_free(map->nodes[i]);
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        _cdtp_rwlock_destroy(&(map->shards[i].lock));
+        free(map->shards[i].nodes);
     }
 
-    free(map->nodes);
+    _cdtp_mutex_destroy(&(map->add_lock));
     free(map);
 }
@@ -1,5 +1,6 @@
 /**
- * CDTP interfaces to dynamically keep track of clients within a server.
+ * CDTP interfaces to dynamically keep track of clients within a server. All client map functions are safe to call from
+ * multiple threads at once.
  */
 
 #pragma once
@@ -7,8 +8,12 @@
 #define CDTP_MAP_H
 
 #include "defs.h"
+#include "threading.h"
 #include <stdbool.h>
 
+// Value that is never a valid client ID.
+#define CDTP_CLIENT_MAP_INVALID_ID SIZE_MAX
+
 /**
  * Create a new client map.
  *
@@ -17,58 +22,107 @@
 CDTP_TEST_EXPORT CDTPClientMap *_cdtp_client_map(void);
 
 /**
- * Check if a client map contains a given key.
+ * Get the number of clients in a client map.
  *
  * @param map The client map.
- * @param client_id The client ID key.
- * @return If the map contains the given client ID key.
+ * @return The number of clients.
+ */
+CDTP_TEST_EXPORT size_t _cdtp_client_map_size(CDTPClientMap *map);
+
+/**
+ * Check if a client map contains a given client ID. This takes constant time.
+ *
+ * @param map The client map.
+ * @param client_id The client ID.
+ * @return If the map contains a client with the given ID.
  */
 CDTP_TEST_EXPORT bool _cdtp_client_map_contains(CDTPClientMap *map, size_t client_id);
 
 /**
- * Get the client with a given key.
+ * Get the client with a given ID. This takes constant time.
  *
  * @param map The client map.
- * @param client_id The client ID key.
- * @return The client socket, or NULL if the key does not exist in the map.
+ * @param client_id The client ID.
+ * @return The client socket, or NULL if the ID does not exist in the map.
+ *
+ * Note that another thread may pop and free the client socket at any time. Use `_cdtp_client_map_acquire` to keep the
+ * socket valid while using it.
  */
 CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_get(CDTPClientMap *map, size_t client_id);
 
 /**
- * Set the client at a given key, given that the key is not already in use.
+ * Get the client with a given ID, preventing it from being popped until `_cdtp_client_map_release` is called.
  *
  * @param map The client map.
- * @param client_id The client ID key.
- * @param sock The client socket.
- * @return If the value was successfully inserted. Returns false if the key already exists in the map.
+ * @param client_id The client ID.
+ * @return The client socket, or NULL if the ID does not exist in the map.
+ *
+ * If a client socket is returned, `_cdtp_client_map_release` must be called with the same ID as soon as possible, and
+ * no other client may be acquired, added, or popped by the calling thread in the meantime. Other threads may acquire
+ * clients concurrently.
  */
-CDTP_TEST_EXPORT bool _cdtp_client_map_set(CDTPClientMap *map, size_t client_id, CDTPSocket *sock);
+CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_acquire(CDTPClientMap *map, size_t client_id);
 
 /**
- * Pop a client from the map by key.
+ * Release a client acquired with `_cdtp_client_map_acquire`.
  *
  * @param map The client map.
- * @param client_id The client ID key.
- * @return The client socket, or NULL if the key does not exist in the map.
+ * @param client_id The client ID.
+ */
+CDTP_TEST_EXPORT void _cdtp_client_map_release(CDTPClientMap *map, size_t client_id);
+
+/**
+ * Add a client to the map, assigning it a new client ID.
+ *
+ * @param map The client map.
+ * @param sock The client socket. This must not be NULL.
+ * @return The new client ID, or `CDTP_CLIENT_MAP_INVALID_ID` if the map is full.
+ */
+CDTP_TEST_EXPORT size_t _cdtp_client_map_add(CDTPClientMap *map, CDTPSocket *sock);
+
+/**
+ * Pop a client from the map by ID. The ID will not refer to any client again until its node's generation wraps around.
+ *
+ * @param map The client map.
+ * @param client_id The client ID.
+ * @return The client socket, or NULL if the ID does not exist in the map.
  *
  * Note that the client socket is returned, and the memory is still valid (`free` has not been called).
  */
 CDTP_TEST_EXPORT CDTPSocket *_cdtp_client_map_pop(CDTPClientMap *map, size_t client_id);
 
 /**
- * Create an iterator over the client map.
+ * Call a function on every client in a client map, without allocating.
  *
  * @param map The client map.
- * @return An iterator over the clients in the map.
+ * @param func The function to call with each client ID, client socket, and `arg`.
+ * @param arg A value that will be passed to `func`.
+ *
+ * The function must not use the map itself. Clients cannot be popped from the map while the function is running.
  */
-CDTP_TEST_EXPORT CDTPClientMapIter *_cdtp_client_map_iter(CDTPClientMap *map);
+CDTP_TEST_EXPORT void _cdtp_client_map_for_each(CDTPClientMap *map, void (*func)(size_t, CDTPSocket *, void *), void *arg);
 
 /**
- * Free the memory used by a client map iterator.
+ * Pop every client from a client map.
+ *
+ * @param map The client map.
+ * @param func The function to call with each popped client ID, client socket, and `arg`, or NULL.
+ * @param arg A value that will be passed to `func`.
+ *
+ * The function is called while the client's shard is locked for writing, so it must not use the map itself, and should
+ * do no more than take over the client socket. By the time it is called, no other thread can get the client from the
+ * map.
+ */
+CDTP_TEST_EXPORT void _cdtp_client_map_pop_all(CDTPClientMap *map, void (*func)(size_t, CDTPSocket *, void *), void *arg);
+
+/**
+ * Remove every client from a client map.
+ *
+ * @param map The client map.
  *
- * @param iter The client map iterator.
+ * Note that the client sockets are not freed.
  */
-CDTP_TEST_EXPORT void _cdtp_client_map_iter_free(CDTPClientMapIter *iter);
+CDTP_TEST_EXPORT void _cdtp_client_map_clear(CDTPClientMap *map);
 
 /**
  * Free the memory used by a client map.
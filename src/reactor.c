@@ -0,0 +1,271 @@
+#include "reactor.h"
+
+// Starting capacity of a reactor's socket list.
+#define CDTP_REACTOR_START_CAPACITY 16
+
+CDTPReactor *_cdtp_reactor(void)
+{
+    CDTPReactor *reactor = (CDTPReactor *) malloc(sizeof(CDTPReactor));
+
+#ifdef _WIN32
+    reactor->size = 0;
+    reactor->capacity = CDTP_REACTOR_START_CAPACITY;
+    reactor->fds = (WSAPOLLFD *) malloc(reactor->capacity * sizeof(WSAPOLLFD));
+    reactor->tokens = (size_t *) malloc(reactor->capacity * sizeof(size_t));
+    reactor->poll_fds = (WSAPOLLFD *) malloc(reactor->capacity * sizeof(WSAPOLLFD));
+    reactor->poll_tokens = (size_t *) malloc(reactor->capacity * sizeof(size_t));
+    _cdtp_mutex_init(&(reactor->lock));
+#else
+    if ((reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        _cdtp_set_err(CDTP_REACTOR_INIT_FAILED);
+        free(reactor);
+        return NULL;
+    }
+
+    if ((reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        _cdtp_set_err(CDTP_REACTOR_INIT_FAILED);
+        close(reactor->epoll_fd);
+        free(reactor);
+        return NULL;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = CDTP_REACTOR_WAKE_TOKEN;
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) == -1) {
+        _cdtp_set_err(CDTP_REACTOR_INIT_FAILED);
+        close(reactor->wake_fd);
+        close(reactor->epoll_fd);
+        free(reactor);
+        return NULL;
+    }
+#endif
+
+    return reactor;
+}
+
+bool _cdtp_reactor_add(CDTPReactor *reactor, CDTPSocket *sock, size_t token)
+{
+#ifdef _WIN32
+    _cdtp_mutex_lock(&(reactor->lock));
+
+    if (reactor->size == reactor->capacity) {
+        reactor->capacity *= 2;
+        reactor->fds = (WSAPOLLFD *) realloc(reactor->fds, reactor->capacity * sizeof(WSAPOLLFD));
+        reactor->tokens = (size_t *) realloc(reactor->tokens, reactor->capacity * sizeof(size_t));
+    }
+
+    reactor->fds[reactor->size].fd = sock->sock;
+    reactor->fds[reactor->size].events = POLLRDNORM;
+    reactor->fds[reactor->size].revents = 0;
+    reactor->tokens[reactor->size] = token;
+    reactor->size++;
+
+    _cdtp_mutex_unlock(&(reactor->lock));
+#else
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = token;
+
+    // Sockets using shared memory are woken by their doorbell, and the socket itself is only watched for hang-ups
+    if (sock->shm != NULL) {
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, sock->shm->doorbell, &event) == -1) {
+            _cdtp_set_err(CDTP_REACTOR_REGISTER_FAILED);
+            return false;
+        }
+
+        event.events = 0;
+    }
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, sock->sock, &event) == -1) {
+        _cdtp_set_err(CDTP_REACTOR_REGISTER_FAILED);
+
+        if (sock->shm != NULL) {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, sock->shm->doorbell, NULL);
+        }
+
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+bool _cdtp_reactor_modify(CDTPReactor *reactor, CDTPSocket *sock, size_t token, bool readable, bool writable)
+{
+#ifdef _WIN32
+    bool found = false;
+
+    _cdtp_mutex_lock(&(reactor->lock));
+
+    for (size_t i = 0; i < reactor->size; i++) {
+        if (reactor->fds[i].fd == sock->sock) {
+            reactor->fds[i].events = (SHORT) ((readable ? POLLRDNORM : 0) | (writable ? POLLWRNORM : 0));
+            reactor->tokens[i] = token;
+            found = true;
+            break;
+        }
+    }
+
+    _cdtp_mutex_unlock(&(reactor->lock));
+
+    if (!found) {
+        _cdtp_set_err(CDTP_REACTOR_REGISTER_FAILED);
+        return false;
+    }
+#else
+    // The doorbell of a socket using shared memory rings both when bytes arrive and when room is made for queued bytes,
+    // so it is always watched
+    if (sock->shm != NULL) {
+        return true;
+    }
+
+    struct epoll_event event;
+    event.events = (readable ? EPOLLIN : 0) | (writable ? EPOLLOUT : 0);
+    event.data.u64 = token;
+
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, sock->sock, &event) == -1) {
+        _cdtp_set_err(CDTP_REACTOR_REGISTER_FAILED);
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+void _cdtp_reactor_remove(CDTPReactor *reactor, CDTPSocket *sock)
+{
+#ifdef _WIN32
+    _cdtp_mutex_lock(&(reactor->lock));
+
+    for (size_t i = 0; i < reactor->size; i++) {
+        if (reactor->fds[i].fd == sock->sock) {
+            reactor->size--;
+            reactor->fds[i] = reactor->fds[reactor->size];
+            reactor->tokens[i] = reactor->tokens[reactor->size];
+            break;
+        }
+    }
+
+    _cdtp_mutex_unlock(&(reactor->lock));
+#else
+    // The socket may already have been closed, in which case the kernel has removed it for us
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, sock->sock, NULL);
+
+    // The other party holds a copy of the doorbell, so the kernel only removes it once it is removed here
+    if (sock->shm != NULL) {
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, sock->shm->doorbell, NULL);
+    }
+#endif
+}
+
+int _cdtp_reactor_wait(CDTPReactor *reactor, CDTPReactorEvent *events, int max_events)
+{
+#ifdef _WIN32
+    // Poll a snapshot so sockets can be added or removed while waiting
+    _cdtp_mutex_lock(&(reactor->lock));
+
+    size_t num_fds = reactor->size;
+
+    if (num_fds > 0) {
+        reactor->poll_fds = (WSAPOLLFD *) realloc(reactor->poll_fds, reactor->capacity * sizeof(WSAPOLLFD));
+        reactor->poll_tokens = (size_t *) realloc(reactor->poll_tokens, reactor->capacity * sizeof(size_t));
+        memcpy(reactor->poll_fds, reactor->fds, num_fds * sizeof(WSAPOLLFD));
+        memcpy(reactor->poll_tokens, reactor->tokens, num_fds * sizeof(size_t));
+    }
+
+    _cdtp_mutex_unlock(&(reactor->lock));
+
+    if (num_fds == 0) {
+        cdtp_sleep(CDTP_SLEEP_TIME);
+        return 0;
+    }
+
+    int num_ready = WSAPoll(reactor->poll_fds, (ULONG) num_fds, (INT) (CDTP_SLEEP_TIME * 1000));
+
+    if (num_ready == SOCKET_ERROR) {
+        // A socket in the snapshot may have been closed while polling
+        return WSAGetLastError() == WSAENOTSOCK ? 0 : -1;
+    }
+
+    int num_events = 0;
+
+    for (size_t i = 0; i < num_fds && num_events < max_events; i++) {
+        SHORT revents = reactor->poll_fds[i].revents;
+
+        if (revents != 0) {
+            events[num_events].token = reactor->poll_tokens[i];
+            events[num_events].readable = (revents & ~POLLWRNORM) != 0;
+            events[num_events].writable = (revents & POLLWRNORM) != 0;
+            num_events++;
+        }
+    }
+
+    return num_events;
+#else
+    struct epoll_event epoll_events[CDTP_REACTOR_MAX_EVENTS];
+
+    if (max_events > CDTP_REACTOR_MAX_EVENTS) {
+        max_events = CDTP_REACTOR_MAX_EVENTS;
+    }
+
+    int num_ready = epoll_wait(reactor->epoll_fd, epoll_events, max_events, -1);
+
+    if (num_ready == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int num_events = 0;
+
+    for (int i = 0; i < num_ready; i++) {
+        if (epoll_events[i].data.u64 == CDTP_REACTOR_WAKE_TOKEN) {
+            // Drain the wake-up signal
+            uint64_t value;
+
+            if (read(reactor->wake_fd, &value, sizeof(value)) == -1) {
+                // Another thread already drained it, do nothing
+            }
+        }
+        else {
+            // Hang-ups and errors are reported as readable, so that reading from the socket reveals them
+            events[num_events].token = (size_t) (epoll_events[i].data.u64);
+            events[num_events].readable = (epoll_events[i].events & ~((uint32_t) EPOLLOUT)) != 0;
+            events[num_events].writable = (epoll_events[i].events & EPOLLOUT) != 0;
+            num_events++;
+        }
+    }
+
+    return num_events;
+#endif
+}
+
+void _cdtp_reactor_wake(CDTPReactor *reactor)
+{
+#ifdef _WIN32
+    // The Windows reactor never blocks for longer than `CDTP_SLEEP_TIME`, so there is nothing to wake
+    (void) reactor;
+#else
+    uint64_t value = 1;
+
+    if (write(reactor->wake_fd, &value, sizeof(value)) == -1) {
+        // The counter is already saturated, so the reactor will wake regardless
+    }
+#endif
+}
+
+void _cdtp_reactor_free(CDTPReactor *reactor)
+{
+#ifdef _WIN32
+    _cdtp_mutex_destroy(&(reactor->lock));
+    free(reactor->fds);
+    free(reactor->tokens);
+    free(reactor->poll_fds);
+    free(reactor->poll_tokens);
+#else
+    close(reactor->wake_fd);
+    close(reactor->epoll_fd);
+#endif
+
+    free(reactor);
+}
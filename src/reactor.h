@@ -0,0 +1,90 @@
+/**
+ * CDTP event reactor.
+ */
+
+#pragma once
+#ifndef CDTP_REACTOR_H
+#define CDTP_REACTOR_H
+
+#include "defs.h"
+#include "util.h"
+#include "threading.h"
+
+// Maximum number of events handled per reactor wait.
+#define CDTP_REACTOR_MAX_EVENTS 64
+
+// Token identifying a server's listening socket.
+#define CDTP_REACTOR_LISTENER_TOKEN SIZE_MAX
+
+// Token identifying the reactor's own wake-up signal.
+#define CDTP_REACTOR_WAKE_TOKEN (SIZE_MAX - 1)
+
+/**
+ * Create a new event reactor.
+ *
+ * @return The new reactor, or NULL if it could not be created.
+ */
+CDTPReactor *_cdtp_reactor(void);
+
+/**
+ * Watch a socket for incoming data.
+ *
+ * @param reactor The event reactor.
+ * @param sock The socket to watch.
+ * @param token The value reported when the socket becomes readable.
+ * @return If the socket was registered.
+ *
+ * Sockets using shared memory are reported as readable when their doorbell rings or their connection is closed.
+ */
+bool _cdtp_reactor_add(CDTPReactor *reactor, CDTPSocket *sock, size_t token);
+
+/**
+ * Change what a socket is watched for.
+ *
+ * @param reactor The event reactor.
+ * @param sock The socket, which must already be watched.
+ * @param token The value reported when the socket is ready.
+ * @param readable If the socket should be watched for incoming data.
+ * @param writable If the socket should be watched for room to send data.
+ * @return If the socket's registration was changed.
+ *
+ * This has no effect on sockets using shared memory, whose doorbell is always watched.
+ */
+bool _cdtp_reactor_modify(CDTPReactor *reactor, CDTPSocket *sock, size_t token, bool readable, bool writable);
+
+/**
+ * Stop watching a socket.
+ *
+ * @param reactor The event reactor.
+ * @param sock The socket to stop watching.
+ */
+void _cdtp_reactor_remove(CDTPReactor *reactor, CDTPSocket *sock);
+
+/**
+ * Wait for registered sockets to become readable or writable.
+ *
+ * @param reactor The event reactor.
+ * @param events The array to write ready events to.
+ * @param max_events The maximum number of events to write.
+ * @return The number of events written, or -1 if an error occurred.
+ *
+ * On Linux this blocks until a socket is ready or `_cdtp_reactor_wake` is called. On Windows it returns after at most
+ * `CDTP_SLEEP_TIME` seconds.
+ */
+int _cdtp_reactor_wait(CDTPReactor *reactor, CDTPReactorEvent *events, int max_events);
+
+/**
+ * Wake a thread blocked in `_cdtp_reactor_wait`.
+ *
+ * @param reactor The event reactor.
+ */
+void _cdtp_reactor_wake(CDTPReactor *reactor);
+
+/**
+ * Free the memory used by a reactor.
+ *
+ * @param reactor The event reactor.
+ */
+void _cdtp_reactor_free(CDTPReactor *reactor);
+
+#endif // CDTP_REACTOR_H
@@ -1,63 +1,265 @@
 #include "server.h"
 
+// Starting capacity of a list of client sockets.
+#define CDTP_SERVER_CLIENT_LIST_START_CAPACITY 16
+
 /**
- * Get a new client ID.
+ * Free the memory used by a client socket. Events already queued on the client's strand still run.
  *
- * @param server The socket server.
- * @return The next available client ID.
+ * @param client The client socket.
  */
-size_t _cdtp_server_new_client_id(CDTPServer *server)
+void _cdtp_server_free_client(CDTPSocket *client)
 {
-    return server->next_client_id++;
+    if (client->key != NULL) {
+        _cdtp_crypto_aes_key_free(client->key);
+    }
+
+    if (client->shm != NULL) {
+        _cdtp_shm_free(client->shm);
+    }
+
+    if (client->strand != NULL) {
+        _cdtp_strand_free(client->strand);
+    }
+
+    _cdtp_recv_buffer_free(client->recv_buffer);
+    _cdtp_send_buffer_free(client->send_buffer);
+    free(client);
 }
 
 /**
- * Disconnect a client from the server.
+ * Take a reference to the client with a given ID, keeping its socket open and its memory valid even if it is removed
+ * from the client map in the meantime.
  *
  * @param server The socket server.
- * @param client_id The ID of the client to disconnect.
+ * @param client_id The ID of the client.
+ * @return The client socket, or NULL if the client does not exist. `_cdtp_server_release_client` must be called on it
+ * once it is no longer used.
  */
-void _cdtp_server_disconnect_sock(CDTPServer *server, size_t client_id)
+CDTPSocket *_cdtp_server_hold_client(CDTPServer *server, size_t client_id)
 {
-    CDTPSocket *client = _cdtp_client_map_pop(server->clients, client_id);
+    CDTPSocket *client = _cdtp_client_map_acquire(server->clients, client_id);
 
+    // The map's own reference keeps the client alive until this one is taken
     if (client != NULL) {
+        __atomic_add_fetch(&(client->refs), 1, __ATOMIC_RELAXED);
+        _cdtp_client_map_release(server->clients, client_id);
+    }
+
+    return client;
+}
+
+/**
+ * Release a reference to a client, closing its socket and freeing its memory if it was the last one.
+ *
+ * @param client The client socket.
+ * @return If the socket was not closed, or was closed successfully.
+ */
+bool _cdtp_server_release_client(CDTPSocket *client)
+{
+    if (__atomic_sub_fetch(&(client->refs), 1, __ATOMIC_ACQ_REL) != 0) {
+        return true;
+    }
+
 #ifdef _WIN32
-        closesocket(client->sock);
+    bool closed = closesocket(client->sock) == 0;
 #else
-        close(client->sock);
+    bool closed = close(client->sock) == 0;
 #endif
 
-        _cdtp_crypto_aes_key_free(client->key);
-        free(client);
+    _cdtp_server_free_client(client);
+
+    return closed;
+}
+
+/**
+ * Stop a client's strand from waiting for room. This is called for each client when the server stops.
+ *
+ * @param client_id The ID of the client.
+ * @param client The client socket.
+ * @param arg Unused.
+ */
+void _cdtp_server_close_strand(size_t client_id, CDTPSocket *client, void *arg)
+{
+    (void) client_id;
+    (void) arg;
+
+    if (client->strand != NULL) {
+        _cdtp_strand_close(client->strand);
+    }
+}
+
+/**
+ * A list of client sockets, each holding a reference to its client.
+ */
+typedef struct _CDTPServerClientList {
+    CDTPSocket **clients;
+    size_t size;
+    size_t capacity;
+} CDTPServerClientList;
+
+/**
+ * Add a client to a list, taking over a reference the caller already holds.
+ *
+ * @param client_id The ID of the client.
+ * @param client The client socket.
+ * @param list_ptr The client list.
+ */
+void _cdtp_server_client_list_add(size_t client_id, CDTPSocket *client, void *list_ptr)
+{
+    (void) client_id;
+
+    CDTPServerClientList *list = (CDTPServerClientList *) list_ptr;
+
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity > 0 ? list->capacity * 2 : CDTP_SERVER_CLIENT_LIST_START_CAPACITY;
+        list->clients = (CDTPSocket **) realloc(list->clients, list->capacity * sizeof(CDTPSocket *));
+    }
+
+    list->clients[list->size++] = client;
+}
+
+/**
+ * Take a reference to a client and add it to a list. This is called for each client while the client map is iterated
+ * over, so the client cannot be freed before its reference is taken.
+ *
+ * @param client_id The ID of the client.
+ * @param client The client socket.
+ * @param list_ptr The client list.
+ */
+void _cdtp_server_client_list_hold(size_t client_id, CDTPSocket *client, void *list_ptr)
+{
+    __atomic_add_fetch(&(client->refs), 1, __ATOMIC_RELAXED);
+    _cdtp_server_client_list_add(client_id, client, list_ptr);
+}
+
+/**
+ * Release the reference held to each client in a list, and free the list's memory.
+ *
+ * @param list The client list.
+ * @return If every socket that was closed was closed successfully.
+ */
+bool _cdtp_server_client_list_release(CDTPServerClientList *list)
+{
+    bool closed = true;
+
+    for (size_t i = 0; i < list->size; i++) {
+        if (!_cdtp_server_release_client(list->clients[i])) {
+            closed = false;
+        }
+    }
+
+    free(list->clients);
+
+    return closed;
+}
+
+/**
+ * Send the queued data of every client in a list. The clients are sent to in turns, and whatever is left once
+ * `CDTP_SEND_DRAIN_TIMEOUT` seconds have passed is dropped, however many clients are not reading.
+ *
+ * @param list The client list.
+ */
+void _cdtp_server_drain_clients(CDTPServerClientList *list)
+{
+    double deadline = _cdtp_time() + CDTP_SEND_DRAIN_TIMEOUT;
+
+    for (;;) {
+        bool pending = false;
+
+        // A client whose connection is broken has nothing more that can be sent
+        for (size_t i = 0; i < list->size; i++) {
+            CDTPSocket *client = list->clients[i];
+
+            if (_cdtp_send_buffer_flush(client->send_buffer, client) &&
+                _cdtp_send_buffer_pending(client->send_buffer) > 0) {
+                pending = true;
+            }
+        }
+
+        if (!pending || _cdtp_time() >= deadline) {
+            return;
+        }
+
+        cdtp_sleep(CDTP_SLEEP_TIME);
     }
 }
 
+/**
+ * Close and free every client socket, emptying the client map.
+ *
+ * @param server The socket server.
+ * @return If every socket was closed.
+ */
+bool _cdtp_server_close_clients(CDTPServer *server)
+{
+    CDTPServerClientList list = {NULL, 0, 0};
+
+    // Take every client out of the map before freeing any, so no other thread can get a client that has been freed
+    _cdtp_client_map_pop_all(server->clients, _cdtp_server_client_list_add, &list);
+
+    // Send the clients' queued data before closing their sockets
+    _cdtp_server_drain_clients(&list);
+
+    return _cdtp_server_client_list_release(&list);
+}
+
+/**
+ * Encrypt data and send it to a client socket, queueing whatever the socket cannot take right away.
+ *
+ * @param client The client socket.
+ * @param data The data to send.
+ * @param data_size The size of the data, in bytes.
+ * @return 1 if the data was sent or queued, 0 if too many bytes are already queued, or -1 on failure.
+ */
+int _cdtp_server_send_sock(CDTPSocket *client, void *data, size_t data_size)
+{
+    return _cdtp_send_buffer_send(client->send_buffer, client, data, data_size);
+}
+
 /**
  * Call the `on_recv` event function.
  *
  * @param server The socket server.
  * @param client_id The ID of the client who sent the data.
- * @param data The received data.
+ * @param client The socket of the client who sent the data.
+ * @param data The received data, which is decrypted in place unless the connection is plaintext. This is not freed.
  * @param data_size The size of the received data, in bytes.
  */
-void _cdtp_server_call_on_recv(CDTPServer *server, size_t client_id, void *data, size_t data_size)
+void _cdtp_server_call_on_recv(CDTPServer *server, size_t client_id, CDTPSocket *client, void *data, size_t data_size)
 {
     if (server->on_recv != NULL) {
-        CDTPSocket *client = _cdtp_client_map_get(server->clients, client_id);
-        CDTPCryptoData *data_decrypted = _cdtp_crypto_aes_decrypt(client->key, data, data_size);
-        size_t decrypted_data_size = data_decrypted->data_size;
-        void *decrypted_data = _cdtp_crypto_data_unwrap(data_decrypted);
+        void *decrypted_data;
+        size_t decrypted_data_size;
+
+        // Plaintext connections pass the data along as it was received
+        if (client->key == NULL) {
+            decrypted_data = data;
+            decrypted_data_size = data_size;
+        }
+        else if (!_cdtp_crypto_aes_decrypt_in_place(client->key, data, data_size, &decrypted_data, &decrypted_data_size)) {
+            return;
+        }
+
+        if (server->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            // The data is only lent to the event function, straight from the receive buffer
+            (*server->on_recv)(server, client_id, decrypted_data, decrypted_data_size, server->on_recv_arg);
+        }
+        else {
+            // The event function runs later, so it gets its own copy of the data
+            void *data_copy = malloc(decrypted_data_size);
+            memcpy(data_copy, decrypted_data, decrypted_data_size);
+            decrypted_data = data_copy;
 
-        _cdtp_start_thread_on_recv_server(server->on_recv,
+            _cdtp_dispatch_on_recv_server(server->on_recv,
                                           server,
+                                          client->strand,
                                           client_id,
                                           decrypted_data,
                                           decrypted_data_size,
                                           server->on_recv_arg);
+        }
     }
-
-    free(data);
 }
 
 /**
@@ -65,14 +267,21 @@ void _cdtp_server_call_on_recv(CDTPServer *server, size_t client_id, void *data,
  *
  * @param server The socket server.
  * @param client_id The ID of the connecting client.
+ * @param client The socket of the connecting client.
  */
-void _cdtp_server_call_on_connect(CDTPServer *server, size_t client_id)
+void _cdtp_server_call_on_connect(CDTPServer *server, size_t client_id, CDTPSocket *client)
 {
     if (server->on_connect != NULL) {
-        _cdtp_start_thread_on_connect(server->on_connect,
+        if (server->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            (*server->on_connect)(server, client_id, server->on_connect_arg);
+        }
+        else {
+            _cdtp_dispatch_on_connect(server->on_connect,
                                       server,
+                                      client->strand,
                                       client_id,
                                       server->on_connect_arg);
+        }
     }
 }
 
@@ -81,461 +290,1365 @@ void _cdtp_server_call_on_connect(CDTPServer *server, size_t client_id)
  *
  * @param server The socket server.
  * @param client_id The ID of the disconnecting client.
+ * @param client The socket of the disconnecting client.
  */
-void _cdtp_server_call_on_disconnect(CDTPServer *server, size_t client_id)
+void _cdtp_server_call_on_disconnect(CDTPServer *server, size_t client_id, CDTPSocket *client)
 {
     if (server->on_disconnect != NULL) {
-        _cdtp_start_thread_on_disconnect(server->on_disconnect,
+        if (server->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            (*server->on_disconnect)(server, client_id, server->on_disconnect_arg);
+        }
+        else {
+            _cdtp_dispatch_on_disconnect(server->on_disconnect,
                                          server,
+                                         client->strand,
                                          client_id,
                                          server->on_disconnect_arg);
+        }
     }
 }
 
 /**
- * Exchange crypto keys with a client.
+ * Call the `on_writable` event function.
  *
- * @param client The client socket.
- * @return If the exchange succeeded.
+ * @param server The socket server.
+ * @param client_id The ID of the client that can be sent to again.
+ * @param client The socket of the client that can be sent to again.
  */
-bool _cdtp_server_exchange_keys(CDTPSocket *client)
+void _cdtp_server_call_on_writable(CDTPServer *server, size_t client_id, CDTPSocket *client)
 {
-    CDTPRSAKeyPair *rsa_keys = _cdtp_crypto_rsa_key_pair();
-    CDTPRSAPublicKey *public_key = rsa_keys->public_key;
-    CDTPRSAPrivateKey *private_key = rsa_keys->private_key;
-    CDTPCryptoData *public_key_data = _cdtp_crypto_rsa_public_key_to_bytes(public_key);
-    char *public_key_encoded = _cdtp_construct_message(public_key_data->data, public_key_data->data_size);
+    if (server->on_writable != NULL) {
+        if (server->dispatch_mode == CDTP_DISPATCH_INLINE) {
+            (*server->on_writable)(server, client_id, server->on_writable_arg);
+        }
+        else {
+            _cdtp_dispatch_on_writable_server(server->on_writable,
+                                              server,
+                                              client->strand,
+                                              client_id,
+                                              server->on_writable_arg);
+        }
+    }
+}
 
-    if (send(client->sock, public_key_encoded, CDTP_LENSIZE + public_key_data->data_size, 0) < 0) {
-        _cdtp_set_err(CDTP_SERVER_KEY_EXCHANGE_FAILED);
-        return false;
+/**
+ * Disconnect a client from the server, calling the `on_disconnect` event function.
+ *
+ * @param server The socket server.
+ * @param client_id The ID of the client to disconnect.
+ */
+void _cdtp_server_disconnect_sock(CDTPServer *server, size_t client_id)
+{
+    CDTPSocket *client = _cdtp_client_map_pop(server->clients, client_id);
+
+    if (client == NULL) {
+        return;
     }
 
-    char size_buffer[CDTP_LENSIZE];
-    size_t msg_size;
-    char *buffer;
-    int recv_code;
+    _cdtp_reactor_remove(server->reactors[client->reactor_index].reactor, client);
 
-#ifdef _WIN32
-    recv_code = recv(client->sock, size_buffer, CDTP_LENSIZE, 0);
+    // Queue the event before releasing the strand, so it runs after the client's last message
+    _cdtp_server_call_on_disconnect(server, client_id, client);
+    _cdtp_server_release_client(client);
+}
 
-    if (recv_code == SOCKET_ERROR || recv_code == 0) {
-        _cdtp_set_err(CDTP_SERVER_KEY_EXCHANGE_FAILED);
-        return false;
+/**
+ * Get the RSA key pair to use for a key exchange, according to the server's key mode.
+ *
+ * @param server The socket server.
+ * @return The key pair, or NULL if one could not be generated.
+ */
+CDTPRSAKeyPair *_cdtp_server_take_key_pair(CDTPServer *server)
+{
+    switch (server->key_mode) {
+        case CDTP_KEY_MODE_POOL:
+            return _cdtp_key_pool_take(server->key_pool);
+        case CDTP_KEY_MODE_PERSISTENT:
+            return server->key_pair;
+        case CDTP_KEY_MODE_PER_CONNECTION:
+        default:
+            return _cdtp_crypto_rsa_key_pair();
     }
-    else {
-        msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
-        buffer = (char *) malloc(msg_size * sizeof(char));
+}
+
+/**
+ * Release an RSA key pair obtained from `_cdtp_server_take_key_pair`.
+ *
+ * @param server The socket server.
+ * @param key_pair The key pair.
+ */
+void _cdtp_server_release_key_pair(CDTPServer *server, CDTPRSAKeyPair *key_pair)
+{
+    // The persistent key pair lives as long as the server
+    if (server->key_mode != CDTP_KEY_MODE_PERSISTENT) {
+        _cdtp_crypto_rsa_key_pair_free(key_pair);
+    }
+}
+
+/**
+ * Set whether a socket's operations block, and how long blocking operations may wait.
+ *
+ * @param sock The socket.
+ * @param blocking If operations should block.
+ * @param timeout The maximum time, in seconds, a blocking operation may wait, or 0 to wait indefinitely.
+ * @return If the socket options were set.
+ */
+bool _cdtp_server_set_blocking(CDTPSocket *sock, bool blocking, double timeout)
+{
+#ifdef _WIN32
+    unsigned long mode = blocking ? 0 : 1;
+    DWORD timeout_ms = (DWORD) (timeout * 1000);
+
+    return ioctlsocket(sock->sock, FIONBIO, &mode) == 0 &&
+           setsockopt(sock->sock, SOL_SOCKET, SO_RCVTIMEO, (char *) (&timeout_ms), sizeof(timeout_ms)) == 0 &&
+           setsockopt(sock->sock, SOL_SOCKET, SO_SNDTIMEO, (char *) (&timeout_ms), sizeof(timeout_ms)) == 0;
+#else
+    int flags = fcntl(sock->sock, F_GETFL, 0);
+    struct timeval timeout_tv;
+    timeout_tv.tv_sec = (time_t) timeout;
+    timeout_tv.tv_usec = (suseconds_t) ((timeout - (double) timeout_tv.tv_sec) * 1000000);
+
+    return flags != -1 &&
+           fcntl(sock->sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) != -1 &&
+           setsockopt(sock->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout_tv, sizeof(timeout_tv)) == 0 &&
+           setsockopt(sock->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout_tv, sizeof(timeout_tv)) == 0;
+#endif
+}
+
+/**
+ * Read an exact number of bytes while exchanging keys with a client, continuing after short reads.
+ *
+ * @param client The client socket.
+ * @param dest The buffer to read into.
+ * @param size The number of bytes to read.
+ * @param deadline The time, from `_cdtp_time`, after which to stop waiting for the rest of the bytes.
+ * @return If all of the bytes were read before the deadline.
+ */
+bool _cdtp_server_recv_handshake_exact(CDTPSocket *client, char *dest, size_t size, double deadline)
+{
+    size_t received = 0;
 
-        recv_code = recv(client->sock, buffer, msg_size, 0);
+    while (received < size) {
+        // Only wait for whatever is left of the timeout
+        double remaining = deadline - _cdtp_time();
 
-        if (recv_code == SOCKET_ERROR || recv_code == 0 || (size_t) recv_code != msg_size) {
-            _cdtp_set_err(CDTP_SERVER_KEY_EXCHANGE_FAILED);
+        if (remaining <= 0 || !_cdtp_server_set_blocking(client, true, remaining)) {
             return false;
         }
-    }
-#else
-    recv_code = read(client->sock, size_buffer, CDTP_LENSIZE);
 
-    if (recv_code == 0 || recv_code == -1) {
-        _cdtp_set_err(CDTP_SERVER_KEY_EXCHANGE_FAILED);
-        return false;
-    }
-    else {
-        msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
-        buffer = (char *) malloc(msg_size * sizeof(char));
+#ifdef _WIN32
+        int recv_code = recv(client->sock, dest + received, (int) (size - received), 0);
 
-        recv_code = read(client->sock, buffer, msg_size);
+        if (recv_code == SOCKET_ERROR || recv_code == 0) {
+            return false;
+        }
+#else
+        ssize_t recv_code = read(client->sock, dest + received, size - received);
 
-        if (recv_code == 0 || recv_code == -1 || (size_t) recv_code != msg_size) {
-            _cdtp_set_err(CDTP_SERVER_KEY_EXCHANGE_FAILED);
+        if (recv_code == 0 || recv_code == -1) {
             return false;
         }
-    }
 #endif
 
-    CDTPCryptoData *key_data = _cdtp_crypto_rsa_decrypt(private_key, buffer, msg_size);
-    client->key = _cdtp_crypto_aes_key_from(key_data->data, key_data->data_size);
-
-    _cdtp_crypto_rsa_key_pair_free(rsa_keys);
-    _cdtp_crypto_data_free(public_key_data);
-    free(public_key_encoded);
-    free(buffer);
-    _cdtp_crypto_data_free(key_data);
+        received += (size_t) recv_code;
+    }
 
     return true;
 }
 
 /**
- * Serve clients.
+ * Receive a message while exchanging keys with a client.
  *
- * @param server The socket server.
+ * @param client The client socket.
+ * @param msg_size A pointer that will be set to the size of the message, in bytes.
+ * @return The message, or NULL if it could not be received within `CDTP_HANDSHAKE_TIMEOUT` seconds.
+ *
+ * Note that the returned value is allocated on the heap, and `free` will need to be called on it.
  */
-void _cdtp_server_serve(CDTPServer *server)
+char *_cdtp_server_recv_handshake(CDTPSocket *client, size_t *msg_size)
 {
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
-
-#ifdef _WIN32
-    // Set non-blocking
-    unsigned long mode = 1;
+    char size_buffer[CDTP_LENSIZE];
+    double deadline = _cdtp_time() + CDTP_HANDSHAKE_TIMEOUT;
 
-    if (ioctlsocket(server->sock->sock, FIONBIO, &mode) != 0) {
-        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
-        return;
+    if (!_cdtp_server_recv_handshake_exact(client, size_buffer, CDTP_LENSIZE, deadline)) {
+        return NULL;
     }
 
-    SOCKET new_sock;
-#else
-    // Set non-blocking
-    if (fcntl(server->sock->sock, F_SETFL, fcntl(server->sock->sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
-        return;
-    }
+    // The size comes from a peer that has not been authenticated yet, so nothing larger than a handshake is allocated
+    *msg_size = _cdtp_decode_message_size((unsigned char *) size_buffer);
 
-    int new_sock;
-#endif
+    if (*msg_size > CDTP_HANDSHAKE_MAX_SIZE) {
+        return NULL;
+    }
 
-    unsigned char size_buffer[CDTP_LENSIZE];
-    int recv_code;
+    char *buffer = (char *) malloc(*msg_size * sizeof(char));
 
-    while (server->serving) {
-        // Accept incoming connections
-#ifdef _WIN32
-        new_sock = accept(server->sock->sock, (struct sockaddr *) (&address), (int *) (&addrlen));
-#else
-        new_sock = accept(server->sock->sock, (struct sockaddr *) (&address), (socklen_t *) (&addrlen));
-#endif
+    if (buffer == NULL) {
+        return NULL;
+    }
 
-        // Check if the server has been stopped
-        if (!server->serving) {
-            return;
-        }
+    if (!_cdtp_server_recv_handshake_exact(client, buffer, *msg_size, deadline)) {
+        free(buffer);
+        return NULL;
+    }
 
-#ifdef _WIN32
-        if (new_sock == INVALID_SOCKET) {
-            int err_code = WSAGetLastError();
+    return buffer;
+}
 
-            if (err_code == WSAEWOULDBLOCK) {
-                // No new connections, do nothing
-            }
-            else if (err_code != WSAENOTSOCK || server->serving) {
-                _cdtp_set_error(CDTP_SOCKET_ACCEPT_FAILED, err_code);
-                return;
-            }
-            else {
-                return;
-            }
-        }
-        else {
-            size_t client_id = _cdtp_server_new_client_id(server);
+/**
+ * Send a message while exchanging keys with a client.
+ *
+ * @param client The client socket.
+ * @param data The message.
+ * @param data_size The size of the message, in bytes.
+ * @return If the message was sent.
+ */
+bool _cdtp_server_send_handshake(CDTPSocket *client, void *data, size_t data_size)
+{
+    char *message = _cdtp_construct_message(data, data_size);
+    bool sent = send(client->sock, message, CDTP_LENSIZE + data_size, 0) >= 0;
 
-            // Set blocking for key exchange
-            mode = 0;
+    free(message);
 
-            if (ioctlsocket(new_sock, FIONBIO, &mode) != 0) {
-                _cdtp_set_err(CDTP_SOCKET_ACCEPT_FAILED);
-                return;
-            }
+    return sent;
+}
 
-            // Create the new client object
-            CDTPSocket *new_client = (CDTPSocket *) malloc(sizeof(CDTPSocket));
-            new_client->sock = new_sock;
-            memcpy(&(new_client->address), &address, sizeof(address));
+/**
+ * Resume the session a client's ticket came from.
+ *
+ * @param server The socket server.
+ * @param client The client socket.
+ * @param client_random The random data sent by the client.
+ * @param ticket The ticket sent by the client, `CDTP_TICKET_SIZE` bytes long.
+ * @param server_public_key The X25519 public key the server sent in this key exchange.
+ * @return If the ticket was accepted, in which case the client's key is set.
+ */
+bool _cdtp_server_resume(CDTPServer *server,
+                         CDTPSocket *client,
+                         char *client_random,
+                         char *ticket,
+                         char *server_public_key)
+{
+    CDTPCipher mode;
+    char secret[CDTP_RESUMPTION_SECRET_SIZE];
 
-            // Exchange keys
-            if (!_cdtp_server_exchange_keys(new_client)) {
-                return;
-            }
+    if (server->ticket_lifetime > 0 &&
+        _cdtp_crypto_ticket_open(server->ticket_key, ticket, CDTP_TICKET_SIZE, &mode, secret)) {
+        client->key = _cdtp_crypto_resumed_aes_key(secret, client_random, server_public_key, true, mode);
+    }
 
-            // Set non-blocking
-            mode = 1;
+    memset(secret, 0, sizeof(secret));
 
-            if (ioctlsocket(new_sock, FIONBIO, &mode) != 0) {
-                _cdtp_set_err(CDTP_SOCKET_ACCEPT_FAILED);
-                return;
-            }
+    return client->key != NULL;
+}
 
-            // Add the new socket to the client map
-            _cdtp_client_map_set(server->clients, client_id, new_client);
-            _cdtp_server_call_on_connect(server, client_id);
-        }
-#else
-        if (new_sock < 0) {
+/**
+ * Send a client a resumption ticket for its session, encrypted with the session key.
+ *
+ * @param server The socket server.
+ * @param client The client socket.
+ * @return If the ticket was sent.
+ *
+ * The ticket is empty if the server does not resume sessions.
+ */
+bool _cdtp_server_send_ticket(CDTPServer *server, CDTPSocket *client)
+{
+    CDTPCryptoData *ticket = NULL;
+    char secret[CDTP_RESUMPTION_SECRET_SIZE];
+
+    if (server->ticket_lifetime > 0) {
+        if (!_cdtp_crypto_resumption_secret(client->key, secret)) {
+            return false;
+        }
+
+        ticket = _cdtp_crypto_ticket_seal(server->ticket_key, client->key->mode, secret, server->ticket_lifetime);
+        memset(secret, 0, sizeof(secret));
+
+        if (ticket == NULL) {
+            return false;
+        }
+    }
+
+    char empty = 0;
+    size_t message_size;
+    void *message = ticket != NULL ?
+                    _cdtp_crypto_aes_encrypt_message(client->key, ticket->data, ticket->data_size, &message_size) :
+                    _cdtp_crypto_aes_encrypt_message(client->key, &empty, 0, &message_size);
+
+    if (ticket != NULL) {
+        _cdtp_crypto_data_free(ticket);
+    }
+
+    bool sent = message != NULL && send(client->sock, message, message_size, 0) >= 0;
+
+    free(message);
+
+    return sent;
+}
+
+/**
+ * Agree with a client to send messages without encrypting them.
+ *
+ * @param client The client socket.
+ * @param wants_shared_memory A pointer that will be set to whether the client asked for shared memory.
+ * @return If the client also uses the plaintext mode.
+ *
+ * The server's hello message is a null byte followed by the `CDTP_HANDSHAKE_PLAINTEXT` version byte, which clients
+ * in the plaintext mode reply to with the same version byte, and optionally a flags byte. Every other client fails to
+ * find a key exchange it understands, and goes away.
+ */
+bool _cdtp_server_exchange_plaintext(CDTPSocket *client, bool *wants_shared_memory)
+{
+    char hello[2] = {(char) 0, (char) CDTP_HANDSHAKE_PLAINTEXT};
+
+    if (!_cdtp_server_send_handshake(client, hello, sizeof(hello))) {
+        return false;
+    }
+
+    size_t msg_size;
+    char *buffer = _cdtp_server_recv_handshake(client, &msg_size);
+    bool agreed = buffer != NULL && (msg_size == 1 || msg_size == 2) && buffer[0] == (char) CDTP_HANDSHAKE_PLAINTEXT;
+    *wants_shared_memory = agreed && msg_size == 2 && (buffer[1] & CDTP_HANDSHAKE_WANTS_SHARED_MEMORY) != 0;
+
+    free(buffer);
+
+    return agreed;
+}
+
+/**
+ * Exchange crypto keys with a client.
+ *
+ * @param server The socket server.
+ * @param client The client socket.
+ * @return If the exchange succeeded.
+ *
+ * The server's hello message is its RSA public key in PEM format, if legacy key exchanges are allowed, followed by a
+ * null byte, the `CDTP_HANDSHAKE_ECDH` version byte, an ephemeral X25519 public key, and the ciphers the server offers,
+ * in order of preference (see `_cdtp_crypto_offer_ciphers`). Clients that understand the version byte reply with the
+ * same version byte, their own X25519 public key, the cipher they chose, and optionally a flags byte, and older clients
+ * reply with an AES key encrypted with the RSA public key, ignoring everything after the PEM text. Keys exchanged with
+ * RSA, and X25519 replies without a cipher, use AES-256-CBC.
+ *
+ * Clients holding a resumption ticket may instead reply with the `CDTP_HANDSHAKE_RESUME` version byte, a flags byte,
+ * random data, and the ticket. The server answers with a single status byte, and if it rejected the ticket, the client
+ * continues with one of the replies above. Clients that set `CDTP_HANDSHAKE_WANTS_TICKET` in their flags are sent a new
+ * ticket, encrypted with the session key, once the key is set.
+ *
+ * A failed exchange is not reported as an error, since it only means the client misbehaved or went away.
+ */
+bool _cdtp_server_exchange_keys(CDTPServer *server, CDTPSocket *client, bool *wants_shared_memory)
+{
+    CDTPECDHKeyPair *ecdh_keys = _cdtp_crypto_ecdh_key_pair();
+
+    if (ecdh_keys == NULL) {
+        return false;
+    }
+
+    CDTPRSAKeyPair *rsa_keys = NULL;
+
+    if (server->legacy_handshake && (rsa_keys = _cdtp_server_take_key_pair(server)) == NULL) {
+        _cdtp_crypto_ecdh_key_pair_free(ecdh_keys);
+        return false;
+    }
+
+    // Build the hello message
+    char ciphers[CDTP_NUM_CIPHERS];
+    size_t num_ciphers = _cdtp_crypto_offer_ciphers(ciphers, _cdtp_crypto_aes_accelerated());
+    size_t pem_size = rsa_keys != NULL ? rsa_keys->public_key->key_size : 0;
+    size_t hello_size = pem_size + 2 + CDTP_ECDH_PUBLIC_KEY_SIZE + num_ciphers;
+    char *hello = (char *) malloc(hello_size * sizeof(char));
+
+    if (rsa_keys != NULL) {
+        memcpy(hello, rsa_keys->public_key->key, pem_size);
+    }
+
+    hello[pem_size] = (char) 0;
+    hello[pem_size + 1] = (char) CDTP_HANDSHAKE_ECDH;
+    memcpy(hello + pem_size + 2, ecdh_keys->public_key, CDTP_ECDH_PUBLIC_KEY_SIZE);
+    memcpy(hello + pem_size + 2 + CDTP_ECDH_PUBLIC_KEY_SIZE, ciphers, num_ciphers);
+
+    bool sent = _cdtp_server_send_handshake(client, hello, hello_size);
+
+    free(hello);
+
+    size_t msg_size = 0;
+    char *buffer = sent ? _cdtp_server_recv_handshake(client, &msg_size) : NULL;
+    bool wants_ticket = false;
+    *wants_shared_memory = false;
+
+    // Try to resume the client's earlier session, continuing with a full key exchange if its ticket is rejected
+    if (buffer != NULL && msg_size == 2 + CDTP_RESUMPTION_RANDOM_SIZE + CDTP_TICKET_SIZE &&
+        buffer[0] == (char) CDTP_HANDSHAKE_RESUME) {
+        wants_ticket = (buffer[1] & CDTP_HANDSHAKE_WANTS_TICKET) != 0;
+        *wants_shared_memory = (buffer[1] & CDTP_HANDSHAKE_WANTS_SHARED_MEMORY) != 0;
+        char status = (char) (_cdtp_server_resume(server,
+                                                  client,
+                                                  buffer + 2,
+                                                  buffer + 2 + CDTP_RESUMPTION_RANDOM_SIZE,
+                                                  ecdh_keys->public_key) ? 1 : 0);
+        free(buffer);
+        buffer = NULL;
+
+        if (!_cdtp_server_send_handshake(client, &status, 1)) {
+            if (client->key != NULL) {
+                _cdtp_crypto_aes_key_free(client->key);
+                client->key = NULL;
+            }
+        }
+        else if (client->key == NULL) {
+            buffer = _cdtp_server_recv_handshake(client, &msg_size);
+        }
+    }
+
+    if (buffer != NULL) {
+        if (msg_size >= 1 + CDTP_ECDH_PUBLIC_KEY_SIZE && msg_size <= 3 + CDTP_ECDH_PUBLIC_KEY_SIZE &&
+            buffer[0] == (char) CDTP_HANDSHAKE_ECDH) {
+            int cipher = msg_size >= 2 + CDTP_ECDH_PUBLIC_KEY_SIZE ?
+                         (int) ((unsigned char) buffer[1 + CDTP_ECDH_PUBLIC_KEY_SIZE]) :
+                         CDTP_CIPHER_AES_256_CBC;
+            wants_ticket = msg_size == 3 + CDTP_ECDH_PUBLIC_KEY_SIZE &&
+                           (buffer[2 + CDTP_ECDH_PUBLIC_KEY_SIZE] & CDTP_HANDSHAKE_WANTS_TICKET) != 0;
+            *wants_shared_memory = msg_size == 3 + CDTP_ECDH_PUBLIC_KEY_SIZE &&
+                                   (buffer[2 + CDTP_ECDH_PUBLIC_KEY_SIZE] & CDTP_HANDSHAKE_WANTS_SHARED_MEMORY) != 0;
+
+            if (_cdtp_crypto_cipher_supported(cipher)) {
+                client->key = _cdtp_crypto_ecdh_aes_key(ecdh_keys, buffer + 1, true, (CDTPCipher) cipher);
+            }
+        }
+        else if (rsa_keys != NULL) {
+            CDTPCryptoData *key_data = _cdtp_crypto_rsa_decrypt(rsa_keys->private_key, buffer, msg_size);
+
+            if (key_data != NULL) {
+                client->key = _cdtp_crypto_aes_key_from(key_data->data, key_data->data_size);
+                _cdtp_crypto_data_free(key_data);
+            }
+        }
+    }
+
+    if (rsa_keys != NULL) {
+        _cdtp_server_release_key_pair(server, rsa_keys);
+    }
+
+    _cdtp_crypto_ecdh_key_pair_free(ecdh_keys);
+    free(buffer);
+
+    if (client->key != NULL && wants_ticket && !_cdtp_server_send_ticket(server, client)) {
+        _cdtp_crypto_aes_key_free(client->key);
+        client->key = NULL;
+    }
+
+    return client->key != NULL;
+}
+
+/**
+ * Answer a client that asked to send and receive messages through shared memory.
+ *
+ * @param server The socket server.
+ * @param client The client socket.
+ * @return If the client was answered.
+ *
+ * Shared memory is offered if the server uses it and the client is connected to a Unix domain socket. The client
+ * replies with a single status byte, which is 1 if it mapped the shared memory, and only then is the socket's ring used.
+ * Failing to set up shared memory is not an error, since messages can still be sent through the socket.
+ */
+bool _cdtp_server_offer_shared_memory(CDTPServer *server, CDTPSocket *client)
+{
+    CDTPSharedMemory *shm = server->shm_ring_size > 0 && client->address.ss_family == AF_UNIX ?
+                            _cdtp_shm(server->shm_ring_size) :
+                            NULL;
+
+    if (!_cdtp_shm_offer(client, shm)) {
+        if (shm != NULL) {
+            _cdtp_shm_free(shm);
+        }
+
+        return false;
+    }
+
+    if (shm == NULL) {
+        return true;
+    }
+
+    size_t msg_size;
+    char *buffer = _cdtp_server_recv_handshake(client, &msg_size);
+    bool answered = buffer != NULL && msg_size == 1;
+
+    if (answered && buffer[0] == (char) 1) {
+        client->shm = shm;
+    }
+    else {
+        _cdtp_shm_free(shm);
+    }
+
+    free(buffer);
+
+    return answered;
+}
+
+/**
+ * A newly accepted client connection, waiting for its key exchange.
+ */
+typedef struct _CDTPServerHandshake {
+    CDTPServerReactor *reactor;
+    CDTPSocket *sock;
+} CDTPServerHandshake;
+
+/**
+ * Exchange keys with a newly accepted client, then add it to the server. This runs on a handshake thread, so slow
+ * clients and key generation never hold up the I/O threads.
+ *
+ * @param handshake_ptr The accepted client connection.
+ */
+void _cdtp_server_handshake(void *handshake_ptr)
+{
+    CDTPServerHandshake *handshake = (CDTPServerHandshake *) handshake_ptr;
+    CDTPServerReactor *reactor = handshake->reactor;
+    CDTPServer *server = reactor->server;
+    CDTPSocket *client = handshake->sock;
+    free(handshake);
+
+    // Exchange keys over a blocking socket, giving up on clients that take too long to respond
+    bool wants_shared_memory = false;
+    bool exchanged = server->serving &&
+                     _cdtp_server_set_blocking(client, true, CDTP_HANDSHAKE_TIMEOUT) &&
+                     (server->plaintext ?
+                      _cdtp_server_exchange_plaintext(client, &wants_shared_memory) :
+                      _cdtp_server_exchange_keys(server, client, &wants_shared_memory)) &&
+                     (!wants_shared_memory || _cdtp_server_offer_shared_memory(server, client)) &&
+                     _cdtp_server_set_blocking(client, false, 0);
+    size_t client_id = 0;
+
+    // Run the client's events one at a time, if the server dispatches events in order
+    if (exchanged && server->dispatch_mode == CDTP_DISPATCH_ORDERED) {
+        client->strand = _cdtp_strand(server->event_pool);
+    }
+
+    // Add the client to the client map, which holds a reference of its own, since the client can be removed as soon as
+    // it is added
+    if (exchanged && server->serving) {
+        client->refs++;
+        client_id = _cdtp_client_map_add(server->clients, client);
+        exchanged = client_id != CDTP_CLIENT_MAP_INVALID_ID;
+
+        if (!exchanged) {
+            client->refs--;
+        }
+    }
+    else {
+        exchanged = false;
+    }
+
+    if (!exchanged) {
+        _cdtp_server_release_client(client);
+        return;
+    }
+
+    // Queue the connect event before the I/O thread can see the client's first message, then start watching the client
+    // for messages on the I/O thread that accepted it, unless it has already been removed
+    _cdtp_server_call_on_connect(server, client_id, client);
+
+    bool watched = true;
+
+    if (_cdtp_client_map_acquire(server->clients, client_id) != NULL) {
+        watched = _cdtp_reactor_add(reactor->reactor, client, client_id);
+
+        if (watched) {
+            _cdtp_send_buffer_watch(client->send_buffer, client, reactor->reactor, client_id);
+        }
+
+        _cdtp_client_map_release(server->clients, client_id);
+    }
+
+    if (!watched) {
+        _cdtp_server_disconnect_sock(server, client_id);
+    }
+
+    _cdtp_server_release_client(client);
+}
+
+/**
+ * Accept all pending connections on an I/O thread's listening socket.
+ *
+ * @param reactor The server I/O thread.
+ * @return If the server should keep serving.
+ */
+bool _cdtp_server_accept(CDTPServerReactor *reactor)
+{
+    CDTPServer *server = reactor->server;
+    struct sockaddr_storage address;
+    int addrlen;
+
+#ifdef _WIN32
+    SOCKET new_sock;
+#else
+    int new_sock;
+#endif
+
+    while (server->serving) {
+        addrlen = sizeof(address);
+
+#ifdef _WIN32
+        new_sock = accept(reactor->sock->sock, (struct sockaddr *) (&address), (int *) (&addrlen));
+
+        if (new_sock == INVALID_SOCKET) {
+            int err_code = WSAGetLastError();
+
+            if (err_code == WSAEWOULDBLOCK) {
+                // No more pending connections
+                return true;
+            }
+            else if (err_code != WSAENOTSOCK || server->serving) {
+                _cdtp_set_error(CDTP_SOCKET_ACCEPT_FAILED, err_code);
+                return false;
+            }
+            else {
+                return false;
+            }
+        }
+#else
+        new_sock = accept(reactor->sock->sock, (struct sockaddr *) (&address), (socklen_t *) (&addrlen));
+
+        if (new_sock < 0) {
             int err_code = errno;
 
             if (CDTP_EAGAIN_OR_WOULDBLOCK(err_code)) {
-                // No new connections, do nothing
+                // No more pending connections
+                return true;
             }
             else if (err_code != ENOTSOCK || server->serving) {
                 _cdtp_set_error(CDTP_SOCKET_ACCEPT_FAILED, err_code);
-                return;
+                return false;
             }
             else {
-                return;
+                return false;
             }
         }
+#endif
+
+        // Create the new client object
+        CDTPSocket *new_client = (CDTPSocket *) malloc(sizeof(CDTPSocket));
+        new_client->sock = new_sock;
+        memcpy(&(new_client->address), &address, sizeof(address));
+        new_client->address_size = (socklen_t) addrlen;
+        new_client->key = NULL;
+        new_client->shm = NULL;
+        new_client->recv_buffer = _cdtp_recv_buffer(server->max_message_size);
+        new_client->send_buffer = _cdtp_send_buffer(server->send_low_watermark, server->send_high_watermark);
+        new_client->reactor_index = reactor->index;
+        new_client->strand = NULL;
+        new_client->refs = 1;
+
+        // Hand the client off for its key exchange
+        CDTPServerHandshake *handshake = (CDTPServerHandshake *) malloc(sizeof(CDTPServerHandshake));
+        handshake->reactor = reactor;
+        handshake->sock = new_client;
+        _cdtp_thread_pool_submit(server->handshake_pool, _cdtp_server_handshake, handshake);
+    }
+
+    return false;
+}
+
+/**
+ * Disconnect a client that has closed its connection, calling the `on_disconnect` event function.
+ *
+ * @param server The socket server.
+ * @param client_id The ID of the client that disconnected.
+ */
+void _cdtp_server_client_disconnected(CDTPServer *server, size_t client_id)
+{
+    _cdtp_server_disconnect_sock(server, client_id);
+}
+
+/**
+ * Receive messages from a client whose socket is readable.
+ *
+ * @param server The socket server.
+ * @param client_id The ID of the client.
+ * @return If the server should keep serving.
+ */
+bool _cdtp_server_recv(CDTPServer *server, size_t client_id)
+{
+    // Hold the client, since an event function may remove it on another thread while it is being read from
+    CDTPSocket *client_sock = _cdtp_server_hold_client(server, client_id);
+
+    // The client may have been removed since the event was reported
+    if (client_sock == NULL) {
+        return true;
+    }
+
+    bool keep_serving = true;
+    int recv_code = _cdtp_recv_buffer_read(client_sock->recv_buffer, client_sock);
+
+    // Reading from shared memory also sends queued data, since the doorbell rings when the client makes room for it
+    if (client_sock->shm != NULL && _cdtp_send_buffer_take_unblocked(client_sock->send_buffer)) {
+        _cdtp_server_call_on_writable(server, client_id, client_sock);
+    }
+
+    if (recv_code == 0) {
+        _cdtp_server_client_disconnected(server, client_id);
+    }
+    else if (recv_code < 0) {
+#ifdef _WIN32
+        int err_code = WSAGetLastError();
+
+        // A client that sent too large a message is disconnected
+        if (err_code == WSAECONNRESET || err_code == WSAENOTSOCK || err_code == WSAEMSGSIZE || err_code == WSAENOBUFS) {
+            _cdtp_server_client_disconnected(server, client_id);
+        }
+        else if (err_code == WSAEWOULDBLOCK) {
+            // Nothing happened on the socket, do nothing
+        }
         else {
-            size_t client_id = _cdtp_server_new_client_id(server);
+            _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
+            keep_serving = false;
+        }
+#else
+        int err_code = errno;
 
-            // Set blocking for key exchange
-            if (fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL, 0) & ~O_NONBLOCK) == -1) {
-                _cdtp_set_err(CDTP_SOCKET_ACCEPT_FAILED);
-                return;
+        // A client that corrupted its shared memory or sent too large a message is treated as having gone away
+        if (err_code == EBADF || err_code == ECONNRESET || err_code == EPROTO || err_code == EMSGSIZE ||
+            err_code == ENOBUFS) {
+            _cdtp_server_client_disconnected(server, client_id);
+        }
+        else if (CDTP_EAGAIN_OR_WOULDBLOCK(err_code)) {
+            // Nothing happened on the socket, do nothing
+        }
+        else {
+            _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
+            keep_serving = false;
+        }
+#endif
+    }
+    else {
+        // Handle every complete message received so far, leaving any partial message for the next read
+        void *data;
+        size_t data_size;
+
+        while (_cdtp_recv_buffer_next(client_sock->recv_buffer, &data, &data_size)) {
+            _cdtp_server_call_on_recv(server, client_id, client_sock, data, data_size);
+
+            // An inline event function may have removed the client or stopped the server
+            if (server->dispatch_mode == CDTP_DISPATCH_INLINE &&
+                (!server->serving || _cdtp_client_map_get(server->clients, client_id) != client_sock)) {
+                break;
             }
+        }
+    }
 
-            // Create the new client object
-            CDTPSocket *new_client = (CDTPSocket *) malloc(sizeof(CDTPSocket));
-            new_client->sock = new_sock;
-            memcpy(&(new_client->address), &address, sizeof(address));
+    _cdtp_server_release_client(client_sock);
 
-            // Exchange keys
-            if (!_cdtp_server_exchange_keys(new_client)) {
-                return;
+    return keep_serving;
+}
+
+/**
+ * Send queued data to a client whose socket is writable, calling the `on_writable` event function if sending to the
+ * client was being refused and is now allowed again.
+ *
+ * @param server The socket server.
+ * @param client_id The ID of the client.
+ */
+void _cdtp_server_flush(CDTPServer *server, size_t client_id)
+{
+    CDTPSocket *client_sock = _cdtp_server_hold_client(server, client_id);
+
+    // The client may have been removed since the event was reported
+    if (client_sock == NULL) {
+        return;
+    }
+
+    // A failed send means the connection is broken, which the next read reports
+    _cdtp_send_buffer_flush(client_sock->send_buffer, client_sock);
+
+    if (_cdtp_send_buffer_take_unblocked(client_sock->send_buffer)) {
+        _cdtp_server_call_on_writable(server, client_id, client_sock);
+    }
+
+    _cdtp_server_release_client(client_sock);
+}
+
+/**
+ * Serve the clients owned by an I/O thread.
+ *
+ * @param reactor The server I/O thread.
+ */
+void _cdtp_server_serve(CDTPServerReactor *reactor)
+{
+    CDTPServer *server = reactor->server;
+    CDTPReactorEvent events[CDTP_REACTOR_MAX_EVENTS];
+
+    while (server->serving) {
+        int num_events = _cdtp_reactor_wait(reactor->reactor, events, CDTP_REACTOR_MAX_EVENTS);
+
+        // Check if the server has been stopped
+        if (!server->serving) {
+            return;
+        }
+
+        if (num_events == -1) {
+            _cdtp_set_err(CDTP_REACTOR_WAIT_FAILED);
+            return;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            bool keep_serving;
+
+            if (events[i].token == CDTP_REACTOR_LISTENER_TOKEN) {
+                // Accept incoming connections
+                keep_serving = _cdtp_server_accept(reactor);
             }
+            else {
+                keep_serving = true;
 
-            // Set non-blocking
-            if (fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
-                _cdtp_set_err(CDTP_SOCKET_ACCEPT_FAILED);
+                // Send queued data to the client socket
+                if (events[i].writable) {
+                    _cdtp_server_flush(server, events[i].token);
+                }
+
+                // Check for messages from the client socket
+                if (events[i].readable) {
+                    keep_serving = _cdtp_server_recv(server, events[i].token);
+                }
+            }
+
+            if (!keep_serving || !server->serving) {
                 return;
             }
+        }
+    }
+}
 
-            // Add the new socket to the client map
-            _cdtp_client_map_set(server->clients, client_id, new_client);
-            _cdtp_server_call_on_connect(server, client_id);
+/**
+ * Create a listening socket bound to the same address as the server's own, for an additional I/O thread.
+ *
+ * @param server The socket server.
+ * @return The listening socket, or NULL if it could not be created.
+ *
+ * A Unix domain socket's path cannot be bound more than once, so for Unix domain servers, the listening socket is
+ * instead a duplicate of the server's own, and the I/O threads take turns accepting from it.
+ */
+CDTPSocket *_cdtp_server_listener(CDTPServer *server)
+{
+    CDTPSocket *sock = (CDTPSocket *) malloc(sizeof(CDTPSocket));
+    int opt = 1;
+
+    memcpy(&(sock->address), &(server->sock->address), sizeof(sock->address));
+    sock->address_size = server->sock->address_size;
+    sock->key = NULL;
+    sock->shm = NULL;
+    sock->recv_buffer = NULL;
+    sock->send_buffer = NULL;
+
+#ifndef _WIN32
+    if (server->sock->address.ss_family == AF_UNIX) {
+        if ((sock->sock = dup(server->sock->sock)) < 0) {
+            _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+            free(sock);
+            return NULL;
         }
+
+        return sock;
+    }
+#endif
+
+#ifdef _WIN32
+    if ((sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        free(sock);
+        return NULL;
+    }
+    if (setsockopt(sock->sock, SOL_SOCKET, SO_REUSEADDR, (char *) (&opt), sizeof(opt)) == SOCKET_ERROR) {
+        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
+        closesocket(sock->sock);
+        free(sock);
+        return NULL;
+    }
+#else
+    if ((sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) < 0) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        free(sock);
+        return NULL;
+    }
+    if (setsockopt(sock->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(sock->sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
+        close(sock->sock);
+        free(sock);
+        return NULL;
+    }
+#endif
+
+    if (bind(sock->sock, (struct sockaddr *) (&(sock->address)), sock->address_size) < 0) {
+        _cdtp_set_err(CDTP_SERVER_BIND_FAILED);
+#ifdef _WIN32
+        closesocket(sock->sock);
+#else
+        close(sock->sock);
+#endif
+        free(sock);
+        return NULL;
+    }
+
+    return sock;
+}
+
+/**
+ * Start listening on an I/O thread's socket and watch it for incoming connections.
+ *
+ * @param reactor The server I/O thread.
+ * @return If the I/O thread is ready to serve.
+ */
+bool _cdtp_server_listen(CDTPServerReactor *reactor)
+{
+    // Listen for connections
+    if (listen(reactor->sock->sock, CDTP_SERVER_LISTEN_BACKLOG) < 0) {
+        _cdtp_set_err(CDTP_SERVER_LISTEN_FAILED);
+        return false;
+    }
+
+    // Set non-blocking and watch for incoming connections
+#ifdef _WIN32
+    unsigned long mode = 1;
+
+    if (ioctlsocket(reactor->sock->sock, FIONBIO, &mode) != 0) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return false;
+    }
+#else
+    if (fcntl(reactor->sock->sock, F_SETFL, fcntl(reactor->sock->sock, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return false;
+    }
+#endif
+
+    return _cdtp_reactor_add(reactor->reactor, reactor->sock, CDTP_REACTOR_LISTENER_TOKEN);
+}
+
+/**
+ * Call the serve function on each I/O thread.
+ *
+ * @param server The socket server.
+ */
+void _cdtp_server_call_serve(CDTPServer *server)
+{
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        server->reactors[i].serve_thread = _cdtp_start_serve_thread(_cdtp_server_serve, &(server->reactors[i]));
+    }
+}
+
+CDTP_EXPORT CDTPServer *cdtp_server(
+    ServerOnRecvCallback on_recv,
+    ServerOnConnectCallback on_connect,
+    ServerOnDisconnectCallback on_disconnect,
+    void *on_recv_arg,
+    void *on_connect_arg,
+    void *on_disconnect_arg
+)
+{
+    CDTPServer *server = (CDTPServer *) malloc(sizeof(CDTPServer));
+
+    // Initialize the server object
+    server->on_recv = on_recv;
+    server->on_connect = on_connect;
+    server->on_disconnect = on_disconnect;
+    server->on_writable = NULL;
+    server->on_recv_arg = on_recv_arg;
+    server->on_connect_arg = on_connect_arg;
+    server->on_disconnect_arg = on_disconnect_arg;
+    server->on_writable_arg = NULL;
+    server->serving = false;
+    server->done = false;
+    server->clients = _cdtp_client_map();
+    server->num_io_threads = CDTP_SERVER_IO_THREADS > 0 ? CDTP_SERVER_IO_THREADS : _cdtp_cpu_count();
+    server->num_reactors = 0;
+    server->reactors = NULL;
+    server->num_handshake_threads = CDTP_SERVER_HANDSHAKE_THREADS > 0 ? CDTP_SERVER_HANDSHAKE_THREADS : _cdtp_cpu_count();
+    server->handshake_pool = NULL;
+    server->num_event_threads = CDTP_SERVER_EVENT_THREADS > 0 ? CDTP_SERVER_EVENT_THREADS : _cdtp_cpu_count();
+    server->max_queued_events = CDTP_EVENT_QUEUE_SIZE;
+    server->event_pool = NULL;
+    server->dispatch_mode = CDTP_DISPATCH_ORDERED;
+    server->legacy_handshake = false;
+    server->key_mode = CDTP_KEY_MODE_PER_CONNECTION;
+    server->key_pool_size = CDTP_SERVER_KEY_POOL_SIZE;
+    server->key_pool = NULL;
+    server->key_pair = NULL;
+    server->send_low_watermark = CDTP_SEND_LOW_WATERMARK;
+    server->send_high_watermark = CDTP_SEND_HIGH_WATERMARK;
+    server->max_message_size = CDTP_MAX_MESSAGE_SIZE;
+    server->ticket_lifetime = 0;
+    server->plaintext = false;
+    server->shm_ring_size = 0;
+
+    // Initialize the library
+    if (!CDTP_INIT) {
+        int return_code = _cdtp_init();
+
+        if (return_code != 0) {
+            _cdtp_set_error(CDTP_WINSOCK_INIT_FAILED, return_code);
+            return NULL;
+        }
+    }
+
+    // Initialize the server socket
+    server->sock = (CDTPSocket *) malloc(sizeof(CDTPSocket));
+
+    // Initialize the socket info
+    int opt = 1;
+
+#ifdef _WIN32
+    // Initialize the socket
+    if ((server->sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return NULL;
+    }
+    if (setsockopt(server->sock->sock, SOL_SOCKET, SO_REUSEADDR, (char *) (&opt), sizeof(opt)) == SOCKET_ERROR) {
+        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
+        return NULL;
+    }
+#else
+    // Initialize the socket
+    if ((server->sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) == 0) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return NULL;
+    }
+    if (setsockopt(server->sock->sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server->sock->sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
+        return NULL;
+    }
 #endif
 
-        // Check for messages from client sockets
-        CDTPClientMapIter *iter = _cdtp_client_map_iter(server->clients);
+    server->sock->key = NULL;
+    server->sock->shm = NULL;
+    server->sock->recv_buffer = NULL;
+    server->sock->send_buffer = NULL;
+
+    return server;
+}
+
+CDTP_EXPORT void cdtp_server_set_io_threads(CDTPServer *server, size_t num_threads)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->num_io_threads = num_threads > 0 ? num_threads : _cdtp_cpu_count();
+}
+
+CDTP_EXPORT void cdtp_server_set_handshake_threads(CDTPServer *server, size_t num_threads)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->num_handshake_threads = num_threads > 0 ? num_threads : _cdtp_cpu_count();
+}
+
+CDTP_EXPORT void cdtp_server_set_event_threads(CDTPServer *server, size_t num_threads, size_t max_queued_events)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->num_event_threads = num_threads > 0 ? num_threads : _cdtp_cpu_count();
+    server->max_queued_events = max_queued_events;
+}
+
+CDTP_EXPORT void cdtp_server_set_dispatch_mode(CDTPServer *server, CDTPDispatchMode dispatch_mode)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->dispatch_mode = dispatch_mode;
+}
+
+CDTP_EXPORT void cdtp_server_set_legacy_handshake(CDTPServer *server, bool legacy_handshake)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->legacy_handshake = legacy_handshake;
+}
+
+CDTP_EXPORT void cdtp_server_set_key_mode(CDTPServer *server, CDTPKeyMode key_mode, size_t key_pool_size)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->key_mode = key_mode;
+    server->key_pool_size = key_pool_size > 0 ? key_pool_size : CDTP_SERVER_KEY_POOL_SIZE;
+}
+
+CDTP_EXPORT void cdtp_server_set_send_watermarks(CDTPServer *server, size_t low_watermark, size_t high_watermark)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->send_low_watermark = low_watermark < high_watermark ? low_watermark : high_watermark;
+    server->send_high_watermark = high_watermark;
+}
+
+CDTP_EXPORT void cdtp_server_set_on_writable(CDTPServer *server, ServerOnWritableCallback on_writable, void *on_writable_arg)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->on_writable = on_writable;
+    server->on_writable_arg = on_writable_arg;
+}
+
+CDTP_EXPORT void cdtp_server_set_max_message_size(CDTPServer *server, size_t max_message_size)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->max_message_size = max_message_size;
+}
+
+CDTP_EXPORT void cdtp_server_set_resumption(CDTPServer *server, bool resumption, double ticket_lifetime)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->ticket_lifetime = !resumption ? 0 : ticket_lifetime > 0 ? ticket_lifetime : CDTP_SERVER_TICKET_LIFETIME;
+}
+
+CDTP_EXPORT void cdtp_server_set_plaintext(CDTPServer *server, bool plaintext)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->plaintext = plaintext;
+}
+
+CDTP_EXPORT void cdtp_server_set_shared_memory(CDTPServer *server, bool shared_memory, size_t ring_size)
+{
+    // Make sure the server has not been started
+    if (server->serving || server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_CONFIGURE, 0);
+        return;
+    }
+
+    server->shm_ring_size = !shared_memory ? 0 : ring_size > 0 ? ring_size : CDTP_SHM_RING_SIZE;
+}
+
+/**
+ * Check that the server can be started.
+ *
+ * @param server The socket server.
+ * @return If the server has never been started.
+ */
+bool _cdtp_server_can_start(CDTPServer *server)
+{
+    // Make sure the server has not been run before
+    if (server->done) {
+        _cdtp_set_error(CDTP_SERVER_CANNOT_RESTART, 0);
+        return false;
+    }
+
+    // Make sure the server is not already serving
+    if (server->serving) {
+        _cdtp_set_error(CDTP_SERVER_ALREADY_SERVING, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Undo a server start that failed after the server's socket was bound, so that the server is left as it was before.
+ *
+ * @param server The socket server.
+ */
+void _cdtp_server_unwind_start(CDTPServer *server)
+{
+    if (server->event_pool != NULL) {
+        _cdtp_thread_pool_free(server->event_pool);
+        server->event_pool = NULL;
+    }
 
-        for (size_t i = 0; i < iter->size; i++) {
-            size_t client_id = iter->clients[i]->client_id;
-            CDTPSocket *client_sock = iter->clients[i]->sock;
+    if (server->key_pool != NULL) {
+        _cdtp_key_pool_free(server->key_pool);
+        server->key_pool = NULL;
+    }
 
-#ifdef _WIN32
-            recv_code = recv(client_sock->sock, (char *) size_buffer, CDTP_LENSIZE, 0);
+    if (server->key_pair != NULL) {
+        _cdtp_crypto_rsa_key_pair_free(server->key_pair);
+        server->key_pair = NULL;
+    }
 
-            if (recv_code == SOCKET_ERROR) {
-                int err_code = WSAGetLastError();
+    // Free the I/O threads' reactors and close their listening sockets, except for the server's own socket
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        _cdtp_reactor_free(server->reactors[i].reactor);
 
-                if (err_code == WSAECONNRESET || err_code == WSAENOTSOCK) {
-                    if (_cdtp_client_map_contains(server->clients, client_id)) {
-                        _cdtp_server_disconnect_sock(server, client_id);
-                        _cdtp_server_call_on_disconnect(server, client_id);
-                    }
-                }
-                else if (err_code == WSAEWOULDBLOCK) {
-                    // Nothing happened on the socket, do nothing
-                }
-                else {
-                    _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
-                    return;
-                }
-            }
-            else if (recv_code == 0) {
-                if (_cdtp_client_map_contains(server->clients, client_id)) {
-                    _cdtp_server_disconnect_sock(server, client_id);
-                    _cdtp_server_call_on_disconnect(server, client_id);
-                }
-            }
-            else {
-                size_t msg_size = _cdtp_decode_message_size(size_buffer);
-                unsigned char *buffer = (unsigned char *) malloc(msg_size * sizeof(unsigned char));
-
-                // Wait in case the message is sent in multiple chunks
-                cdtp_sleep(CDTP_SLEEP_TIME);
-
-                recv_code = recv(client_sock->sock, (char *) buffer, msg_size, 0);
-
-                if (recv_code == SOCKET_ERROR) {
-                    int err_code = WSAGetLastError();
-
-                    if (err_code == WSAECONNRESET || err_code == WSAENOTSOCK) {
-                        if (_cdtp_client_map_contains(server->clients, client_id)) {
-                            _cdtp_server_disconnect_sock(server, client_id);
-                            _cdtp_server_call_on_disconnect(server, client_id);
-                        }
-                    }
-                    else {
-                        _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
-                        return;
-                    }
-                }
-                else if (recv_code == 0) {
-                    if (_cdtp_client_map_contains(server->clients, client_id)) {
-                        _cdtp_server_disconnect_sock(server, client_id);
-                        _cdtp_server_call_on_disconnect(server, client_id);
-                    }
-                }
-                else if (((size_t) recv_code) != msg_size) {
-                    _cdtp_set_err(CDTP_SERVER_RECV_FAILED);
-                    return;
-                }
-                else {
-                    _cdtp_server_call_on_recv(server, client_id, (void *) buffer, msg_size);
-                }
-            }
+        if (i > 0) {
+#ifdef _WIN32
+            closesocket(server->reactors[i].sock->sock);
 #else
-            recv_code = read(client_sock->sock, (char *) size_buffer, CDTP_LENSIZE);
-
-            if (recv_code == 0) {
-                if (_cdtp_client_map_contains(server->clients, client_id)) {
-                    _cdtp_server_disconnect_sock(server, client_id);
-                    _cdtp_server_call_on_disconnect(server, client_id);
-                }
-            }
-            else if (recv_code == -1) {
-                int err_code = errno;
-
-                if (err_code == EBADF) {
-                    if (_cdtp_client_map_contains(server->clients, client_id)) {
-                        _cdtp_server_disconnect_sock(server, client_id);
-                        _cdtp_server_call_on_disconnect(server, client_id);
-                    }
-                }
-                else if (CDTP_EAGAIN_OR_WOULDBLOCK(err_code)) {
-                    // Nothing happened on the socket, do nothing
-                }
-                else {
-                    _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
-                    return;
-                }
-            }
-            else {
-                size_t msg_size = _cdtp_decode_message_size(size_buffer);
-                unsigned char *buffer = (unsigned char *) malloc(msg_size * sizeof(unsigned char));
-
-                // Wait in case the message is sent in multiple chunks
-                cdtp_sleep(CDTP_SLEEP_TIME);
-
-                recv_code = read(client_sock->sock, (char *) buffer, msg_size);
-
-                if (recv_code == -1) {
-                    int err_code = errno;
-
-                    if (err_code == EBADF) {
-                        if (_cdtp_client_map_contains(server->clients, client_id)) {
-                            _cdtp_server_disconnect_sock(server, client_id);
-                            _cdtp_server_call_on_disconnect(server, client_id);
-                        }
-                    } else {
-                        _cdtp_set_error(CDTP_SERVER_RECV_FAILED, err_code);
-                        return;
-                    }
-                }
-                else if (recv_code == 0) {
-                    if (_cdtp_client_map_contains(server->clients, client_id)) {
-                        _cdtp_server_disconnect_sock(server, client_id);
-                        _cdtp_server_call_on_disconnect(server, client_id);
-                    }
-                }
-                else if (((size_t) recv_code) != msg_size) {
-                    _cdtp_set_err(CDTP_SERVER_RECV_FAILED);
-                    return;
-                }
-                else {
-                    _cdtp_server_call_on_recv(server, client_id, (void *) buffer, msg_size);
-                }
-            }
+            close(server->reactors[i].sock->sock);
 #endif
+            free(server->reactors[i].sock);
         }
+    }
 
-        _cdtp_client_map_iter_free(iter);
+    free(server->reactors);
+    server->reactors = NULL;
+    server->num_reactors = 0;
 
-        cdtp_sleep(CDTP_SLEEP_TIME);
+    // Remove the Unix domain socket's path, which was created when the socket was bound
+    if (server->sock->address.ss_family == AF_UNIX) {
+#ifdef _WIN32
+        DeleteFileA(((struct sockaddr_un *) (&(server->sock->address)))->sun_path);
+#else
+        unlink(((struct sockaddr_un *) (&(server->sock->address)))->sun_path);
+#endif
     }
 }
 
 /**
- * Call the serve function.
+ * Bind the server to its address and start serving.
  *
- * @param server The socket server.
+ * @param server The socket server, whose socket's address has been set.
  */
-void _cdtp_server_call_serve(CDTPServer *server)
+void _cdtp_server_start(CDTPServer *server)
 {
-    server->serve_thread = _cdtp_start_serve_thread(_cdtp_server_serve, server);
-}
+    // Bind the address to the server
+    if (bind(server->sock->sock, (struct sockaddr *) (&(server->sock->address)), server->sock->address_size) < 0) {
+        _cdtp_set_err(CDTP_SERVER_BIND_FAILED);
+        return;
+    }
 
-CDTP_EXPORT CDTPServer *cdtp_server(
-    ServerOnRecvCallback on_recv,
-    ServerOnConnectCallback on_connect,
-    ServerOnDisconnectCallback on_disconnect,
-    void *on_recv_arg,
-    void *on_connect_arg,
-    void *on_disconnect_arg
-)
-{
-    CDTPServer *server = (CDTPServer *) malloc(sizeof(CDTPServer));
+    // Record the bound port, so additional listeners share it even if an ephemeral port was requested
+    socklen_t bound_len = sizeof(server->sock->address);
 
-    // Initialize the server object
-    server->on_recv = on_recv;
-    server->on_connect = on_connect;
-    server->on_disconnect = on_disconnect;
-    server->on_recv_arg = on_recv_arg;
-    server->on_connect_arg = on_connect_arg;
-    server->on_disconnect_arg = on_disconnect_arg;
-    server->serving = false;
-    server->done = false;
-    server->clients = _cdtp_client_map();
-    server->next_client_id = 0;
+    if (getsockname(server->sock->sock, (struct sockaddr *) (&(server->sock->address)), &bound_len) != 0) {
+        _cdtp_set_err(CDTP_SERVER_ADDRESS_FAILED);
+        _cdtp_server_unwind_start(server);
+        return;
+    }
 
-    // Initialize the library
-    if (!CDTP_INIT) {
-        int return_code = _cdtp_init();
+    // Set up the I/O threads, each with its own listening socket and event reactor. The kernel balances incoming
+    // connections across the listeners, and each client is then served by the thread that accepted it. Windows cannot
+    // balance connections across sockets sharing a port, so it always uses a single I/O thread. Unix domain servers
+    // cannot bind their path more than once, so their listeners share one socket (see `_cdtp_server_listener`).
+#ifdef _WIN32
+    size_t num_reactors = 1;
+#else
+    size_t num_reactors = server->num_io_threads;
+#endif
 
-        if (return_code != 0) {
-            _cdtp_set_error(CDTP_WINSOCK_INIT_FAILED, return_code);
-            return NULL;
+    server->reactors = (CDTPServerReactor *) malloc(num_reactors * sizeof(CDTPServerReactor));
+
+    for (size_t i = 0; i < num_reactors; i++) {
+        CDTPServerReactor *reactor = &(server->reactors[i]);
+        reactor->server = server;
+        reactor->index = i;
+
+        if ((reactor->reactor = _cdtp_reactor()) == NULL) {
+            _cdtp_server_unwind_start(server);
+            return;
         }
-    }
 
-    // Initialize the server socket
-    server->sock = (CDTPSocket *) malloc(sizeof(CDTPSocket));
+        if (i == 0) {
+            reactor->sock = server->sock;
+        }
+        else if ((reactor->sock = _cdtp_server_listener(server)) == NULL) {
+            _cdtp_reactor_free(reactor->reactor);
+            _cdtp_server_unwind_start(server);
+            return;
+        }
 
-    // Initialize the socket info
-    int opt = 1;
+        server->num_reactors++;
 
-#ifdef _WIN32
-    // Initialize the socket
-    if ((server->sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) == INVALID_SOCKET) {
-        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
-        return NULL;
+        if (!_cdtp_server_listen(reactor)) {
+            _cdtp_server_unwind_start(server);
+            return;
+        }
     }
-    if (setsockopt(server->sock->sock, SOL_SOCKET, SO_REUSEADDR, (char *) (&opt), sizeof(opt)) == SOCKET_ERROR) {
-        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
-        return NULL;
+
+    // Prepare the RSA keys used for legacy key exchanges
+    switch (server->legacy_handshake && !server->plaintext ? server->key_mode : CDTP_KEY_MODE_PER_CONNECTION) {
+        case CDTP_KEY_MODE_POOL:
+            if ((server->key_pool = _cdtp_key_pool(server->key_pool_size)) == NULL) {
+                _cdtp_server_unwind_start(server);
+                return;
+            }
+
+            break;
+        case CDTP_KEY_MODE_PERSISTENT:
+            if ((server->key_pair = _cdtp_crypto_rsa_key_pair()) == NULL) {
+                _cdtp_server_unwind_start(server);
+                return;
+            }
+
+            break;
+        case CDTP_KEY_MODE_PER_CONNECTION:
+        default:
+            break;
     }
-#else
-    // Initialize the socket
-    if ((server->sock->sock = socket(CDTP_ADDRESS_FAMILY, SOCK_STREAM, 0)) == 0) {
-        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
-        return NULL;
+
+    // Generate the key that seals resumption tickets, so tickets from before the server started are never accepted
+    if (server->ticket_lifetime > 0 && !server->plaintext &&
+        RAND_bytes((unsigned char *) (server->ticket_key), CDTP_AES_KEY_SIZE) == 0) {
+        _cdtp_set_error(CDTP_OPENSSL_ERROR, ERR_get_error());
+        _cdtp_server_unwind_start(server);
+        return;
     }
-    if (setsockopt(server->sock->sock, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
-        _cdtp_set_err(CDTP_SERVER_SETSOCKOPT_FAILED);
-        return NULL;
+
+    // Start the event and key exchange threads, with event functions called directly if they are dispatched inline
+    if (server->dispatch_mode != CDTP_DISPATCH_INLINE &&
+        (server->event_pool = _cdtp_thread_pool(server->num_event_threads, server->max_queued_events)) == NULL) {
+        _cdtp_server_unwind_start(server);
+        return;
     }
-#endif
 
-    server->sock->key = NULL;
+    if ((server->handshake_pool = _cdtp_thread_pool(server->num_handshake_threads, 0)) == NULL) {
+        _cdtp_server_unwind_start(server);
+        return;
+    }
 
-    return server;
+    // Serve
+    server->serving = true;
+    _cdtp_server_call_serve(server);
 }
 
 CDTP_EXPORT void cdtp_server_start(CDTPServer *server, char *host, unsigned short port)
 {
-    // Make sure the server has not been run before
-    if (server->done) {
-        _cdtp_set_error(CDTP_SERVER_CANNOT_RESTART, 0);
+    if (!_cdtp_server_can_start(server)) {
         return;
     }
 
-    // Make sure the server is not already serving
-    if (server->serving) {
-        _cdtp_set_error(CDTP_SERVER_ALREADY_SERVING, 0);
-        return;
-    }
+    struct sockaddr_in *address = (struct sockaddr_in *) (&(server->sock->address));
 
     // Change 'localhost' to '127.0.0.1'
     if (strcmp(host, "localhost") == 0) {
@@ -555,30 +1668,48 @@ CDTP_EXPORT void cdtp_server_start(CDTPServer *server, char *host, unsigned shor
 
     free(host_wc);
 #else
-    if (inet_pton(CDTP_ADDRESS_FAMILY, host, &(server->sock->address)) != 1) {
+    if (inet_pton(CDTP_ADDRESS_FAMILY, host, &(address->sin_addr)) != 1) {
         _cdtp_set_err(CDTP_SERVER_ADDRESS_FAILED);
         return;
     }
 #endif
 
-    server->sock->address.sin_family = CDTP_ADDRESS_FAMILY;
-    server->sock->address.sin_port = htons(port);
+    address->sin_family = CDTP_ADDRESS_FAMILY;
+    address->sin_port = htons(port);
+    server->sock->address_size = (socklen_t) sizeof(struct sockaddr_in);
 
-    // Bind the address to the server
-    if (bind(server->sock->sock, (struct sockaddr *) (&(server->sock->address)), sizeof(server->sock->address)) < 0) {
-        _cdtp_set_err(CDTP_SERVER_BIND_FAILED);
+    _cdtp_server_start(server);
+}
+
+CDTP_EXPORT void cdtp_server_start_unix(CDTPServer *server, char *path)
+{
+    if (!_cdtp_server_can_start(server)) {
         return;
     }
 
-    // Listen for connections
-    if (listen(server->sock->sock, CDTP_SERVER_LISTEN_BACKLOG) < 0) {
-        _cdtp_set_err(CDTP_SERVER_LISTEN_FAILED);
+    if (!_cdtp_unix_address(&(server->sock->address), &(server->sock->address_size), path)) {
+        _cdtp_set_err(CDTP_SERVER_ADDRESS_FAILED);
         return;
     }
 
-    // Serve
-    server->serving = true;
-    _cdtp_server_call_serve(server);
+    // Replace the server's TCP socket with a Unix domain socket
+#ifdef _WIN32
+    closesocket(server->sock->sock);
+
+    if ((server->sock->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return;
+    }
+#else
+    close(server->sock->sock);
+
+    if ((server->sock->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        _cdtp_set_err(CDTP_SERVER_SOCK_INIT_FAILED);
+        return;
+    }
+#endif
+
+    _cdtp_server_start(server);
 }
 
 CDTP_EXPORT void cdtp_server_stop(CDTPServer *server)
@@ -592,79 +1723,141 @@ CDTP_EXPORT void cdtp_server_stop(CDTPServer *server)
     server->serving = false;
     server->done = true;
 
+    // An event function may be stopping the server, so the I/O threads must not wait for it to make room for events
+    if (server->event_pool != NULL) {
+        _cdtp_thread_pool_close(server->event_pool);
+        _cdtp_client_map_for_each(server->clients, _cdtp_server_close_strand, NULL);
+    }
+
+    // Wake the I/O threads so they notice the server has stopped
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        _cdtp_reactor_wake(server->reactors[i].reactor);
+    }
+
 #ifdef _WIN32
-    // Close sockets
-    CDTPClientMapIter *iter = _cdtp_client_map_iter(server->clients);
+    // Wait for threads to exit
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        HANDLE serve_thread = server->reactors[i].serve_thread;
 
-    for (size_t i = 0; i < iter->size; i++) {
-        if (closesocket(iter->clients[i]->sock->sock) != 0) {
-            _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
-            return;
+        if (GetThreadId(serve_thread) != GetCurrentThreadId()) {
+            if (WaitForSingleObject(serve_thread, INFINITE) == WAIT_FAILED) {
+                _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, GetLastError());
+                return;
+            }
+        } else {
+            if (CloseHandle(serve_thread) == 0) {
+                _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, GetLastError());
+                return;
+            }
         }
+    }
 
-        CDTPSocket *client = _cdtp_client_map_pop(server->clients, iter->clients[i]->client_id);
-        _cdtp_crypto_aes_key_free(client->key);
-        free(client);
+    // Wait for in-progress key exchanges, which will not add clients now that the server has stopped
+    if (!_cdtp_thread_pool_free(server->handshake_pool)) {
+        return;
     }
 
-    _cdtp_client_map_iter_free(iter);
+    server->handshake_pool = NULL;
 
-    if (closesocket(server->sock->sock) != 0) {
+    // Finish handling events, now that no more can be produced
+    if (server->event_pool != NULL && !_cdtp_thread_pool_free(server->event_pool)) {
+        return;
+    }
+
+    server->event_pool = NULL;
+
+    // Free the RSA keys used for key exchanges
+    if (server->key_pool != NULL) {
+        _cdtp_key_pool_free(server->key_pool);
+        server->key_pool = NULL;
+    }
+
+    if (server->key_pair != NULL) {
+        _cdtp_crypto_rsa_key_pair_free(server->key_pair);
+        server->key_pair = NULL;
+    }
+
+    // Close sockets
+    if (!_cdtp_server_close_clients(server)) {
         _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
         return;
     }
 
-    // Wait for threads to exit
-    if (GetThreadId(server->serve_thread) == GetCurrentThreadId()) {
-        if (WaitForSingleObject(server->serve_thread, INFINITE) == WAIT_FAILED) {
-            _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, GetLastError());
-            return;
-        }
-    } else {
-        if (CloseHandle(server->serve_thread) == 0) {
-            _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, GetLastError());
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        if (closesocket(server->reactors[i].sock->sock) != 0) {
+            _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
             return;
         }
     }
 #else
-    // Close sockets
-    CDTPClientMapIter *iter = _cdtp_client_map_iter(server->clients);
+    // Wait for threads to exit
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        pthread_t serve_thread = server->reactors[i].serve_thread;
 
-    for (size_t i = 0; i < iter->size; i++) {
-        if (close(iter->clients[i]->sock->sock) != 0) {
-            _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
-            return;
+        if (pthread_equal(serve_thread, pthread_self()) == 0) {
+            int err_code = pthread_join(serve_thread, NULL);
+
+            if (err_code != 0) {
+                _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, err_code);
+                return;
+            }
+        } else {
+            int err_code = pthread_detach(serve_thread);
+
+            if (err_code != 0) {
+                _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, err_code);
+                return;
+            }
         }
+    }
 
-        CDTPSocket *client = _cdtp_client_map_pop(server->clients, iter->clients[i]->client_id);
-        _cdtp_crypto_aes_key_free(client->key);
-        free(client);
+    // Wait for in-progress key exchanges, which will not add clients now that the server has stopped
+    if (!_cdtp_thread_pool_free(server->handshake_pool)) {
+        return;
     }
 
-    _cdtp_client_map_iter_free(iter);
+    server->handshake_pool = NULL;
 
-    if (close(server->sock->sock) != 0) {
-        _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
+    // Finish handling events, now that no more can be produced
+    if (server->event_pool != NULL && !_cdtp_thread_pool_free(server->event_pool)) {
         return;
     }
 
-    // Wait for threads to exit
-    if (pthread_equal(server->serve_thread, pthread_self()) == 0) {
-        int err_code = pthread_join(server->serve_thread, NULL);
+    server->event_pool = NULL;
 
-        if (err_code != 0) {
-            _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, err_code);
-            return;
-        }
-    } else {
-        int err_code = pthread_detach(server->serve_thread);
+    // Free the RSA keys used for key exchanges
+    if (server->key_pool != NULL) {
+        _cdtp_key_pool_free(server->key_pool);
+        server->key_pool = NULL;
+    }
+
+    if (server->key_pair != NULL) {
+        _cdtp_crypto_rsa_key_pair_free(server->key_pair);
+        server->key_pair = NULL;
+    }
+
+    // Close sockets
+    if (!_cdtp_server_close_clients(server)) {
+        _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
+        return;
+    }
 
-        if (err_code != 0) {
-            _cdtp_set_error(CDTP_SERVE_THREAD_NOT_CLOSING, err_code);
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        if (close(server->reactors[i].sock->sock) != 0) {
+            _cdtp_set_err(CDTP_SERVER_STOP_FAILED);
             return;
         }
     }
 #endif
+
+    // Remove the Unix domain socket's path, so it can be bound again
+    if (server->sock->address.ss_family == AF_UNIX) {
+#ifdef _WIN32
+        DeleteFileA(((struct sockaddr_un *) (&(server->sock->address)))->sun_path);
+#else
+        unlink(((struct sockaddr_un *) (&(server->sock->address)))->sun_path);
+#endif
+    }
 }
 
 CDTP_EXPORT bool cdtp_server_is_serving(CDTPServer *server)
@@ -688,6 +1881,11 @@ CDTP_EXPORT char *cdtp_server_get_host(CDTPServer *server)
         return NULL;
     }
 
+    // Unix domain sockets are identified by their path
+    if (addr.ss_family == AF_UNIX) {
+        return _cdtp_unix_address_path(&addr, len);
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
 
 #ifdef _WIN32
@@ -737,6 +1935,11 @@ CDTP_EXPORT unsigned short cdtp_server_get_port(CDTPServer *server)
         return 0;
     }
 
+    // Unix domain sockets have no port
+    if (addr.ss_family == AF_UNIX) {
+        return 0;
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
     unsigned short port = ntohs(s->sin_port);
 
@@ -751,7 +1954,7 @@ CDTP_EXPORT char *cdtp_server_get_client_host(CDTPServer *server, size_t client_
         return NULL;
     }
 
-    CDTPSocket *client = _cdtp_client_map_get(server->clients, client_id);
+    CDTPSocket *client = _cdtp_client_map_acquire(server->clients, client_id);
 
     // Make sure the client exists
     if (client == NULL) {
@@ -761,12 +1964,19 @@ CDTP_EXPORT char *cdtp_server_get_client_host(CDTPServer *server, size_t client_
 
     struct sockaddr_storage addr;
     socklen_t len = sizeof(addr);
+    int peer_code = getpeername(client->sock, (struct sockaddr *) (&addr), &len);
+    _cdtp_client_map_release(server->clients, client_id);
 
-    if (getpeername(client->sock, (struct sockaddr *) (&addr), &len) != 0) {
+    if (peer_code != 0) {
         _cdtp_set_err(CDTP_CLIENT_ADDRESS_FAILED);
         return NULL;
     }
 
+    // Unix domain sockets are identified by their path
+    if (addr.ss_family == AF_UNIX) {
+        return _cdtp_unix_address_path(&addr, len);
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
 
 #ifdef _WIN32
@@ -808,7 +2018,7 @@ CDTP_EXPORT unsigned short cdtp_server_get_client_port(CDTPServer *server, size_
         return 0;
     }
 
-    CDTPSocket *client = _cdtp_client_map_get(server->clients, client_id);
+    CDTPSocket *client = _cdtp_client_map_acquire(server->clients, client_id);
 
     // Make sure the client exists
     if (client == NULL) {
@@ -818,12 +2028,19 @@ CDTP_EXPORT unsigned short cdtp_server_get_client_port(CDTPServer *server, size_
 
     struct sockaddr_storage addr;
     socklen_t len = sizeof(addr);
+    int peer_code = getpeername(client->sock, (struct sockaddr *) (&addr), &len);
+    _cdtp_client_map_release(server->clients, client_id);
 
-    if (getpeername(client->sock, (struct sockaddr *) (&addr), &len) != 0) {
+    if (peer_code != 0) {
         _cdtp_set_err(CDTP_CLIENT_ADDRESS_FAILED);
         return 0;
     }
 
+    // Unix domain sockets have no port
+    if (addr.ss_family == AF_UNIX) {
+        return 0;
+    }
+
     struct sockaddr_in *s = (struct sockaddr_in *) (&addr);
     unsigned short port = ntohs(s->sin_port);
 
@@ -846,20 +2063,13 @@ CDTP_EXPORT void cdtp_server_remove_client(CDTPServer *server, size_t client_id)
         return;
     }
 
-#ifdef _WIN32
-    if (closesocket(client->sock) != 0) {
-        _cdtp_set_err(CDTP_CLIENT_REMOVE_FAILED);
-        return;
-    }
-#else
-    if (close(client->sock) != 0) {
+    // Send any queued data before closing the socket, which waits for an I/O thread still reading from it
+    _cdtp_reactor_remove(server->reactors[client->reactor_index].reactor, client);
+    _cdtp_send_buffer_drain(client->send_buffer, client, CDTP_SEND_DRAIN_TIMEOUT);
+
+    if (!_cdtp_server_release_client(client)) {
         _cdtp_set_err(CDTP_CLIENT_REMOVE_FAILED);
-        return;
     }
-#endif
-
-    _cdtp_crypto_aes_key_free(client->key);
-    free(client);
 }
 
 CDTP_EXPORT void cdtp_server_send(CDTPServer *server, size_t client_id, void *data, size_t data_size)
@@ -870,7 +2080,7 @@ CDTP_EXPORT void cdtp_server_send(CDTPServer *server, size_t client_id, void *da
         return;
     }
 
-    CDTPSocket *client = _cdtp_client_map_get(server->clients, client_id);
+    CDTPSocket *client = _cdtp_server_hold_client(server, client_id);
 
     // Make sure the client exists
     if (client == NULL) {
@@ -878,16 +2088,16 @@ CDTP_EXPORT void cdtp_server_send(CDTPServer *server, size_t client_id, void *da
         return;
     }
 
-    CDTPCryptoData *data_encrypted = _cdtp_crypto_aes_encrypt(client->key, data, data_size);
-    char *message = _cdtp_construct_message(data_encrypted->data, data_encrypted->data_size);
+    // Hold a reference while sending, so the client cannot be freed mid-send without its shard staying locked
+    int sent = _cdtp_server_send_sock(client, data, data_size);
+    _cdtp_server_release_client(client);
 
-    if (send(client->sock, message, CDTP_LENSIZE + data_encrypted->data_size, 0) < 0) {
+    if (sent < 0) {
         _cdtp_set_err(CDTP_SERVER_SEND_FAILED);
-        return;
     }
-
-    _cdtp_crypto_data_free(data_encrypted);
-    free(message);
+    else if (sent == 0) {
+        _cdtp_set_error(CDTP_SERVER_SEND_WOULD_BLOCK, 0);
+    }
 }
 
 CDTP_EXPORT void cdtp_server_send_all(CDTPServer *server, void *data, size_t data_size)
@@ -898,13 +2108,32 @@ CDTP_EXPORT void cdtp_server_send_all(CDTPServer *server, void *data, size_t dat
         return;
     }
 
-    CDTPClientMapIter *iter = _cdtp_client_map_iter(server->clients);
+    CDTPServerClientList list = {NULL, 0, 0};
+    bool sent = true;
+    bool blocked = false;
 
-    for (size_t i = 0; i < iter->size; i++) {
-        cdtp_server_send(server, iter->clients[i]->client_id, data, data_size);
+    // Hold a reference to each client, so the data is sent without keeping the client map locked
+    _cdtp_client_map_for_each(server->clients, _cdtp_server_client_list_hold, &list);
+
+    for (size_t i = 0; i < list.size; i++) {
+        int client_sent = _cdtp_server_send_sock(list.clients[i], data, data_size);
+
+        if (client_sent < 0) {
+            sent = false;
+        }
+        else if (client_sent == 0) {
+            blocked = true;
+        }
     }
 
-    _cdtp_client_map_iter_free(iter);
+    _cdtp_server_client_list_release(&list);
+
+    if (!sent) {
+        _cdtp_set_err(CDTP_SERVER_SEND_FAILED);
+    }
+    else if (blocked) {
+        _cdtp_set_error(CDTP_SERVER_SEND_WOULD_BLOCK, 0);
+    }
 }
 
 CDTP_EXPORT void cdtp_server_free(CDTPServer *server)
@@ -915,6 +2144,16 @@ CDTP_EXPORT void cdtp_server_free(CDTPServer *server)
         return;
     }
 
+    for (size_t i = 0; i < server->num_reactors; i++) {
+        _cdtp_reactor_free(server->reactors[i].reactor);
+
+        // The first I/O thread uses the server's own socket
+        if (i > 0) {
+            free(server->reactors[i].sock);
+        }
+    }
+
+    free(server->reactors);
     free(server->sock);
     _cdtp_client_map_free(server->clients);
     free(server);
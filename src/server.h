@@ -11,6 +11,10 @@
 #include "crypto.h"
 #include "threading.h"
 #include "map.h"
+#include "reactor.h"
+#include "buffer.h"
+#include "keypool.h"
+#include "shm.h"
 
 /**
  * Instantiate a socket server.
@@ -30,13 +34,18 @@
  *   - a `size_t` representing the size of the received data, in bytes
  *   - a `void *` containing the `on_recv_arg`
  * Note that the data (the second parameter) is allocated on the heap by CDTP. Users are responsible for calling `free`
- * on the data at some point, whether that be at the end of the `on_recv` function or at a later time.
+ * on the data at some point, whether that be at the end of the `on_recv` function or at a later time, unless the
+ * server dispatches events inline.
  *
  * The `on_connect` and `on_disconnect` functions should each take two parameters:
  *   - a `size_t` representing the ID of the client that connected/disconnected
  *   - a `void *` containing the `on_connect_arg`/`on_disconnect_arg`
  *
- * All event functions are executed in their own threads to prevent halting the server's event loop.
+ * Client IDs are opaque values. Once a client has been removed, its ID is no longer valid, and is not given to clients
+ * that connect later.
+ *
+ * By default, all event functions are executed on a pool of event threads to prevent halting the server's event loop.
+ * See `cdtp_server_set_event_threads` and `cdtp_server_set_dispatch_mode`.
  */
 CDTP_EXPORT CDTPServer *cdtp_server(
   ServerOnRecvCallback on_recv,
@@ -47,6 +56,181 @@ CDTP_EXPORT CDTPServer *cdtp_server(
   void *on_disconnect_arg
 );
 
+/**
+ * Set the number of I/O threads the server uses to accept and serve clients.
+ *
+ * @param server The socket server.
+ * @param num_threads The number of I/O threads, or 0 to use one per processor.
+ *
+ * Each I/O thread has its own listening socket bound to the server's address, and serves the clients it accepted.
+ * This must be called before the server is started. Windows servers always use a single I/O thread.
+ */
+CDTP_EXPORT void cdtp_server_set_io_threads(CDTPServer *server, size_t num_threads);
+
+/**
+ * Set the number of threads the server uses to exchange keys with newly connected clients.
+ *
+ * @param server The socket server.
+ * @param num_threads The number of key exchange threads, or 0 to use one per processor.
+ *
+ * Clients are only added to the server, and the `on_connect` event function is only called, once their key exchange
+ * has completed. This must be called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_handshake_threads(CDTPServer *server, size_t num_threads);
+
+/**
+ * Set the number of threads the server uses to call event functions.
+ *
+ * @param server The socket server.
+ * @param num_threads The number of event threads, or 0 to use one per processor.
+ * @param max_queued_events The number of events that may wait for an event thread before I/O threads stop reading
+ * from clients until an event function returns, or 0 to never stop reading.
+ *
+ * Events still waiting when the server is stopped are handled before `cdtp_server_stop` returns. This must be called
+ * before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_event_threads(CDTPServer *server, size_t num_threads, size_t max_queued_events);
+
+/**
+ * Set how the server schedules event functions on its event threads.
+ *
+ * @param server The socket server.
+ * @param dispatch_mode The dispatch mode.
+ *
+ * The dispatch modes are:
+ *   - `CDTP_DISPATCH_ORDERED`: event functions for the same client run one at a time, in the order the events occurred,
+ *     while event functions for different clients run in parallel (the default)
+ *   - `CDTP_DISPATCH_PARALLEL`: every event function may run as soon as an event thread is free, so events for the
+ *     same client may be handled concurrently or out of order
+ *   - `CDTP_DISPATCH_INLINE`: event functions are called directly from the I/O thread serving the client, or from the
+ *     key exchange thread for `on_connect`, and no event threads are started
+ * The inline mode has the lowest latency, but an I/O thread reads nothing from any of its clients until an inline event
+ * function returns, so inline event functions must not block. The data passed to an inline `on_recv` function points
+ * into the server's receive buffer, so it is only valid until the function returns, may not be suitably aligned for any
+ * particular type, and must not be freed by the user. In the ordered and inline modes, a client's `on_connect` call
+ * always comes first, and its `on_disconnect` call always comes last.
+ * This must be called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_dispatch_mode(CDTPServer *server, CDTPDispatchMode dispatch_mode);
+
+/**
+ * Set whether the server supports clients that only understand the RSA key exchange.
+ *
+ * @param server The socket server.
+ * @param legacy_handshake If RSA key exchanges should be supported.
+ *
+ * By default, keys are exchanged using ephemeral X25519 key pairs, which older clients do not understand. Supporting
+ * them requires the server to also send an RSA public key with every key exchange, which costs far more CPU time and
+ * bandwidth; see `cdtp_server_set_key_mode`. Clients that understand X25519 still use it either way. This must be
+ * called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_legacy_handshake(CDTPServer *server, bool legacy_handshake);
+
+/**
+ * Set where the server gets the RSA key pair used for each legacy key exchange.
+ *
+ * @param server The socket server.
+ * @param key_mode The key mode.
+ * @param key_pool_size The number of key pairs to keep ready when using `CDTP_KEY_MODE_POOL`, or 0 for the default.
+ *
+ * The key modes are:
+ *   - `CDTP_KEY_MODE_PER_CONNECTION`: generate a new key pair during every key exchange (the default)
+ *   - `CDTP_KEY_MODE_POOL`: take a new key pair from a pool that is refilled in the background
+ *   - `CDTP_KEY_MODE_PERSISTENT`: generate one key pair when the server starts, and use it for every key exchange
+ * The pool mode still uses each key pair only once. The persistent mode is the cheapest, but a compromise of its
+ * private key exposes every session key negotiated while the server was running. This must be called before the
+ * server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_key_mode(CDTPServer *server, CDTPKeyMode key_mode, size_t key_pool_size);
+
+/**
+ * Set how much sent data the server may queue for each client before it refuses to send that client more.
+ *
+ * @param server The socket server.
+ * @param low_watermark The number of queued bytes at or below which data is sent to a client again.
+ * @param high_watermark The number of queued bytes above which sending to a client fails with
+ * `CDTP_SERVER_SEND_WOULD_BLOCK`.
+ *
+ * Data that cannot be sent to a client right away is queued, and sent by the client's I/O thread once the client can
+ * take it. Once more than `high_watermark` bytes are queued for a client, sending to it is refused until no more than
+ * `low_watermark` bytes are left, so a client that does not read what it is sent cannot make the server queue without
+ * limit. See `cdtp_server_set_on_writable` to be told when that happens. Clients are always read from, whatever is
+ * queued for them. This must be called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_send_watermarks(CDTPServer *server, size_t low_watermark, size_t high_watermark);
+
+/**
+ * Set the event function called when a client that the server refused to send more to can be sent to again.
+ *
+ * @param server The socket server.
+ * @param on_writable The function to call with the server, the client's ID, and `on_writable_arg`, or NULL.
+ * @param on_writable_arg A value that will be passed to `on_writable`.
+ *
+ * Once sending to a client has failed with `CDTP_SERVER_SEND_WOULD_BLOCK`, the function is called as soon as no more
+ * than the low watermark is queued for the client (see `cdtp_server_set_send_watermarks`), after which sending to it
+ * succeeds again. It is called in the same way as the other event functions. This must be called before the server is
+ * started.
+ */
+CDTP_EXPORT void cdtp_server_set_on_writable(CDTPServer *server, ServerOnWritableCallback on_writable, void *on_writable_arg);
+
+/**
+ * Set the size of the largest message the server will receive from a client.
+ *
+ * @param server The socket server.
+ * @param max_message_size The size of the largest message, in bytes.
+ *
+ * A client that sends a larger message is disconnected before any memory is set aside for it. This must be called
+ * before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_max_message_size(CDTPServer *server, size_t max_message_size);
+
+/**
+ * Set whether the server lets clients resume earlier sessions with resumption tickets.
+ *
+ * @param server The socket server.
+ * @param resumption If sessions can be resumed.
+ * @param ticket_lifetime The number of seconds each ticket is valid for, or 0 for the default.
+ *
+ * Clients that ask for one are sent a ticket once their key exchange completes. A client that reconnects with a ticket
+ * skips the X25519 or RSA key agreement, and its new session key is derived from the secret the ticket holds. Tickets
+ * are sealed with a key generated when the server starts, so they are only accepted by the server that issued them,
+ * while it is running. A resumed session's key depends on the secret in the ticket, so unlike a full key exchange,
+ * resumption does not provide forward secrecy for the lifetime of the ticket. This must be called before the server is
+ * started.
+ */
+CDTP_EXPORT void cdtp_server_set_resumption(CDTPServer *server, bool resumption, double ticket_lifetime);
+
+/**
+ * Set whether the server sends and receives messages without encrypting them.
+ *
+ * @param server The socket server.
+ * @param plaintext If messages should be sent unencrypted.
+ *
+ * In the plaintext mode, no keys are exchanged, and messages are sent exactly as they are given, which is much faster.
+ * Only clients that also use the plaintext mode can connect, so neither side can be tricked into using it. Messages can
+ * be read and altered by anything between the server and its clients, so this should only be used on connections
+ * between processes on the same host that fully trust each other. The legacy handshake, key mode, and resumption
+ * settings have no effect in the plaintext mode. This must be called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_plaintext(CDTPServer *server, bool plaintext);
+
+/**
+ * Set whether the server sends and receives messages through shared memory, for clients on the same host that ask.
+ *
+ * @param server The socket server.
+ * @param shared_memory If clients should be offered shared memory.
+ * @param ring_size The size, in bytes, of the ring each direction of a connection uses, or 0 for the default.
+ *
+ * Clients connected to a Unix domain socket (see `cdtp_server_start_unix`) that call `cdtp_client_set_shared_memory`
+ * are offered a region of memory shared with the server once their key exchange completes. Messages are then written to
+ * and read from rings in that region instead of going through the socket, and a system call is only made to wake the
+ * other side once it has run out of work. Messages are still encrypted unless the plaintext mode is used, and the event
+ * functions are called exactly as they otherwise would be. The ring size is rounded up to a power of two, and each
+ * connection uses twice that much memory. Other clients are served through their socket as usual, and Windows servers
+ * never use shared memory. This must be called before the server is started.
+ */
+CDTP_EXPORT void cdtp_server_set_shared_memory(CDTPServer *server, bool shared_memory, size_t ring_size);
+
 /**
  * Start the socket server.
  *
@@ -56,6 +240,18 @@ CDTP_EXPORT CDTPServer *cdtp_server(
  */
 CDTP_EXPORT void cdtp_server_start(CDTPServer *server, char *host, unsigned short port);
 
+/**
+ * Start the socket server on a Unix domain socket.
+ *
+ * @param server The socket server.
+ * @param path The path to bind the socket to, which must not already exist.
+ *
+ * Clients on the same host connect with `cdtp_client_connect_unix`, and are served exactly like clients connected over
+ * TCP, without going through the network stack. The path is removed when the server stops. The server's host is its
+ * path, the hosts of its clients are empty strings, and all of their ports are 0.
+ */
+CDTP_EXPORT void cdtp_server_start_unix(CDTPServer *server, char *path);
+
 /**
  * Stop the server.
  *
@@ -124,6 +320,11 @@ CDTP_EXPORT void cdtp_server_remove_client(CDTPServer *server, size_t client_id)
  * @param client_id The ID of the client to send the data to.
  * @param data The data to send.
  * @param data_size The size of the data, in bytes.
+ *
+ * This never waits for the client to read the data. Whatever cannot be sent right away is queued, and any data still
+ * queued when the client is removed is sent before its connection is closed. If too much data is already queued for
+ * the client, nothing is sent and the error `CDTP_SERVER_SEND_WOULD_BLOCK` is reported, and the data should be sent
+ * again later.
  */
 CDTP_EXPORT void cdtp_server_send(CDTPServer *server, size_t client_id, void *data, size_t data_size);
 
@@ -133,6 +334,9 @@ CDTP_EXPORT void cdtp_server_send(CDTPServer *server, size_t client_id, void *da
  * @param server The socket server.
  * @param data The data to send.
  * @param data_size The size of the data, in bytes.
+ *
+ * The data is still sent to every client that can take it when some cannot, in which case the error
+ * `CDTP_SERVER_SEND_WOULD_BLOCK` is reported.
  */
 CDTP_EXPORT void cdtp_server_send_all(CDTPServer *server, void *data, size_t data_size);
 
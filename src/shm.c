@@ -0,0 +1,439 @@
+// Needed for memfd_create
+#define _GNU_SOURCE
+
+#include "shm.h"
+
+/**
+ * Point shared memory at the rings in its region. The party that offered the region sends through the first ring and
+ * receives through the second, and the party it was offered to does the opposite.
+ *
+ * @param shm The shared memory, whose region and ring size are set.
+ * @param offerer If the party offered the region.
+ */
+void _cdtp_shm_layout(CDTPSharedMemory *shm, bool offerer)
+{
+    CDTPShmRing *first_ring = (CDTPShmRing *) (shm->region);
+    CDTPShmRing *second_ring = first_ring + 1;
+    unsigned char *first_data = (unsigned char *) (second_ring + 1);
+    unsigned char *second_data = first_data + shm->ring_size;
+
+    shm->send_ring = offerer ? first_ring : second_ring;
+    shm->send_data = offerer ? first_data : second_data;
+    shm->recv_ring = offerer ? second_ring : first_ring;
+    shm->recv_data = offerer ? second_data : first_data;
+}
+
+/**
+ * Map shared memory offered by the other party, taking over the file descriptors sent with the offer.
+ *
+ * @param region_fd The file descriptor of the region, which is closed once it is mapped.
+ * @param doorbell The party's own doorbell.
+ * @param peer_doorbell The other party's doorbell.
+ * @return The shared memory, or NULL if the region could not be mapped, in which case the doorbells are closed.
+ */
+CDTPSharedMemory *_cdtp_shm_map(int region_fd, int doorbell, int peer_doorbell)
+{
+    CDTPSharedMemory *shm = (CDTPSharedMemory *) malloc(sizeof(CDTPSharedMemory));
+
+#ifdef _WIN32
+    (void) region_fd;
+    (void) doorbell;
+    (void) peer_doorbell;
+    free(shm);
+
+    return NULL;
+#else
+    shm->region = MAP_FAILED;
+    shm->region_fd = region_fd;
+    shm->doorbell = doorbell;
+    shm->peer_doorbell = peer_doorbell;
+
+    // The region must hold both ring headers, followed by two rings whose size is a power of two
+    struct stat region_stat;
+    bool mapped = fstat(region_fd, &region_stat) == 0 && region_stat.st_size > (off_t) (2 * sizeof(CDTPShmRing));
+
+    if (mapped) {
+        shm->region_size = (size_t) (region_stat.st_size);
+        shm->ring_size = (shm->region_size - 2 * sizeof(CDTPShmRing)) / 2;
+        mapped = (shm->ring_size & (shm->ring_size - 1)) == 0 &&
+                 shm->region_size == 2 * sizeof(CDTPShmRing) + 2 * shm->ring_size &&
+                 (shm->region = mmap(NULL, shm->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, region_fd, 0)) !=
+                 MAP_FAILED;
+    }
+
+    // The mapping outlives the region's file descriptor
+    close(region_fd);
+    shm->region_fd = -1;
+
+    if (!mapped) {
+        _cdtp_shm_free(shm);
+        return NULL;
+    }
+
+    _cdtp_shm_layout(shm, false);
+
+    return shm;
+#endif
+}
+
+/**
+ * Ring a doorbell.
+ *
+ * @param doorbell The doorbell.
+ */
+void _cdtp_shm_ring_doorbell(int doorbell)
+{
+#ifdef _WIN32
+    (void) doorbell;
+#else
+    uint64_t value = 1;
+
+    if (write(doorbell, &value, sizeof(value)) == -1) {
+        // The counter is already saturated, so the doorbell is ringing regardless
+    }
+#endif
+}
+
+/**
+ * Check that a ring's counters describe no more bytes than the ring can hold. Both parties can write to the ring's
+ * header, so a party that misbehaves could otherwise make the other read or write past the end of the ring.
+ *
+ * @param shm The shared memory.
+ * @param head The number of bytes written to the ring.
+ * @param tail The number of bytes read from the ring.
+ * @return If the counters are consistent.
+ */
+bool _cdtp_shm_ring_valid(CDTPSharedMemory *shm, size_t head, size_t tail)
+{
+    return tail <= head && head - tail <= shm->ring_size;
+}
+
+/**
+ * Copy bytes into a ring, wrapping around its end.
+ *
+ * @param data The ring's data.
+ * @param ring_size The size of the ring, in bytes.
+ * @param position The number of bytes written to the ring before these.
+ * @param src The bytes to copy.
+ * @param size The number of bytes, which must fit in the ring.
+ */
+void _cdtp_shm_copy_in(unsigned char *data, size_t ring_size, size_t position, unsigned char *src, size_t size)
+{
+    size_t start = position & (ring_size - 1);
+    size_t first_size = size < ring_size - start ? size : ring_size - start;
+
+    memcpy(data + start, src, first_size);
+    memcpy(data, src + first_size, size - first_size);
+}
+
+/**
+ * Copy bytes out of a ring, wrapping around its end.
+ *
+ * @param data The ring's data.
+ * @param ring_size The size of the ring, in bytes.
+ * @param position The number of bytes read from the ring before these.
+ * @param dest Where to copy the bytes.
+ * @param size The number of bytes, which must all have been written.
+ */
+void _cdtp_shm_copy_out(unsigned char *data, size_t ring_size, size_t position, unsigned char *dest, size_t size)
+{
+    size_t start = position & (ring_size - 1);
+    size_t first_size = size < ring_size - start ? size : ring_size - start;
+
+    memcpy(dest, data + start, first_size);
+    memcpy(dest + first_size, data, size - first_size);
+}
+
+CDTPSharedMemory *_cdtp_shm(size_t ring_size)
+{
+#ifdef _WIN32
+    (void) ring_size;
+
+    return NULL;
+#else
+    CDTPSharedMemory *shm = (CDTPSharedMemory *) malloc(sizeof(CDTPSharedMemory));
+
+    shm->ring_size = 1;
+
+    while (shm->ring_size < ring_size) {
+        shm->ring_size *= 2;
+    }
+
+    shm->region_size = 2 * sizeof(CDTPShmRing) + 2 * shm->ring_size;
+    shm->region = MAP_FAILED;
+    shm->doorbell = -1;
+    shm->peer_doorbell = -1;
+
+    // The region is anonymous, so it is only reachable through the file descriptors handed to the other party
+    if ((shm->region_fd = memfd_create("cdtp", MFD_CLOEXEC)) == -1 ||
+        ftruncate(shm->region_fd, (off_t) (shm->region_size)) == -1 ||
+        (shm->region = mmap(NULL, shm->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->region_fd, 0)) ==
+        MAP_FAILED ||
+        (shm->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        (shm->peer_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        _cdtp_shm_free(shm);
+        return NULL;
+    }
+
+    // The region starts zeroed, and both readers start out waiting for bytes
+    _cdtp_shm_layout(shm, true);
+    shm->send_ring->reader_waiting = 1;
+    shm->recv_ring->reader_waiting = 1;
+
+    return shm;
+#endif
+}
+
+bool _cdtp_shm_offer(CDTPSocket *sock, CDTPSharedMemory *shm)
+{
+    unsigned char message[CDTP_LENSIZE + 1];
+    _cdtp_write_message_size(message, 1);
+    message[CDTP_LENSIZE] = (unsigned char) (shm != NULL ? 1 : 0);
+
+#ifdef _WIN32
+    // Shared memory cannot be set up on Windows, so it is never offered
+    return send(sock->sock, (char *) message, (int) sizeof(message), 0) == (int) sizeof(message);
+#else
+    struct iovec vec;
+    vec.iov_base = (void *) message;
+    vec.iov_len = sizeof(message);
+
+    union {
+        struct cmsghdr header;
+        unsigned char buffer[CMSG_SPACE(CDTP_SHM_NUM_FDS * sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+
+    if (shm != NULL) {
+        // The other party's doorbell is sent first, since to the other party it is its own
+        int fds[CDTP_SHM_NUM_FDS] = {shm->region_fd, shm->peer_doorbell, shm->doorbell};
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buffer;
+        msg.msg_controllen = sizeof(control.buffer);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    bool sent = sendmsg(sock->sock, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(message);
+
+    // The mapping outlives the region's file descriptor
+    if (shm != NULL) {
+        close(shm->region_fd);
+        shm->region_fd = -1;
+    }
+
+    return sent;
+#endif
+}
+
+bool _cdtp_shm_recv_offer(CDTPSocket *sock, bool *offered, CDTPSharedMemory **shm)
+{
+    *offered = false;
+    *shm = NULL;
+
+#ifdef _WIN32
+    // Windows clients never ask for shared memory
+    (void) sock;
+
+    return false;
+#else
+    unsigned char message[CDTP_LENSIZE + 1];
+    struct iovec vec;
+    vec.iov_base = (void *) message;
+    vec.iov_len = sizeof(message);
+
+    union {
+        struct cmsghdr header;
+        unsigned char buffer[CMSG_SPACE(CDTP_SHM_NUM_FDS * sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t recv_code = recvmsg(sock->sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+    // Take whatever file descriptors were sent, so that none are leaked
+    int fds[CDTP_SHM_NUM_FDS];
+    size_t num_fds = 0;
+    struct cmsghdr *cmsg = recv_code > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        num_fds = num_fds < CDTP_SHM_NUM_FDS ? num_fds : CDTP_SHM_NUM_FDS;
+        memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+    }
+
+    bool received = recv_code == (ssize_t) sizeof(message) && _cdtp_decode_message_size(message) == 1;
+    *offered = received && message[CDTP_LENSIZE] == 1;
+
+    if (*offered && num_fds == CDTP_SHM_NUM_FDS) {
+        *shm = _cdtp_shm_map(fds[0], fds[1], fds[2]);
+    }
+    else {
+        for (size_t i = 0; i < num_fds; i++) {
+            close(fds[i]);
+        }
+    }
+
+    return received;
+#endif
+}
+
+bool _cdtp_shm_write(CDTPSharedMemory *shm, CDTPIOVec *vecs, size_t num_vecs, size_t *written)
+{
+    CDTPShmRing *ring = shm->send_ring;
+    size_t head = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+    size_t vec_index = 0;
+    size_t vec_offset = 0;
+
+    *written = 0;
+
+    while (vec_index < num_vecs) {
+        size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+
+        if (!_cdtp_shm_ring_valid(shm, head, tail)) {
+            return false;
+        }
+
+        size_t room = shm->ring_size - (head - tail);
+
+        if (room == 0) {
+            // Ask to be woken once the reader makes room, unless it has made some since the ring was found full
+            __atomic_store_n(&(ring->writer_waiting), 1, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&(ring->tail), __ATOMIC_SEQ_CST) == tail) {
+                break;
+            }
+
+            __atomic_store_n(&(ring->writer_waiting), 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        // Copy as much of the regions as fits
+        while (room > 0 && vec_index < num_vecs) {
+#ifdef _WIN32
+            unsigned char *base = (unsigned char *) (vecs[vec_index].buf);
+            size_t vec_size = (size_t) (vecs[vec_index].len);
+#else
+            unsigned char *base = (unsigned char *) (vecs[vec_index].iov_base);
+            size_t vec_size = vecs[vec_index].iov_len;
+#endif
+            size_t size = vec_size - vec_offset < room ? vec_size - vec_offset : room;
+
+            _cdtp_shm_copy_in(shm->send_data, shm->ring_size, head, base + vec_offset, size);
+            head += size;
+            room -= size;
+            *written += size;
+            vec_offset += size;
+
+            if (vec_offset == vec_size) {
+                vec_index++;
+                vec_offset = 0;
+            }
+        }
+
+        // Publish the bytes, then wake the reader if it is waiting for them
+        __atomic_store_n(&(ring->head), head, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&(ring->reader_waiting), 0, __ATOMIC_SEQ_CST) != 0) {
+            _cdtp_shm_ring_doorbell(shm->peer_doorbell);
+        }
+    }
+
+    return true;
+}
+
+bool _cdtp_shm_read(CDTPSharedMemory *shm, void *dest, size_t space, size_t *received)
+{
+    CDTPShmRing *ring = shm->recv_ring;
+    size_t tail = __atomic_load_n(&(ring->tail), __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+
+    *received = 0;
+
+    if (!_cdtp_shm_ring_valid(shm, head, tail)) {
+        return false;
+    }
+
+    size_t size = head - tail < space ? head - tail : space;
+
+    if (size > 0) {
+        _cdtp_shm_copy_out(shm->recv_data, shm->ring_size, tail, (unsigned char *) dest, size);
+        tail += size;
+
+        // Free the bytes, then wake the writer if it is waiting for room
+        __atomic_store_n(&(ring->tail), tail, __ATOMIC_SEQ_CST);
+
+        if (__atomic_exchange_n(&(ring->writer_waiting), 0, __ATOMIC_SEQ_CST) != 0) {
+            _cdtp_shm_ring_doorbell(shm->peer_doorbell);
+        }
+    }
+
+    if (tail != head) {
+        // Come back for the bytes that did not fit
+        _cdtp_shm_ring_doorbell(shm->doorbell);
+    }
+    else {
+        // Ask to be woken once more bytes are written, unless some were written before the writer could see the request
+        __atomic_store_n(&(ring->reader_waiting), 1, __ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&(ring->head), __ATOMIC_SEQ_CST) != tail &&
+            __atomic_exchange_n(&(ring->reader_waiting), 0, __ATOMIC_SEQ_CST) != 0) {
+            _cdtp_shm_ring_doorbell(shm->doorbell);
+        }
+    }
+
+    *received = size;
+
+    return true;
+}
+
+void _cdtp_shm_clear_doorbell(CDTPSharedMemory *shm)
+{
+#ifdef _WIN32
+    (void) shm;
+#else
+    uint64_t value;
+
+    if (read(shm->doorbell, &value, sizeof(value)) == -1) {
+        // The doorbell was not ringing, do nothing
+    }
+#endif
+}
+
+void _cdtp_shm_free(CDTPSharedMemory *shm)
+{
+#ifndef _WIN32
+    if (shm->region != MAP_FAILED) {
+        munmap(shm->region, shm->region_size);
+    }
+
+    if (shm->region_fd != -1) {
+        close(shm->region_fd);
+    }
+
+    if (shm->doorbell != -1) {
+        close(shm->doorbell);
+    }
+
+    if (shm->peer_doorbell != -1) {
+        close(shm->peer_doorbell);
+    }
+#endif
+
+    free(shm);
+}
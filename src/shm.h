@@ -0,0 +1,97 @@
+/**
+ * CDTP shared memory transport.
+ */
+
+#pragma once
+#ifndef CDTP_SHM_H
+#define CDTP_SHM_H
+
+#include "defs.h"
+#include "util.h"
+#include <stdbool.h>
+
+#ifndef _WIN32
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+// Number of file descriptors sent along with an offer of shared memory.
+#define CDTP_SHM_NUM_FDS 3
+
+/**
+ * Set up shared memory for a connection, on behalf of the party that offers it.
+ *
+ * @param ring_size The size of each direction's ring, in bytes, which is rounded up to a power of two.
+ * @return The shared memory, or NULL if it could not be set up.
+ *
+ * Shared memory cannot be set up on Windows.
+ */
+CDTPSharedMemory *_cdtp_shm(size_t ring_size);
+
+/**
+ * Answer a request to use shared memory, sending an offer over a socket.
+ *
+ * @param sock The blocking Unix domain socket to send the offer on.
+ * @param shm The shared memory to offer, or NULL to decline.
+ * @return If the offer was sent.
+ *
+ * The offer is a message holding a single status byte, which is 1 if shared memory is offered. The file descriptors of
+ * the shared memory and of both parties' doorbells are sent along with it, after which the region's file descriptor
+ * is closed.
+ */
+bool _cdtp_shm_offer(CDTPSocket *sock, CDTPSharedMemory *shm);
+
+/**
+ * Receive an answer to a request to use shared memory, mapping the shared memory if it was offered.
+ *
+ * @param sock The blocking Unix domain socket to receive the offer on.
+ * @param offered A pointer that will be set to whether shared memory was offered.
+ * @param shm A pointer that will be set to the offered shared memory, or NULL if it was not offered or could not be
+ * mapped.
+ * @return If the answer was received.
+ */
+bool _cdtp_shm_recv_offer(CDTPSocket *sock, bool *offered, CDTPSharedMemory **shm);
+
+/**
+ * Write bytes to the ring the party sends through, waking the other party if it is waiting for them.
+ *
+ * @param shm The shared memory.
+ * @param vecs The regions of memory to write, in order.
+ * @param num_vecs The number of regions.
+ * @param written A pointer that will be set to the number of bytes written, which is less than requested if the ring is
+ * full.
+ * @return If the ring was intact. Otherwise, the other party has corrupted it, and the connection must be closed.
+ *
+ * If the ring is full, the other party rings the doorbell once it has made room.
+ */
+bool _cdtp_shm_write(CDTPSharedMemory *shm, CDTPIOVec *vecs, size_t num_vecs, size_t *written);
+
+/**
+ * Read bytes from the ring the party receives through, waking the other party if it is waiting for room.
+ *
+ * @param shm The shared memory.
+ * @param dest Where to write the bytes.
+ * @param space The maximum number of bytes to read.
+ * @param received A pointer that will be set to the number of bytes read.
+ * @return If the ring was intact. Otherwise, the other party has corrupted it, and the connection must be closed.
+ *
+ * If bytes are left in the ring, the doorbell is rung right away so the party comes back for them. Otherwise, it is
+ * rung as soon as more bytes are written.
+ */
+bool _cdtp_shm_read(CDTPSharedMemory *shm, void *dest, size_t space, size_t *received);
+
+/**
+ * Silence the party's doorbell once it has woken.
+ *
+ * @param shm The shared memory.
+ */
+void _cdtp_shm_clear_doorbell(CDTPSharedMemory *shm);
+
+/**
+ * Unmap shared memory and close its doorbells. The doorbell must no longer be watched by a reactor.
+ *
+ * @param shm The shared memory.
+ */
+void _cdtp_shm_free(CDTPSharedMemory *shm);
+
+#endif // CDTP_SHM_H
@@ -1,16 +1,31 @@
 #include "threading.h"
 
+/**
+ * The kinds of event functions.
+ */
+typedef enum _CDTPEventType {
+    CDTP_EVENT_ON_RECV_SERVER,
+    CDTP_EVENT_ON_CONNECT,
+    CDTP_EVENT_ON_DISCONNECT,
+    CDTP_EVENT_ON_WRITABLE_SERVER,
+    CDTP_EVENT_ON_RECV_CLIENT,
+    CDTP_EVENT_ON_DISCONNECTED,
+    CDTP_EVENT_ON_WRITABLE_CLIENT
+} CDTPEventType;
+
 /**
  * A representation of all possible event functions.
  */
 typedef struct _CDTPEventFunc {
-    char *name;
+    CDTPEventType type;
     union func {
         ServerOnRecvCallback func_server_on_recv;                 // on_recv         (server)
         ServerOnConnectCallback func_server_on_connect;           // on_connect      (server)
         ServerOnDisconnectCallback func_server_on_disconnect;     // on_disconnect   (server)
+        ServerOnWritableCallback func_server_on_writable;         // on_writable     (server)
         ClientOnRecvCallback func_client_on_recv;                 // on_recv         (client)
         ClientOnDisconnectedCallback func_client_on_disconnected; // on_disconnected (client)
+        ClientOnWritableCallback func_client_on_writable;         // on_writable     (client)
     } func;
     CDTPServer *server;
     CDTPClient *client;
@@ -24,8 +39,8 @@ typedef struct _CDTPEventFunc {
  * A representation of a server's serve function, which can be passed to a thread.
  */
 typedef struct _CDTPServeFunc {
-    void (*func)(CDTPServer *);
-    CDTPServer *server;
+    void (*func)(CDTPServerReactor *);
+    CDTPServerReactor *reactor;
 } CDTPServeFunc;
 
 /**
@@ -36,51 +51,196 @@ typedef struct _CDTPHandleFunc {
     CDTPClient *client;
 } CDTPHandleFunc;
 
+void _cdtp_mutex_init(CDTPMutex *mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void _cdtp_mutex_lock(CDTPMutex *mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void _cdtp_mutex_unlock(CDTPMutex *mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void _cdtp_mutex_destroy(CDTPMutex *mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void _cdtp_rwlock_init(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    InitializeSRWLock(lock);
+#else
+    pthread_rwlock_init(lock, NULL);
+#endif
+}
+
+void _cdtp_rwlock_read_lock(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    AcquireSRWLockShared(lock);
+#else
+    pthread_rwlock_rdlock(lock);
+#endif
+}
+
+void _cdtp_rwlock_read_unlock(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    ReleaseSRWLockShared(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void _cdtp_rwlock_write_lock(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    AcquireSRWLockExclusive(lock);
+#else
+    pthread_rwlock_wrlock(lock);
+#endif
+}
+
+void _cdtp_rwlock_write_unlock(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    ReleaseSRWLockExclusive(lock);
+#else
+    pthread_rwlock_unlock(lock);
+#endif
+}
+
+void _cdtp_rwlock_destroy(CDTPRWLock *lock)
+{
+#ifdef _WIN32
+    // Windows reader-writer locks do not need to be destroyed
+    (void) lock;
+#else
+    pthread_rwlock_destroy(lock);
+#endif
+}
+
+void _cdtp_cond_init(CDTPCond *cond)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, NULL);
+#endif
+}
+
+void _cdtp_cond_wait(CDTPCond *cond, CDTPMutex *mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+void _cdtp_cond_signal(CDTPCond *cond)
+{
+#ifdef _WIN32
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+void _cdtp_cond_broadcast(CDTPCond *cond)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+
+void _cdtp_cond_destroy(CDTPCond *cond)
+{
+#ifdef _WIN32
+    // Windows condition variables do not need to be destroyed
+    (void) cond;
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
 /**
- * Call the relevant event function from within the current thread.
+ * Run tasks from a thread pool's queue until the pool is stopped and the queue is empty.
  *
- * @param func_info Information on the function being called.
+ * @param pool_ptr The thread pool.
  * @return This always returns 0 or NULL, depending on the thread API being used.
  */
 #ifdef _WIN32
-DWORD WINAPI _cdtp_event_thread(LPVOID func_info)
+DWORD WINAPI _cdtp_thread_pool_worker(LPVOID pool_ptr)
 #else
-void *_cdtp_event_thread(void *func_info)
+void *_cdtp_thread_pool_worker(void *pool_ptr)
 #endif
 {
-    CDTPEventFunc *event_func_info = (CDTPEventFunc *) func_info;
+    CDTPThreadPool *pool = (CDTPThreadPool *) pool_ptr;
 
-    // Determine which function to call
-    if (strcmp(event_func_info->name, "on_recv_server") == 0) {
-        (*event_func_info->func.func_server_on_recv)(event_func_info->server,
-                                                     event_func_info->size_t1,
-                                                     event_func_info->voidp1,
-                                                     event_func_info->size_t2,
-                                                     event_func_info->voidp2);
-    }
-    else if (strcmp(event_func_info->name, "on_connect") == 0) {
-        (*event_func_info->func.func_server_on_connect)(event_func_info->server,
-                                                        event_func_info->size_t1,
-                                                        event_func_info->voidp1);
-    }
-    else if (strcmp(event_func_info->name, "on_disconnect") == 0) {
-        (*event_func_info->func.func_server_on_disconnect)(event_func_info->server,
-                                                           event_func_info->size_t1,
-                                                           event_func_info->voidp1);
-    }
-    else if (strcmp(event_func_info->name, "on_recv_client") == 0) {
-        (*event_func_info->func.func_client_on_recv)(event_func_info->client,
-                                                     event_func_info->voidp1,
-                                                     event_func_info->size_t2,
-                                                     event_func_info->voidp2);
-    }
-    else if (strcmp(event_func_info->name, "on_disconnected") == 0) {
-        (*event_func_info->func.func_client_on_disconnected)(event_func_info->client,
-                                                             event_func_info->voidp1);
+    _cdtp_mutex_lock(&(pool->lock));
+
+    while (true) {
+        while (pool->head == NULL && !pool->stopping) {
+            _cdtp_cond_wait(&(pool->cond), &(pool->lock));
+        }
+
+        if (pool->head == NULL) {
+            break;
+        }
+
+        // Take the next task and run it without holding the lock
+        CDTPThreadPoolTask *task = pool->head;
+        pool->head = task->next;
+
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+
+        pool->num_tasks--;
+        _cdtp_cond_signal(&(pool->not_full));
+        _cdtp_mutex_unlock(&(pool->lock));
+
+        (*task->func)(task->arg);
+        free(task);
+
+        _cdtp_mutex_lock(&(pool->lock));
     }
 
-    // Free function information memory and return
-    free(event_func_info);
+    _cdtp_mutex_unlock(&(pool->lock));
+
+    // The pool was freed by one of its own tasks, which left the rest of the cleanup to this thread
+    if (pool->free_on_exit) {
+        _cdtp_cond_destroy(&(pool->not_full));
+        _cdtp_cond_destroy(&(pool->cond));
+        _cdtp_mutex_destroy(&(pool->lock));
+        free(pool->threads);
+        free(pool);
+    }
 
 #ifdef _WIN32
     return 0;
@@ -90,33 +250,386 @@ void *_cdtp_event_thread(void *func_info)
 }
 
 /**
- * Call an event function in a separate thread.
+ * Get the index of the calling thread in a pool's worker threads.
  *
- * @param func_info Information on the function being called.
+ * @param pool The thread pool.
+ * @return The index of the calling thread, or the number of worker threads if it is not one of them.
  */
-void _cdtp_start_event_thread(CDTPEventFunc *func_info)
+size_t _cdtp_thread_pool_current_worker(CDTPThreadPool *pool)
 {
+    for (size_t i = 0; i < pool->num_threads; i++) {
 #ifdef _WIN32
-    HANDLE thread = CreateThread(NULL, 0, _cdtp_event_thread, func_info, 0, NULL);
+        if (GetThreadId(pool->threads[i]) == GetCurrentThreadId()) {
+#else
+        if (pthread_equal(pool->threads[i], pthread_self()) != 0) {
+#endif
+            return i;
+        }
+    }
 
-    if (thread == NULL) {
-        _cdtp_set_error(CDTP_EVENT_THREAD_START_FAILED, GetLastError());
-        return;
+    return pool->num_threads;
+}
+
+CDTP_TEST_EXPORT CDTPThreadPool *_cdtp_thread_pool(size_t num_threads, size_t max_tasks)
+{
+    CDTPThreadPool *pool = (CDTPThreadPool *) malloc(sizeof(CDTPThreadPool));
+
+    _cdtp_mutex_init(&(pool->lock));
+    _cdtp_cond_init(&(pool->cond));
+    _cdtp_cond_init(&(pool->not_full));
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->num_tasks = 0;
+    pool->max_tasks = max_tasks;
+    pool->closing = false;
+    pool->stopping = false;
+    pool->free_on_exit = false;
+    pool->num_threads = 0;
+
+#ifdef _WIN32
+    pool->threads = (HANDLE *) malloc(num_threads * sizeof(HANDLE));
+#else
+    pool->threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+#endif
+
+    for (size_t i = 0; i < num_threads; i++) {
+#ifdef _WIN32
+        HANDLE thread = CreateThread(NULL, 0, _cdtp_thread_pool_worker, pool, 0, NULL);
+
+        if (thread == NULL) {
+            _cdtp_set_error(CDTP_POOL_THREAD_START_FAILED, GetLastError());
+            _cdtp_thread_pool_free(pool);
+            return NULL;
+        }
+#else
+        pthread_t thread;
+        int return_code = pthread_create(&thread, NULL, _cdtp_thread_pool_worker, pool);
+
+        if (return_code != 0) {
+            _cdtp_set_error(CDTP_POOL_THREAD_START_FAILED, return_code);
+            _cdtp_thread_pool_free(pool);
+            return NULL;
+        }
+#endif
+
+        pool->threads[pool->num_threads++] = thread;
     }
+
+    return pool;
+}
+
+CDTP_TEST_EXPORT void _cdtp_thread_pool_submit(CDTPThreadPool *pool, void (*func)(void *), void *arg)
+{
+    CDTPThreadPoolTask *task = (CDTPThreadPoolTask *) malloc(sizeof(CDTPThreadPoolTask));
+    task->func = func;
+    task->arg = arg;
+    task->next = NULL;
+
+    // Workers never wait for room in their own queue, since that room may only be made by the waiting worker
+    bool wait_for_room = pool->max_tasks > 0 && _cdtp_thread_pool_current_worker(pool) == pool->num_threads;
+
+    _cdtp_mutex_lock(&(pool->lock));
+
+    while (wait_for_room && pool->num_tasks >= pool->max_tasks && !pool->closing && !pool->stopping) {
+        _cdtp_cond_wait(&(pool->not_full), &(pool->lock));
+    }
+
+    if (pool->tail == NULL) {
+        pool->head = task;
+    }
+    else {
+        pool->tail->next = task;
+    }
+
+    pool->tail = task;
+    pool->num_tasks++;
+
+    _cdtp_cond_signal(&(pool->cond));
+    _cdtp_mutex_unlock(&(pool->lock));
+}
+
+CDTP_TEST_EXPORT void _cdtp_thread_pool_close(CDTPThreadPool *pool)
+{
+    _cdtp_mutex_lock(&(pool->lock));
+    pool->closing = true;
+    _cdtp_cond_broadcast(&(pool->not_full));
+    _cdtp_mutex_unlock(&(pool->lock));
+}
+
+CDTP_TEST_EXPORT bool _cdtp_thread_pool_free(CDTPThreadPool *pool)
+{
+    // Let the workers finish the queue, then exit
+    _cdtp_mutex_lock(&(pool->lock));
+    pool->stopping = true;
+    _cdtp_cond_broadcast(&(pool->cond));
+    _cdtp_cond_broadcast(&(pool->not_full));
+    _cdtp_mutex_unlock(&(pool->lock));
+
+    size_t current_worker = _cdtp_thread_pool_current_worker(pool);
+
+    for (size_t i = 0; i < pool->num_threads; i++) {
+        // A task cannot wait for its own thread to exit
+        if (i == current_worker) {
+            continue;
+        }
+
+#ifdef _WIN32
+        if (WaitForSingleObject(pool->threads[i], INFINITE) == WAIT_FAILED) {
+            _cdtp_set_error(CDTP_POOL_THREAD_NOT_CLOSING, GetLastError());
+            return false;
+        }
+
+        CloseHandle(pool->threads[i]);
 #else
-    pthread_t thread;
-    int return_code = pthread_create(&thread, NULL, _cdtp_event_thread, func_info);
+        int err_code = pthread_join(pool->threads[i], NULL);
 
-    if (return_code != 0) {
-        _cdtp_set_error(CDTP_EVENT_THREAD_START_FAILED, return_code);
-        return;
+        if (err_code != 0) {
+            _cdtp_set_error(CDTP_POOL_THREAD_NOT_CLOSING, err_code);
+            return false;
+        }
+#endif
     }
+
+    // Leave the cleanup to the current worker once its task returns
+    if (current_worker < pool->num_threads) {
+#ifdef _WIN32
+        if (CloseHandle(pool->threads[current_worker]) == 0) {
+            _cdtp_set_error(CDTP_POOL_THREAD_NOT_CLOSING, GetLastError());
+            return false;
+        }
+#else
+        int err_code = pthread_detach(pool->threads[current_worker]);
+
+        if (err_code != 0) {
+            _cdtp_set_error(CDTP_POOL_THREAD_NOT_CLOSING, err_code);
+            return false;
+        }
 #endif
+
+        pool->free_on_exit = true;
+        return true;
+    }
+
+    _cdtp_cond_destroy(&(pool->not_full));
+    _cdtp_cond_destroy(&(pool->cond));
+    _cdtp_mutex_destroy(&(pool->lock));
+    free(pool->threads);
+    free(pool);
+
+    return true;
+}
+
+/**
+ * Free the memory used by a strand.
+ *
+ * @param strand The strand.
+ */
+void _cdtp_strand_destroy(CDTPStrand *strand)
+{
+    _cdtp_cond_destroy(&(strand->not_full));
+    _cdtp_mutex_destroy(&(strand->lock));
+    free(strand);
+}
+
+/**
+ * Run the next task on a strand, then hand the strand back to its thread pool if more tasks are waiting.
+ *
+ * @param strand_ptr The strand.
+ */
+void _cdtp_strand_run(void *strand_ptr)
+{
+    CDTPStrand *strand = (CDTPStrand *) strand_ptr;
+
+    _cdtp_mutex_lock(&(strand->lock));
+
+    CDTPThreadPoolTask *task = strand->head;
+    strand->head = task->next;
+
+    if (strand->head == NULL) {
+        strand->tail = NULL;
+    }
+
+    strand->num_tasks--;
+    _cdtp_cond_signal(&(strand->not_full));
+    _cdtp_mutex_unlock(&(strand->lock));
+
+    (*task->func)(task->arg);
+    free(task);
+
+    // Requeue rather than looping, so that a busy strand cannot starve the others
+    _cdtp_mutex_lock(&(strand->lock));
+
+    bool requeue = strand->head != NULL;
+    bool finished = false;
+
+    if (!requeue) {
+        strand->running = false;
+        finished = strand->released;
+    }
+
+    _cdtp_mutex_unlock(&(strand->lock));
+
+    // The strand stays running, so it cannot be freed before it is requeued
+    if (requeue) {
+        _cdtp_thread_pool_submit(strand->pool, _cdtp_strand_run, strand);
+    }
+    else if (finished) {
+        _cdtp_strand_destroy(strand);
+    }
+}
+
+CDTP_TEST_EXPORT CDTPStrand *_cdtp_strand(CDTPThreadPool *pool)
+{
+    CDTPStrand *strand = (CDTPStrand *) malloc(sizeof(CDTPStrand));
+
+    strand->pool = pool;
+    _cdtp_mutex_init(&(strand->lock));
+    _cdtp_cond_init(&(strand->not_full));
+    strand->head = NULL;
+    strand->tail = NULL;
+    strand->num_tasks = 0;
+    strand->closing = false;
+    strand->running = false;
+    strand->released = false;
+
+    return strand;
+}
+
+CDTP_TEST_EXPORT void _cdtp_strand_submit(CDTPStrand *strand, void (*func)(void *), void *arg)
+{
+    CDTPThreadPool *pool = strand->pool;
+    CDTPThreadPoolTask *task = (CDTPThreadPoolTask *) malloc(sizeof(CDTPThreadPoolTask));
+    task->func = func;
+    task->arg = arg;
+    task->next = NULL;
+
+    bool wait_for_room = pool->max_tasks > 0 && _cdtp_thread_pool_current_worker(pool) == pool->num_threads;
+
+    _cdtp_mutex_lock(&(strand->lock));
+
+    while (wait_for_room && strand->num_tasks >= pool->max_tasks && !strand->closing) {
+        _cdtp_cond_wait(&(strand->not_full), &(strand->lock));
+    }
+
+    if (strand->tail == NULL) {
+        strand->head = task;
+    }
+    else {
+        strand->tail->next = task;
+    }
+
+    strand->tail = task;
+    strand->num_tasks++;
+
+    // Only one of the strand's tasks is ever queued on the pool at a time
+    bool start = !strand->running;
+    strand->running = true;
+
+    _cdtp_mutex_unlock(&(strand->lock));
+
+    // Submitting may wait for room in the pool's queue, which must not hold up the strand's own tasks
+    if (start) {
+        _cdtp_thread_pool_submit(pool, _cdtp_strand_run, strand);
+    }
+}
+
+CDTP_TEST_EXPORT void _cdtp_strand_close(CDTPStrand *strand)
+{
+    _cdtp_mutex_lock(&(strand->lock));
+    strand->closing = true;
+    _cdtp_cond_broadcast(&(strand->not_full));
+    _cdtp_mutex_unlock(&(strand->lock));
+}
+
+CDTP_TEST_EXPORT void _cdtp_strand_free(CDTPStrand *strand)
+{
+    _cdtp_mutex_lock(&(strand->lock));
+    strand->released = true;
+    bool idle = !strand->running;
+    _cdtp_mutex_unlock(&(strand->lock));
+
+    // Otherwise the strand frees itself once its last task has run
+    if (idle) {
+        _cdtp_strand_destroy(strand);
+    }
+}
+
+/**
+ * Call the relevant event function from within the current thread.
+ *
+ * @param func_info Information on the function being called.
+ */
+void _cdtp_event_task(void *func_info)
+{
+    CDTPEventFunc *event_func_info = (CDTPEventFunc *) func_info;
+
+    // Determine which function to call
+    switch (event_func_info->type) {
+        case CDTP_EVENT_ON_RECV_SERVER:
+            (*event_func_info->func.func_server_on_recv)(event_func_info->server,
+                                                         event_func_info->size_t1,
+                                                         event_func_info->voidp1,
+                                                         event_func_info->size_t2,
+                                                         event_func_info->voidp2);
+            break;
+        case CDTP_EVENT_ON_CONNECT:
+            (*event_func_info->func.func_server_on_connect)(event_func_info->server,
+                                                            event_func_info->size_t1,
+                                                            event_func_info->voidp1);
+            break;
+        case CDTP_EVENT_ON_DISCONNECT:
+            (*event_func_info->func.func_server_on_disconnect)(event_func_info->server,
+                                                               event_func_info->size_t1,
+                                                               event_func_info->voidp1);
+            break;
+        case CDTP_EVENT_ON_WRITABLE_SERVER:
+            (*event_func_info->func.func_server_on_writable)(event_func_info->server,
+                                                             event_func_info->size_t1,
+                                                             event_func_info->voidp1);
+            break;
+        case CDTP_EVENT_ON_RECV_CLIENT:
+            (*event_func_info->func.func_client_on_recv)(event_func_info->client,
+                                                         event_func_info->voidp1,
+                                                         event_func_info->size_t2,
+                                                         event_func_info->voidp2);
+            break;
+        case CDTP_EVENT_ON_DISCONNECTED:
+            (*event_func_info->func.func_client_on_disconnected)(event_func_info->client,
+                                                                 event_func_info->voidp1);
+            break;
+        case CDTP_EVENT_ON_WRITABLE_CLIENT:
+            (*event_func_info->func.func_client_on_writable)(event_func_info->client,
+                                                             event_func_info->voidp1);
+            break;
+        default:
+            break;
+    }
+
+    // Free function information memory
+    free(event_func_info);
 }
 
-void _cdtp_start_thread_on_recv_server(
+/**
+ * Queue an event function to be called on an event thread.
+ *
+ * @param pool The event thread pool.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
+ * @param func_info Information on the function being called.
+ */
+void _cdtp_dispatch_event(CDTPThreadPool *pool, CDTPStrand *strand, CDTPEventFunc *func_info)
+{
+    if (strand != NULL) {
+        _cdtp_strand_submit(strand, _cdtp_event_task, func_info);
+    }
+    else {
+        _cdtp_thread_pool_submit(pool, _cdtp_event_task, func_info);
+    }
+}
+
+void _cdtp_dispatch_on_recv_server(
     ServerOnRecvCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *data,
     size_t data_size,
@@ -124,78 +637,114 @@ void _cdtp_start_thread_on_recv_server(
 )
 {
     CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
-    func_info->name = "on_recv_server";
+    func_info->type = CDTP_EVENT_ON_RECV_SERVER;
     func_info->func.func_server_on_recv = func;
     func_info->server = server;
     func_info->size_t1 = client_id;
     func_info->voidp1 = data;
     func_info->size_t2 = data_size;
     func_info->voidp2 = arg;
-    _cdtp_start_event_thread(func_info);
+    _cdtp_dispatch_event(server->event_pool, strand, func_info);
 }
 
-void _cdtp_start_thread_on_connect(
+void _cdtp_dispatch_on_connect(
     ServerOnConnectCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *arg
 )
 {
     CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
-    func_info->name = "on_connect";
+    func_info->type = CDTP_EVENT_ON_CONNECT;
     func_info->func.func_server_on_connect = func;
     func_info->server = server;
     func_info->size_t1 = client_id;
     func_info->voidp1 = arg;
-    _cdtp_start_event_thread(func_info);
+    _cdtp_dispatch_event(server->event_pool, strand, func_info);
 }
 
-void _cdtp_start_thread_on_disconnect(
+void _cdtp_dispatch_on_disconnect(
     ServerOnDisconnectCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *arg
 )
 {
     CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
-    func_info->name = "on_disconnect";
+    func_info->type = CDTP_EVENT_ON_DISCONNECT;
     func_info->func.func_server_on_disconnect = func;
     func_info->server = server;
     func_info->size_t1 = client_id;
     func_info->voidp1 = arg;
-    _cdtp_start_event_thread(func_info);
+    _cdtp_dispatch_event(server->event_pool, strand, func_info);
 }
 
-void _cdtp_start_thread_on_recv_client(
+void _cdtp_dispatch_on_writable_server(
+    ServerOnWritableCallback func,
+    CDTPServer *server,
+    CDTPStrand *strand,
+    size_t client_id,
+    void *arg
+)
+{
+    CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
+    func_info->type = CDTP_EVENT_ON_WRITABLE_SERVER;
+    func_info->func.func_server_on_writable = func;
+    func_info->server = server;
+    func_info->size_t1 = client_id;
+    func_info->voidp1 = arg;
+    _cdtp_dispatch_event(server->event_pool, strand, func_info);
+}
+
+void _cdtp_dispatch_on_recv_client(
     ClientOnRecvCallback func,
     CDTPClient *client,
+    CDTPStrand *strand,
     void *data,
     size_t data_size,
     void *arg
 )
 {
     CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
-    func_info->name = "on_recv_client";
+    func_info->type = CDTP_EVENT_ON_RECV_CLIENT;
     func_info->func.func_client_on_recv = func;
     func_info->client = client;
     func_info->voidp1 = data;
     func_info->size_t2 = data_size;
     func_info->voidp2 = arg;
-    _cdtp_start_event_thread(func_info);
+    _cdtp_dispatch_event(client->event_pool, strand, func_info);
 }
 
-void _cdtp_start_thread_on_disconnected(
+void _cdtp_dispatch_on_disconnected(
     ClientOnDisconnectedCallback func,
     CDTPClient *client,
+    CDTPStrand *strand,
     void *arg
 )
 {
     CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
-    func_info->name = "on_disconnected";
+    func_info->type = CDTP_EVENT_ON_DISCONNECTED;
     func_info->func.func_client_on_disconnected = func;
     func_info->client = client;
     func_info->voidp1 = arg;
-    _cdtp_start_event_thread(func_info);
+    _cdtp_dispatch_event(client->event_pool, strand, func_info);
+}
+
+void _cdtp_dispatch_on_writable_client(
+    ClientOnWritableCallback func,
+    CDTPClient *client,
+    CDTPStrand *strand,
+    void *arg
+)
+{
+    CDTPEventFunc *func_info = (CDTPEventFunc *) malloc(sizeof(CDTPEventFunc));
+    func_info->type = CDTP_EVENT_ON_WRITABLE_CLIENT;
+    func_info->func.func_client_on_writable = func;
+    func_info->client = client;
+    func_info->voidp1 = arg;
+    _cdtp_dispatch_event(client->event_pool, strand, func_info);
 }
 
 /**
@@ -213,7 +762,7 @@ void *_cdtp_serve_thread(void *func_info)
     CDTPServeFunc *serve_func_info = (CDTPServeFunc *) func_info;
 
     // Call the function
-    (*serve_func_info->func)(serve_func_info->server);
+    (*serve_func_info->func)(serve_func_info->reactor);
 
     // Free function information memory and return
     free(serve_func_info);
@@ -227,20 +776,20 @@ void *_cdtp_serve_thread(void *func_info)
 
 #ifdef _WIN32
 HANDLE _cdtp_start_serve_thread(
-    void (*func)(CDTPServer *),
-    CDTPServer *server
+    void (*func)(CDTPServerReactor *),
+    CDTPServerReactor *reactor
 )
 #else
 pthread_t _cdtp_start_serve_thread(
-    void (*func)(CDTPServer *),
-    CDTPServer *server
+    void (*func)(CDTPServerReactor *),
+    CDTPServerReactor *reactor
 )
 #endif
 {
     // Set function information
     CDTPServeFunc *func_info = (CDTPServeFunc *) malloc(sizeof(CDTPServeFunc));
     func_info->func = func;
-    func_info->server = server;
+    func_info->reactor = reactor;
 
     // Start the thread
 #ifdef _WIN32
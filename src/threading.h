@@ -18,18 +18,197 @@
 #endif
 
 /**
- * Call the server `on_recv` event function in another thread.
+ * Initialize a mutex.
+ *
+ * @param mutex The mutex.
+ */
+void _cdtp_mutex_init(CDTPMutex *mutex);
+
+/**
+ * Lock a mutex, blocking until it is available.
+ *
+ * @param mutex The mutex.
+ */
+void _cdtp_mutex_lock(CDTPMutex *mutex);
+
+/**
+ * Unlock a mutex.
+ *
+ * @param mutex The mutex.
+ */
+void _cdtp_mutex_unlock(CDTPMutex *mutex);
+
+/**
+ * Destroy a mutex.
+ *
+ * @param mutex The mutex.
+ */
+void _cdtp_mutex_destroy(CDTPMutex *mutex);
+
+/**
+ * Initialize a reader-writer lock.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_init(CDTPRWLock *lock);
+
+/**
+ * Lock a reader-writer lock for reading, blocking while it is locked for writing.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_read_lock(CDTPRWLock *lock);
+
+/**
+ * Unlock a reader-writer lock locked for reading.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_read_unlock(CDTPRWLock *lock);
+
+/**
+ * Lock a reader-writer lock for writing, blocking while it is locked at all.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_write_lock(CDTPRWLock *lock);
+
+/**
+ * Unlock a reader-writer lock locked for writing.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_write_unlock(CDTPRWLock *lock);
+
+/**
+ * Destroy a reader-writer lock.
+ *
+ * @param lock The reader-writer lock.
+ */
+void _cdtp_rwlock_destroy(CDTPRWLock *lock);
+
+/**
+ * Initialize a condition variable.
+ *
+ * @param cond The condition variable.
+ */
+void _cdtp_cond_init(CDTPCond *cond);
+
+/**
+ * Wait on a condition variable. The mutex must be locked, and is locked again when this returns.
+ *
+ * @param cond The condition variable.
+ * @param mutex The mutex protecting the condition.
+ */
+void _cdtp_cond_wait(CDTPCond *cond, CDTPMutex *mutex);
+
+/**
+ * Wake one thread waiting on a condition variable.
+ *
+ * @param cond The condition variable.
+ */
+void _cdtp_cond_signal(CDTPCond *cond);
+
+/**
+ * Wake all threads waiting on a condition variable.
+ *
+ * @param cond The condition variable.
+ */
+void _cdtp_cond_broadcast(CDTPCond *cond);
+
+/**
+ * Destroy a condition variable.
+ *
+ * @param cond The condition variable.
+ */
+void _cdtp_cond_destroy(CDTPCond *cond);
+
+/**
+ * Create a pool of worker threads.
+ *
+ * @param num_threads The number of worker threads.
+ * @param max_tasks The number of queued tasks at which submitting blocks, or 0 to never block.
+ * @return The new thread pool, or NULL if the threads could not be started.
+ */
+CDTP_TEST_EXPORT CDTPThreadPool *_cdtp_thread_pool(size_t num_threads, size_t max_tasks);
+
+/**
+ * Queue a task to be run by one of a pool's worker threads. If the queue is full, this waits for room, unless called
+ * from one of the pool's own worker threads.
+ *
+ * @param pool The thread pool.
+ * @param func The task function.
+ * @param arg The value to pass to the task function.
+ */
+CDTP_TEST_EXPORT void _cdtp_thread_pool_submit(CDTPThreadPool *pool, void (*func)(void *), void *arg);
+
+/**
+ * Stop bounding a pool's queue, waking anything waiting for room in it. This is called before waiting for threads that
+ * submit to the pool, which might otherwise wait for room that only a task waiting on those same threads can make.
+ *
+ * @param pool The thread pool.
+ */
+CDTP_TEST_EXPORT void _cdtp_thread_pool_close(CDTPThreadPool *pool);
+
+/**
+ * Run all queued tasks, stop the pool's worker threads, and free the memory used by the pool.
+ *
+ * @param pool The thread pool.
+ * @return If the worker threads were stopped.
+ *
+ * If this is called by one of the pool's own tasks, that task's worker thread is detached instead of joined, and frees
+ * the pool once the task returns.
+ */
+CDTP_TEST_EXPORT bool _cdtp_thread_pool_free(CDTPThreadPool *pool);
+
+/**
+ * Create a strand, which runs tasks on a thread pool one at a time.
+ *
+ * @param pool The thread pool.
+ * @return The new strand.
+ */
+CDTP_TEST_EXPORT CDTPStrand *_cdtp_strand(CDTPThreadPool *pool);
+
+/**
+ * Queue a task to be run on a strand after all tasks previously submitted to it. If the pool bounds its queue and that
+ * many tasks are waiting on the strand, this waits for room, unless called from one of the pool's worker threads.
+ *
+ * @param strand The strand.
+ * @param func The task function.
+ * @param arg The value to pass to the task function.
+ */
+CDTP_TEST_EXPORT void _cdtp_strand_submit(CDTPStrand *strand, void (*func)(void *), void *arg);
+
+/**
+ * Stop bounding a strand's queue, waking anything waiting for room in it, in the same way as
+ * `_cdtp_thread_pool_close`.
+ *
+ * @param strand The strand.
+ */
+CDTP_TEST_EXPORT void _cdtp_strand_close(CDTPStrand *strand);
+
+/**
+ * Release a strand. Tasks already submitted to it still run, and its memory is freed once they have.
+ *
+ * @param strand The strand.
+ */
+CDTP_TEST_EXPORT void _cdtp_strand_free(CDTPStrand *strand);
+
+/**
+ * Call the server `on_recv` event function on the server's event thread pool.
  *
  * @param func A pointer to the event function.
  * @param server The socket server itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
  * @param client_id The client ID parameter.
  * @param data The data parameter.
  * @param data_size The data size parameter.
  * @param arg The function argument parameter.
  */
-void _cdtp_start_thread_on_recv_server(
+void _cdtp_dispatch_on_recv_server(
     ServerOnRecvCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *data,
     size_t data_size,
@@ -37,81 +216,121 @@ void _cdtp_start_thread_on_recv_server(
 );
 
 /**
- * Call the server `on_connect` event function in another thread.
+ * Call the server `on_connect` event function on the server's event thread pool.
  *
  * @param func A pointer to the event function.
  * @param server The socket server itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
  * @param client_id The client ID parameter.
  * @param arg The function argument parameter.
  */
-void _cdtp_start_thread_on_connect(
+void _cdtp_dispatch_on_connect(
     ServerOnConnectCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *arg
 );
 
 /**
- * Call the server `on_disconnect` event function in another thread.
+ * Call the server `on_disconnect` event function on the server's event thread pool.
  *
  * @param func A pointer to the event function.
  * @param server The socket server itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
  * @param client_id The client ID parameter.
  * @param arg The function argument parameter.
  */
-void _cdtp_start_thread_on_disconnect(
+void _cdtp_dispatch_on_disconnect(
     ServerOnDisconnectCallback func,
     CDTPServer *server,
+    CDTPStrand *strand,
+    size_t client_id,
+    void *arg
+);
+
+/**
+ * Call the server `on_writable` event function on the server's event thread pool.
+ *
+ * @param func A pointer to the event function.
+ * @param server The socket server itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
+ * @param client_id The client ID parameter.
+ * @param arg The function argument parameter.
+ */
+void _cdtp_dispatch_on_writable_server(
+    ServerOnWritableCallback func,
+    CDTPServer *server,
+    CDTPStrand *strand,
     size_t client_id,
     void *arg
 );
 
 /**
- * Call the client `on_recv` event function in another thread.
+ * Call the client `on_recv` event function on the client's event thread pool.
  *
  * @param func A pointer to the event function.
  * @param client The socket client itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
  * @param data The data parameter.
  * @param data_size The data size parameter.
  * @param arg The function argument parameter.
  */
-void _cdtp_start_thread_on_recv_client(
+void _cdtp_dispatch_on_recv_client(
     ClientOnRecvCallback func,
     CDTPClient *client,
+    CDTPStrand *strand,
     void *data,
     size_t data_size,
     void *arg
 );
 
 /**
- * Call the client `on_disconnected` event function in another thread.
+ * Call the client `on_disconnected` event function on the client's event thread pool.
  *
  * @param func A pointer to the event function.
  * @param client The socket client itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
  * @param arg The function argument parameter.
  */
-void _cdtp_start_thread_on_disconnected(
+void _cdtp_dispatch_on_disconnected(
     ClientOnDisconnectedCallback func,
     CDTPClient *client,
+    CDTPStrand *strand,
+    void *arg
+);
+
+/**
+ * Call the client `on_writable` event function on the client's event thread pool.
+ *
+ * @param func A pointer to the event function.
+ * @param client The socket client itself.
+ * @param strand The strand to run the event function on, or NULL to run it on any event thread.
+ * @param arg The function argument parameter.
+ */
+void _cdtp_dispatch_on_writable_client(
+    ClientOnWritableCallback func,
+    CDTPClient *client,
+    CDTPStrand *strand,
     void *arg
 );
 
 /**
- * Call the server's serve function in a separate thread.
+ * Call a server I/O thread's serve function in a separate thread.
  *
  * @param func The serve function.
- * @param server The socket server.
+ * @param reactor The server I/O thread.
  * @return A handle to the thread.
  */
 #ifdef _WIN32
 HANDLE _cdtp_start_serve_thread(
-    void (*func)(CDTPServer *),
-    CDTPServer *server
+    void (*func)(CDTPServerReactor *),
+    CDTPServerReactor *reactor
 );
 #else
 pthread_t _cdtp_start_serve_thread(
-    void (*func)(CDTPServer *),
-    CDTPServer *server
+    void (*func)(CDTPServerReactor *),
+    CDTPServerReactor *reactor
 );
 #endif
 
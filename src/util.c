@@ -94,14 +94,18 @@ CDTP_EXPORT void cdtp_on_error_clear(void)
     CDTP_ON_ERROR_REGISTERED = false;
 }
 
-CDTP_TEST_EXPORT unsigned char *_cdtp_encode_message_size(size_t size)
+CDTP_TEST_EXPORT void _cdtp_write_message_size(unsigned char *dest, size_t size)
 {
-    unsigned char *encoded_size = (unsigned char *) malloc(CDTP_LENSIZE * sizeof(unsigned char));
-
     for (int i = CDTP_LENSIZE - 1; i >= 0; i--) {
-        encoded_size[i] = size % 256;
+        dest[i] = size % 256;
         size = size >> 8;
     }
+}
+
+CDTP_TEST_EXPORT unsigned char *_cdtp_encode_message_size(size_t size)
+{
+    unsigned char *encoded_size = (unsigned char *) malloc(CDTP_LENSIZE * sizeof(unsigned char));
+    _cdtp_write_message_size(encoded_size, size);
 
     return encoded_size;
 }
@@ -118,21 +122,13 @@ CDTP_TEST_EXPORT size_t _cdtp_decode_message_size(unsigned char *encoded_size)
     return size;
 }
 
-char *_cdtp_construct_message(void *data, size_t data_size)
+CDTP_TEST_EXPORT char *_cdtp_construct_message(void *data, size_t data_size)
 {
-    char *data_str = (char *) data;
     char *message = (char *) malloc((CDTP_LENSIZE + data_size) * sizeof(char));
-    unsigned char *size = _cdtp_encode_message_size(data_size);
 
-    for (int i = 0; i < CDTP_LENSIZE; i++) {
-        message[i] = size[i];
-    }
+    _cdtp_write_message_size((unsigned char *) message, data_size);
+    memcpy(message + CDTP_LENSIZE, data, data_size);
 
-    for (size_t i = 0; i < data_size; i++) {
-        message[i + CDTP_LENSIZE] = data_str[i];
-    }
-
-    free(size);
     return message;
 }
 
@@ -149,6 +145,67 @@ void *_cdtp_deconstruct_message(char *message, size_t *data_size)
     return (void *) data;
 }
 
+size_t _cdtp_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (size_t) info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t) count : 1;
+#endif
+}
+
+double _cdtp_time(void)
+{
+#ifdef _WIN32
+    return (double) GetTickCount64() / 1000.0;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1000000000.0;
+#endif
+}
+
+bool _cdtp_unix_address(struct sockaddr_storage *address, socklen_t *address_size, const char *path)
+{
+    struct sockaddr_un *unix_address = (struct sockaddr_un *) address;
+    size_t path_size = strlen(path);
+
+    // The path must fit with its null terminator
+    if (path_size == 0 || path_size >= sizeof(unix_address->sun_path)) {
+        return false;
+    }
+
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    unix_address->sun_family = AF_UNIX;
+    memcpy(unix_address->sun_path, path, path_size + 1);
+    *address_size = (socklen_t) sizeof(struct sockaddr_un);
+
+    return true;
+}
+
+char *_cdtp_unix_address_path(struct sockaddr_storage *address, socklen_t address_size)
+{
+    struct sockaddr_un *unix_address = (struct sockaddr_un *) address;
+    size_t path_offset = offsetof(struct sockaddr_un, sun_path);
+    size_t max_path_size = (size_t) address_size > path_offset ? (size_t) address_size - path_offset : 0;
+    size_t path_size = 0;
+
+    // The path is not always null-terminated within the address
+    while (path_size < max_path_size && path_size < sizeof(unix_address->sun_path) &&
+           unix_address->sun_path[path_size] != '\0') {
+        path_size++;
+    }
+
+    char *path = (char *) malloc((path_size + 1) * sizeof(char));
+    memcpy(path, unix_address->sun_path, path_size);
+    path[path_size] = '\0';
+
+    return path;
+}
+
 CDTP_EXPORT void cdtp_sleep(double seconds)
 {
 #ifdef _WIN32
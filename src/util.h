@@ -10,21 +10,27 @@
 #include <stddef.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #  include <WinSock2.h>
 #  include <Windows.h>
 #  include <WS2tcpip.h>
+#  include <afunix.h>
 #else
 #  include <unistd.h>
 #  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <sys/uio.h>
 #  include <fcntl.h>
 #  include <netinet/in.h>
 #  include <arpa/inet.h>
 #  include <errno.h>
 #  include <time.h>
-#  include <limits.h>
 #  include <stdint.h>
+#  include <sys/epoll.h>
+#  include <sys/eventfd.h>
+#  include <pthread.h>
 #endif
 
 // Export functions.
@@ -81,6 +87,16 @@
 #define CDTP_CLIENT_KEY_EXCHANGE_FAILED 32
 #define CDTP_SERVER_NOT_DONE            33
 #define CDTP_CLIENT_NOT_DONE            34
+#define CDTP_REACTOR_INIT_FAILED        35
+#define CDTP_REACTOR_REGISTER_FAILED    36
+#define CDTP_REACTOR_WAIT_FAILED        37
+#define CDTP_SERVER_CANNOT_CONFIGURE    38
+#define CDTP_POOL_THREAD_START_FAILED   39
+#define CDTP_POOL_THREAD_NOT_CLOSING    40
+#define CDTP_KEY_POOL_START_FAILED      41
+#define CDTP_CLIENT_CANNOT_CONFIGURE    42
+#define CDTP_SERVER_SEND_WOULD_BLOCK    43
+#define CDTP_CLIENT_SEND_WOULD_BLOCK    44
 
 // Global address family to use.
 #ifndef CDTP_ADDRESS_FAMILY
@@ -109,9 +125,107 @@
 #  define CDTP_SERVER_LISTEN_BACKLOG 8
 #endif
 
+// Default number of CDTP server I/O threads.
+#ifndef CDTP_SERVER_IO_THREADS
+#  define CDTP_SERVER_IO_THREADS 1
+#endif
+
+// Default number of CDTP server handshake threads.
+#ifndef CDTP_SERVER_HANDSHAKE_THREADS
+#  define CDTP_SERVER_HANDSHAKE_THREADS 4
+#endif
+
+// Default number of CDTP server event threads.
+#ifndef CDTP_SERVER_EVENT_THREADS
+#  define CDTP_SERVER_EVENT_THREADS 4
+#endif
+
+// Default number of CDTP client event threads.
+#ifndef CDTP_CLIENT_EVENT_THREADS
+#  define CDTP_CLIENT_EVENT_THREADS 1
+#endif
+
+// Default maximum number of events waiting to be handled before I/O threads block.
+#ifndef CDTP_EVENT_QUEUE_SIZE
+#  define CDTP_EVENT_QUEUE_SIZE 1024
+#endif
+
+// Default number of RSA key pairs kept ready by a CDTP server using a key pool.
+#ifndef CDTP_SERVER_KEY_POOL_SIZE
+#  define CDTP_SERVER_KEY_POOL_SIZE 8
+#endif
+
+// Amount of time, in seconds, a client is given to complete its key exchange.
+#ifndef CDTP_HANDSHAKE_TIMEOUT
+#  define CDTP_HANDSHAKE_TIMEOUT 5.0
+#endif
+
+// Size of the largest message, in bytes, accepted while exchanging keys. Peers sending larger messages are refused.
+#ifndef CDTP_HANDSHAKE_MAX_SIZE
+#  define CDTP_HANDSHAKE_MAX_SIZE 16384
+#endif
+
+// Minimum amount of free space, in bytes, offered to each socket read.
+#ifndef CDTP_RECV_BUFFER_SIZE
+#  define CDTP_RECV_BUFFER_SIZE 65536
+#endif
+
+// Default size of the largest message that may be received, in bytes. Connections sending larger messages are closed.
+#ifndef CDTP_MAX_MESSAGE_SIZE
+#  define CDTP_MAX_MESSAGE_SIZE 16777216
+#endif
+
+// Default number of bytes waiting to be sent on a connection above which more data is refused.
+#ifndef CDTP_SEND_HIGH_WATERMARK
+#  define CDTP_SEND_HIGH_WATERMARK 1048576
+#endif
+
+// Default number of bytes waiting to be sent on a connection at which a connection that refused data takes it again.
+#ifndef CDTP_SEND_LOW_WATERMARK
+#  define CDTP_SEND_LOW_WATERMARK 65536
+#endif
+
+// Amount of time, in seconds, spent sending a connection's queued bytes when it is closed.
+#ifndef CDTP_SEND_DRAIN_TIMEOUT
+#  define CDTP_SEND_DRAIN_TIMEOUT 5.0
+#endif
+
+// Default amount of time, in seconds, a CDTP server's resumption tickets are valid for.
+#ifndef CDTP_SERVER_TICKET_LIFETIME
+#  define CDTP_SERVER_TICKET_LIFETIME 3600.0
+#endif
+
+// Default size, in bytes, of the ring each direction of a shared memory connection uses.
+#ifndef CDTP_SHM_RING_SIZE
+#  define CDTP_SHM_RING_SIZE 1048576
+#endif
+
+// Number of independently locked shards in a CDTP server's client map.
+#ifndef CDTP_CLIENT_MAP_SHARDS
+#  define CDTP_CLIENT_MAP_SHARDS 16
+#endif
+
 // Length of the size portion of each message.
 #define CDTP_LENSIZE 5
 
+// Handshake version byte identifying an X25519 key exchange.
+#define CDTP_HANDSHAKE_ECDH 2
+
+// Handshake version byte identifying an attempt to resume an earlier session with a ticket.
+#define CDTP_HANDSHAKE_RESUME 3
+
+// Handshake version byte identifying a plaintext connection, where messages are sent without being encrypted.
+#define CDTP_HANDSHAKE_PLAINTEXT 4
+
+// Handshake flag bit asking the server for a resumption ticket.
+#define CDTP_HANDSHAKE_WANTS_TICKET 1
+
+// Handshake flag bit asking the server to send and receive messages through shared memory.
+#define CDTP_HANDSHAKE_WANTS_SHARED_MEMORY 2
+
+// Size, in bytes, of a processor cache line.
+#define CDTP_CACHE_LINE_SIZE 64
+
 // Amount of time to sleep between socket reads.
 #define CDTP_SLEEP_TIME 0.001
 
@@ -211,6 +325,14 @@ CDTP_EXPORT void cdtp_on_error(
  */
 CDTP_EXPORT void cdtp_on_error_clear(void);
 
+/**
+ * Write the size portion of a message.
+ *
+ * @param dest Where to write the `CDTP_LENSIZE` encoded bytes.
+ * @param size The message size.
+ */
+CDTP_TEST_EXPORT void _cdtp_write_message_size(unsigned char *dest, size_t size);
+
 /**
  * Encode the size portion of a message.
  *
@@ -238,7 +360,7 @@ CDTP_TEST_EXPORT size_t _cdtp_decode_message_size(unsigned char *encoded_size);
  *
  * Note that the returned value is allocated on the heap, and `free` will need to be called on it.
  */
-char *_cdtp_construct_message(void *data, size_t data_size);
+CDTP_TEST_EXPORT char *_cdtp_construct_message(void *data, size_t data_size);
 
 /**
  * Deconstruct a message.
@@ -251,6 +373,41 @@ char *_cdtp_construct_message(void *data, size_t data_size);
  */
 void *_cdtp_deconstruct_message(char *message, size_t *data_size);
 
+/**
+ * Get the number of processors available to the current process.
+ *
+ * @return The number of processors, or 1 if it cannot be determined.
+ */
+size_t _cdtp_cpu_count(void);
+
+/**
+ * Get the current time of a monotonic clock, for measuring how long operations take.
+ *
+ * @return The current time, in seconds.
+ */
+double _cdtp_time(void);
+
+/**
+ * Set up a Unix domain socket address.
+ *
+ * @param address The address to set up.
+ * @param address_size A pointer that will be set to the size of the address, in bytes.
+ * @param path The path of the socket.
+ * @return If the path fits in a Unix domain socket address.
+ */
+bool _cdtp_unix_address(struct sockaddr_storage *address, socklen_t *address_size, const char *path);
+
+/**
+ * Get the path of a Unix domain socket address.
+ *
+ * @param address The address.
+ * @param address_size The size of the address, in bytes.
+ * @return The path, which is empty for sockets that are not bound to one.
+ *
+ * Note that the returned value is allocated on the heap, and `free` will need to be called on it.
+ */
+char *_cdtp_unix_address_path(struct sockaddr_storage *address, socklen_t address_size);
+
 /**
  * Sleep for a number of seconds.
  *
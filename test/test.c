@@ -436,6 +436,360 @@ void client_on_disconnected(CDTPClient *client, void *arg)
     test_state_client_disconnected(state, client);
 }
 
+#define ORDERED_CLIENTS 4
+#define ORDERED_MESSAGES 64
+
+typedef struct _ClientMapTaskArg {
+    CDTPClientMap *map;
+    CDTPSocket *sock;
+    bool failed;
+} ClientMapTaskArg;
+
+typedef struct _StrandTaskArg {
+    size_t index;
+    size_t *order;
+    size_t *count;
+} StrandTaskArg;
+
+typedef struct _OrderedState {
+    size_t received[ORDERED_CLIENTS];
+    bool connected[ORDERED_CLIENTS];
+    bool disconnected[ORDERED_CLIENTS];
+    bool in_order;
+} OrderedState;
+
+#define INLINE_MESSAGES 64
+
+typedef struct _InlineState {
+    size_t server_connected;
+    size_t server_received;
+    size_t client_received;
+    size_t client_disconnected;
+    bool in_order;
+} InlineState;
+
+#define BACKPRESSURE_MESSAGES 64
+#define BACKPRESSURE_MESSAGE_SIZE 262144
+#define BACKPRESSURE_LOW_WATERMARK 65536
+#define BACKPRESSURE_HIGH_WATERMARK 262144
+
+typedef struct _BackpressureState {
+    size_t client_id;
+    size_t server_received;
+    size_t client_received;
+    size_t server_writable;
+    size_t client_writable;
+    bool client_blocked;
+    bool in_order;
+} BackpressureState;
+
+void client_map_task(void *arg)
+{
+    ClientMapTaskArg *task_arg = (ClientMapTaskArg *) arg;
+    size_t client_ids[16];
+
+    for (size_t i = 0; i < 256; i++) {
+        for (size_t j = 0; j < 16; j++) {
+            client_ids[j] = _cdtp_client_map_add(task_arg->map, task_arg->sock);
+        }
+
+        for (size_t j = 0; j < 16; j++) {
+            CDTPSocket *sock = _cdtp_client_map_acquire(task_arg->map, client_ids[j]);
+
+            if (sock != task_arg->sock) {
+                task_arg->failed = true;
+            }
+
+            if (sock != NULL) {
+                _cdtp_client_map_release(task_arg->map, client_ids[j]);
+            }
+        }
+
+        for (size_t j = 0; j < 16; j++) {
+            if (_cdtp_client_map_pop(task_arg->map, client_ids[j]) != task_arg->sock) {
+                task_arg->failed = true;
+            }
+        }
+    }
+}
+
+size_t client_map_capacity(CDTPClientMap *map)
+{
+    size_t capacity = 0;
+
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        capacity += map->shards[i].capacity;
+    }
+
+    return capacity;
+}
+
+void client_map_sum(size_t client_id, CDTPSocket *sock, void *arg)
+{
+    size_t *totals = (size_t *) arg;
+    totals[0] += client_id;
+    totals[1] += (size_t) (sock->sock);
+}
+
+void thread_pool_task(void *arg)
+{
+    cdtp_sleep(0.001);
+    *((bool *) arg) = true;
+}
+
+void thread_pool_free_task(void *arg)
+{
+    TEST_ASSERT(_cdtp_thread_pool_free((CDTPThreadPool *) arg))
+}
+
+void strand_task(void *arg)
+{
+    StrandTaskArg *task_arg = (StrandTaskArg *) arg;
+    cdtp_sleep(0.001);
+    task_arg->order[(*(task_arg->count))++] = task_arg->index;
+}
+
+void strand_blocking_task(void *arg)
+{
+    while (*((bool *) arg)) {
+        cdtp_sleep(0.001);
+    }
+}
+
+void stopping_on_recv(CDTPServer *server, size_t client_id, void *data, size_t data_size, void *arg)
+{
+    (void) client_id;
+    (void) data_size;
+
+    size_t *received = (size_t *) arg;
+    free(data);
+
+    // Stop the server from the first event, once the client's strand has filled up behind it
+    if ((*received)++ == 0) {
+        cdtp_sleep(0.1);
+        cdtp_server_stop(server);
+    }
+}
+
+void ordered_on_recv(CDTPServer *server, size_t client_id, void *data, size_t data_size, void *arg)
+{
+    (void) server;
+
+    OrderedState *state = (OrderedState *) arg;
+    TEST_ASSERT_EQ(data_size, sizeof(size_t))
+    TEST_ASSERT(client_id < ORDERED_CLIENTS)
+    size_t value = *((size_t *) data);
+    free(data);
+
+    // Give events for the same client a chance to overlap, if they could
+    cdtp_sleep(0.001);
+
+    if (!state->connected[client_id] || state->disconnected[client_id] || value != state->received[client_id]) {
+        state->in_order = false;
+    }
+
+    state->received[client_id]++;
+}
+
+void ordered_on_connect(CDTPServer *server, size_t client_id, void *arg)
+{
+    (void) server;
+
+    OrderedState *state = (OrderedState *) arg;
+    TEST_ASSERT(client_id < ORDERED_CLIENTS)
+
+    if (state->received[client_id] != 0) {
+        state->in_order = false;
+    }
+
+    state->connected[client_id] = true;
+}
+
+void ordered_on_disconnect(CDTPServer *server, size_t client_id, void *arg)
+{
+    (void) server;
+
+    OrderedState *state = (OrderedState *) arg;
+    TEST_ASSERT(client_id < ORDERED_CLIENTS)
+
+    if (state->received[client_id] != ORDERED_MESSAGES) {
+        state->in_order = false;
+    }
+
+    state->disconnected[client_id] = true;
+}
+
+void inline_server_on_recv(CDTPServer *server, size_t client_id, void *data, size_t data_size, void *arg)
+{
+    InlineState *state = (InlineState *) arg;
+    TEST_ASSERT_EQ(data_size, sizeof(size_t))
+    size_t value;
+    memcpy(&value, data, sizeof(size_t));
+
+    if (state->server_connected != 1 || value != state->server_received) {
+        state->in_order = false;
+    }
+
+    state->server_received++;
+
+    // Reply with the lent data, then drop the client once it has sent everything
+    cdtp_server_send(server, client_id, data, data_size);
+
+    if (value == INLINE_MESSAGES - 1) {
+        cdtp_server_remove_client(server, client_id);
+    }
+}
+
+void inline_server_on_connect(CDTPServer *server, size_t client_id, void *arg)
+{
+    (void) server;
+    (void) client_id;
+
+    InlineState *state = (InlineState *) arg;
+    state->server_connected++;
+}
+
+void inline_client_on_recv(CDTPClient *client, void *data, size_t data_size, void *arg)
+{
+    (void) client;
+
+    InlineState *state = (InlineState *) arg;
+    TEST_ASSERT_EQ(data_size, sizeof(size_t))
+    size_t value;
+    memcpy(&value, data, sizeof(size_t));
+
+    if (value != state->client_received) {
+        state->in_order = false;
+    }
+
+    state->client_received++;
+}
+
+void inline_client_on_disconnected(CDTPClient *client, void *arg)
+{
+    (void) client;
+
+    InlineState *state = (InlineState *) arg;
+    state->client_disconnected++;
+}
+
+bool backpressure_check_message(void *data, size_t data_size, size_t expected_index)
+{
+    unsigned char *bytes = (unsigned char *) data;
+    size_t index;
+
+    if (data_size != BACKPRESSURE_MESSAGE_SIZE) {
+        return false;
+    }
+
+    memcpy(&index, data, sizeof(size_t));
+
+    if (index != expected_index) {
+        return false;
+    }
+
+    for (size_t i = sizeof(size_t); i < data_size; i++) {
+        if (bytes[i] != (unsigned char) (i + expected_index)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void backpressure_fill_message(unsigned char *message, size_t index)
+{
+    memcpy(message, &index, sizeof(size_t));
+
+    for (size_t i = sizeof(size_t); i < BACKPRESSURE_MESSAGE_SIZE; i++) {
+        message[i] = (unsigned char) (i + index);
+    }
+}
+
+bool backpressure_server_send(CDTPServer *server, size_t client_id, unsigned char *message, size_t index)
+{
+    backpressure_fill_message(message, index);
+    cdtp_server_send(server, client_id, message, BACKPRESSURE_MESSAGE_SIZE);
+
+    if (cdtp_get_error() == CDTP_SERVER_SEND_WOULD_BLOCK) {
+        cdtp_get_underlying_error();
+        return false;
+    }
+
+    return true;
+}
+
+bool backpressure_client_send(CDTPClient *client, unsigned char *message, size_t index)
+{
+    backpressure_fill_message(message, index);
+    cdtp_client_send(client, message, BACKPRESSURE_MESSAGE_SIZE);
+
+    if (cdtp_get_error() == CDTP_CLIENT_SEND_WOULD_BLOCK) {
+        cdtp_get_underlying_error();
+        return false;
+    }
+
+    return true;
+}
+
+void backpressure_server_on_recv(CDTPServer *server, size_t client_id, void *data, size_t data_size, void *arg)
+{
+    (void) server;
+    (void) client_id;
+
+    BackpressureState *state = (BackpressureState *) arg;
+
+    if (!backpressure_check_message(data, data_size, state->server_received)) {
+        state->in_order = false;
+    }
+
+    state->server_received++;
+    free(data);
+}
+
+void backpressure_server_on_connect(CDTPServer *server, size_t client_id, void *arg)
+{
+    (void) server;
+
+    BackpressureState *state = (BackpressureState *) arg;
+    state->client_id = client_id;
+}
+
+void backpressure_server_on_writable(CDTPServer *server, size_t client_id, void *arg)
+{
+    (void) server;
+    (void) client_id;
+
+    BackpressureState *state = (BackpressureState *) arg;
+    state->server_writable++;
+}
+
+void backpressure_client_on_writable(CDTPClient *client, void *arg)
+{
+    (void) client;
+
+    BackpressureState *state = (BackpressureState *) arg;
+    state->client_writable++;
+}
+
+void backpressure_client_on_recv(CDTPClient *client, void *data, size_t data_size, void *arg)
+{
+    (void) client;
+
+    BackpressureState *state = (BackpressureState *) arg;
+
+    if (!backpressure_check_message(data, data_size, state->client_received)) {
+        state->in_order = false;
+    }
+
+    state->client_received++;
+
+    // Hold up the client's handle thread, so that nothing more is read from the server until the test allows it
+    while (state->client_blocked) {
+        cdtp_sleep(0.01);
+    }
+}
+
 void on_err(int cdtp_err, int underlying_err, void *arg)
 {
     printf("CDTP error:               %d\n", cdtp_err);
@@ -462,6 +816,7 @@ typedef struct _Custom {
 #define SERVER_PORT 29275
 #define CLIENT_HOST "127.0.0.1"
 #define CLIENT_PORT 29275
+#define UNIX_SOCKET_PATH "cdtp-test.sock"
 #define EMPTY {0}
 
 /**
@@ -498,6 +853,11 @@ void test_util(void)
     TEST_ASSERT_ARRAY_EQ(msg_size8, expected_msg_size8, (size_t) CDTP_LENSIZE)
     TEST_ASSERT_ARRAY_EQ(msg_size9, expected_msg_size9, (size_t) CDTP_LENSIZE)
 
+    // Test writing the message size in place
+    unsigned char written_msg_size[CDTP_LENSIZE];
+    _cdtp_write_message_size(written_msg_size, 47362409218);
+    TEST_ASSERT_ARRAY_EQ(written_msg_size, expected_msg_size8, (size_t) CDTP_LENSIZE)
+
     // Test message size decoding
     TEST_ASSERT_EQ(_cdtp_decode_message_size(expected_msg_size1), (size_t) 0)
     TEST_ASSERT_EQ(_cdtp_decode_message_size(expected_msg_size2), (size_t) 1)
@@ -528,8 +888,8 @@ void test_client_map(void)
 {
     // Create map
     CDTPClientMap *map = _cdtp_client_map();
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
 
     // Create test sockets
     CDTPSocket *sock1 = (CDTPSocket *) malloc(sizeof(CDTPSocket));
@@ -540,167 +900,216 @@ void test_client_map(void)
     // Test false contains
     bool false_contains = _cdtp_client_map_contains(map, 234);
     TEST_ASSERT(!false_contains)
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
 
     // Test null get
     CDTPSocket *null_get = _cdtp_client_map_get(map, 234);
     TEST_ASSERT(null_get == NULL)
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    CDTPSocket *null_acquire = _cdtp_client_map_acquire(map, 234);
+    TEST_ASSERT(null_acquire == NULL)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
 
     // Test null pop
     CDTPSocket *null_pop = _cdtp_client_map_pop(map, 234);
     TEST_ASSERT(null_pop == NULL)
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-
-    // Test zero-size iterator
-    CDTPClientMapIter *zero_size_iter = _cdtp_client_map_iter(map);
-    TEST_ASSERT_EQ(zero_size_iter->size, (size_t) 0)
-    _cdtp_client_map_iter_free(zero_size_iter);
-
-    // Test set
-    bool set1 = _cdtp_client_map_set(map, 234, sock1);
-    TEST_ASSERT(set1)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-
-    // Test double set
-    bool double_set = _cdtp_client_map_set(map, 234, sock2);
-    TEST_ASSERT(!double_set)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+
+    // Test zero-size iteration
+    size_t zero_size_totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, zero_size_totals);
+    TEST_ASSERT_EQ(zero_size_totals[0], (size_t) 0)
+    TEST_ASSERT_EQ(zero_size_totals[1], (size_t) 0)
+
+    // Test add
+    size_t id1 = _cdtp_client_map_add(map, sock1);
+    TEST_ASSERT_EQ(id1, (size_t) 0)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 1)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
 
     // Test true contains
-    bool contains1 = _cdtp_client_map_contains(map, 234);
+    bool contains1 = _cdtp_client_map_contains(map, id1);
     TEST_ASSERT(contains1)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 1)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
 
     // Test get
-    CDTPSocket *get1 = _cdtp_client_map_get(map, 234);
+    CDTPSocket *get1 = _cdtp_client_map_get(map, id1);
     TEST_ASSERT_EQ((size_t) (get1->sock), (size_t) 123)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-
-    // Test one-size iterator
-    CDTPClientMapIter *one_size_iter = _cdtp_client_map_iter(map);
-    TEST_ASSERT_EQ(one_size_iter->size, (size_t) 1)
-    TEST_ASSERT_EQ(one_size_iter->clients[0]->client_id, (size_t) 234)
-    TEST_ASSERT_EQ((size_t) (one_size_iter->clients[0]->sock->sock), (size_t) 123)
-    _cdtp_client_map_iter_free(one_size_iter);
-
-    // Test second set, contains, get
-    bool contains2 = _cdtp_client_map_contains(map, 456);
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 1)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+
+    // Test acquire
+    CDTPSocket *acquire1 = _cdtp_client_map_acquire(map, id1);
+    TEST_ASSERT(acquire1 == sock1)
+    TEST_ASSERT(_cdtp_client_map_get(map, id1) == sock1)
+    _cdtp_client_map_release(map, id1);
+
+    // Test one-size iteration
+    size_t one_size_totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, one_size_totals);
+    TEST_ASSERT_EQ(one_size_totals[0], id1)
+    TEST_ASSERT_EQ(one_size_totals[1], (size_t) 123)
+
+    // Test second add, contains, get
+    bool contains2 = _cdtp_client_map_contains(map, 1);
     TEST_ASSERT(!contains2)
-    CDTPSocket *get2 = _cdtp_client_map_get(map, 456);
+    CDTPSocket *get2 = _cdtp_client_map_get(map, 1);
     TEST_ASSERT(get2 == NULL)
-    bool set2 = _cdtp_client_map_set(map, 456, sock2);
-    TEST_ASSERT(set2)
-    TEST_ASSERT_EQ(map->size, (size_t) 2)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-    bool contains3 = _cdtp_client_map_contains(map, 456);
+    size_t id2 = _cdtp_client_map_add(map, sock2);
+    TEST_ASSERT_EQ(id2, (size_t) 1)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 2)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+    bool contains3 = _cdtp_client_map_contains(map, id2);
     TEST_ASSERT(contains3)
-    CDTPSocket *get3 = _cdtp_client_map_get(map, 456);
+    CDTPSocket *get3 = _cdtp_client_map_get(map, id2);
     TEST_ASSERT_EQ((size_t) (get3->sock), (size_t) 345)
 
-    // Test two-size iterator
-    CDTPClientMapIter *two_size_iter = _cdtp_client_map_iter(map);
-    TEST_ASSERT_EQ(two_size_iter->size, (size_t) 2)
-    TEST_ASSERT_EQ(two_size_iter->clients[0]->client_id, (size_t) 456)
-    TEST_ASSERT_EQ((size_t) (two_size_iter->clients[0]->sock->sock), (size_t) 345)
-    TEST_ASSERT_EQ(two_size_iter->clients[1]->client_id, (size_t) 234)
-    TEST_ASSERT_EQ((size_t) (two_size_iter->clients[1]->sock->sock), (size_t) 123)
-    _cdtp_client_map_iter_free(two_size_iter);
+    // Test two-size iteration
+    size_t two_size_totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, two_size_totals);
+    TEST_ASSERT_EQ(two_size_totals[0], id1 + id2)
+    TEST_ASSERT_EQ(two_size_totals[1], (size_t) 468)
 
     // Test pop
-    CDTPSocket *pop1 = _cdtp_client_map_pop(map, 234);
+    CDTPSocket *pop1 = _cdtp_client_map_pop(map, id1);
     TEST_ASSERT_EQ((size_t) (pop1->sock), (size_t) 123)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-    CDTPSocket *pop2 = _cdtp_client_map_pop(map, 456);
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 1)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+    CDTPSocket *pop2 = _cdtp_client_map_pop(map, id2);
     TEST_ASSERT_EQ((size_t) (pop2->sock), (size_t) 345)
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-
-    // Test hash collisions
-    bool set3 = _cdtp_client_map_set(map, 3, sock1);
-    bool set4 = _cdtp_client_map_set(map, 19, sock2);
-    TEST_ASSERT(set3)
-    TEST_ASSERT(set4)
-    TEST_ASSERT_EQ(map->size, (size_t) 2)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-    bool contains4 = _cdtp_client_map_contains(map, 3);
-    TEST_ASSERT(contains4)
-    bool contains5 = _cdtp_client_map_contains(map, 19);
-    TEST_ASSERT(contains5)
-    CDTPSocket *get4 = _cdtp_client_map_get(map, 3);
-    TEST_ASSERT_EQ((size_t) (get4->sock), (size_t) 123)
-    CDTPSocket *get5 = _cdtp_client_map_get(map, 19);
-    TEST_ASSERT_EQ((size_t) (get5->sock), (size_t) 345)
-    CDTPClientMapIter *iter1 = _cdtp_client_map_iter(map);
-    TEST_ASSERT_EQ(iter1->size, (size_t) 2)
-    TEST_ASSERT_EQ(iter1->clients[0]->client_id, (size_t) 3)
-    TEST_ASSERT_EQ((size_t) (iter1->clients[0]->sock->sock), (size_t) 123)
-    TEST_ASSERT_EQ(iter1->clients[1]->client_id, (size_t) 19)
-    TEST_ASSERT_EQ((size_t) (iter1->clients[1]->sock->sock), (size_t) 345)
-    _cdtp_client_map_iter_free(iter1);
-    CDTPSocket *pop3 = _cdtp_client_map_pop(map, 3);
-    TEST_ASSERT_EQ((size_t) (pop3->sock), (size_t) 123)
-    TEST_ASSERT_EQ(map->size, (size_t) 1)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-    CDTPSocket *pop4 = _cdtp_client_map_pop(map, 19);
-    TEST_ASSERT_EQ((size_t) (pop4->sock), (size_t) 345)
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+
+    // Test that a popped ID is rejected, even after its node is used again
+    TEST_ASSERT(_cdtp_client_map_pop(map, id1) == NULL)
+    size_t reused_ids[64];
+    for (size_t i = 0; i < 64; i++) {
+        reused_ids[i] = _cdtp_client_map_add(map, sock2);
+        TEST_ASSERT(reused_ids[i] != CDTP_CLIENT_MAP_INVALID_ID)
+        TEST_ASSERT(reused_ids[i] != id1)
+        TEST_ASSERT(reused_ids[i] != id2)
+    }
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
+    TEST_ASSERT(!_cdtp_client_map_contains(map, id1))
+    TEST_ASSERT(!_cdtp_client_map_contains(map, id2))
+    TEST_ASSERT(_cdtp_client_map_get(map, id1) == NULL)
+    TEST_ASSERT(_cdtp_client_map_acquire(map, id2) == NULL)
+    TEST_ASSERT(_cdtp_client_map_pop(map, id1) == NULL)
+    TEST_ASSERT(_cdtp_client_map_pop(map, id2) == NULL)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 64)
+    for (size_t i = 0; i < 64; i++) {
+        TEST_ASSERT(_cdtp_client_map_pop(map, reused_ids[i]) == sock2)
+    }
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+
+    // Test that every pop moves a node on to a new generation, so IDs are never handed out twice
+    size_t generation_ids[256];
+    for (size_t i = 0; i < 256; i++) {
+        generation_ids[i] = _cdtp_client_map_add(map, sock1);
+        TEST_ASSERT_EQ((generation_ids[i] & 0xffff) % CDTP_CLIENT_MAP_SHARDS, (i + 2) % CDTP_CLIENT_MAP_SHARDS)
+        TEST_ASSERT(_cdtp_client_map_pop(map, generation_ids[i]) == sock1)
+        for (size_t j = 0; j < i; j++) {
+            TEST_ASSERT(generation_ids[j] != generation_ids[i])
+        }
+    }
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
 
     // Test resize up
-    for (size_t i = 0; i < 16; i++) {
+    size_t client_ids[65];
+    size_t client_id_total = 0;
+    for (size_t i = 0; i < 64; i++) {
         CDTPSocket *sock = (CDTPSocket *) malloc(sizeof(CDTPSocket));
         sock->sock = 1000 + i;
-        bool set5 = _cdtp_client_map_set(map, i * 2, sock);
-        TEST_ASSERT(set5)
+        client_ids[i] = _cdtp_client_map_add(map, sock);
+        TEST_ASSERT(client_ids[i] != CDTP_CLIENT_MAP_INVALID_ID)
+        client_id_total += client_ids[i];
     }
-    TEST_ASSERT_EQ(map->size, (size_t) 16)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 64)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 64)
     CDTPSocket *sock3 = (CDTPSocket *) malloc(sizeof(CDTPSocket));
-    sock3->sock = 1016;
-    bool set6 = _cdtp_client_map_set(map, 32, sock3);
-    TEST_ASSERT(set6)
-    TEST_ASSERT_EQ(map->size, (size_t) 17)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 32)
-    size_t client_id_total = 0;
-    size_t sock_total = 0;
-    CDTPClientMapIter *iter2 = _cdtp_client_map_iter(map);
-    for (size_t i = 0; i < iter2->size; i++) {
-        client_id_total += iter2->clients[i]->client_id;
-        sock_total += (size_t) (iter2->clients[i]->sock->sock);
-    }
-    TEST_ASSERT_EQ(client_id_total, (size_t) 272)
-    TEST_ASSERT_EQ(sock_total, (size_t) 17136)
-    _cdtp_client_map_iter_free(iter2);
-
-    // Test resize down
-    for (size_t i = 16; i >= 8; i--) {
-        CDTPSocket *sock = _cdtp_client_map_pop(map, i * 2);
+    sock3->sock = 1064;
+    client_ids[64] = _cdtp_client_map_add(map, sock3);
+    TEST_ASSERT(client_ids[64] != CDTP_CLIENT_MAP_INVALID_ID)
+    client_id_total += client_ids[64];
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 65)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 68)
+    for (size_t i = 0; i < 65; i++) {
+        TEST_ASSERT_EQ((size_t) (_cdtp_client_map_get(map, client_ids[i])->sock), 1000 + i)
+    }
+    size_t totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, totals);
+    TEST_ASSERT_EQ(totals[0], client_id_total)
+    TEST_ASSERT_EQ(totals[1], (size_t) 67080)
+
+    // Test resize down, which never happens, since node indices must stay stable for IDs to remain valid
+    for (size_t i = 64; i >= 8; i--) {
+        CDTPSocket *sock = _cdtp_client_map_pop(map, client_ids[i]);
         TEST_ASSERT(sock != NULL)
         free(sock);
     }
-    TEST_ASSERT_EQ(map->size, (size_t) 8)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 32)
-    CDTPSocket *sock4 = _cdtp_client_map_pop(map, 14);
-    TEST_ASSERT(sock4 != NULL)
-    TEST_ASSERT_EQ(map->size, (size_t) 7)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
-    free(sock4);
-    for (int i = 6; i >= 0; i--) {
-        CDTPSocket *sock = _cdtp_client_map_pop(map, ((size_t) i) * 2);
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 8)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 68)
+    for (int i = 7; i >= 0; i--) {
+        CDTPSocket *sock = _cdtp_client_map_pop(map, client_ids[i]);
         TEST_ASSERT(sock != NULL)
         free(sock);
     }
-    TEST_ASSERT_EQ(map->size, (size_t) 0)
-    TEST_ASSERT_EQ(map->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 68)
+    for (size_t i = 0; i < CDTP_CLIENT_MAP_SHARDS; i++) {
+        for (size_t j = 0; j < map->shards[i].capacity; j++) {
+            TEST_ASSERT(map->shards[i].nodes[j].sock == NULL)
+        }
+    }
+
+    // Test clearing, which invalidates every ID
+    size_t cleared_ids[40];
+    for (size_t i = 0; i < 40; i++) {
+        cleared_ids[i] = _cdtp_client_map_add(map, sock1);
+    }
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 68)
+    _cdtp_client_map_clear(map);
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    TEST_ASSERT_EQ(client_map_capacity(map), (size_t) 68)
+    for (size_t i = 0; i < 40; i++) {
+        TEST_ASSERT(!_cdtp_client_map_contains(map, cleared_ids[i]))
+    }
+    size_t empty_totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, empty_totals);
+    TEST_ASSERT_EQ(empty_totals[0], (size_t) 0)
+
+    // Test popping every client, which passes each one on as it is removed
+    size_t popped_id_total = 0;
+    for (size_t i = 0; i < 10; i++) {
+        popped_id_total += _cdtp_client_map_add(map, sock1);
+    }
+    size_t popped_totals[2] = {0, 0};
+    _cdtp_client_map_pop_all(map, client_map_sum, popped_totals);
+    TEST_ASSERT_EQ(popped_totals[0], popped_id_total)
+    TEST_ASSERT_EQ(popped_totals[1], 10 * (size_t) (sock1->sock))
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
+    size_t popped_empty_totals[2] = {0, 0};
+    _cdtp_client_map_for_each(map, client_map_sum, popped_empty_totals);
+    TEST_ASSERT_EQ(popped_empty_totals[0], (size_t) 0)
+
+    // Test using the map from many threads at once
+    CDTPThreadPool *pool = _cdtp_thread_pool(8, 0);
+    TEST_ASSERT(pool != NULL)
+    ClientMapTaskArg task_args[8];
+    for (size_t i = 0; i < 8; i++) {
+        task_args[i].map = map;
+        task_args[i].sock = i % 2 == 0 ? sock1 : sock2;
+        task_args[i].failed = false;
+        _cdtp_thread_pool_submit(pool, client_map_task, &(task_args[i]));
+    }
+    TEST_ASSERT(_cdtp_thread_pool_free(pool))
+    for (size_t i = 0; i < 8; i++) {
+        TEST_ASSERT(!task_args[i].failed)
+    }
+    TEST_ASSERT_EQ(_cdtp_client_map_size(map), (size_t) 0)
 
     // Clean up
     free(sock1);
@@ -708,6 +1117,106 @@ void test_client_map(void)
     _cdtp_client_map_free(map);
 }
 
+/**
+ * Test receive buffer functions.
+ */
+void test_recv_buffer(void)
+{
+    // Build a stream of messages
+    char *message1 = "Hello, receive buffer!";
+    char *message2 = "";
+    size_t message3_size = CDTP_RECV_BUFFER_SIZE * 3 + 7;
+    char *message3 = rand_bytes(message3_size);
+    char *encoded1 = _cdtp_construct_message(message1, STR_SIZE(message1));
+    char *encoded2 = _cdtp_construct_message(message2, STR_SIZE(message2));
+    char *encoded3 = _cdtp_construct_message(message3, message3_size);
+    size_t encoded1_size = CDTP_LENSIZE + STR_SIZE(message1);
+    size_t encoded2_size = CDTP_LENSIZE + STR_SIZE(message2);
+    size_t encoded3_size = CDTP_LENSIZE + message3_size;
+    size_t stream_size = encoded1_size + encoded2_size + encoded3_size;
+    char *stream = (char *) malloc(stream_size * sizeof(char));
+    memcpy(stream, encoded1, encoded1_size);
+    memcpy(stream + encoded1_size, encoded2, encoded2_size);
+    memcpy(stream + encoded1_size + encoded2_size, encoded3, encoded3_size);
+
+    // Create buffer
+    CDTPRecvBuffer *buffer = _cdtp_recv_buffer(CDTP_MAX_MESSAGE_SIZE);
+    void *data;
+    size_t data_size;
+    size_t space;
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+
+    // Receive the first message split in the middle of its size
+    memcpy(_cdtp_recv_buffer_space(buffer, &space), stream, 3);
+    TEST_ASSERT(space >= (size_t) CDTP_RECV_BUFFER_SIZE)
+    _cdtp_recv_buffer_commit(buffer, 3);
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+    memcpy(_cdtp_recv_buffer_space(buffer, &space), stream + 3, encoded1_size - 4);
+    _cdtp_recv_buffer_commit(buffer, encoded1_size - 4);
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+    memcpy(_cdtp_recv_buffer_space(buffer, &space), stream + encoded1_size - 1, 1);
+    _cdtp_recv_buffer_commit(buffer, 1);
+    TEST_ASSERT(_cdtp_recv_buffer_next(buffer, &data, &data_size))
+    TEST_ASSERT_EQ(data_size, STR_SIZE(message1))
+    TEST_ASSERT_MEM_EQ(data, message1, data_size)
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+
+    // Receive the second message and the start of the third message at once
+    size_t offset = encoded1_size;
+    memcpy(_cdtp_recv_buffer_space(buffer, &space), stream + offset, encoded2_size + CDTP_LENSIZE + 1);
+    _cdtp_recv_buffer_commit(buffer, encoded2_size + CDTP_LENSIZE + 1);
+    offset += encoded2_size + CDTP_LENSIZE + 1;
+    TEST_ASSERT(_cdtp_recv_buffer_next(buffer, &data, &data_size))
+    TEST_ASSERT_EQ(data_size, STR_SIZE(message2))
+    TEST_ASSERT_MEM_EQ(data, message2, data_size)
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+
+    // The buffer should make room for the rest of the third message
+    _cdtp_recv_buffer_space(buffer, &space);
+    TEST_ASSERT(space >= stream_size - offset)
+
+    // Receive the rest of the third message in uneven chunks
+    while (offset < stream_size) {
+        void *dest = _cdtp_recv_buffer_space(buffer, &space);
+        size_t chunk_size = MIN(MIN(space, (size_t) 10007), stream_size - offset);
+        memcpy(dest, stream + offset, chunk_size);
+        _cdtp_recv_buffer_commit(buffer, chunk_size);
+        offset += chunk_size;
+
+        if (offset < stream_size) {
+            TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+        }
+    }
+    TEST_ASSERT(_cdtp_recv_buffer_next(buffer, &data, &data_size))
+    TEST_ASSERT_EQ(data_size, message3_size)
+    TEST_ASSERT_MEM_EQ(data, message3, data_size)
+    TEST_ASSERT(!_cdtp_recv_buffer_next(buffer, &data, &data_size))
+
+    // The buffer should shrink back once the large message has been handled
+    TEST_ASSERT(buffer->capacity > (size_t) CDTP_RECV_BUFFER_SIZE)
+    TEST_ASSERT(_cdtp_recv_buffer_space(buffer, &space) != NULL)
+    TEST_ASSERT_EQ(buffer->capacity, (size_t) CDTP_RECV_BUFFER_SIZE)
+
+    // Messages larger than the buffer allows should be rejected, whether or not they are complete
+    CDTPRecvBuffer *small_buffer = _cdtp_recv_buffer(STR_SIZE(message1));
+    memcpy(_cdtp_recv_buffer_space(small_buffer, &space), stream, encoded1_size);
+    TEST_ASSERT(_cdtp_recv_buffer_commit(small_buffer, encoded1_size))
+    memcpy(_cdtp_recv_buffer_space(small_buffer, &space), encoded3, CDTP_LENSIZE);
+    TEST_ASSERT(!_cdtp_recv_buffer_commit(small_buffer, CDTP_LENSIZE))
+    TEST_ASSERT(_cdtp_recv_buffer_next(small_buffer, &data, &data_size))
+    TEST_ASSERT_MEM_EQ(data, message1, data_size)
+    TEST_ASSERT(_cdtp_recv_buffer_space(small_buffer, &space) == NULL)
+    _cdtp_recv_buffer_free(small_buffer);
+
+    // Clean up
+    _cdtp_recv_buffer_free(buffer);
+    free(message3);
+    free(encoded1);
+    free(encoded2);
+    free(encoded3);
+    free(stream);
+}
+
 /**
  * Test crypto functions.
  */
@@ -720,10 +1229,61 @@ void test_crypto(void)
     CDTPCryptoData *rsa_decrypted = _cdtp_crypto_rsa_decrypt(keys->private_key, rsa_encrypted->data, rsa_encrypted->data_size);
     TEST_ASSERT_INT_EQ(strcmp((char *) (rsa_decrypted->data), rsa_message), 0)
     TEST_ASSERT_INT_NE(strcmp((char *) (rsa_encrypted->data), rsa_message), 0)
+
+    // Test that RSA ciphertexts that are cut short or claim the wrong key size are rejected
+    unsigned char *rsa_ciphertext = (unsigned char *) (rsa_encrypted->data);
+    size_t rsa_key_size = _cdtp_decode_message_size(rsa_ciphertext);
+    cdtp_on_error_clear();
+    TEST_ASSERT(_cdtp_crypto_rsa_decrypt(keys->private_key, rsa_ciphertext, CDTP_LENSIZE - 1) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    TEST_ASSERT(_cdtp_crypto_rsa_decrypt(keys->private_key, rsa_ciphertext, CDTP_LENSIZE + rsa_key_size) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    TEST_ASSERT(_cdtp_crypto_rsa_decrypt(keys->private_key, rsa_ciphertext, rsa_encrypted->data_size - 1) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    _cdtp_write_message_size(rsa_ciphertext, rsa_encrypted->data_size);
+    TEST_ASSERT(_cdtp_crypto_rsa_decrypt(keys->private_key, rsa_ciphertext, rsa_encrypted->data_size) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    _cdtp_write_message_size(rsa_ciphertext, rsa_key_size);
+    rsa_ciphertext[CDTP_LENSIZE] ^= 1;
+    TEST_ASSERT(_cdtp_crypto_rsa_decrypt(keys->private_key, rsa_ciphertext, rsa_encrypted->data_size) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    cdtp_get_underlying_error();
+    cdtp_on_error(on_err, NULL);
     _cdtp_crypto_rsa_key_pair_free(keys);
     _cdtp_crypto_data_free(rsa_encrypted);
     _cdtp_crypto_data_free(rsa_decrypted);
 
+    // Test that both halves of an RSA key pair share one parsed key, which survives being written out and parsed again
+    CDTPRSAKeyPair *keys5 = _cdtp_crypto_rsa_key_pair();
+    TEST_ASSERT(keys5->public_key->evp_key == keys5->private_key->evp_key)
+    CDTPCryptoData *public_pem = _cdtp_crypto_rsa_public_key_to_bytes(keys5->public_key);
+    CDTPCryptoData *private_pem = _cdtp_crypto_rsa_private_key_to_bytes(keys5->private_key);
+    TEST_ASSERT(private_pem != NULL)
+    CDTPRSAPublicKey *parsed_public_key = _cdtp_crypto_rsa_public_key_from_bytes(public_pem->data, public_pem->data_size);
+    CDTPRSAPrivateKey *parsed_private_key = _cdtp_crypto_rsa_private_key_from_bytes(private_pem->data, private_pem->data_size);
+    TEST_ASSERT(parsed_public_key != NULL)
+    TEST_ASSERT(parsed_private_key != NULL)
+    CDTPCryptoData *parsed_encrypted = _cdtp_crypto_rsa_encrypt(parsed_public_key, rsa_message, STR_SIZE(rsa_message));
+    CDTPCryptoData *parsed_decrypted = _cdtp_crypto_rsa_decrypt(keys5->private_key, parsed_encrypted->data, parsed_encrypted->data_size);
+    TEST_ASSERT_INT_EQ(strcmp((char *) (parsed_decrypted->data), rsa_message), 0)
+    CDTPCryptoData *parsed_encrypted2 = _cdtp_crypto_rsa_encrypt(keys5->public_key, rsa_message, STR_SIZE(rsa_message));
+    CDTPCryptoData *parsed_decrypted2 = _cdtp_crypto_rsa_decrypt(parsed_private_key, parsed_encrypted2->data, parsed_encrypted2->data_size);
+    TEST_ASSERT_INT_EQ(strcmp((char *) (parsed_decrypted2->data), rsa_message), 0)
+    cdtp_on_error_clear();
+    TEST_ASSERT(_cdtp_crypto_rsa_public_key_from_bytes(rsa_message, STR_SIZE(rsa_message)) == NULL)
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+    cdtp_get_underlying_error();
+    cdtp_on_error(on_err, NULL);
+    _cdtp_crypto_rsa_key_pair_free(keys5);
+    _cdtp_crypto_data_free(public_pem);
+    _cdtp_crypto_data_free(private_pem);
+    _cdtp_crypto_rsa_public_key_free(parsed_public_key);
+    _cdtp_crypto_rsa_private_key_free(parsed_private_key);
+    _cdtp_crypto_data_free(parsed_encrypted);
+    _cdtp_crypto_data_free(parsed_decrypted);
+    _cdtp_crypto_data_free(parsed_encrypted2);
+    _cdtp_crypto_data_free(parsed_decrypted2);
+
     // Test AES
     char *aes_message = "Hello, AES!";
     CDTPAESKey *key = _cdtp_crypto_aes_key();
@@ -731,6 +1291,45 @@ void test_crypto(void)
     CDTPCryptoData *aes_decrypted = _cdtp_crypto_aes_decrypt(key, aes_encrypted->data, aes_encrypted->data_size);
     TEST_ASSERT_INT_EQ(strcmp((char *) (aes_decrypted->data), aes_message), 0)
     TEST_ASSERT_INT_NE(strcmp((char *) (aes_encrypted->data), aes_message), 0)
+    TEST_ASSERT_EQ(aes_encrypted->data_size, _cdtp_crypto_aes_ciphertext_size(key, STR_SIZE(aes_message)))
+
+    // Test decrypting AES data in place
+    void *aes_in_place;
+    size_t aes_in_place_size;
+    bool aes_decrypted_in_place = _cdtp_crypto_aes_decrypt_in_place(key,
+                                                                    aes_encrypted->data,
+                                                                    aes_encrypted->data_size,
+                                                                    &aes_in_place,
+                                                                    &aes_in_place_size);
+    TEST_ASSERT(aes_decrypted_in_place)
+    TEST_ASSERT_EQ(aes_in_place_size, STR_SIZE(aes_message))
+    TEST_ASSERT_INT_EQ(strcmp((char *) aes_in_place, aes_message), 0)
+    TEST_ASSERT((char *) aes_in_place > (char *) (aes_encrypted->data))
+    TEST_ASSERT((char *) aes_in_place < (char *) (aes_encrypted->data) + aes_encrypted->data_size)
+
+    // Test encrypting AES messages of sizes around the block size straight into a frame
+    unsigned char frame_plaintext[48];
+
+    for (size_t i = 0; i < sizeof(frame_plaintext); i++) {
+        frame_plaintext[i] = (unsigned char) (i * 7);
+    }
+
+    for (size_t frame_plaintext_size = 0; frame_plaintext_size <= sizeof(frame_plaintext); frame_plaintext_size++) {
+        size_t frame_size;
+        unsigned char *frame = (unsigned char *) _cdtp_crypto_aes_encrypt_message(key,
+                                                                                  frame_plaintext,
+                                                                                  frame_plaintext_size,
+                                                                                  &frame_size);
+        TEST_ASSERT(frame != NULL)
+        TEST_ASSERT_EQ(frame_size, CDTP_LENSIZE + _cdtp_crypto_aes_ciphertext_size(key, frame_plaintext_size))
+        TEST_ASSERT_EQ(_cdtp_decode_message_size(frame), frame_size - CDTP_LENSIZE)
+        CDTPCryptoData *frame_decrypted = _cdtp_crypto_aes_decrypt(key, frame + CDTP_LENSIZE, frame_size - CDTP_LENSIZE);
+        TEST_ASSERT_EQ(frame_decrypted->data_size, frame_plaintext_size)
+        TEST_ASSERT_MEM_EQ(frame_decrypted->data, frame_plaintext, frame_plaintext_size)
+        _cdtp_crypto_data_free(frame_decrypted);
+        free(frame);
+    }
+
     _cdtp_crypto_aes_key_free(key);
     _cdtp_crypto_data_free(aes_encrypted);
     _cdtp_crypto_data_free(aes_decrypted);
@@ -751,6 +1350,176 @@ void test_crypto(void)
     _cdtp_crypto_data_free(encrypted_key);
     _cdtp_crypto_data_free(decrypted_key);
     _cdtp_crypto_aes_key_free(key3);
+
+    // Test deriving AES keys with X25519
+    CDTPECDHKeyPair *server_keys = _cdtp_crypto_ecdh_key_pair();
+    CDTPECDHKeyPair *client_keys = _cdtp_crypto_ecdh_key_pair();
+    CDTPECDHKeyPair *other_keys = _cdtp_crypto_ecdh_key_pair();
+    CDTPAESKey *server_key = _cdtp_crypto_ecdh_aes_key(server_keys, client_keys->public_key, true, CDTP_CIPHER_AES_256_CBC);
+    CDTPAESKey *client_key = _cdtp_crypto_ecdh_aes_key(client_keys, server_keys->public_key, false, CDTP_CIPHER_AES_256_CBC);
+    CDTPAESKey *other_key = _cdtp_crypto_ecdh_aes_key(other_keys, server_keys->public_key, false, CDTP_CIPHER_AES_256_CBC);
+    TEST_ASSERT_EQ(server_key->key_size, (size_t) CDTP_AES_KEY_SIZE)
+    TEST_ASSERT_EQ(client_key->key_size, (size_t) CDTP_AES_KEY_SIZE)
+    TEST_ASSERT_MEM_EQ(server_key->key, client_key->key, (size_t) CDTP_AES_KEY_SIZE)
+    TEST_ASSERT_MEM_NE(server_key->key, other_key->key, (size_t) CDTP_AES_KEY_SIZE)
+    TEST_ASSERT_MEM_NE(server_keys->public_key, client_keys->public_key, (size_t) CDTP_ECDH_PUBLIC_KEY_SIZE)
+    CDTPCryptoData *ecdh_encrypted = _cdtp_crypto_aes_encrypt(server_key, aes_message, STR_SIZE(aes_message));
+    CDTPCryptoData *ecdh_decrypted = _cdtp_crypto_aes_decrypt(client_key, ecdh_encrypted->data, ecdh_encrypted->data_size);
+    TEST_ASSERT_INT_EQ(strcmp((char *) (ecdh_decrypted->data), aes_message), 0)
+
+    // Test the authenticated ciphers, with nonces counting the messages sent in each direction
+    CDTPCipher aead_ciphers[] = {CDTP_CIPHER_AES_256_GCM, CDTP_CIPHER_CHACHA20_POLY1305};
+
+    for (size_t cipher = 0; cipher < 2; cipher++) {
+        CDTPAESKey *server_aead_key = _cdtp_crypto_ecdh_aes_key(server_keys, client_keys->public_key, true, aead_ciphers[cipher]);
+        CDTPAESKey *client_aead_key = _cdtp_crypto_ecdh_aes_key(client_keys, server_keys->public_key, false, aead_ciphers[cipher]);
+        TEST_ASSERT(server_aead_key->mode == aead_ciphers[cipher])
+        TEST_ASSERT_MEM_EQ(server_aead_key->key, server_key->key, (size_t) CDTP_AES_KEY_SIZE)
+
+        for (size_t frame_plaintext_size = 0; frame_plaintext_size <= sizeof(frame_plaintext); frame_plaintext_size++) {
+            CDTPAESKey *sender = frame_plaintext_size % 2 == 0 ? server_aead_key : client_aead_key;
+            CDTPAESKey *receiver = frame_plaintext_size % 2 == 0 ? client_aead_key : server_aead_key;
+            size_t frame_size;
+            unsigned char *frame = (unsigned char *) _cdtp_crypto_aes_encrypt_message(sender,
+                                                                                      frame_plaintext,
+                                                                                      frame_plaintext_size,
+                                                                                      &frame_size);
+            TEST_ASSERT(frame != NULL)
+            TEST_ASSERT_EQ(frame_size, CDTP_LENSIZE + frame_plaintext_size + CDTP_AEAD_TAG_SIZE)
+            TEST_ASSERT_EQ(_cdtp_crypto_aes_ciphertext_size(sender, frame_plaintext_size), frame_size - CDTP_LENSIZE)
+            void *aead_in_place;
+            size_t aead_in_place_size;
+            bool aead_decrypted_in_place = _cdtp_crypto_aes_decrypt_in_place(receiver,
+                                                                             frame + CDTP_LENSIZE,
+                                                                             frame_size - CDTP_LENSIZE,
+                                                                             &aead_in_place,
+                                                                             &aead_in_place_size);
+            TEST_ASSERT(aead_decrypted_in_place)
+            TEST_ASSERT(aead_in_place == (void *) (frame + CDTP_LENSIZE))
+            TEST_ASSERT_EQ(aead_in_place_size, frame_plaintext_size)
+            TEST_ASSERT_MEM_EQ(aead_in_place, frame_plaintext, frame_plaintext_size)
+            free(frame);
+        }
+
+        TEST_ASSERT_EQ(server_aead_key->send_counter, (size_t) 25)
+        TEST_ASSERT_EQ(client_aead_key->recv_counter, (size_t) 25)
+        TEST_ASSERT_EQ(client_aead_key->send_counter, (size_t) 24)
+        TEST_ASSERT_EQ(server_aead_key->recv_counter, (size_t) 24)
+
+        // Test that tampered, replayed, and reflected messages are rejected
+        CDTPCryptoData *aead_encrypted = _cdtp_crypto_aes_encrypt(server_aead_key, aes_message, STR_SIZE(aes_message));
+        TEST_ASSERT_EQ(aead_encrypted->data_size, STR_SIZE(aes_message) + CDTP_AEAD_TAG_SIZE)
+        TEST_ASSERT_MEM_NE(aead_encrypted->data, aes_message, STR_SIZE(aes_message))
+        cdtp_on_error_clear();
+        ((unsigned char *) (aead_encrypted->data))[0] ^= 1;
+        TEST_ASSERT(_cdtp_crypto_aes_decrypt(client_aead_key, aead_encrypted->data, aead_encrypted->data_size) == NULL)
+        TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+        ((unsigned char *) (aead_encrypted->data))[0] ^= 1;
+        client_aead_key->recv_counter--;
+        CDTPCryptoData *aead_decrypted = _cdtp_crypto_aes_decrypt(client_aead_key, aead_encrypted->data, aead_encrypted->data_size);
+        TEST_ASSERT(aead_decrypted != NULL)
+        TEST_ASSERT_INT_EQ(strcmp((char *) (aead_decrypted->data), aes_message), 0)
+        TEST_ASSERT(_cdtp_crypto_aes_decrypt(client_aead_key, aead_encrypted->data, aead_encrypted->data_size) == NULL)
+        TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+        TEST_ASSERT(_cdtp_crypto_aes_decrypt(server_aead_key, aead_encrypted->data, aead_encrypted->data_size) == NULL)
+        TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_OPENSSL_ERROR)
+        cdtp_get_underlying_error();
+        cdtp_on_error(on_err, NULL);
+        _cdtp_crypto_aes_key_free(server_aead_key);
+        _cdtp_crypto_aes_key_free(client_aead_key);
+        _cdtp_crypto_data_free(aead_encrypted);
+        _cdtp_crypto_data_free(aead_decrypted);
+    }
+
+    // Test choosing ciphers depending on which side accelerates AES
+    char offered[CDTP_NUM_CIPHERS];
+    TEST_ASSERT_EQ(_cdtp_crypto_offer_ciphers(offered, true), (size_t) CDTP_NUM_CIPHERS)
+    TEST_ASSERT_INT_EQ(offered[0], CDTP_CIPHER_AES_256_GCM)
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(offered, CDTP_NUM_CIPHERS, true), CDTP_CIPHER_AES_256_GCM)
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(offered, CDTP_NUM_CIPHERS, false), CDTP_CIPHER_CHACHA20_POLY1305)
+    TEST_ASSERT_EQ(_cdtp_crypto_offer_ciphers(offered, false), (size_t) CDTP_NUM_CIPHERS)
+    TEST_ASSERT_INT_EQ(offered[0], CDTP_CIPHER_CHACHA20_POLY1305)
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(offered, CDTP_NUM_CIPHERS, true), CDTP_CIPHER_CHACHA20_POLY1305)
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(offered, 0, true), CDTP_CIPHER_AES_256_CBC)
+    char unknown_offered[] = {(char) 99, (char) CDTP_CIPHER_AES_256_CBC};
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(unknown_offered, 1, false), 0)
+    TEST_ASSERT_INT_EQ(_cdtp_crypto_choose_cipher(unknown_offered, 2, false), CDTP_CIPHER_AES_256_CBC)
+
+    // Test sealing and opening resumption tickets
+    char ticket_key[CDTP_AES_KEY_SIZE];
+    char other_ticket_key[CDTP_AES_KEY_SIZE];
+    char secret[CDTP_RESUMPTION_SECRET_SIZE];
+    char opened_secret[CDTP_RESUMPTION_SECRET_SIZE];
+    CDTPCipher opened_mode;
+    memset(ticket_key, 1, CDTP_AES_KEY_SIZE);
+    memset(other_ticket_key, 2, CDTP_AES_KEY_SIZE);
+    TEST_ASSERT(_cdtp_crypto_resumption_secret(client_key, secret))
+    CDTPCryptoData *ticket = _cdtp_crypto_ticket_seal(ticket_key, CDTP_CIPHER_CHACHA20_POLY1305, secret, 60);
+    TEST_ASSERT(ticket != NULL)
+    TEST_ASSERT_EQ(ticket->data_size, (size_t) CDTP_TICKET_SIZE)
+    TEST_ASSERT(_cdtp_crypto_ticket_open(ticket_key, ticket->data, ticket->data_size, &opened_mode, opened_secret))
+    TEST_ASSERT_INT_EQ(opened_mode, CDTP_CIPHER_CHACHA20_POLY1305)
+    TEST_ASSERT_INT_EQ(memcmp(opened_secret, secret, CDTP_RESUMPTION_SECRET_SIZE), 0)
+    TEST_ASSERT(!_cdtp_crypto_ticket_open(other_ticket_key, ticket->data, ticket->data_size, &opened_mode, opened_secret))
+    TEST_ASSERT(!_cdtp_crypto_ticket_open(ticket_key, ticket->data, ticket->data_size - 1, &opened_mode, opened_secret))
+    ((char *) (ticket->data))[CDTP_AEAD_NONCE_SIZE] ^= 1;
+    TEST_ASSERT(!_cdtp_crypto_ticket_open(ticket_key, ticket->data, ticket->data_size, &opened_mode, opened_secret))
+    ((char *) (ticket->data))[CDTP_AEAD_NONCE_SIZE] ^= 1;
+    CDTPCryptoData *expired_ticket = _cdtp_crypto_ticket_seal(ticket_key, CDTP_CIPHER_AES_256_GCM, secret, 0);
+    TEST_ASSERT(expired_ticket != NULL)
+    TEST_ASSERT(!_cdtp_crypto_ticket_open(ticket_key, expired_ticket->data, expired_ticket->data_size, &opened_mode, opened_secret))
+
+    // Test that both parties derive the same key when resuming, and a different one every time
+    char client_random[CDTP_RESUMPTION_RANDOM_SIZE];
+    memset(client_random, 3, CDTP_RESUMPTION_RANDOM_SIZE);
+    CDTPAESKey *resumed_server_key = _cdtp_crypto_resumed_aes_key(secret, client_random, server_keys->public_key, true, CDTP_CIPHER_AES_256_GCM);
+    CDTPAESKey *resumed_client_key = _cdtp_crypto_resumed_aes_key(secret, client_random, server_keys->public_key, false, CDTP_CIPHER_AES_256_GCM);
+    client_random[0] = (char) 4;
+    CDTPAESKey *other_resumed_key = _cdtp_crypto_resumed_aes_key(secret, client_random, server_keys->public_key, false, CDTP_CIPHER_AES_256_GCM);
+    TEST_ASSERT(resumed_server_key != NULL)
+    TEST_ASSERT(resumed_client_key != NULL)
+    TEST_ASSERT(other_resumed_key != NULL)
+    TEST_ASSERT_INT_EQ(memcmp(resumed_server_key->key, resumed_client_key->key, CDTP_AES_KEY_SIZE), 0)
+    TEST_ASSERT(memcmp(resumed_client_key->key, client_key->key, CDTP_AES_KEY_SIZE) != 0)
+    TEST_ASSERT(memcmp(resumed_client_key->key, other_resumed_key->key, CDTP_AES_KEY_SIZE) != 0)
+    CDTPCryptoData *resumed_encrypted = _cdtp_crypto_aes_encrypt(resumed_client_key, aes_message, STR_SIZE(aes_message));
+    CDTPCryptoData *resumed_decrypted = _cdtp_crypto_aes_decrypt(resumed_server_key, resumed_encrypted->data, resumed_encrypted->data_size);
+    TEST_ASSERT(resumed_decrypted != NULL)
+    TEST_ASSERT_INT_EQ(strcmp((char *) (resumed_decrypted->data), aes_message), 0)
+    _cdtp_crypto_data_free(ticket);
+    _cdtp_crypto_data_free(expired_ticket);
+    _cdtp_crypto_aes_key_free(resumed_server_key);
+    _cdtp_crypto_aes_key_free(resumed_client_key);
+    _cdtp_crypto_aes_key_free(other_resumed_key);
+    _cdtp_crypto_data_free(resumed_encrypted);
+    _cdtp_crypto_data_free(resumed_decrypted);
+
+    _cdtp_crypto_ecdh_key_pair_free(server_keys);
+    _cdtp_crypto_ecdh_key_pair_free(client_keys);
+    _cdtp_crypto_ecdh_key_pair_free(other_keys);
+    _cdtp_crypto_aes_key_free(server_key);
+    _cdtp_crypto_aes_key_free(client_key);
+    _cdtp_crypto_aes_key_free(other_key);
+    _cdtp_crypto_data_free(ecdh_encrypted);
+    _cdtp_crypto_data_free(ecdh_decrypted);
+
+    // Test that an RSA public key followed by an X25519 offer can still be read by older clients
+    CDTPRSAKeyPair *keys4 = _cdtp_crypto_rsa_key_pair();
+    size_t pem_size = keys4->public_key->key_size;
+    char *hello = (char *) malloc(pem_size + 2 + CDTP_ECDH_PUBLIC_KEY_SIZE);
+    memcpy(hello, keys4->public_key->key, pem_size);
+    hello[pem_size] = (char) 0;
+    hello[pem_size + 1] = (char) CDTP_HANDSHAKE_ECDH;
+    memset(hello + pem_size + 2, 255, CDTP_ECDH_PUBLIC_KEY_SIZE);
+    CDTPRSAPublicKey *hello_public_key = _cdtp_crypto_rsa_public_key_from_bytes(hello, pem_size + 2 + CDTP_ECDH_PUBLIC_KEY_SIZE);
+    CDTPCryptoData *hello_encrypted = _cdtp_crypto_rsa_encrypt(hello_public_key, rsa_message, STR_SIZE(rsa_message));
+    CDTPCryptoData *hello_decrypted = _cdtp_crypto_rsa_decrypt(keys4->private_key, hello_encrypted->data, hello_encrypted->data_size);
+    TEST_ASSERT_INT_EQ(strcmp((char *) (hello_decrypted->data), rsa_message), 0)
+    _cdtp_crypto_rsa_key_pair_free(keys4);
+    free(hello);
+    _cdtp_crypto_rsa_public_key_free(hello_public_key);
+    _cdtp_crypto_data_free(hello_encrypted);
+    _cdtp_crypto_data_free(hello_decrypted);
 }
 
 /**
@@ -990,6 +1759,22 @@ void test_send_large_messages(void)
     printf("Server message sizes: %" PRI_SIZE_T ", %" PRI_SIZE_T "\n", state->server_received[0]->data_size, large_server_message_len);
     printf("Client message sizes: %" PRI_SIZE_T ", %" PRI_SIZE_T "\n", state->client_received[0]->data_size, large_client_message_len);
 
+    // A client that sends a larger message than the server allows is disconnected
+    CDTPServer *s2 = cdtp_server(NULL, NULL, NULL, NULL, NULL, NULL);
+    cdtp_server_set_max_message_size(s2, large_server_message_len / 2);
+    cdtp_server_start(s2, SERVER_HOST, SERVER_PORT);
+    cdtp_sleep(WAIT_TIME);
+    CDTPClient *c2 = cdtp_client(NULL, NULL, NULL, NULL);
+    cdtp_client_connect(c2, CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    cdtp_client_send(c2, large_server_message, large_server_message_len);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT(!cdtp_client_is_connected(c2))
+    cdtp_server_stop(s2);
+    cdtp_sleep(WAIT_TIME);
+    cdtp_server_free(s2);
+    cdtp_client_free(c2);
+
     // Clean up
     test_state_finish(state);
     cdtp_server_free(s);
@@ -1244,7 +2029,7 @@ void test_multiple_clients(void)
 
     // Connect other clients
     state->reply_with_string_length = false;
-    TEST_ASSERT_EQ(s->clients->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(s->clients), (size_t) 2)
     CDTPClient *other_clients[15];
     for (size_t i = 0; i < 15; i++) {
         other_clients[i] = cdtp_client(client_on_recv, client_on_disconnected,
@@ -1252,7 +2037,7 @@ void test_multiple_clients(void)
         cdtp_client_connect(other_clients[i], CLIENT_HOST, CLIENT_PORT);
         cdtp_sleep(WAIT_TIME);
     }
-    TEST_ASSERT_EQ(s->clients->capacity, (size_t) 32)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(s->clients), (size_t) 17)
 
     // Send messages from other clients
     for (int i = 14; i >= 0; i--) {
@@ -1265,7 +2050,7 @@ void test_multiple_clients(void)
         cdtp_client_disconnect(other_clients[i]);
         cdtp_sleep(WAIT_TIME);
     }
-    TEST_ASSERT_EQ(s->clients->capacity, (size_t) 16)
+    TEST_ASSERT_EQ(_cdtp_client_map_size(s->clients), (size_t) 2)
 
     // Disconnect client 1
     cdtp_client_disconnect(c1);
@@ -1399,6 +2184,1249 @@ void test_remove_client(void)
     free(server_host);
 }
 
+/**
+ * Test serving clients from multiple I/O threads.
+ */
+void test_io_threads(void)
+{
+    // Initialize test state
+    char *message_from_client = "Hello from a client on some I/O thread!";
+    TestReceivedMessage *server_received[] = {
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client)
+    };
+    size_t receive_clients[] = {0, 1, 2, 3, 4, 5, 6, 7};
+    size_t connect_clients[] = {0, 1, 2, 3, 4, 5, 6, 7};
+    size_t disconnect_clients[] = {0, 1, 2, 3, 4, 5, 6, 7};
+    TestReceivedMessage *client_received[] = {
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1)
+    };
+    TestState *state = test_state(8, 8, 8,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  8, 0,
+                                  client_received);
+    state->reply_with_string_length = true;
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_io_threads(s, 4);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+#ifdef _WIN32
+    TEST_ASSERT_EQ(s->num_reactors, (size_t) 1)
+#else
+    TEST_ASSERT_EQ(s->num_reactors, (size_t) 4)
+#endif
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect clients
+    CDTPClient *clients[8];
+    for (size_t i = 0; i < 8; i++) {
+        clients[i] = cdtp_client(client_on_recv, client_on_disconnected,
+                                 state, state);
+        cdtp_client_connect(clients[i], CLIENT_HOST, CLIENT_PORT);
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Send messages from clients, which are replied to by whichever I/O thread owns them
+    for (size_t i = 0; i < 8; i++) {
+        cdtp_client_send(clients[i], message_from_client, STR_SIZE(message_from_client));
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Disconnect clients
+    for (size_t i = 0; i < 8; i++) {
+        cdtp_client_disconnect(clients[i]);
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    for (size_t i = 0; i < 8; i++) {
+        cdtp_client_free(clients[i]);
+    }
+    free(server_host);
+}
+
+/**
+ * Test that a client stalling its key exchange does not hold up other clients.
+ */
+void test_slow_handshake(void)
+{
+    // Initialize test state
+    char *message_from_client = "Hello from a client that exchanged keys!";
+    TestReceivedMessage *server_received[] = {
+            str_message(message_from_client)
+    };
+    size_t receive_clients[] = {0};
+    size_t connect_clients[] = {0};
+    size_t disconnect_clients[] = {0};
+    TestReceivedMessage *client_received[] = {
+            size_t_message(strlen(message_from_client) + 1)
+    };
+    TestState *state = test_state(1, 1, 1,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  1, 0,
+                                  client_received);
+    state->reply_with_string_length = true;
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_handshake_threads(s, 2);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect a socket that never responds to the key exchange
+    struct sockaddr_in stalled_address;
+    memset(&stalled_address, 0, sizeof(stalled_address));
+    stalled_address.sin_family = AF_INET;
+    stalled_address.sin_port = htons(CLIENT_PORT);
+    inet_pton(AF_INET, CLIENT_HOST, &(stalled_address.sin_addr));
+#ifdef _WIN32
+    SOCKET stalled_sock = socket(AF_INET, SOCK_STREAM, 0);
+#else
+    int stalled_sock = socket(AF_INET, SOCK_STREAM, 0);
+#endif
+    TEST_ASSERT(connect(stalled_sock, (struct sockaddr *) (&stalled_address), sizeof(stalled_address)) == 0)
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect a client while the other key exchange is still in progress
+    CDTPClient *c = cdtp_client(client_on_recv, client_on_disconnected,
+                                state, state);
+    cdtp_client_connect(c, CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT_EQ(state->server_connect_count, (size_t) 1)
+
+    // Send message from client
+    cdtp_client_send(c, message_from_client, STR_SIZE(message_from_client));
+    cdtp_sleep(WAIT_TIME);
+
+    // Give up on the stalled key exchange
+#ifdef _WIN32
+    closesocket(stalled_sock);
+#else
+    close(stalled_sock);
+#endif
+    cdtp_sleep(WAIT_TIME);
+
+    // Disconnect client
+    cdtp_client_disconnect(c);
+    cdtp_sleep(WAIT_TIME);
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    cdtp_client_free(c);
+    free(server_host);
+}
+
+void test_key_modes(void)
+{
+    // Take key pairs directly from a pool
+    CDTPKeyPool *pool = _cdtp_key_pool(2);
+    TEST_ASSERT(pool != NULL)
+    CDTPRSAKeyPair *key_pair1 = _cdtp_key_pool_take(pool);
+    CDTPRSAKeyPair *key_pair2 = _cdtp_key_pool_take(pool);
+    CDTPRSAKeyPair *key_pair3 = _cdtp_key_pool_take(pool);
+    TEST_ASSERT(key_pair1 != NULL)
+    TEST_ASSERT(key_pair2 != NULL)
+    TEST_ASSERT(key_pair3 != NULL)
+    TEST_ASSERT(key_pair1 != key_pair2)
+    TEST_ASSERT(key_pair2 != key_pair3)
+    _cdtp_crypto_rsa_key_pair_free(key_pair1);
+    _cdtp_crypto_rsa_key_pair_free(key_pair2);
+    _cdtp_crypto_rsa_key_pair_free(key_pair3);
+    _cdtp_key_pool_free(pool);
+
+    // Exchange keys and messages using each server key mode
+    CDTPKeyMode key_modes[] = {CDTP_KEY_MODE_POOL, CDTP_KEY_MODE_PERSISTENT};
+
+    for (size_t mode = 0; mode < 2; mode++) {
+        // Initialize test state
+        char *message_from_client = "Hello from a client of a server supporting RSA key exchanges!";
+        TestReceivedMessage *server_received[] = {
+                str_message(message_from_client),
+                str_message(message_from_client)
+        };
+        size_t receive_clients[] = {0, 1};
+        size_t connect_clients[] = {0, 1};
+        size_t disconnect_clients[] = {0, 1};
+        TestReceivedMessage *client_received[] = {
+                size_t_message(strlen(message_from_client) + 1),
+                size_t_message(strlen(message_from_client) + 1)
+        };
+        TestState *state = test_state(2, 2, 2,
+                                      server_received, receive_clients, connect_clients, disconnect_clients,
+                                      2, 0,
+                                      client_received);
+        state->reply_with_string_length = true;
+
+        // Create server
+        CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                    state, state, state);
+        cdtp_server_set_legacy_handshake(s, true);
+        cdtp_server_set_key_mode(s, key_modes[mode], 2);
+        cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+        char *server_host = cdtp_server_get_host(s);
+        unsigned short server_port = cdtp_server_get_port(s);
+        printf("Server address: %s:%d\n", server_host, server_port);
+        cdtp_sleep(WAIT_TIME);
+
+        // Connect an RSA client and an X25519 client
+        CDTPClient *clients[2];
+        for (size_t i = 0; i < 2; i++) {
+            clients[i] = cdtp_client(client_on_recv, client_on_disconnected,
+                                     state, state);
+            cdtp_client_set_legacy_handshake(clients[i], i == 0);
+            cdtp_client_connect(clients[i], CLIENT_HOST, CLIENT_PORT);
+            cdtp_sleep(WAIT_TIME);
+        }
+
+        // The RSA client uses CBC mode, while the X25519 client negotiates an authenticated cipher
+        CDTPCipher negotiated = _cdtp_crypto_aes_accelerated() ? CDTP_CIPHER_AES_256_GCM : CDTP_CIPHER_CHACHA20_POLY1305;
+        TEST_ASSERT(clients[0]->sock->key->mode == CDTP_CIPHER_AES_256_CBC)
+        TEST_ASSERT(clients[1]->sock->key->mode == negotiated)
+
+        // Send messages from clients
+        for (size_t i = 0; i < 2; i++) {
+            cdtp_client_send(clients[i], message_from_client, STR_SIZE(message_from_client));
+            cdtp_sleep(WAIT_TIME);
+        }
+
+        // Disconnect clients
+        for (size_t i = 0; i < 2; i++) {
+            cdtp_client_disconnect(clients[i]);
+            cdtp_sleep(WAIT_TIME);
+        }
+
+        // Stop server
+        cdtp_server_stop(s);
+        TEST_ASSERT(s->key_pool == NULL)
+        TEST_ASSERT(s->key_pair == NULL)
+        cdtp_sleep(WAIT_TIME);
+
+        // Clean up
+        test_state_finish(state);
+        cdtp_server_free(s);
+        for (size_t i = 0; i < 2; i++) {
+            cdtp_client_free(clients[i]);
+        }
+        free(server_host);
+    }
+}
+
+void test_event_threads(void)
+{
+    // Run tasks on a pool with a bounded queue
+    bool tasks_done[64];
+    CDTPThreadPool *pool = _cdtp_thread_pool(2, 4);
+    TEST_ASSERT(pool != NULL)
+    for (size_t i = 0; i < 64; i++) {
+        tasks_done[i] = false;
+        _cdtp_thread_pool_submit(pool, thread_pool_task, &(tasks_done[i]));
+        TEST_ASSERT(pool->num_tasks <= 4)
+    }
+    TEST_ASSERT(_cdtp_thread_pool_free(pool))
+    for (size_t i = 0; i < 64; i++) {
+        TEST_ASSERT(tasks_done[i])
+    }
+
+    // Free a pool from one of its own tasks
+    CDTPThreadPool *pool2 = _cdtp_thread_pool(2, 4);
+    TEST_ASSERT(pool2 != NULL)
+    _cdtp_thread_pool_submit(pool2, thread_pool_free_task, pool2);
+    cdtp_sleep(WAIT_TIME);
+
+    // Initialize test state
+    size_t num_messages = 256;
+    int *server_messages = (int *) malloc(num_messages * sizeof(int));
+    int *client_messages = (int *) malloc(num_messages * sizeof(int));
+    TestReceivedMessage **server_received = (TestReceivedMessage **) malloc(num_messages * sizeof(TestReceivedMessage *));
+    TestReceivedMessage **client_received = (TestReceivedMessage **) malloc(num_messages * sizeof(TestReceivedMessage *));
+    size_t *receive_clients = (size_t *) malloc(num_messages * sizeof(size_t));
+    for (size_t i = 0; i < num_messages; i++) {
+        server_messages[i] = rand();
+        client_messages[i] = rand();
+        server_received[i] = int_message(server_messages[i]);
+        client_received[i] = int_message(client_messages[i]);
+        receive_clients[i] = 0;
+    }
+    size_t connect_clients[] = {0};
+    size_t disconnect_clients[] = {0};
+    TestState *state = test_state(num_messages, 1, 1,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  num_messages, 0,
+                                  client_received);
+
+    // Create server with a single event thread, so messages are handled in order
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_event_threads(s, 1, 4);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    TEST_ASSERT_EQ(s->event_pool->num_threads, (size_t) 1)
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Create client with a single event thread
+    CDTPClient *c = cdtp_client(client_on_recv, client_on_disconnected,
+                                state, state);
+    cdtp_client_set_event_threads(c, 1, 4);
+    cdtp_client_connect(c, CLIENT_HOST, CLIENT_PORT);
+    TEST_ASSERT_EQ(c->event_pool->num_threads, (size_t) 1)
+    cdtp_sleep(WAIT_TIME);
+
+    // Send bursts of messages, which fill the event queues faster than they are drained
+    for (size_t i = 0; i < num_messages; i++) {
+        cdtp_client_send(c, &(server_messages[i]), sizeof(int));
+    }
+    cdtp_sleep(WAIT_TIME * 5);
+    for (size_t i = 0; i < num_messages; i++) {
+        cdtp_server_send_all(s, &(client_messages[i]), sizeof(int));
+    }
+    cdtp_sleep(WAIT_TIME * 5);
+
+    // Disconnect client
+    cdtp_client_disconnect(c);
+    TEST_ASSERT(c->event_pool == NULL)
+    cdtp_sleep(WAIT_TIME);
+
+    // Stop server
+    cdtp_server_stop(s);
+    TEST_ASSERT(s->event_pool == NULL)
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    cdtp_client_free(c);
+    free(server_messages);
+    free(client_messages);
+    free(server_received);
+    free(client_received);
+    free(receive_clients);
+    free(server_host);
+}
+
+void test_ordered_dispatch(void)
+{
+    // Run tasks on a strand, which must run them one at a time and in order despite the pool having several threads
+    size_t order[64];
+    size_t count = 0;
+    StrandTaskArg task_args[64];
+    CDTPThreadPool *pool = _cdtp_thread_pool(4, 0);
+    TEST_ASSERT(pool != NULL)
+    CDTPStrand *strand = _cdtp_strand(pool);
+    for (size_t i = 0; i < 64; i++) {
+        task_args[i].index = i;
+        task_args[i].order = order;
+        task_args[i].count = &count;
+        _cdtp_strand_submit(strand, strand_task, &(task_args[i]));
+    }
+    _cdtp_strand_free(strand);
+    TEST_ASSERT(_cdtp_thread_pool_free(pool))
+    TEST_ASSERT_EQ(count, (size_t) 64)
+    for (size_t i = 0; i < 64; i++) {
+        TEST_ASSERT_EQ(order[i], i)
+    }
+
+    // Submitting to a full strand stops waiting for room once the strand is closed
+    bool blocking = true;
+    count = 0;
+    CDTPThreadPool *pool2 = _cdtp_thread_pool(1, 2);
+    TEST_ASSERT(pool2 != NULL)
+    CDTPStrand *strand2 = _cdtp_strand(pool2);
+    _cdtp_strand_submit(strand2, strand_blocking_task, &blocking);
+    cdtp_sleep(WAIT_TIME);
+    for (size_t i = 0; i < 2; i++) {
+        _cdtp_strand_submit(strand2, strand_task, &(task_args[i]));
+    }
+    _cdtp_strand_close(strand2);
+    _cdtp_strand_submit(strand2, strand_task, &(task_args[2]));
+    TEST_ASSERT_EQ(strand2->num_tasks, (size_t) 3)
+    blocking = false;
+    _cdtp_strand_free(strand2);
+    TEST_ASSERT(_cdtp_thread_pool_free(pool2))
+    TEST_ASSERT_EQ(count, (size_t) 3)
+
+    // Stop a server from an event function while its I/O thread waits for room on the client's strand
+    size_t stopping_received = 0;
+    CDTPServer *s2 = cdtp_server(stopping_on_recv, NULL, NULL, &stopping_received, NULL, NULL);
+    cdtp_server_set_event_threads(s2, 1, 1);
+    cdtp_server_set_dispatch_mode(s2, CDTP_DISPATCH_ORDERED);
+    cdtp_server_start(s2, SERVER_HOST, SERVER_PORT);
+    cdtp_sleep(WAIT_TIME);
+    CDTPClient *c2 = cdtp_client(NULL, NULL, NULL, NULL);
+    cdtp_client_connect(c2, CLIENT_HOST, CLIENT_PORT);
+    for (size_t i = 0; i < ORDERED_MESSAGES; i++) {
+        cdtp_client_send(c2, &i, sizeof(size_t));
+    }
+    cdtp_sleep(WAIT_TIME * 5);
+    TEST_ASSERT(!cdtp_server_is_serving(s2))
+    TEST_ASSERT(!cdtp_client_is_connected(c2))
+    cdtp_server_free(s2);
+    cdtp_client_free(c2);
+
+    // Initialize test state
+    OrderedState *state = (OrderedState *) malloc(sizeof(OrderedState));
+    for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+        state->received[i] = 0;
+        state->connected[i] = false;
+        state->disconnected[i] = false;
+    }
+    state->in_order = true;
+
+    // Create server with more event threads than clients
+    CDTPServer *s = cdtp_server(ordered_on_recv, ordered_on_connect, ordered_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_event_threads(s, ORDERED_CLIENTS * 2, 0);
+    cdtp_server_set_dispatch_mode(s, CDTP_DISPATCH_ORDERED);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect clients
+    CDTPClient *clients[ORDERED_CLIENTS];
+    for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+        clients[i] = cdtp_client(NULL, NULL, NULL, NULL);
+        cdtp_client_connect(clients[i], CLIENT_HOST, CLIENT_PORT);
+    }
+
+    // Send bursts of numbered messages from every client at once, then disconnect right away
+    for (size_t j = 0; j < ORDERED_MESSAGES; j++) {
+        for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+            cdtp_client_send(clients[i], &j, sizeof(size_t));
+        }
+    }
+    for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+        cdtp_client_disconnect(clients[i]);
+    }
+    cdtp_sleep(WAIT_TIME * 5);
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Check that every client's events were handled in order
+    TEST_ASSERT(state->in_order)
+    for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+        TEST_ASSERT_EQ(state->received[i], (size_t) ORDERED_MESSAGES)
+        TEST_ASSERT(state->connected[i])
+        TEST_ASSERT(state->disconnected[i])
+    }
+
+    // Clean up
+    cdtp_server_free(s);
+    for (size_t i = 0; i < ORDERED_CLIENTS; i++) {
+        cdtp_client_free(clients[i]);
+    }
+    free(state);
+    free(server_host);
+}
+
+void test_inline_dispatch(void)
+{
+    // Initialize test state
+    InlineState *state = (InlineState *) malloc(sizeof(InlineState));
+    state->server_connected = 0;
+    state->server_received = 0;
+    state->client_received = 0;
+    state->client_disconnected = 0;
+    state->in_order = true;
+
+    // Create server
+    CDTPServer *s = cdtp_server(inline_server_on_recv, inline_server_on_connect, NULL, state, state, NULL);
+    cdtp_server_set_dispatch_mode(s, CDTP_DISPATCH_INLINE);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Create client
+    CDTPClient *c = cdtp_client(inline_client_on_recv, inline_client_on_disconnected, state, state);
+    cdtp_client_set_dispatch_mode(c, CDTP_DISPATCH_INLINE);
+    cdtp_client_connect(c, CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT_EQ(state->server_connected, (size_t) 1)
+
+    // Send messages, each of which is echoed back before the server removes the client
+    for (size_t i = 0; i < INLINE_MESSAGES; i++) {
+        cdtp_client_send(c, &i, sizeof(size_t));
+    }
+
+    cdtp_sleep(WAIT_TIME * 5);
+
+    // Check that every event function was called in order, and that the client was disconnected
+    TEST_ASSERT(state->in_order)
+    TEST_ASSERT_EQ(state->server_received, (size_t) INLINE_MESSAGES)
+    TEST_ASSERT_EQ(state->client_received, (size_t) INLINE_MESSAGES)
+    TEST_ASSERT_EQ(state->client_disconnected, (size_t) 1)
+    TEST_ASSERT(!cdtp_client_is_connected(c))
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    cdtp_server_free(s);
+    cdtp_client_free(c);
+    free(state);
+    free(server_host);
+}
+
+void test_send_backpressure(void)
+{
+    // Initialize test state
+    BackpressureState *state = (BackpressureState *) malloc(sizeof(BackpressureState));
+    state->client_id = CDTP_CLIENT_MAP_INVALID_ID;
+    state->server_received = 0;
+    state->client_received = 0;
+    state->server_writable = 0;
+    state->client_writable = 0;
+    state->client_blocked = true;
+    state->in_order = true;
+    unsigned char *message = (unsigned char *) malloc(BACKPRESSURE_MESSAGE_SIZE);
+
+    // Create server
+    CDTPServer *s = cdtp_server(backpressure_server_on_recv, backpressure_server_on_connect, NULL, state, state, NULL);
+    cdtp_server_set_send_watermarks(s, BACKPRESSURE_LOW_WATERMARK, BACKPRESSURE_HIGH_WATERMARK);
+    cdtp_server_set_on_writable(s, backpressure_server_on_writable, state);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Create client, whose inline event function stops it from reading
+    CDTPClient *c = cdtp_client(backpressure_client_on_recv, NULL, state, NULL);
+    cdtp_client_set_dispatch_mode(c, CDTP_DISPATCH_INLINE);
+    cdtp_client_set_send_watermarks(c, BACKPRESSURE_LOW_WATERMARK, BACKPRESSURE_HIGH_WATERMARK);
+    cdtp_client_set_on_writable(c, backpressure_client_on_writable, state);
+    cdtp_client_connect(c, CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT(state->client_id != CDTP_CLIENT_MAP_INVALID_ID)
+
+    // Send far more than the socket can take while the client is not reading, until the server refuses to queue more
+    cdtp_on_error_clear();
+    size_t accepted = 0;
+
+    while (accepted < BACKPRESSURE_MESSAGES && backpressure_server_send(s, state->client_id, message, accepted)) {
+        accepted++;
+    }
+
+    cdtp_on_error(on_err, NULL);
+    TEST_ASSERT(accepted < BACKPRESSURE_MESSAGES)
+
+    CDTPSocket *client_sock = _cdtp_client_map_acquire(s->clients, state->client_id);
+    TEST_ASSERT(client_sock != NULL)
+    size_t pending = _cdtp_send_buffer_pending(client_sock->send_buffer);
+    TEST_ASSERT(pending > BACKPRESSURE_HIGH_WATERMARK)
+
+    // At most one message, with its length and encryption overhead, is queued past the high watermark
+    size_t message_overhead = CDTP_LENSIZE + 2 * CDTP_AES_NONCE_SIZE;
+    TEST_ASSERT(pending <= BACKPRESSURE_HIGH_WATERMARK + BACKPRESSURE_MESSAGE_SIZE + message_overhead)
+    TEST_ASSERT(_cdtp_send_buffer_blocked(client_sock->send_buffer))
+    _cdtp_client_map_release(s->clients, state->client_id);
+    TEST_ASSERT_EQ(state->server_writable, (size_t) 0)
+
+    // Let the client read again, then wait to be told that the client can be sent to again
+    state->client_blocked = false;
+
+    for (size_t i = 0; i < 100 && state->server_writable == 0; i++) {
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    TEST_ASSERT_EQ(state->server_writable, (size_t) 1)
+
+    // The refused message can now be sent
+    cdtp_on_error_clear();
+    TEST_ASSERT(backpressure_server_send(s, state->client_id, message, accepted))
+    cdtp_on_error(on_err, NULL);
+    accepted++;
+
+    // Wait for the queue to be sent
+    for (size_t i = 0; i < 100 && state->client_received < accepted; i++) {
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    TEST_ASSERT_EQ(state->client_received, accepted)
+    client_sock = _cdtp_client_map_acquire(s->clients, state->client_id);
+    TEST_ASSERT(client_sock != NULL)
+    TEST_ASSERT_EQ(_cdtp_send_buffer_pending(client_sock->send_buffer), (size_t) 0)
+    TEST_ASSERT(!_cdtp_send_buffer_blocked(client_sock->send_buffer))
+    _cdtp_client_map_release(s->clients, state->client_id);
+
+    // Have both sides send far more than the sockets can take at once, sending refused messages again later, which
+    // only finishes because each side keeps reading while its own sends are refused
+    unsigned char *client_message = (unsigned char *) malloc(BACKPRESSURE_MESSAGE_SIZE);
+    size_t server_sent = 0;
+    size_t client_sent = 0;
+    size_t server_refused = 0;
+    size_t client_refused = 0;
+    cdtp_on_error_clear();
+
+    for (size_t i = 0; i < 10000 && (server_sent < BACKPRESSURE_MESSAGES || client_sent < BACKPRESSURE_MESSAGES); i++) {
+        bool progress = false;
+
+        if (server_sent < BACKPRESSURE_MESSAGES) {
+            if (backpressure_server_send(s, state->client_id, message, accepted + server_sent)) {
+                server_sent++;
+                progress = true;
+            }
+            else {
+                server_refused++;
+            }
+        }
+
+        if (client_sent < BACKPRESSURE_MESSAGES) {
+            if (backpressure_client_send(c, client_message, client_sent)) {
+                client_sent++;
+                progress = true;
+            }
+            else {
+                client_refused++;
+            }
+        }
+
+        if (!progress) {
+            cdtp_sleep(0.01);
+        }
+    }
+
+    cdtp_on_error(on_err, NULL);
+    TEST_ASSERT_EQ(server_sent, (size_t) BACKPRESSURE_MESSAGES)
+    TEST_ASSERT_EQ(client_sent, (size_t) BACKPRESSURE_MESSAGES)
+
+    for (size_t i = 0; i < 100 && state->client_received < accepted + BACKPRESSURE_MESSAGES; i++) {
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    TEST_ASSERT_EQ(state->client_received, accepted + BACKPRESSURE_MESSAGES)
+
+    // Each side that had its sends refused was told when it could send again
+    TEST_ASSERT(server_refused == 0 || state->server_writable > 1)
+    TEST_ASSERT(client_refused == 0 || state->client_writable > 0)
+
+    // Disconnect right away, which still delivers everything queued for the server
+    cdtp_client_disconnect(c);
+
+    for (size_t i = 0; i < 100 && state->server_received < BACKPRESSURE_MESSAGES; i++) {
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    TEST_ASSERT_EQ(state->server_received, (size_t) BACKPRESSURE_MESSAGES)
+    TEST_ASSERT(state->in_order)
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    cdtp_server_free(s);
+    cdtp_client_free(c);
+    free(client_message);
+    free(message);
+    free(state);
+    free(server_host);
+}
+
+/**
+ * Test that stopping a server gives up on every client that is not reading at once, rather than one after another.
+ */
+void test_stop_drain(void)
+{
+    // Initialize test state
+    BackpressureState *state = (BackpressureState *) malloc(sizeof(BackpressureState));
+    state->client_id = CDTP_CLIENT_MAP_INVALID_ID;
+    state->server_received = 0;
+    state->client_received = 0;
+    state->server_writable = 0;
+    state->client_writable = 0;
+    state->client_blocked = true;
+    state->in_order = true;
+    unsigned char *message = (unsigned char *) malloc(BACKPRESSURE_MESSAGE_SIZE);
+
+    // Create server
+    CDTPServer *s = cdtp_server(NULL, backpressure_server_on_connect, NULL, NULL, state, NULL);
+    cdtp_server_set_send_watermarks(s, BACKPRESSURE_LOW_WATERMARK, BACKPRESSURE_HIGH_WATERMARK);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Create clients, whose inline event functions stop them from reading
+    CDTPClient *clients[2];
+    size_t client_ids[2];
+
+    for (size_t i = 0; i < 2; i++) {
+        clients[i] = cdtp_client(backpressure_client_on_recv, NULL, state, NULL);
+        cdtp_client_set_dispatch_mode(clients[i], CDTP_DISPATCH_INLINE);
+        cdtp_client_connect(clients[i], CLIENT_HOST, CLIENT_PORT);
+        cdtp_sleep(WAIT_TIME);
+        client_ids[i] = state->client_id;
+    }
+
+    // Send to each client until its socket is full and the server keeps refusing to queue more for it
+    cdtp_on_error_clear();
+
+    for (size_t i = 0; i < 2; i++) {
+        size_t refused = 0;
+
+        for (size_t j = 0; j < 1000 && refused < 20; j++) {
+            if (backpressure_server_send(s, client_ids[i], message, j)) {
+                refused = 0;
+            }
+            else {
+                refused++;
+                cdtp_sleep(0.01);
+            }
+        }
+
+        TEST_ASSERT_EQ(refused, (size_t) 20)
+    }
+
+    cdtp_on_error(on_err, NULL);
+
+    // Stop server, which only waits for the queued data once for all of the clients
+    double stop_start = _cdtp_time();
+    cdtp_server_stop(s);
+    double stop_time = _cdtp_time() - stop_start;
+    TEST_ASSERT(stop_time < CDTP_SEND_DRAIN_TIMEOUT * 1.5)
+
+    // Let the clients notice that the server has stopped
+    state->client_blocked = false;
+    cdtp_sleep(WAIT_TIME);
+
+    for (size_t i = 0; i < 2; i++) {
+        if (cdtp_client_is_connected(clients[i])) {
+            cdtp_client_disconnect(clients[i]);
+        }
+    }
+
+    // Clean up
+    cdtp_server_free(s);
+
+    for (size_t i = 0; i < 2; i++) {
+        cdtp_client_free(clients[i]);
+    }
+
+    free(message);
+    free(state);
+    free(server_host);
+}
+
+/**
+ * Test resuming sessions with resumption tickets.
+ */
+void test_resumption(void)
+{
+    // Initialize test state
+    char *message_from_client = "Hello from a resumed session!";
+    TestReceivedMessage *server_received[] = {
+            str_message(message_from_client),
+            str_message(message_from_client),
+            str_message(message_from_client)
+    };
+    size_t receive_clients[] = {0, 1, 2};
+    size_t connect_clients[] = {0, 1, 2};
+    size_t disconnect_clients[] = {0, 1, 2};
+    TestReceivedMessage *client_received[] = {
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1)
+    };
+    TestState *state = test_state(3, 3, 3,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  3, 0,
+                                  client_received);
+    state->reply_with_string_length = true;
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_resumption(s, true, 0);
+    TEST_ASSERT(s->ticket_lifetime > 0)
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect a client with a full key exchange, asking for a ticket
+    CDTPClient *clients[3];
+    size_t ticket_size;
+    clients[0] = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+    cdtp_client_set_resumption(clients[0], true);
+    cdtp_client_connect(clients[0], CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT(!cdtp_client_is_resumed(clients[0]))
+    void *ticket = cdtp_client_get_resumption_ticket(clients[0], &ticket_size);
+    TEST_ASSERT(ticket != NULL)
+    TEST_ASSERT_EQ(ticket_size, (size_t) CDTP_RESUMPTION_TICKET_SIZE)
+
+    // Resume the session with a new client, then connect another with a corrupted ticket, which falls back to a full
+    // key exchange
+    void *bad_ticket = malloc(ticket_size);
+    memcpy(bad_ticket, ticket, ticket_size);
+    ((char *) bad_ticket)[ticket_size - 1] ^= 1;
+    void *tickets[] = {ticket, bad_ticket};
+
+    for (size_t i = 1; i < 3; i++) {
+        clients[i] = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+        cdtp_client_connect_resume(clients[i], CLIENT_HOST, CLIENT_PORT, tickets[i - 1], ticket_size);
+        cdtp_sleep(WAIT_TIME);
+        TEST_ASSERT(cdtp_client_is_connected(clients[i]))
+        TEST_ASSERT(cdtp_client_is_resumed(clients[i]) == (i == 1))
+        TEST_ASSERT(clients[i]->sock->key->mode == clients[0]->sock->key->mode)
+        TEST_ASSERT(memcmp(clients[i]->sock->key->key, clients[0]->sock->key->key, CDTP_AES_KEY_SIZE) != 0)
+    }
+
+    // Resumed clients keep the ticket they resumed with, while rejected tickets are discarded
+    void *kept_ticket = cdtp_client_get_resumption_ticket(clients[1], &ticket_size);
+    TEST_ASSERT(kept_ticket != NULL)
+    TEST_ASSERT_INT_EQ(memcmp(kept_ticket, ticket, CDTP_RESUMPTION_TICKET_SIZE), 0)
+    void *no_ticket = cdtp_client_get_resumption_ticket(clients[2], &ticket_size);
+    TEST_ASSERT(no_ticket == NULL)
+    TEST_ASSERT_EQ(ticket_size, (size_t) 0)
+    free(kept_ticket);
+
+    // Send messages from clients
+    for (size_t i = 0; i < 3; i++) {
+        cdtp_client_send(clients[i], message_from_client, STR_SIZE(message_from_client));
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Disconnect clients
+    for (size_t i = 0; i < 3; i++) {
+        cdtp_client_disconnect(clients[i]);
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    for (size_t i = 0; i < 3; i++) {
+        cdtp_client_free(clients[i]);
+    }
+    free(ticket);
+    free(bad_ticket);
+    free(server_host);
+}
+
+/**
+ * Test sending messages without encryption.
+ */
+void test_plaintext(void)
+{
+    // Initialize test state
+    char *message_from_client = "Hello from a plaintext client!";
+    char *empty_message = "";
+    TestReceivedMessage *server_received[] = {
+            str_message(message_from_client),
+            str_message(empty_message)
+    };
+    size_t receive_clients[] = {0, 0};
+    size_t connect_clients[] = {0};
+    size_t disconnect_clients[] = {0};
+    TestReceivedMessage *client_received[] = {
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(empty_message) + 1)
+    };
+    TestState *state = test_state(2, 1, 1,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  2, 0,
+                                  client_received);
+    state->reply_with_string_length = true;
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_plaintext(s, true);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Create client
+    CDTPClient *c = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+    cdtp_client_set_plaintext(c, true);
+    cdtp_client_connect(c, CLIENT_HOST, CLIENT_PORT);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT(cdtp_client_is_connected(c))
+
+    // Neither side has a key
+    TEST_ASSERT(c->sock->key == NULL)
+    CDTPSocket *client_sock = _cdtp_client_map_acquire(s->clients, state->server_connect_client_ids[0]);
+    TEST_ASSERT(client_sock != NULL)
+    TEST_ASSERT(client_sock->key == NULL)
+    _cdtp_client_map_release(s->clients, state->server_connect_client_ids[0]);
+
+    // Send messages from the client
+    cdtp_client_send(c, message_from_client, STR_SIZE(message_from_client));
+    cdtp_sleep(WAIT_TIME);
+    cdtp_client_send(c, empty_message, STR_SIZE(empty_message));
+    cdtp_sleep(WAIT_TIME);
+
+    // Disconnect client
+    cdtp_client_disconnect(c);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clients that do not use the plaintext mode are refused, without the server being told of them
+    CDTPClient *c_encrypted = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+    cdtp_on_error_clear();
+    cdtp_client_connect(c_encrypted, CLIENT_HOST, CLIENT_PORT);
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_CLIENT_KEY_EXCHANGE_FAILED)
+    cdtp_client_disconnect(c_encrypted);
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_CLIENT_NOT_CONNECTED)
+    cdtp_on_error(on_err, NULL);
+    TEST_ASSERT(!cdtp_client_is_connected(c_encrypted))
+    cdtp_sleep(WAIT_TIME);
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Plaintext clients are refused by servers that do not use the plaintext mode
+    CDTPServer *s_encrypted = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                          state, state, state);
+    cdtp_server_start(s_encrypted, SERVER_HOST, SERVER_PORT);
+    cdtp_sleep(WAIT_TIME);
+
+    CDTPClient *c_plaintext = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+    cdtp_client_set_plaintext(c_plaintext, true);
+    cdtp_on_error_clear();
+    cdtp_client_connect(c_plaintext, CLIENT_HOST, CLIENT_PORT);
+    TEST_ASSERT_INT_EQ(cdtp_get_error(), CDTP_CLIENT_KEY_EXCHANGE_FAILED)
+    cdtp_on_error(on_err, NULL);
+    TEST_ASSERT(!cdtp_client_is_connected(c_plaintext))
+    cdtp_sleep(WAIT_TIME);
+
+    cdtp_server_stop(s_encrypted);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    cdtp_server_free(s_encrypted);
+    cdtp_client_free(c);
+    cdtp_client_free(c_encrypted);
+    cdtp_client_free(c_plaintext);
+    free(server_host);
+}
+
+/**
+ * Test key exchange messages that arrive in pieces.
+ */
+void test_handshake_short_reads(void)
+{
+    // Initialize test state
+    TestReceivedMessage *server_received[] = EMPTY;
+    size_t receive_clients[] = EMPTY;
+    size_t connect_clients[] = {0};
+    size_t disconnect_clients[] = {0};
+    TestReceivedMessage *client_received[] = EMPTY;
+    TestState *state = test_state(0, 1, 1,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  0, 0,
+                                  client_received);
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_plaintext(s, true);
+    cdtp_server_start(s, SERVER_HOST, SERVER_PORT);
+    char *server_host = cdtp_server_get_host(s);
+    unsigned short server_port = cdtp_server_get_port(s);
+    printf("Server address: %s:%d\n", server_host, server_port);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect a socket that does the key exchange by hand
+    struct sockaddr_in split_address;
+    memset(&split_address, 0, sizeof(split_address));
+    split_address.sin_family = AF_INET;
+    split_address.sin_port = htons(CLIENT_PORT);
+    inet_pton(AF_INET, CLIENT_HOST, &(split_address.sin_addr));
+#ifdef _WIN32
+    SOCKET split_sock = socket(AF_INET, SOCK_STREAM, 0);
+#else
+    int split_sock = socket(AF_INET, SOCK_STREAM, 0);
+#endif
+    TEST_ASSERT(connect(split_sock, (struct sockaddr *) (&split_address), sizeof(split_address)) == 0)
+    char hello[CDTP_LENSIZE + 2];
+    TEST_ASSERT_INT_EQ((int) recv(split_sock, hello, sizeof(hello), 0), (int) sizeof(hello))
+    TEST_ASSERT_INT_EQ(hello[CDTP_LENSIZE + 1], CDTP_HANDSHAKE_PLAINTEXT)
+
+    // Send the reply in two pieces, splitting its size
+    char reply_data[1] = {(char) CDTP_HANDSHAKE_PLAINTEXT};
+    char *reply = _cdtp_construct_message(reply_data, sizeof(reply_data));
+    size_t reply_size = CDTP_LENSIZE + sizeof(reply_data);
+    size_t first_piece_size = CDTP_LENSIZE / 2;
+    TEST_ASSERT(send(split_sock, reply, first_piece_size, 0) >= 0)
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT_EQ(state->server_connect_count, (size_t) 0)
+    TEST_ASSERT(send(split_sock, reply + first_piece_size, reply_size - first_piece_size, 0) >= 0)
+    free(reply);
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT_EQ(state->server_connect_count, (size_t) 1)
+
+    // Disconnect the socket
+#ifdef _WIN32
+    closesocket(split_sock);
+#else
+    close(split_sock);
+#endif
+    cdtp_sleep(WAIT_TIME);
+
+    // Sockets that announce a message larger than any handshake are refused right away, rather than being waited on
+#ifdef _WIN32
+    SOCKET large_sock = socket(AF_INET, SOCK_STREAM, 0);
+#else
+    int large_sock = socket(AF_INET, SOCK_STREAM, 0);
+#endif
+    TEST_ASSERT(connect(large_sock, (struct sockaddr *) (&split_address), sizeof(split_address)) == 0)
+    TEST_ASSERT_INT_EQ((int) recv(large_sock, hello, sizeof(hello), 0), (int) sizeof(hello))
+    unsigned char large_size[CDTP_LENSIZE];
+    _cdtp_write_message_size(large_size, CDTP_HANDSHAKE_MAX_SIZE + 1);
+    double refuse_start = _cdtp_time();
+    TEST_ASSERT(send(large_sock, (char *) large_size, CDTP_LENSIZE, 0) >= 0)
+    TEST_ASSERT(recv(large_sock, hello, sizeof(hello), 0) <= 0)
+    TEST_ASSERT(_cdtp_time() - refuse_start < CDTP_HANDSHAKE_TIMEOUT / 2)
+    TEST_ASSERT_EQ(state->server_connect_count, (size_t) 1)
+#ifdef _WIN32
+    closesocket(large_sock);
+#else
+    close(large_sock);
+#endif
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    free(server_host);
+}
+
+/**
+ * Test serving clients over a Unix domain socket.
+ */
+void test_unix_sockets(void)
+{
+    // Initialize test state
+    char *message_from_client = "Hello from a Unix domain socket!";
+    TestReceivedMessage *server_received[] = {
+            str_message(message_from_client),
+            str_message(message_from_client)
+    };
+    size_t receive_clients[] = {0, 1};
+    size_t connect_clients[] = {0, 1};
+    size_t disconnect_clients[] = {0, 1};
+    TestReceivedMessage *client_received[] = {
+            size_t_message(strlen(message_from_client) + 1),
+            size_t_message(strlen(message_from_client) + 1)
+    };
+    TestState *state = test_state(2, 2, 2,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  2, 0,
+                                  client_received);
+    state->reply_with_string_length = true;
+
+    // Create server, with more than one I/O thread accepting from the socket
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_io_threads(s, 2);
+    cdtp_server_start_unix(s, UNIX_SOCKET_PATH);
+    char *server_host = cdtp_server_get_host(s);
+    TEST_ASSERT_INT_EQ(strcmp(server_host, UNIX_SOCKET_PATH), 0)
+    TEST_ASSERT_INT_EQ(cdtp_server_get_port(s), 0)
+    printf("Server address: %s\n", server_host);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect clients
+    CDTPClient *clients[2];
+    for (size_t i = 0; i < 2; i++) {
+        clients[i] = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+        cdtp_client_connect_unix(clients[i], UNIX_SOCKET_PATH);
+        cdtp_sleep(WAIT_TIME);
+        TEST_ASSERT(cdtp_client_is_connected(clients[i]))
+    }
+
+    // Check addresses
+    char *client_host = cdtp_client_get_host(clients[0]);
+    char *client_server_host = cdtp_client_get_server_host(clients[0]);
+    char *server_client_host = cdtp_server_get_client_host(s, state->server_connect_client_ids[0]);
+    TEST_ASSERT_INT_EQ(strcmp(client_host, ""), 0)
+    TEST_ASSERT_INT_EQ(strcmp(client_server_host, UNIX_SOCKET_PATH), 0)
+    TEST_ASSERT_INT_EQ(strcmp(server_client_host, ""), 0)
+    TEST_ASSERT_INT_EQ(cdtp_client_get_port(clients[0]), 0)
+    TEST_ASSERT_INT_EQ(cdtp_client_get_server_port(clients[0]), 0)
+    TEST_ASSERT_INT_EQ(cdtp_server_get_client_port(s, state->server_connect_client_ids[0]), 0)
+
+    // Send messages from clients
+    for (size_t i = 0; i < 2; i++) {
+        cdtp_client_send(clients[i], message_from_client, STR_SIZE(message_from_client));
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Disconnect clients
+    for (size_t i = 0; i < 2; i++) {
+        cdtp_client_disconnect(clients[i]);
+        cdtp_sleep(WAIT_TIME);
+    }
+
+    // Stop server, which removes the socket's path so it can be bound again
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+    CDTPServer *s2 = cdtp_server(NULL, NULL, NULL, NULL, NULL, NULL);
+    cdtp_server_start_unix(s2, UNIX_SOCKET_PATH);
+    TEST_ASSERT(cdtp_server_is_serving(s2))
+    cdtp_server_stop(s2);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    cdtp_server_free(s2);
+    for (size_t i = 0; i < 2; i++) {
+        cdtp_client_free(clients[i]);
+    }
+    free(server_host);
+    free(client_host);
+    free(client_server_host);
+    free(server_client_host);
+}
+
+/**
+ * Test sending messages through shared memory.
+ */
+void test_shared_memory(void)
+{
+    // Initialize test state, with messages larger than the rings they are sent through
+    size_t large_server_message_len = (size_t) rand_int(8192, 16384);
+    char *large_server_message = rand_bytes(large_server_message_len);
+    size_t large_client_message_len = (size_t) rand_int(8192, 16384);
+    char *large_client_message = rand_bytes(large_client_message_len);
+    char *message_from_client = "Hello through the socket!";
+    char *message_from_server = "Hello from the server!";
+    TestReceivedMessage *server_received[] = {
+            test_received_message((void *) large_server_message, large_server_message_len),
+            str_message(message_from_client)
+    };
+    size_t receive_clients[] = {0, 1};
+    size_t connect_clients[] = {0, 1};
+    size_t disconnect_clients[] = {0, 1};
+    TestReceivedMessage *client_received[] = {
+            test_received_message((void *) large_client_message, large_client_message_len),
+            str_message(message_from_server)
+    };
+    TestState *state = test_state(2, 2, 2,
+                                  server_received, receive_clients, connect_clients, disconnect_clients,
+                                  2, 1,
+                                  client_received);
+
+    // Create server
+    CDTPServer *s = cdtp_server(server_on_recv, server_on_connect, server_on_disconnect,
+                                state, state, state);
+    cdtp_server_set_shared_memory(s, true, 4096);
+    cdtp_server_start_unix(s, UNIX_SOCKET_PATH);
+    cdtp_sleep(WAIT_TIME);
+
+    // Connect a client using shared memory, and one that does not ask for it
+    CDTPClient *clients[2];
+    for (size_t i = 0; i < 2; i++) {
+        clients[i] = cdtp_client(client_on_recv, client_on_disconnected, state, state);
+        cdtp_client_set_shared_memory(clients[i], i == 0);
+        cdtp_client_connect_unix(clients[i], UNIX_SOCKET_PATH);
+        cdtp_sleep(WAIT_TIME);
+        TEST_ASSERT(cdtp_client_is_connected(clients[i]))
+    }
+
+    // Only the first client uses shared memory, and its messages are still encrypted
+    TEST_ASSERT(cdtp_client_uses_shared_memory(clients[0]))
+    TEST_ASSERT(!cdtp_client_uses_shared_memory(clients[1]))
+    TEST_ASSERT(clients[0]->sock->key != NULL)
+    for (size_t i = 0; i < 2; i++) {
+        CDTPSocket *client_sock = _cdtp_client_map_acquire(s->clients, state->server_connect_client_ids[i]);
+        TEST_ASSERT(client_sock != NULL)
+        TEST_ASSERT((client_sock->shm != NULL) == (i == 0))
+        _cdtp_client_map_release(s->clients, state->server_connect_client_ids[i]);
+    }
+
+    // Send messages through shared memory
+    cdtp_client_send(clients[0], large_server_message, large_server_message_len);
+    cdtp_sleep(WAIT_TIME);
+    cdtp_server_send(s, state->server_connect_client_ids[0], large_client_message, large_client_message_len);
+    cdtp_sleep(WAIT_TIME);
+
+    // Send messages through the socket
+    cdtp_client_send(clients[1], message_from_client, STR_SIZE(message_from_client));
+    cdtp_sleep(WAIT_TIME);
+    cdtp_server_send(s, state->server_connect_client_ids[1], message_from_server, STR_SIZE(message_from_server));
+    cdtp_sleep(WAIT_TIME);
+
+    // A client that corrupts its ring is disconnected by the server
+    CDTPSharedMemory *shm = clients[0]->sock->shm;
+    uint64_t doorbell_value = 1;
+    shm->send_ring->head += 2 * shm->ring_size;
+    TEST_ASSERT_EQ(write(shm->peer_doorbell, &doorbell_value, sizeof(doorbell_value)), (ssize_t) sizeof(doorbell_value))
+    cdtp_sleep(WAIT_TIME);
+    TEST_ASSERT(!cdtp_client_is_connected(clients[0]))
+
+    // Disconnect the other client
+    cdtp_client_disconnect(clients[1]);
+    cdtp_sleep(WAIT_TIME);
+
+    // Stop server
+    cdtp_server_stop(s);
+    cdtp_sleep(WAIT_TIME);
+
+    // Clean up
+    test_state_finish(state);
+    cdtp_server_free(s);
+    for (size_t i = 0; i < 2; i++) {
+        cdtp_client_free(clients[i]);
+    }
+}
+
 int main(void)
 {
     printf("Beginning tests\n");
@@ -1414,6 +3442,8 @@ int main(void)
     test_util();
     printf("\nTesting client map...\n");
     test_client_map();
+    printf("\nTesting receive buffer...\n");
+    test_recv_buffer();
     printf("\nTesting crypto...\n");
     test_crypto();
     printf("\nTesting server creation and serving...\n");
@@ -1434,6 +3464,32 @@ int main(void)
     test_client_disconnected();
     printf("\nTesting removing clients...\n");
     test_remove_client();
+    printf("\nTesting multiple I/O threads...\n");
+    test_io_threads();
+    printf("\nTesting slow key exchanges...\n");
+    test_slow_handshake();
+    printf("\nTesting legacy key exchanges...\n");
+    test_key_modes();
+    printf("\nTesting event threads...\n");
+    test_event_threads();
+    printf("\nTesting ordered event dispatch...\n");
+    test_ordered_dispatch();
+    printf("\nTesting inline event dispatch...\n");
+    test_inline_dispatch();
+    printf("\nTesting send backpressure...\n");
+    test_send_backpressure();
+    printf("\nTesting draining clients when stopping...\n");
+    test_stop_drain();
+    printf("\nTesting session resumption...\n");
+    test_resumption();
+    printf("\nTesting plaintext connections...\n");
+    test_plaintext();
+    printf("\nTesting key exchange short reads...\n");
+    test_handshake_short_reads();
+    printf("\nTesting Unix domain sockets...\n");
+    test_unix_sockets();
+    printf("\nTesting shared memory...\n");
+    test_shared_memory();
 
     // Done
     printf("\nCompleted tests\n");